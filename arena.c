@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+
+static size_t align_up(size_t size)
+{
+    return (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+}
+
+static arena_block *new_block(arena *a, size_t size)
+{
+    arena_block *block = malloc(sizeof(arena_block) + size);
+    if (!block)
+    {
+        fprintf(stderr, "Error: Unable to allocate arena block\n");
+        return NULL;
+    }
+
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    a->heap_allocs++;
+
+    return block;
+}
+
+void arena_init(arena *a, size_t block_size)
+{
+    a->head = NULL;
+    a->overflow = NULL;
+    a->block_size = align_up(block_size);
+    a->used = 0;
+    a->heap_allocs = 0;
+}
+
+void *arena_alloc(arena *a, size_t size)
+{
+    size = align_up(size ? size : 1);
+
+    if (!a->head)
+    {
+        a->head = new_block(a, a->block_size);
+        if (!a->head)
+            return NULL;
+    }
+
+    arena_block *block = a->overflow ? a->overflow : a->head;
+    if (block->size - block->used < size)
+    {
+        size_t block_size = size > a->block_size ? size : a->block_size;
+        block = new_block(a, block_size);
+        if (!block)
+            return NULL;
+        block->next = a->overflow;
+        a->overflow = block;
+    }
+
+    void *ptr = block->data + block->used;
+    block->used += size;
+    a->used += size;
+
+    return ptr;
+}
+
+char *arena_strndup(arena *a, const char *str, size_t length)
+{
+    char *copy = arena_alloc(a, length + 1);
+    if (copy)
+    {
+        memcpy(copy, str, length);
+        copy[length] = '\0';
+    }
+
+    return copy;
+}
+
+char *arena_strdup(arena *a, const char *str)
+{
+    return arena_strndup(a, str, strlen(str));
+}
+
+void arena_reset(arena *a)
+{
+    if (a->overflow)
+    {
+        // this cycle outgrew the first block; size it to the whole cycle
+        size_t needed = align_up(a->used + a->used / 2);
+        while (a->overflow)
+        {
+            arena_block *next = a->overflow->next;
+            free(a->overflow);
+            a->overflow = next;
+        }
+        free(a->head);
+        a->head = NULL;
+        if (needed > a->block_size)
+            a->block_size = needed;
+    }
+    else if (a->head)
+    {
+        a->head->used = 0;
+    }
+
+    a->used = 0;
+}
+
+void arena_destroy(arena *a)
+{
+    arena_reset(a);
+    free(a->head);
+    a->head = NULL;
+}
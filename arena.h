@@ -0,0 +1,83 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h> // size_t
+
+#define ARENA_INITIAL_SIZE 8192
+#define ARENA_ALIGNMENT 16
+
+typedef struct arena_block
+{
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    char data[];
+} arena_block;
+
+/*
+ * Bump allocator for everything built while handling one connection's
+ * requests. Memory is released all at once by arena_reset. A reset that
+ * found overflow blocks resizes the first block to fit, so a steady workload
+ * stops touching the heap after its first request.
+ */
+typedef struct
+{
+    arena_block *head;        // first block, kept across resets
+    arena_block *overflow;    // extra blocks, freed on reset
+    size_t block_size;        // size of the first block
+    size_t used;              // bytes handed out since the last reset
+    unsigned long heap_allocs; // blocks ever allocated from the heap
+} arena;
+
+/**
+ * Initializes an arena. No memory is allocated until the first arena_alloc.
+ *
+ * @param a Pointer to the arena to initialize.
+ * @param block_size Size of the first block.
+ */
+void arena_init(arena *a, size_t block_size);
+
+/**
+ * Allocates aligned memory from the arena.
+ *
+ * @param a Pointer to the arena.
+ * @param size Number of bytes.
+ * @return Pointer to the memory, or NULL if the heap is exhausted.
+ */
+void *arena_alloc(arena *a, size_t size);
+
+/**
+ * Copies length bytes into the arena and NUL-terminates the copy.
+ *
+ * @param a Pointer to the arena.
+ * @param str Pointer to the bytes to copy.
+ * @param length Number of bytes to copy.
+ * @return Pointer to the copy, or NULL if the heap is exhausted.
+ */
+char *arena_strndup(arena *a, const char *str, size_t length);
+
+/**
+ * Copies a NUL-terminated string into the arena.
+ *
+ * @param a Pointer to the arena.
+ * @param str String to copy.
+ * @return Pointer to the copy, or NULL if the heap is exhausted.
+ */
+char *arena_strdup(arena *a, const char *str);
+
+/**
+ * Releases everything allocated from the arena. O(1) unless the last
+ * cycle overflowed the first block.
+ *
+ * @param a Pointer to the arena.
+ */
+void arena_reset(arena *a);
+
+/**
+ * Frees all memory owned by the arena.
+ *
+ * @param a Pointer to the arena.
+ */
+void arena_destroy(arena *a);
+
+#endif // ARENA_H
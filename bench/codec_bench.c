@@ -0,0 +1,279 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../arena.h"
+#include "../request.h"
+#include "../response.h"
+
+/*
+ * Codec microbenchmark: decodes every request in a corpus directory with
+ * the incremental parser (body framing included) and re-serializes every
+ * response with format_http_response, reporting ns/op, heap allocations/op
+ * and bytes/s for each file. Files starting with "HTTP/" are responses, the
+ * rest requests. The default corpus, bench/corpus, is also the seed corpus
+ * of bench/http_fuzz, so inputs the fuzzer finds can be timed here too.
+ */
+
+#define BENCH_SECONDS 0.2
+#define BENCH_MAX_FILES 256
+#define BENCH_MAX_FILE_SIZE (1 << 20)
+
+typedef struct
+{
+    char name[256];
+    char *data;
+    size_t length;
+} corpus_file;
+
+// a recorded response split into what a handler would pass to the serializer
+typedef struct
+{
+    http_status_code status;
+    char *names[HTTP_MAX_HEADERS];
+    char *values[HTTP_MAX_HEADERS];
+    int header_count;
+    const char *body;
+    size_t body_length;
+} recorded_response;
+
+static unsigned long allocations;
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+
+// every heap allocation in the process is counted, the codec's included
+void *malloc(size_t size)
+{
+    allocations++;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size)
+{
+    allocations++;
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    allocations++;
+    return __libc_realloc(ptr, size);
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_files(const void *a, const void *b)
+{
+    return strcmp(((const corpus_file *)a)->name, ((const corpus_file *)b)->name);
+}
+
+static int load_corpus(const char *dir, corpus_file *files)
+{
+    DIR *d = opendir(dir);
+    if (!d)
+    {
+        perror(dir);
+        return -1;
+    }
+
+    int count = 0;
+    struct dirent *entry;
+    while ((entry = readdir(d)) && count < BENCH_MAX_FILES)
+    {
+        if (entry->d_name[0] == '.')
+            continue;
+
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+        FILE *f = fopen(path, "rb");
+        if (!f)
+            continue;
+
+        corpus_file *file = &files[count];
+        file->data = malloc(BENCH_MAX_FILE_SIZE);
+        file->length = file->data ? fread(file->data, 1, BENCH_MAX_FILE_SIZE, f) : 0;
+        fclose(f);
+        if (file->length == 0)
+        {
+            free(file->data);
+            continue;
+        }
+        snprintf(file->name, sizeof(file->name), "%s", entry->d_name);
+        count++;
+    }
+    closedir(d);
+
+    qsort(files, count, sizeof(corpus_file), compare_files);
+    return count;
+}
+
+// the server's decode path: head, then body framing, in one pass over the buffer
+static int decode_request(const char *data, size_t length, http_parser *parser, http_request *request)
+{
+    http_parser_init(parser, request);
+    http_parse_status status = http_parser_execute(parser, data, length, request);
+    if (status == HTTP_PARSE_BODY)
+    {
+        size_t offset = parser->body_start;
+        do
+        {
+            size_t used;
+            http_slice chunk;
+            status = http_parser_body(parser, data + offset, length - offset, &used, &chunk);
+            offset += used;
+        } while (status == HTTP_PARSE_NEED_MORE && offset < length);
+    }
+    return status == HTTP_PARSE_COMPLETE ? 0 : -1;
+}
+
+static void bench_request(const corpus_file *file)
+{
+    http_parser parser;
+    http_request request;
+    if (decode_request(file->data, file->length, &parser, &request) == -1)
+    {
+        printf("%-24s request  %6zu B  does not parse, skipped\n", file->name, file->length);
+        return;
+    }
+    int headers = request.header_count;
+
+    unsigned long ops = 0;
+    unsigned long allocations_before = allocations;
+    double start = now_seconds();
+    double elapsed;
+    do
+    {
+        for (int batch = 0; batch < 1000; batch++)
+            decode_request(file->data, file->length, &parser, &request);
+        ops += 1000;
+        elapsed = now_seconds() - start;
+    } while (elapsed < BENCH_SECONDS);
+
+    printf("%-24s request  %6zu B %3d headers %8.1f ns/op %6.2f allocs/op %8.1f MB/s\n", file->name, file->length,
+           headers, elapsed * 1e9 / ops, (double)(allocations - allocations_before) / ops,
+           file->length * ops / elapsed / 1e6);
+}
+
+static int load_response(char *data, size_t length, recorded_response *response)
+{
+    char *head_end = memmem(data, length, "\r\n\r\n", 4);
+    if (!head_end || length < 13)
+        return -1;
+    *head_end = '\0';
+    response->body = head_end + 4;
+    response->body_length = length - (head_end + 4 - data);
+
+    response->status = (http_status_code)atoi(data + 9);
+    if (!find_http_status(response->status))
+        return -1;
+
+    response->header_count = 0;
+    char *line = strstr(data, "\r\n");
+    while (line && response->header_count < HTTP_MAX_HEADERS)
+    {
+        line += 2;
+        char *next = strstr(line, "\r\n");
+        if (next)
+            *next = '\0';
+        char *colon = strchr(line, ':');
+        // set_http_body supplies Content-Length and the serializer Date
+        if (colon && strncasecmp(line, "Content-Length", colon - line) != 0 &&
+            strncasecmp(line, "Date", colon - line) != 0)
+        {
+            *colon = '\0';
+            char *value = colon + 1;
+            while (*value == ' ')
+                value++;
+            response->names[response->header_count] = line;
+            response->values[response->header_count] = value;
+            response->header_count++;
+        }
+        line = next;
+    }
+    return 0;
+}
+
+// what a handler does to answer: build the response in the arena and flatten it
+static char *encode_response(const recorded_response *recorded, arena *a)
+{
+    arena_reset(a);
+    http_response response;
+    init_http_response(&response, a, HTTP_VERSION);
+    set_http_status(&response, recorded->status);
+    for (int i = 0; i < recorded->header_count; i++)
+        if (add_http_header(&response, recorded->names[i], recorded->values[i]) == -1)
+            return NULL;
+    set_http_body(&response, recorded->body, recorded->body_length);
+    return format_http_response(&response);
+}
+
+static void bench_response(corpus_file *file)
+{
+    // parsing the recording cuts it up, so work on a copy
+    char *copy = malloc(file->length);
+    memcpy(copy, file->data, file->length);
+
+    recorded_response recorded;
+    arena a;
+    arena_init(&a, ARENA_INITIAL_SIZE);
+    char *out = NULL;
+    if (load_response(copy, file->length, &recorded) == -1 || !(out = encode_response(&recorded, &a)))
+    {
+        printf("%-24s response %6zu B  unsupported status or format, skipped\n", file->name, file->length);
+        arena_destroy(&a);
+        free(copy);
+        return;
+    }
+    size_t out_length = (size_t)(strstr(out, "\r\n\r\n") + 4 - out) + recorded.body_length;
+
+    unsigned long ops = 0;
+    unsigned long allocations_before = allocations;
+    double start = now_seconds();
+    double elapsed;
+    do
+    {
+        for (int batch = 0; batch < 1000; batch++)
+            encode_response(&recorded, &a);
+        ops += 1000;
+        elapsed = now_seconds() - start;
+    } while (elapsed < BENCH_SECONDS);
+
+    printf("%-24s response %6zu B %3d headers %8.1f ns/op %6.2f allocs/op %8.1f MB/s\n", file->name, out_length,
+           recorded.header_count + 2, elapsed * 1e9 / ops, (double)(allocations - allocations_before) / ops,
+           out_length * ops / elapsed / 1e6);
+
+    arena_destroy(&a);
+    free(copy);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *dir = argc > 1 ? argv[1] : "bench/corpus";
+    static corpus_file files[BENCH_MAX_FILES];
+    int count = load_corpus(dir, files);
+    if (count <= 0)
+    {
+        fprintf(stderr, "No corpus files in %s\n", dir);
+        return 1;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        if (files[i].length >= 5 && memcmp(files[i].data, "HTTP/", 5) == 0)
+            bench_response(&files[i]);
+        else
+            bench_request(&files[i]);
+        free(files[i].data);
+    }
+    return 0;
+}
@@ -0,0 +1,43 @@
+#!/bin/sh
+# End-to-end benchmark: runs a fixed set of loadgen scenarios against both
+# backends and prints one JSON object per run, tagged with the commit, so
+# results can be appended to a file and compared across commits.
+#
+# usage: bench/e2e.sh [requests] [workers] >> results.jsonl
+set -e
+
+REQUESTS=${1:-200000}
+WORKERS=${2:-1}
+
+cd "$(dirname "$0")/.."
+make -s server bench/loadgen
+
+commit=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+fresh=$((REQUESTS / 10))
+
+# name and loadgen arguments of each scenario
+scenarios="
+keepalive|-c 64 -n $REQUESTS -u /
+mix|-c 64 -n $REQUESTS -m /:8,/echo/bench:1,/user-agent:1
+fresh|-c 16 -n $fresh -f -m /:8,/echo/bench:1,/user-agent:1
+open_loop|-c 64 -n $REQUESTS -r 50000 -m /:8,/echo/bench:1,/user-agent:1
+"
+
+for backend in epoll io_uring; do
+    flag=""
+    [ "$backend" = io_uring ] && flag="--io-uring"
+
+    ./server --workers "$WORKERS" --max-requests 0 $flag >/dev/null 2>&1 &
+    pid=$!
+    sleep 0.5
+
+    echo "$scenarios" | while IFS='|' read -r name args; do
+        [ -n "$name" ] || continue
+        result=$(bench/loadgen $args -j) || true
+        printf '{"commit":"%s","backend":"%s","workers":%s,"scenario":"%s","result":%s}\n' \
+            "$commit" "$backend" "$WORKERS" "$name" "${result:-null}"
+    done
+
+    kill "$pid"
+    wait "$pid" 2>/dev/null || true
+done
@@ -0,0 +1,210 @@
+#include <dirent.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../arena.h"
+#include "../request.h"
+#include "../response.h"
+
+/*
+ * Fuzz target for the request parser and the response serializer, built as
+ * a libFuzzer target by "make fuzz" (clang) and as a replay tool,
+ * bench/http_fuzz, that runs the same checks over files and directories,
+ * e.g. bench/corpus, which seeds the fuzzer and is the codec_bench input.
+ *
+ * Besides crashes and sanitizer reports, it aborts when feeding a request
+ * in pieces gives a different result from feeding it whole, for the head
+ * as well as for the body framing.
+ */
+
+#define FUZZ_MAX_PIECE 16
+
+typedef struct
+{
+    http_parse_status status;
+    int header_count;
+    size_t end;         // bytes of head, or of head and body once complete
+    size_t body_length; // decoded body bytes
+} decode_result;
+
+static void check(int condition, const char *what)
+{
+    if (!condition)
+    {
+        fprintf(stderr, "http_fuzz: %s\n", what);
+        abort();
+    }
+}
+
+/*
+ * Decodes a request as the server does, giving the parser at most piece
+ * more bytes per call; piece 0 passes everything at once.
+ */
+static decode_result decode(const char *data, size_t size, size_t piece)
+{
+    http_parser parser;
+    http_request request;
+    decode_result result = {HTTP_PARSE_NEED_MORE, 0, 0, 0};
+
+    http_parser_init(&parser, &request);
+    size_t available = 0;
+    while (available < size)
+    {
+        available = piece && size - available > piece ? available + piece : size;
+        result.status = http_parser_execute(&parser, data, available, &request);
+        if (result.status != HTTP_PARSE_NEED_MORE)
+            break;
+    }
+    result.header_count = request.header_count;
+    if (result.status == HTTP_PARSE_COMPLETE)
+        result.end = parser.consumed;
+    if (result.status != HTTP_PARSE_BODY)
+        return result;
+
+    size_t offset = parser.body_start;
+    while (offset < size)
+    {
+        size_t length = piece && size - offset > piece ? piece : size - offset;
+        size_t used;
+        http_slice chunk;
+        result.status = http_parser_body(&parser, data + offset, length, &used, &chunk);
+        offset += used;
+        result.body_length += chunk.length;
+        if (result.status != HTTP_PARSE_NEED_MORE)
+            break;
+    }
+    if (result.status == HTTP_PARSE_COMPLETE)
+        result.end = offset;
+    return result;
+}
+
+// answers the request by echoing its URI and headers, as a handler might
+static void echo_response(const char *data, size_t size)
+{
+    http_request request;
+    if (parse_http_request(data, size, &request) != 0)
+        return;
+
+    arena a;
+    arena_init(&a, ARENA_INITIAL_SIZE);
+    http_response response;
+    init_http_response(&response, &a, HTTP_VERSION);
+    set_http_status(&response, HTTP_OK);
+
+    for (int i = 0; i < request.header_count; i++)
+    {
+        char *name = arena_strndup(&a, request.headers[i].name.data, request.headers[i].name.length);
+        char *value = arena_strndup(&a, request.headers[i].value.data, request.headers[i].value.length);
+        if (name && value)
+            add_http_header(&response, name, value);
+    }
+    set_http_body(&response, request.request_line.uri.data, request.request_line.uri.length);
+
+    char *out = format_http_response(&response);
+    check(out != NULL, "format_http_response failed");
+    check(strncmp(out, "HTTP/1.1 200 OK\r\n", 17) == 0, "serialized status line is wrong");
+
+    arena_destroy(&a);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *input, size_t size)
+{
+    // an exact-size copy, so sanitizers see any read past the end
+    char *data = malloc(size ? size : 1);
+    if (!data)
+        return 0;
+    memcpy(data, input, size);
+
+    decode_result whole = decode(data, size, 0);
+    size_t piece = size ? 1 + (unsigned char)data[size - 1] % FUZZ_MAX_PIECE : 1;
+    decode_result pieces = decode(data, size, piece);
+    decode_result bytes = decode(data, size, 1);
+
+    check(whole.status == pieces.status && whole.status == bytes.status, "status depends on how input is split");
+    if (whole.status != HTTP_PARSE_ERROR)
+    {
+        check(whole.header_count == pieces.header_count && whole.header_count == bytes.header_count,
+              "header count depends on how input is split");
+        check(whole.end == pieces.end && whole.end == bytes.end, "request end depends on how input is split");
+        check(whole.body_length == pieces.body_length && whole.body_length == bytes.body_length,
+              "body length depends on how input is split");
+    }
+
+    echo_response(data, size);
+
+    free(data);
+    return 0;
+}
+
+#ifdef HTTP_FUZZ_REPLAY
+static int replay_file(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (!f)
+    {
+        perror(path);
+        return -1;
+    }
+
+    size_t capacity = 4096;
+    size_t size = 0;
+    uint8_t *data = malloc(capacity);
+    size_t n;
+    while (data && (n = fread(data + size, 1, capacity - size, f)) > 0)
+    {
+        size += n;
+        if (size == capacity)
+            data = realloc(data, capacity *= 2);
+    }
+    fclose(f);
+    if (!data)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for %s\n", path);
+        return -1;
+    }
+
+    LLVMFuzzerTestOneInput(data, size);
+    free(data);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s FILE_OR_DIR...\n", argv[0]);
+        return 1;
+    }
+
+    int replayed = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        DIR *d = opendir(argv[i]);
+        if (!d)
+        {
+            if (replay_file(argv[i]) == -1)
+                return 1;
+            replayed++;
+            continue;
+        }
+
+        struct dirent *entry;
+        while ((entry = readdir(d)))
+        {
+            if (entry->d_name[0] == '.')
+                continue;
+            char path[4096];
+            snprintf(path, sizeof(path), "%s/%s", argv[i], entry->d_name);
+            if (replay_file(path) == -1)
+                return 1;
+            replayed++;
+        }
+        closedir(d);
+    }
+
+    printf("replayed %d inputs\n", replayed);
+    return 0;
+}
+#endif // HTTP_FUZZ_REPLAY
@@ -0,0 +1,33 @@
+#!/bin/sh
+# Compares the epoll and io_uring backends: syscalls per request as counted
+# by the server, and client-side latency percentiles from bench/loadgen.
+#
+# usage: bench/io_backends.sh [connections] [requests] [workers]
+set -e
+
+CONNECTIONS=${1:-64}
+REQUESTS=${2:-200000}
+WORKERS=${3:-1}
+
+cd "$(dirname "$0")/.."
+make -s server bench/loadgen
+
+for backend in epoll io_uring; do
+    flag=""
+    [ "$backend" = io_uring ] && flag="--io-uring"
+
+    log=$(mktemp)
+    ./server --workers "$WORKERS" $flag >"$log" 2>&1 &
+    pid=$!
+    sleep 0.5
+
+    echo "== $backend =="
+    bench/loadgen -c "$CONNECTIONS" -n "$REQUESTS" -u /echo/bench
+
+    kill -USR1 "$pid"
+    sleep 0.2
+    kill "$pid"
+    wait "$pid" 2>/dev/null || true
+    grep '^total:' "$log"
+    rm -f "$log"
+done
@@ -0,0 +1,490 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * HTTP load generator. Each connection keeps exactly one request in flight.
+ *
+ * Closed loop (default): the next request goes out as soon as the response
+ * is complete, so throughput is whatever the server sustains.
+ *
+ * Open loop (-r rate): requests are scheduled at a fixed total rate spread
+ * over the connections, and latency is measured from when a request was
+ * due rather than when it could be sent. A stalled server then shows up in
+ * the percentiles instead of quietly slowing the client down (coordinated
+ * omission).
+ *
+ * Requests are drawn from a weighted mix of paths (-m). With -f every
+ * request goes out on a fresh connection, and its latency includes the
+ * connect; otherwise connections are kept alive and only reopened when the
+ * server answers "Connection: close".
+ */
+
+#define LOADGEN_BUF_SIZE 65536
+#define LOADGEN_MAX_MIX 16
+#define LOADGEN_REQUEST_SIZE 1024
+
+typedef struct
+{
+    const char *path;
+    int weight;
+    char request[LOADGEN_REQUEST_SIZE];
+    int request_len;
+    long completed;
+} mix_entry;
+
+typedef struct
+{
+    int fd;
+    char buf[LOADGEN_BUF_SIZE];
+    size_t received;
+    long due_ns;      // when the request in flight (or the next one) was due
+    long remaining;   // requests this connection still has to complete
+    int in_flight;    // a request has been sent and not yet answered
+    int connected;    // the socket has finished connecting
+    int entry;        // mix entry of the request in flight
+    unsigned int rng; // picks mix entries
+} client;
+
+typedef struct
+{
+    const char *host;
+    int port;
+    int connections;
+    long requests;
+    double rate; // total requests/s in open-loop mode, 0 for closed loop
+    int fresh;   // a new connection for every request
+    int json;
+    mix_entry mix[LOADGEN_MAX_MIX];
+    int mix_count;
+    int total_weight;
+} loadgen_options;
+
+static long now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static int compare_long(const void *a, const void *b)
+{
+    long x = *(const long *)a;
+    long y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+static long percentile(const long *sorted, long count, double p)
+{
+    if (count == 0)
+        return 0;
+    long index = (long)(p * (count - 1));
+    return sorted[index];
+}
+
+// "path[:weight],..." into the mix
+static int parse_mix(loadgen_options *options, char *spec)
+{
+    options->mix_count = 0;
+    for (char *item = strtok(spec, ","); item; item = strtok(NULL, ","))
+    {
+        if (options->mix_count == LOADGEN_MAX_MIX)
+        {
+            fprintf(stderr, "At most %d paths in a mix.\n", LOADGEN_MAX_MIX);
+            return -1;
+        }
+
+        mix_entry *entry = &options->mix[options->mix_count++];
+        char *weight = strrchr(item, ':');
+        entry->weight = 1;
+        // "/users/:id" style colons are part of the path; only a numeric tail is a weight
+        if (weight && weight[1] != '\0' && strspn(weight + 1, "0123456789") == strlen(weight + 1))
+        {
+            *weight = '\0';
+            entry->weight = atoi(weight + 1);
+        }
+        entry->path = item;
+        if (item[0] != '/' || entry->weight < 1)
+        {
+            fprintf(stderr, "Invalid mix entry %s\n", item);
+            return -1;
+        }
+    }
+    return options->mix_count ? 0 : -1;
+}
+
+static void build_requests(loadgen_options *options)
+{
+    options->total_weight = 0;
+    for (int i = 0; i < options->mix_count; i++)
+    {
+        mix_entry *entry = &options->mix[i];
+        entry->request_len = snprintf(entry->request, sizeof(entry->request),
+                                      "GET %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: loadgen\r\n%s\r\n", entry->path,
+                                      options->host, options->fresh ? "Connection: close\r\n" : "");
+        options->total_weight += entry->weight;
+    }
+}
+
+static int pick_entry(const loadgen_options *options, client *c)
+{
+    // xorshift32
+    c->rng ^= c->rng << 13;
+    c->rng ^= c->rng >> 17;
+    c->rng ^= c->rng << 5;
+
+    int ticket = (int)(c->rng % (unsigned int)options->total_weight);
+    for (int i = 0; i < options->mix_count; i++)
+    {
+        ticket -= options->mix[i].weight;
+        if (ticket < 0)
+            return i;
+    }
+    return options->mix_count - 1;
+}
+
+static int connect_client(client *c, int epoll_fd, const loadgen_options *options)
+{
+    c->received = 0;
+    c->connected = 0;
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd == -1)
+        return -1;
+
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(options->port);
+    inet_pton(AF_INET, options->host, &addr.sin_addr);
+
+    if (connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 && errno != EINPROGRESS)
+    {
+        close(c->fd);
+        c->fd = -1;
+        return -1;
+    }
+
+    struct epoll_event ev = {.events = EPOLLOUT, .data.ptr = c};
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->fd, &ev);
+}
+
+static void close_client(client *c)
+{
+    if (c->fd != -1)
+        close(c->fd);
+    c->fd = -1;
+    c->connected = 0;
+}
+
+/* Returns the length of a complete response at the start of buf, or 0. */
+static size_t complete_response(const char *buf, size_t len)
+{
+    const char *end = memmem(buf, len, "\r\n\r\n", 4);
+    if (!end)
+        return 0;
+
+    size_t header_len = end - buf + 4;
+    size_t body_len = 0;
+    const char *cl = memmem(buf, header_len, "Content-Length:", 15);
+    if (cl)
+        body_len = strtoul(cl + 15, NULL, 10);
+
+    return len >= header_len + body_len ? header_len + body_len : 0;
+}
+
+static int send_request(client *c, const loadgen_options *options)
+{
+    const mix_entry *entry = &options->mix[c->entry];
+    ssize_t n = send(c->fd, entry->request, entry->request_len, MSG_NOSIGNAL);
+    if (n != entry->request_len)
+        return -1;
+    c->in_flight = 1;
+    return 0;
+}
+
+/*
+ * Starts the next request of a connection that is due: sends it, or on a
+ * fresh connection opens the socket and sends once it is connected.
+ */
+static int start_request(client *c, int epoll_fd, const loadgen_options *options)
+{
+    c->entry = pick_entry(options, c);
+    if (options->rate == 0)
+        c->due_ns = now_ns();
+
+    if (c->fd == -1)
+        return connect_client(c, epoll_fd, options);
+    return send_request(c, options);
+}
+
+static void print_text(const loadgen_options *options, long completed, long errors, double elapsed,
+                       const long *latencies)
+{
+    printf("requests: %ld, errors: %ld, time: %.3f s, throughput: %.0f req/s\n", completed, errors, elapsed,
+           completed / elapsed);
+    printf("latency us: p50 %.1f, p99 %.1f, p999 %.1f, max %.1f\n", percentile(latencies, completed, 0.50) / 1e3,
+           percentile(latencies, completed, 0.99) / 1e3, percentile(latencies, completed, 0.999) / 1e3,
+           completed ? latencies[completed - 1] / 1e3 : 0.0);
+    if (options->mix_count > 1)
+        for (int i = 0; i < options->mix_count; i++)
+            printf("  %s: %ld\n", options->mix[i].path, options->mix[i].completed);
+}
+
+static void print_json(const loadgen_options *options, long completed, long errors, double elapsed,
+                       const long *latencies)
+{
+    double mean = 0;
+    for (long i = 0; i < completed; i++)
+        mean += latencies[i];
+    mean = completed ? mean / completed : 0;
+
+    printf("{\"mode\":\"%s\",\"connections\":%d,\"keepalive\":%s,\"rate\":%.0f,", options->rate ? "open" : "closed",
+           options->connections, options->fresh ? "false" : "true", options->rate);
+    printf("\"requests\":%ld,\"errors\":%ld,\"seconds\":%.6f,\"throughput\":%.1f,", completed, errors, elapsed,
+           completed / elapsed);
+    printf("\"latency_us\":{\"mean\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f},", mean / 1e3,
+           percentile(latencies, completed, 0.50) / 1e3, percentile(latencies, completed, 0.90) / 1e3,
+           percentile(latencies, completed, 0.99) / 1e3, percentile(latencies, completed, 0.999) / 1e3,
+           completed ? latencies[completed - 1] / 1e3 : 0.0);
+    printf("\"mix\":[");
+    for (int i = 0; i < options->mix_count; i++)
+        printf("%s{\"path\":\"%s\",\"weight\":%d,\"requests\":%ld}", i ? "," : "", options->mix[i].path,
+               options->mix[i].weight, options->mix[i].completed);
+    printf("]}\n");
+}
+
+static void usage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s [-h host] [-p port] [-c connections] [-n requests] [-u path | -m path[:weight],...]\n"
+            "          [-r rate] [-f] [-j]\n",
+            program);
+    fprintf(stderr, "  -m MIX   weighted request mix, e.g. /:8,/echo/abc:1,/user-agent:1\n");
+    fprintf(stderr, "  -r RATE  open loop at RATE requests/s, latency measured from when each was due\n");
+    fprintf(stderr, "  -f       a fresh connection for every request\n");
+    fprintf(stderr, "  -j       print the results as one JSON object\n");
+}
+
+int main(int argc, char *argv[])
+{
+    loadgen_options options = {.host = "127.0.0.1", .port = 4221, .connections = 16, .requests = 100000};
+    options.mix[0].path = "/";
+    options.mix[0].weight = 1;
+    options.mix_count = 1;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:c:n:u:m:r:fj")) != -1)
+    {
+        switch (opt)
+        {
+        case 'h':
+            options.host = optarg;
+            break;
+        case 'p':
+            options.port = atoi(optarg);
+            break;
+        case 'c':
+            options.connections = atoi(optarg);
+            break;
+        case 'n':
+            options.requests = atol(optarg);
+            break;
+        case 'u':
+            options.mix[0].path = optarg;
+            options.mix[0].weight = 1;
+            options.mix_count = 1;
+            break;
+        case 'm':
+            if (parse_mix(&options, optarg) == -1)
+            {
+                usage(argv[0]);
+                return 1;
+            }
+            break;
+        case 'r':
+            options.rate = atof(optarg);
+            break;
+        case 'f':
+            options.fresh = 1;
+            break;
+        case 'j':
+            options.json = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (options.connections < 1 || options.requests < options.connections || options.rate < 0)
+    {
+        fprintf(stderr, "Need at least one connection and one request per connection.\n");
+        return 1;
+    }
+    build_requests(&options);
+
+    long *latencies = malloc(options.requests * sizeof(long));
+    client *clients = calloc(options.connections, sizeof(client));
+    int epoll_fd = epoll_create1(0);
+    if (!latencies || !clients || epoll_fd == -1)
+    {
+        perror("loadgen setup");
+        return 1;
+    }
+
+    // in open loop each connection sends every interval, staggered across connections
+    long interval_ns = options.rate ? (long)(options.connections * 1e9 / options.rate) : 0;
+    long per_client = options.requests / options.connections;
+    long completed = 0;
+    long errors = 0;
+    int open_clients = 0;
+    long start = now_ns();
+
+    for (int i = 0; i < options.connections; i++)
+    {
+        client *c = &clients[i];
+        c->fd = -1;
+        c->remaining = per_client + (i < options.requests % options.connections);
+        c->rng = 2654435761u * (i + 1);
+        c->due_ns = start + (interval_ns * i) / options.connections;
+        open_clients++;
+
+        // keep-alive connections are opened up front, outside the measurement of any request
+        if (!options.fresh && connect_client(c, epoll_fd, &options) == -1)
+        {
+            perror("connect");
+            return 1;
+        }
+    }
+
+    struct epoll_event events[256];
+    while (open_clients > 0)
+    {
+        // start every request that is due, and sleep until the next one is
+        long now = now_ns();
+        long next_due = -1;
+        for (int i = 0; i < options.connections; i++)
+        {
+            client *c = &clients[i];
+            if (c->remaining == 0 || c->in_flight || (c->fd != -1 && !c->connected))
+                continue;
+            if (c->due_ns > now && options.rate)
+            {
+                if (next_due == -1 || c->due_ns < next_due)
+                    next_due = c->due_ns;
+                continue;
+            }
+            if (start_request(c, epoll_fd, &options) == -1)
+            {
+                errors += c->remaining;
+                c->remaining = 0;
+                close_client(c);
+                open_clients--;
+                continue;
+            }
+            // a fresh connection sends once it is connected
+            c->in_flight = 1;
+        }
+        if (open_clients == 0)
+            break;
+
+        int timeout = 5000;
+        if (next_due != -1)
+            timeout = (int)((next_due - now) / 1000000);
+        int n = epoll_wait(epoll_fd, events, 256, timeout);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0 && next_due == -1)
+        {
+            fprintf(stderr, "Timed out waiting for responses.\n");
+            break;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            client *c = events[i].data.ptr;
+
+            if (events[i].events & EPOLLOUT)
+            {
+                // connected: switch to reading, and send if a request is waiting for the connection
+                struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+                epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+                c->connected = 1;
+                if (c->in_flight && send_request(c, &options) == -1)
+                {
+                    errors += c->remaining;
+                    c->remaining = 0;
+                    close_client(c);
+                    open_clients--;
+                }
+                continue;
+            }
+
+            ssize_t r = recv(c->fd, c->buf + c->received, sizeof(c->buf) - c->received, 0);
+            if (r <= 0)
+            {
+                if (r == -1 && errno == EAGAIN)
+                    continue;
+                errors += c->remaining;
+                c->remaining = 0;
+                close_client(c);
+                open_clients--;
+                continue;
+            }
+            c->received += r;
+
+            size_t len = complete_response(c->buf, c->received);
+            if (len == 0)
+                continue;
+
+            latencies[completed++] = now_ns() - c->due_ns;
+            options.mix[c->entry].completed++;
+            int server_closing = memmem(c->buf, len, "Connection: close", 17) != NULL;
+            memmove(c->buf, c->buf + len, c->received - len);
+            c->received -= len;
+            c->in_flight = 0;
+            c->due_ns += interval_ns;
+
+            if (server_closing || options.fresh)
+                close_client(c);
+
+            // the next request starts at the top of the loop
+            if (--c->remaining == 0)
+            {
+                close_client(c);
+                open_clients--;
+            }
+            else if (c->fd == -1 && !options.fresh && connect_client(c, epoll_fd, &options) == -1)
+            {
+                errors += c->remaining;
+                c->remaining = 0;
+                open_clients--;
+            }
+        }
+    }
+
+    double elapsed = (now_ns() - start) / 1e9;
+    qsort(latencies, completed, sizeof(long), compare_long);
+
+    if (options.json)
+        print_json(&options, completed, errors, elapsed, latencies);
+    else
+        print_text(&options, completed, errors, elapsed, latencies);
+
+    free(latencies);
+    free(clients);
+    close(epoll_fd);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../router.h"
+
+/*
+ * Router microbenchmark: builds route tables of 10 to 10k entries mixing
+ * literal, parameter and prefix routes, then reports lookups/s for the radix
+ * trie next to a linear prefix scan like the one it replaced.
+ */
+
+#define BENCH_SECONDS 0.5
+#define BENCH_PATHS 1024
+#define BENCH_PATH_LEN 96
+
+static int bench_handler(http_request *request, struct connection *conn, const route_match *match)
+{
+    return 0;
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// route i as a pattern, and a request path that matches it
+static void make_route(int i, char *pattern, char *path)
+{
+    switch (i % 3)
+    {
+    case 0:
+        snprintf(pattern, BENCH_PATH_LEN, "/api/v1/resource%d/items", i);
+        snprintf(path, BENCH_PATH_LEN, "/api/v1/resource%d/items", i);
+        break;
+    case 1:
+        snprintf(pattern, BENCH_PATH_LEN, "/users%d/:id/posts", i);
+        snprintf(path, BENCH_PATH_LEN, "/users%d/%d/posts", i, i * 7919);
+        break;
+    default:
+        snprintf(pattern, BENCH_PATH_LEN, "/assets/bundle%d/*", i);
+        snprintf(path, BENCH_PATH_LEN, "/assets/bundle%d/js/app.%x.js", i, i * 40503);
+        break;
+    }
+}
+
+// the old dispatch: first literal prefix that matches wins
+static int linear_lookup(char (*prefixes)[BENCH_PATH_LEN], const size_t *lengths, int count, const char *path,
+                         size_t length)
+{
+    for (int i = 0; i < count; i++)
+        if (length >= lengths[i] && strncmp(path, prefixes[i], lengths[i]) == 0)
+            return i;
+    return -1;
+}
+
+static void run_table(int routes)
+{
+    router r;
+    if (router_init(&r) == -1)
+        exit(1);
+
+    char(*prefixes)[BENCH_PATH_LEN] = malloc(routes * sizeof(*prefixes));
+    size_t *prefix_lengths = malloc(routes * sizeof(size_t));
+    static char paths[BENCH_PATHS][BENCH_PATH_LEN];
+    static size_t path_lengths[BENCH_PATHS];
+    if (!prefixes || !prefix_lengths)
+        exit(1);
+
+    char pattern[BENCH_PATH_LEN];
+    char path[BENCH_PATH_LEN];
+    for (int i = 0; i < routes; i++)
+    {
+        make_route(i, pattern, path);
+        if (router_add(&r, HTTP_METHOD_GET, pattern, bench_handler) == -1)
+            exit(1);
+
+        // literal part of the pattern, up to a parameter or '*'
+        prefix_lengths[i] = strcspn(pattern, ":*");
+        memcpy(prefixes[i], pattern, prefix_lengths[i]);
+    }
+
+    srand(routes);
+    for (int i = 0; i < BENCH_PATHS; i++)
+    {
+        make_route(rand() % routes, pattern, paths[i]);
+        path_lengths[i] = strlen(paths[i]);
+    }
+
+    route_match match;
+    unsigned long lookups = 0;
+    double start = now_seconds();
+    double elapsed;
+    do
+    {
+        for (int i = 0; i < BENCH_PATHS; i++)
+        {
+            if (!router_lookup(&r, HTTP_METHOD_GET, paths[i], path_lengths[i], &match))
+            {
+                fprintf(stderr, "%s did not match\n", paths[i]);
+                exit(1);
+            }
+        }
+        lookups += BENCH_PATHS;
+        elapsed = now_seconds() - start;
+    } while (elapsed < BENCH_SECONDS);
+    double trie_ns = elapsed * 1e9 / lookups;
+
+    unsigned long linear_lookups = 0;
+    start = now_seconds();
+    do
+    {
+        for (int i = 0; i < BENCH_PATHS; i++)
+            if (linear_lookup(prefixes, prefix_lengths, routes, paths[i], path_lengths[i]) == -1)
+                exit(1);
+        linear_lookups += BENCH_PATHS;
+        elapsed = now_seconds() - start;
+    } while (elapsed < BENCH_SECONDS);
+    double linear_ns = elapsed * 1e9 / linear_lookups;
+
+    printf("%6d routes  trie %8.1f ns/lookup %7.2f Mlookups/s  linear %10.1f ns/lookup\n", routes, trie_ns,
+           1e3 / trie_ns, linear_ns);
+
+    router_destroy(&r);
+    free(prefixes);
+    free(prefix_lengths);
+}
+
+int main(void)
+{
+    static const int sizes[] = {10, 100, 1000, 10000};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+        run_table(sizes[i]);
+    return 0;
+}
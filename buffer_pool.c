@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "buffer_pool.h"
+#include "io_stats.h"
+
+static int class_of(const buffer_pool *pool, size_t size);
+static size_t class_size(const buffer_pool *pool, int index);
+
+int buffer_pool_init(buffer_pool *pool, size_t min_size, size_t max_size, size_t retain)
+{
+    pool->min_size = min_size < sizeof(void *) ? sizeof(void *) : min_size;
+    pool->max_size = max_size < pool->min_size ? pool->min_size : max_size;
+    pool->retain = retain;
+
+    pool->class_count = 1;
+    while (class_size(pool, pool->class_count - 1) < pool->max_size)
+    {
+        if (++pool->class_count > BUFFER_POOL_MAX_CLASSES)
+        {
+            fprintf(stderr, "Error: Buffer pool sizes need too many classes\n");
+            return -1;
+        }
+    }
+
+    for (int i = 0; i < BUFFER_POOL_MAX_CLASSES; i++)
+        pool->free[i] = NULL;
+    pool->free_bytes = 0;
+    pool->in_use = 0;
+    pool->in_use_bytes = 0;
+    pool->peak_bytes = 0;
+    return 0;
+}
+
+void buffer_pool_cleanup(buffer_pool *pool)
+{
+    for (int i = 0; i < pool->class_count; i++)
+    {
+        while (pool->free[i])
+        {
+            void *next = *(void **)pool->free[i];
+            free(pool->free[i]);
+            pool->free[i] = next;
+        }
+    }
+    pool->free_bytes = 0;
+}
+
+char *buffer_pool_get(buffer_pool *pool, size_t size, size_t *capacity)
+{
+    int index = class_of(pool, size);
+    if (index == -1)
+        return NULL;
+
+    size_t bytes = class_size(pool, index);
+    char *buffer = pool->free[index];
+    if (buffer)
+    {
+        pool->free[index] = *(void **)buffer;
+        pool->free_bytes -= bytes;
+    }
+    else
+    {
+        buffer = malloc(bytes);
+        if (!buffer)
+        {
+            fprintf(stderr, "Error: Unable to allocate a %zu-byte buffer\n", bytes);
+            return NULL;
+        }
+        io_stats_allocations(1);
+    }
+
+    pool->in_use++;
+    pool->in_use_bytes += bytes;
+    if (pool->in_use_bytes > pool->peak_bytes)
+        pool->peak_bytes = pool->in_use_bytes;
+
+    *capacity = bytes;
+    return buffer;
+}
+
+void buffer_pool_put(buffer_pool *pool, char *buffer, size_t capacity)
+{
+    if (!buffer)
+        return;
+
+    pool->in_use--;
+    pool->in_use_bytes -= capacity;
+
+    if (pool->free_bytes + capacity > pool->retain)
+    {
+        free(buffer);
+        return;
+    }
+
+    int index = class_of(pool, capacity);
+    *(void **)buffer = pool->free[index];
+    pool->free[index] = buffer;
+    pool->free_bytes += capacity;
+}
+
+static int class_of(const buffer_pool *pool, size_t size)
+{
+    for (int i = 0; i < pool->class_count; i++)
+        if (class_size(pool, i) >= size)
+            return i;
+    return -1;
+}
+
+static size_t class_size(const buffer_pool *pool, int index)
+{
+    size_t size = pool->min_size << index;
+    return size > pool->max_size ? pool->max_size : size;
+}
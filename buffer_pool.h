@@ -0,0 +1,67 @@
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stddef.h> // size_t
+
+#define BUFFER_POOL_MAX_CLASSES 16
+
+/*
+ * Buffers in power-of-two size classes, from a smallest size doubling up to
+ * a largest one (the last class is clamped to it). Returned buffers are
+ * kept on a free list per class, linked through their own first bytes, and
+ * handed out again before anything new is allocated, so a steady load
+ * allocates nothing. Free buffers beyond the retain budget are released.
+ * A pool belongs to one thread.
+ */
+typedef struct
+{
+    size_t min_size;
+    size_t max_size;
+    size_t retain; // free bytes kept for reuse
+    int class_count;
+    void *free[BUFFER_POOL_MAX_CLASSES];
+    size_t free_bytes;
+    unsigned long in_use;    // buffers handed out
+    size_t in_use_bytes;
+    size_t peak_bytes;       // highest in_use_bytes so far
+} buffer_pool;
+
+/**
+ * Initializes a pool. No memory is allocated until the first buffer_pool_get.
+ *
+ * @param pool Pool to initialize.
+ * @param min_size Size of the smallest class; at least a pointer.
+ * @param max_size Largest buffer the pool hands out.
+ * @param retain Most bytes of free buffers kept for reuse.
+ * @return 0 on success, -1 if the sizes need more than BUFFER_POOL_MAX_CLASSES classes.
+ */
+int buffer_pool_init(buffer_pool *pool, size_t min_size, size_t max_size, size_t retain);
+
+/**
+ * Frees the pool's free buffers. Buffers still handed out must be freed by
+ * returning them first.
+ *
+ * @param pool Pool to clean up.
+ */
+void buffer_pool_cleanup(buffer_pool *pool);
+
+/**
+ * Hands out a buffer of the smallest class that holds at least size bytes.
+ *
+ * @param pool Pool to take from.
+ * @param size Bytes needed, at most the pool's max_size.
+ * @param capacity Set to the size of the buffer's class.
+ * @return The buffer, or NULL if size is too large or the heap is exhausted.
+ */
+char *buffer_pool_get(buffer_pool *pool, size_t size, size_t *capacity);
+
+/**
+ * Returns a buffer to its class.
+ *
+ * @param pool Pool the buffer came from.
+ * @param buffer Buffer from buffer_pool_get, or NULL.
+ * @param capacity Capacity buffer_pool_get reported for it.
+ */
+void buffer_pool_put(buffer_pool *pool, char *buffer, size_t capacity);
+
+#endif // BUFFER_POOL_H
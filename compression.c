@@ -0,0 +1,301 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "compression.h"
+#include "io_stats.h"
+
+// written once before workers start, read-only afterwards
+static int compression_level = COMPRESSION_DEFAULT_LEVEL;
+static size_t compression_min_size = COMPRESSION_DEFAULT_MIN_SIZE;
+
+// each worker thread owns its streams for whole bodies outright
+static __thread z_stream *whole_body_streams[HTTP_CODING_COUNT];
+
+static const char *const coding_names[HTTP_CODING_COUNT] = {"identity", "gzip", "deflate"};
+
+// compressible besides text/* and the +json and +xml suffixes
+static const char *const compressible_types[] = {
+    "application/json",
+    "application/javascript",
+    "application/xml",
+    "application/wasm",
+    NULL,
+};
+
+static int compressible(const char *content_type);
+static void parse_coding(const char *p, const char *end, int *weights, int *any);
+static int parse_weight(const char *p, const char *end);
+static const char *skip_space(const char *p, const char *end);
+static int window_bits(http_coding coding);
+static z_stream *whole_body_stream(http_coding coding);
+
+int compression_configure(int level, size_t min_size)
+{
+    if (level < 0 || level > 9)
+    {
+        fprintf(stderr, "Compression level must be between 0 and 9.\n");
+        return -1;
+    }
+
+    compression_level = level;
+    compression_min_size = min_size;
+    return 0;
+}
+
+int http_compression_eligible(const char *content_type, long long length)
+{
+    if (compression_level == 0 || !content_type)
+        return 0;
+    if (length >= 0 && (unsigned long long)length < compression_min_size)
+        return 0;
+    return compressible(content_type);
+}
+
+void compression_thread_cleanup(void)
+{
+    for (int coding = 0; coding < HTTP_CODING_COUNT; coding++)
+    {
+        if (!whole_body_streams[coding])
+            continue;
+        deflateEnd(whole_body_streams[coding]);
+        free(whole_body_streams[coding]);
+        whole_body_streams[coding] = NULL;
+    }
+}
+
+http_coding http_coding_negotiate(const http_request *request)
+{
+    const http_slice *accept = http_request_find_header(request, HTTP_HEADER_ACCEPT_ENCODING);
+    if (!accept || compression_level == 0)
+        return HTTP_CODING_IDENTITY;
+
+    // weights in thousandths, -1 for codings the header does not name
+    int weights[HTTP_CODING_COUNT] = {-1, -1, -1};
+    int any = -1;
+
+    const char *p = accept->data;
+    const char *end = p + accept->length;
+    while (p < end)
+    {
+        const char *comma = memchr(p, ',', end - p);
+        const char *item_end = comma ? comma : end;
+        parse_coding(p, item_end, weights, &any);
+        p = comma ? comma + 1 : end;
+    }
+
+    // "*" stands for every coding not listed by name
+    for (int coding = HTTP_CODING_GZIP; coding < HTTP_CODING_COUNT; coding++)
+        if (weights[coding] < 0)
+            weights[coding] = any > 0 ? any : 0;
+
+    if (weights[HTTP_CODING_GZIP] > 0 && weights[HTTP_CODING_GZIP] >= weights[HTTP_CODING_DEFLATE])
+        return HTTP_CODING_GZIP;
+    if (weights[HTTP_CODING_DEFLATE] > 0)
+        return HTTP_CODING_DEFLATE;
+    return HTTP_CODING_IDENTITY;
+}
+
+const char *http_coding_name(http_coding coding)
+{
+    return coding_names[coding];
+}
+
+int http_encode_body(http_coding coding, const char *body, size_t length, arena *a, const char **encoded,
+                     size_t *encoded_length)
+{
+    char *out = arena_alloc(a, length);
+    if (!out)
+        return -1;
+    int result = http_compress(coding, body, length, out, encoded_length);
+    if (result == 1)
+        *encoded = out;
+    return result;
+}
+
+int http_compress(http_coding coding, const char *data, size_t length, char *out, size_t *out_length)
+{
+    if (length > UINT_MAX)
+        return 0;
+
+    z_stream *z = whole_body_stream(coding);
+    if (!z)
+        return -1;
+
+    deflateReset(z);
+    z->next_in = (Bytef *)data;
+    z->avail_in = (uInt)length;
+    z->next_out = (Bytef *)out;
+    z->avail_out = (uInt)length;
+
+    // an encoding that does not fit in the body's own size is not worth sending
+    if (deflate(z, Z_FINISH) != Z_STREAM_END || z->total_out >= length)
+        return 0;
+
+    *out_length = z->total_out;
+    return 1;
+}
+
+int http_compressor_init(http_compressor *c, http_coding coding)
+{
+    memset(&c->z, 0, sizeof(c->z));
+    if (deflateInit2(&c->z, compression_level, Z_DEFLATED, window_bits(coding), 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        fprintf(stderr, "Error: Unable to start compressor\n");
+        return -1;
+    }
+    io_stats_allocations(1);
+    return 0;
+}
+
+char *http_compressor_write(http_compressor *c, arena *a, const char *data, size_t length, int finish,
+                            size_t *out_length)
+{
+    // deflateBound does not allow for the flush marker
+    size_t capacity = deflateBound(&c->z, length) + 16;
+    char *out = arena_alloc(a, capacity);
+    if (!out)
+        return NULL;
+
+    c->z.next_in = (Bytef *)data;
+    c->z.avail_in = (uInt)length;
+    size_t produced = 0;
+    for (;;)
+    {
+        c->z.next_out = (Bytef *)out + produced;
+        c->z.avail_out = (uInt)(capacity - produced);
+        int status = deflate(&c->z, finish ? Z_FINISH : Z_SYNC_FLUSH);
+        if (status == Z_STREAM_ERROR)
+        {
+            fprintf(stderr, "Error: Compressor failed\n");
+            return NULL;
+        }
+        produced = capacity - c->z.avail_out;
+        if (finish ? status == Z_STREAM_END : c->z.avail_out > 0)
+            break;
+
+        // out of room; carry on in a larger buffer
+        char *larger = arena_alloc(a, capacity * 2);
+        if (!larger)
+            return NULL;
+        memcpy(larger, out, produced);
+        out = larger;
+        capacity *= 2;
+    }
+
+    *out_length = produced;
+    return out;
+}
+
+void http_compressor_end(http_compressor *c)
+{
+    deflateEnd(&c->z);
+}
+
+static int compressible(const char *content_type)
+{
+    // the media type without parameters
+    size_t length = strcspn(content_type, "; \t");
+
+    if (length > 5 && strncasecmp(content_type, "text/", 5) == 0)
+        return 1;
+    // structured syntax suffixes (RFC 6839), e.g. application/problem+json or image/svg+xml
+    if (length > 5 && strncasecmp(content_type + length - 5, "+json", 5) == 0)
+        return 1;
+    if (length > 4 && strncasecmp(content_type + length - 4, "+xml", 4) == 0)
+        return 1;
+
+    for (int i = 0; compressible_types[i]; i++)
+        if (strlen(compressible_types[i]) == length && strncasecmp(content_type, compressible_types[i], length) == 0)
+            return 1;
+    return 0;
+}
+
+/*
+ * One element of Accept-Encoding (RFC 9110 12.5.3): a coding, "*" or
+ * "identity", optionally followed by ";q=" and a weight. Elements with a
+ * malformed weight are ignored.
+ */
+static void parse_coding(const char *p, const char *end, int *weights, int *any)
+{
+    p = skip_space(p, end);
+    const char *name = p;
+    while (p < end && *p != ';' && *p != ' ' && *p != '\t')
+        p++;
+    http_slice token = {name, (size_t)(p - name)};
+
+    int weight = 1000;
+    const char *semicolon = memchr(p, ';', end - p);
+    if (semicolon)
+    {
+        p = skip_space(semicolon + 1, end);
+        if (end - p < 2 || (p[0] != 'q' && p[0] != 'Q') || p[1] != '=')
+            return;
+        weight = parse_weight(p + 2, end);
+        if (weight < 0)
+            return;
+    }
+
+    if (http_slice_equals_ignore_case(token, "gzip") || http_slice_equals_ignore_case(token, "x-gzip"))
+        weights[HTTP_CODING_GZIP] = weight;
+    else if (http_slice_equals_ignore_case(token, "deflate"))
+        weights[HTTP_CODING_DEFLATE] = weight;
+    else if (http_slice_equals(token, "*"))
+        *any = weight;
+}
+
+// qvalue = ( "0" [ "." 0*3DIGIT ] ) / ( "1" [ "." 0*3("0") ] ), in thousandths
+static int parse_weight(const char *p, const char *end)
+{
+    if (p == end || (*p != '0' && *p != '1'))
+        return -1;
+
+    int weight = (*p++ - '0') * 1000;
+    if (p < end && *p == '.')
+    {
+        p++;
+        for (int scale = 100; scale > 0 && p < end && *p >= '0' && *p <= '9'; scale /= 10)
+            weight += (*p++ - '0') * scale;
+    }
+
+    p = skip_space(p, end);
+    return p == end && weight <= 1000 ? weight : -1;
+}
+
+static const char *skip_space(const char *p, const char *end)
+{
+    while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+    return p;
+}
+
+static int window_bits(http_coding coding)
+{
+    // 16 more asks zlib for the gzip wrapper instead of its own
+    return coding == HTTP_CODING_GZIP ? MAX_WBITS + 16 : MAX_WBITS;
+}
+
+// kept for the life of the thread; deflateReset makes it ready for the next body
+static z_stream *whole_body_stream(http_coding coding)
+{
+    if (whole_body_streams[coding])
+        return whole_body_streams[coding];
+
+    z_stream *z = calloc(1, sizeof(z_stream));
+    if (!z)
+    {
+        fprintf(stderr, "Error: Unable to allocate compressor\n");
+        return NULL;
+    }
+    if (deflateInit2(z, compression_level, Z_DEFLATED, window_bits(coding), 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        fprintf(stderr, "Error: Unable to start compressor\n");
+        free(z);
+        return NULL;
+    }
+
+    whole_body_streams[coding] = z;
+    return z;
+}
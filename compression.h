@@ -0,0 +1,130 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <stddef.h> // size_t
+#include <zlib.h>
+
+#include "arena.h"
+#include "request.h"
+
+#define COMPRESSION_DEFAULT_LEVEL 6       // zlib level 1-9; 0 turns compression off
+#define COMPRESSION_DEFAULT_MIN_SIZE 1024 // smaller bodies save less than the encoding costs
+
+typedef enum
+{
+    HTTP_CODING_IDENTITY,
+    HTTP_CODING_GZIP,
+    HTTP_CODING_DEFLATE, // zlib format, as RFC 9110 8.4.1.2 defines it
+    HTTP_CODING_COUNT
+} http_coding;
+
+// compresses a body written in pieces, each piece flushed so it can go out as soon as it is queued
+typedef struct
+{
+    z_stream z;
+} http_compressor;
+
+/**
+ * Sets the compression level and the smallest body worth compressing.
+ * Call once before workers start; compression is on with the defaults
+ * otherwise.
+ *
+ * @param level zlib level 1-9, or 0 to send every body as it is.
+ * @param min_size Bodies of fewer bytes are sent as they are.
+ * @return 0 on success, -1 if the level is out of range.
+ */
+int compression_configure(int level, size_t min_size);
+
+/**
+ * Tells whether a response may be sent compressed, whatever the client
+ * accepts; such a response needs "Vary: Accept-Encoding".
+ *
+ * @param content_type Value of the Content-Type header.
+ * @param length Body length, or -1 if it is not known yet.
+ * @return Non-zero if compression is on, the type is textual and the body is large enough.
+ */
+int http_compression_eligible(const char *content_type, long long length);
+
+/**
+ * Frees the calling thread's reusable whole-body compressors, for a thread
+ * that used http_compress or http_encode_body and is about to exit.
+ */
+void compression_thread_cleanup(void);
+
+/**
+ * Picks the content coding for a response from the request's
+ * Accept-Encoding: the accepted coding with the highest weight, gzip on a
+ * tie, and identity if neither gzip nor deflate is acceptable.
+ *
+ * @param request Pointer to the parsed request.
+ * @return The coding to use.
+ */
+http_coding http_coding_negotiate(const http_request *request);
+
+/**
+ * Returns the token of a coding for Content-Encoding.
+ *
+ * @param coding Coding other than identity.
+ * @return Static string (e.g., "gzip").
+ */
+const char *http_coding_name(http_coding coding);
+
+/**
+ * Compresses a whole body into the arena. Static files keep their compressed
+ * copies with their cache entries; every other body is made per request.
+ *
+ * @param coding Coding other than identity.
+ * @param body Body to encode.
+ * @param length Length of the body.
+ * @param a Arena the encoded body is allocated from.
+ * @param encoded Set to the encoded body.
+ * @param encoded_length Set to its length.
+ * @return 1 if encoded, 0 if the encoding would be no smaller (send the body as it is), -1 on failure.
+ */
+int http_encode_body(http_coding coding, const char *body, size_t length, arena *a, const char **encoded,
+                     size_t *encoded_length);
+
+/**
+ * Compresses a whole body into a caller-supplied buffer, without caching.
+ *
+ * @param coding Coding other than identity.
+ * @param data Body to encode.
+ * @param length Length of the body.
+ * @param out Buffer of at least length bytes; an encoding that does not fit is not worth sending.
+ * @param out_length Set to the encoded length.
+ * @return 1 if encoded, 0 if the encoding would be no smaller, -1 on failure.
+ */
+int http_compress(http_coding coding, const char *data, size_t length, char *out, size_t *out_length);
+
+/**
+ * Starts a streaming compressor.
+ *
+ * @param c Compressor to initialize.
+ * @param coding Coding other than identity.
+ * @return 0 on success, -1 on failure.
+ */
+int http_compressor_init(http_compressor *c, http_coding coding);
+
+/**
+ * Compresses the next piece of a body into the arena and flushes it, so
+ * the output decodes to everything written so far.
+ *
+ * @param c Compressor started by http_compressor_init.
+ * @param a Arena the output is allocated from.
+ * @param data Body bytes, or NULL with finish set.
+ * @param length Number of bytes.
+ * @param finish Non-zero to end the encoded stream after these bytes.
+ * @param out_length Set to the length of the output.
+ * @return The output, or NULL on failure.
+ */
+char *http_compressor_write(http_compressor *c, arena *a, const char *data, size_t length, int finish,
+                            size_t *out_length);
+
+/**
+ * Frees a compressor's zlib state.
+ *
+ * @param c Compressor started by http_compressor_init.
+ */
+void http_compressor_end(http_compressor *c);
+
+#endif // COMPRESSION_H
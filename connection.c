@@ -0,0 +1,740 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "connection.h"
+#include "io_stats.h"
+#include "metrics.h"
+
+#define CONNECTION_TABLE_INITIAL_CAPACITY 64
+
+static connection *take_slot(connection_table *table);
+static void add_active(connection_table *table, int delta);
+static time_t coarse_now(void);
+static int flush_batch(connection *conn, int flags);
+static int write_iov(connection *conn, const struct iovec *iov, int count, int flags);
+static int queue_iov(connection *conn, const struct iovec *iov, int count);
+static int queue_file(connection *conn, const connection_file *file);
+static void release_file(connection_file *file);
+static int resize_recv_buf(connection *conn, size_t capacity);
+static void publish_recv_buffers(const connection_table *table);
+static void stop_producer(connection *conn);
+static void connection_timed_out(timer *t);
+static void arm_deadline(connection *conn, connection_wait waiting);
+
+int connection_table_init(connection_table *table, event_loop *loop, int max_connections)
+{
+    table->loop = loop;
+    table->io = NULL;
+    table->slots = NULL;
+    table->capacity = 0;
+    table->used = 0;
+    atomic_init(&table->active, 0);
+    atomic_init(&table->accepted, 0);
+    table->max_connections = max_connections;
+    table->free_list = NULL;
+    table->timeouts.idle = CONNECTION_IDLE_TIMEOUT;
+    table->timeouts.header = CONNECTION_HEADER_TIMEOUT;
+    table->timeouts.body = CONNECTION_BODY_TIMEOUT;
+    table->timeouts.write = CONNECTION_WRITE_TIMEOUT;
+    table->timeouts.upstream = CONNECTION_UPSTREAM_TIMEOUT;
+    table->max_requests = CONNECTION_MAX_REQUESTS;
+    table->now = coarse_now();
+    timer_wheel_init(&table->timers, table->now);
+
+    return buffer_pool_init(&table->recv_buffers, CONNECTION_RECV_INITIAL, CONNECTION_RECV_MAX,
+                            CONNECTION_RECV_RETAIN);
+}
+
+void connection_table_cleanup(connection_table *table)
+{
+    for (int i = 0; i < table->used; i++)
+    {
+        connection *conn = table->slots[i];
+        if (conn->handler.fd != -1)
+            connection_close(conn);
+        free(conn);
+    }
+    buffer_pool_cleanup(&table->recv_buffers);
+
+    free(table->slots);
+    table->slots = NULL;
+    table->capacity = 0;
+    table->used = 0;
+    table->free_list = NULL;
+}
+
+static time_t coarse_now(void)
+{
+    // vDSO, no syscall; resolution of a few milliseconds is plenty here
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+void connection_table_tick(connection_table *table)
+{
+    table->now = coarse_now();
+    timer_wheel_advance(&table->timers, table->now);
+}
+
+static void connection_timed_out(timer *t)
+{
+    connection_close(t->data);
+}
+
+void connection_update_deadline(connection *conn)
+{
+    if (conn->handler.fd == -1)
+        return;
+
+    connection_wait waiting = CONNECTION_WAIT_IDLE;
+    if (conn->parked)
+        waiting = conn->parked == CONNECTION_PARKED_UPSTREAM ? CONNECTION_WAIT_UPSTREAM : CONNECTION_WAIT_OFFLOAD;
+    else if (conn->out_queued > 0 || conn->producer.produce)
+        waiting = CONNECTION_WAIT_WRITE;
+    else if (conn->parser.state == HTTP_PARSER_BODY)
+        waiting = CONNECTION_WAIT_BODY;
+    else if (conn->recv_start < conn->recv_len)
+        waiting = CONNECTION_WAIT_HEADER;
+
+    // a client trickling in header bytes must not keep pushing its deadline back
+    if (waiting == CONNECTION_WAIT_HEADER && conn->waiting == CONNECTION_WAIT_HEADER)
+        return;
+
+    arm_deadline(conn, waiting);
+}
+
+static void arm_deadline(connection *conn, connection_wait waiting)
+{
+    connection_table *table = conn->table;
+    int timeout = 0;
+    switch (waiting)
+    {
+    case CONNECTION_WAIT_IDLE:
+        timeout = table->timeouts.idle;
+        break;
+    case CONNECTION_WAIT_HEADER:
+        timeout = table->timeouts.header;
+        break;
+    case CONNECTION_WAIT_BODY:
+        timeout = table->timeouts.body;
+        break;
+    case CONNECTION_WAIT_WRITE:
+        timeout = table->timeouts.write;
+        break;
+    case CONNECTION_WAIT_OFFLOAD:
+        break;
+    case CONNECTION_WAIT_UPSTREAM:
+        timeout = table->timeouts.upstream;
+        break;
+    }
+
+    conn->waiting = waiting;
+    if (timeout > 0)
+        timer_wheel_arm(&table->timers, &conn->deadline, table->now + timeout);
+    else
+        timer_cancel(&conn->deadline);
+}
+
+/*
+ * Single-writer counters: a relaxed load and store avoids a locked
+ * read-modify-write while still giving readers a torn-free value.
+ */
+static void add_active(connection_table *table, int delta)
+{
+    int active = atomic_load_explicit(&table->active, memory_order_relaxed);
+    atomic_store_explicit(&table->active, active + delta, memory_order_relaxed);
+}
+
+static connection *take_slot(connection_table *table)
+{
+    if (table->free_list)
+    {
+        connection *conn = table->free_list;
+        table->free_list = conn->next_free;
+        return conn;
+    }
+
+    if (table->used == table->capacity)
+    {
+        int capacity = table->capacity ? table->capacity * 2 : CONNECTION_TABLE_INITIAL_CAPACITY;
+        connection **slots = realloc(table->slots, capacity * sizeof(connection *));
+        if (!slots)
+        {
+            fprintf(stderr, "Error: Unable to grow connection table\n");
+            return NULL;
+        }
+        table->slots = slots;
+        table->capacity = capacity;
+    }
+
+    connection *conn = malloc(sizeof(connection));
+    if (!conn)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for connection\n");
+        return NULL;
+    }
+
+    conn->table = table;
+    conn->slot = table->used;
+    conn->generation = 0;
+    conn->io_data = NULL;
+    conn->recv_buf = NULL;
+    conn->recv_cap = 0;
+    request_body_init(&conn->body);
+    timer_init(&conn->deadline, connection_timed_out, conn);
+    arena_init(&conn->arena, ARENA_INITIAL_SIZE);
+    table->slots[table->used++] = conn;
+
+    return conn;
+}
+
+connection *connection_open(connection_table *table, int fd, unsigned int events, event_callback callback)
+{
+    if (atomic_load_explicit(&table->active, memory_order_relaxed) >= table->max_connections)
+        return NULL;
+
+    connection *conn = take_slot(table);
+    if (!conn)
+        return NULL;
+
+    conn->next_free = NULL;
+    conn->generation++;
+    conn->handler.fd = fd;
+    conn->handler.events = events;
+    conn->handler.callback = callback;
+    conn->handler.data = conn;
+    conn->recv_start = 0;
+    conn->recv_len = 0;
+    http_parser_init(&conn->parser, &conn->request);
+    conn->body_mode = CONNECTION_BODY_BUFFER;
+    conn->requests = 0;
+    conn->keep_alive = 1;
+    conn->closing = 0;
+    conn->parked = CONNECTION_RUNNING;
+    conn->out_count = 0;
+    conn->out_head = NULL;
+    conn->out_tail = NULL;
+    conn->out_queued = 0;
+    conn->producer.produce = NULL;
+
+    if (callback && event_loop_add(table->loop, &conn->handler) == -1)
+    {
+        conn->handler.fd = -1;
+        conn->next_free = table->free_list;
+        table->free_list = conn;
+        return NULL;
+    }
+
+    // the first request's header section is due from the accept on
+    arm_deadline(conn, CONNECTION_WAIT_HEADER);
+    add_active(table, 1);
+    unsigned long accepted = atomic_load_explicit(&table->accepted, memory_order_relaxed);
+    atomic_store_explicit(&table->accepted, accepted + 1, memory_order_relaxed);
+    metrics_connection_opened();
+    return conn;
+}
+
+int connection_set_events(connection *conn, unsigned int events)
+{
+    return event_loop_modify(conn->table->loop, &conn->handler, events);
+}
+
+char *connection_recv_space(connection *conn, size_t *space)
+{
+    if (conn->recv_len == conn->recv_cap && conn->recv_start > 0)
+    {
+        // the parser tracks offsets from the request start; only the slices move
+        memmove(conn->recv_buf, conn->recv_buf + conn->recv_start, conn->recv_len - conn->recv_start);
+        http_request_rebase(&conn->request, conn->recv_buf + conn->recv_start, conn->recv_buf);
+        conn->recv_len -= conn->recv_start;
+        conn->recv_start = 0;
+    }
+
+    if (conn->recv_len == conn->recv_cap)
+    {
+        if (conn->recv_cap >= CONNECTION_RECV_MAX)
+            return NULL;
+
+        size_t capacity = conn->recv_cap ? conn->recv_cap * 2 : CONNECTION_RECV_INITIAL;
+        if (resize_recv_buf(conn, capacity) == -1)
+            return NULL;
+    }
+
+    *space = conn->recv_cap - conn->recv_len;
+    return conn->recv_buf + conn->recv_len;
+}
+
+int connection_recv_reserve(connection *conn, size_t space)
+{
+    size_t capacity = conn->recv_cap ? conn->recv_cap : CONNECTION_RECV_INITIAL;
+    while (capacity - conn->recv_len < space && capacity < CONNECTION_RECV_MAX)
+        capacity *= 2;
+
+    return capacity > conn->recv_cap ? resize_recv_buf(conn, capacity) : 0;
+}
+
+// moves the data to a buffer of the pool's next fitting class and hands the old one back
+static int resize_recv_buf(connection *conn, size_t capacity)
+{
+    buffer_pool *pool = &conn->table->recv_buffers;
+    if (capacity > CONNECTION_RECV_MAX)
+        capacity = CONNECTION_RECV_MAX;
+
+    char *buf = buffer_pool_get(pool, capacity, &capacity);
+    if (!buf)
+    {
+        fprintf(stderr, "Error: Unable to grow receive buffer\n");
+        return -1;
+    }
+    if (conn->recv_buf)
+    {
+        memcpy(buf, conn->recv_buf, conn->recv_len);
+        http_request_rebase(&conn->request, conn->recv_buf + conn->recv_start, buf + conn->recv_start);
+        buffer_pool_put(pool, conn->recv_buf, conn->recv_cap);
+    }
+    conn->recv_buf = buf;
+    conn->recv_cap = capacity;
+    publish_recv_buffers(conn->table);
+    return 0;
+}
+
+void connection_recv_release(connection *conn)
+{
+    if (!conn->recv_buf || conn->recv_len > 0)
+        return;
+
+    buffer_pool_put(&conn->table->recv_buffers, conn->recv_buf, conn->recv_cap);
+    conn->recv_buf = NULL;
+    conn->recv_cap = 0;
+    publish_recv_buffers(conn->table);
+}
+
+static void publish_recv_buffers(const connection_table *table)
+{
+    const buffer_pool *pool = &table->recv_buffers;
+    metrics_recv_buffers(pool->in_use, pool->in_use_bytes, pool->peak_bytes, pool->free_bytes);
+}
+
+void connection_drop(connection *conn, size_t offset, size_t length)
+{
+    char *start = conn->recv_buf + conn->recv_start + offset;
+    memmove(start, start + length, conn->recv_len - (conn->recv_start + offset + length));
+    conn->recv_len -= length;
+}
+
+void connection_consume(connection *conn, size_t length)
+{
+    conn->recv_start += length;
+    if (conn->recv_start == conn->recv_len)
+    {
+        conn->recv_start = 0;
+        conn->recv_len = 0;
+    }
+}
+
+int connection_send(connection *conn, const char *data, size_t length)
+{
+    struct iovec iov = {.iov_base = (void *)data, .iov_len = length};
+    return connection_sendv(conn, &iov, 1);
+}
+
+int connection_sendv(connection *conn, const struct iovec *iov, int count)
+{
+    if (count < 0 || count > CONNECTION_MAX_IOV)
+        return -1;
+
+    if (conn->out_count + count > CONNECTION_MAX_IOV && connection_flush(conn) == -1)
+        return -1;
+
+    memcpy(conn->out_iov + conn->out_count, iov, count * sizeof(struct iovec));
+    conn->out_count += count;
+
+    return 0;
+}
+
+int connection_set_producer(connection *conn, const connection_producer *producer)
+{
+    if (conn->producer.produce)
+    {
+        fprintf(stderr, "Error: Connection already has a producer\n");
+        if (producer->release)
+            producer->release(producer->arg);
+        return -1;
+    }
+
+    conn->producer = *producer;
+    return 0;
+}
+
+int connection_run_producer(connection *conn)
+{
+    while (conn->producer.produce && !connection_input_paused(conn) && conn->handler.fd != -1)
+    {
+        int status = conn->producer.produce(conn, conn->producer.arg);
+        if (status == -1 || connection_flush(conn) == -1)
+        {
+            stop_producer(conn);
+            return -1;
+        }
+
+        // flushed output is sent or copied, so what the producer built is garbage now
+        arena_reset(&conn->arena);
+
+        if (status == 1)
+        {
+            stop_producer(conn);
+            if (!conn->keep_alive)
+                conn->closing = 1;
+        }
+    }
+
+    return 0;
+}
+
+static void stop_producer(connection *conn)
+{
+    connection_producer producer = conn->producer;
+    conn->producer.produce = NULL;
+    if (producer.release)
+        producer.release(producer.arg);
+}
+
+int connection_flush(connection *conn)
+{
+    return flush_batch(conn, 0);
+}
+
+static int flush_batch(connection *conn, int flags)
+{
+    int count = conn->out_count;
+    if (count == 0)
+        return 0;
+
+    conn->out_count = 0;
+    return write_iov(conn, conn->out_iov, count, flags);
+}
+
+static int write_iov(connection *conn, const struct iovec *iov, int count, int flags)
+{
+    connection_table *table = conn->table;
+
+    if (table->io && table->io->send)
+        return table->io->send(conn, iov, count);
+
+    size_t length = 0;
+    for (int i = 0; i < count; i++)
+        length += iov[i].iov_len;
+    connection_account_output(conn, (long)length);
+
+    // earlier output is still waiting for the socket; keep the order
+    if (conn->out_head)
+        return queue_iov(conn, iov, count);
+
+    // sendmsg may stop short; advance through a private copy of the vector
+    struct iovec vec[CONNECTION_MAX_IOV];
+    memcpy(vec, iov, count * sizeof(struct iovec));
+
+    struct msghdr msg = {.msg_iov = vec, .msg_iovlen = count};
+    while (msg.msg_iovlen > 0)
+    {
+        io_stats_syscall();
+        ssize_t n = sendmsg(conn->handler.fd, &msg, MSG_NOSIGNAL | flags);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return queue_iov(conn, msg.msg_iov, (int)msg.msg_iovlen);
+            perror("Failed to send response to client");
+            return -1;
+        }
+        connection_account_output(conn, -(long)n);
+        metrics_bytes_out(n);
+
+        while (msg.msg_iovlen > 0 && (size_t)n >= msg.msg_iov->iov_len)
+        {
+            n -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0)
+        {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + n;
+            msg.msg_iov->iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * The iovecs point into the arena and the receive buffer, both of which are
+ * reused before the socket drains, so the rest of the output is copied.
+ */
+static int queue_iov(connection *conn, const struct iovec *iov, int count)
+{
+    size_t length = 0;
+    for (int i = 0; i < count; i++)
+        length += iov[i].iov_len;
+
+    output_chunk *chunk = malloc(sizeof(output_chunk) + length);
+    if (!chunk)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for queued output\n");
+        return -1;
+    }
+    io_stats_allocations(1);
+
+    size_t offset = 0;
+    for (int i = 0; i < count; i++)
+    {
+        memcpy(chunk->data + offset, iov[i].iov_base, iov[i].iov_len);
+        offset += iov[i].iov_len;
+    }
+    chunk->next = NULL;
+    chunk->file.fd = -1;
+    chunk->length = length;
+    chunk->offset = 0;
+
+    if (conn->out_tail)
+        conn->out_tail->next = chunk;
+    else
+        conn->out_head = chunk;
+    conn->out_tail = chunk;
+
+    return connection_set_events(conn, EVENT_READ | EVENT_WRITE);
+}
+
+static int queue_file(connection *conn, const connection_file *file)
+{
+    output_chunk *chunk = malloc(sizeof(output_chunk));
+    if (!chunk)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for queued output\n");
+        return -1;
+    }
+    io_stats_allocations(1);
+
+    chunk->next = NULL;
+    chunk->file = *file;
+    chunk->length = 0;
+    chunk->offset = 0;
+
+    if (conn->out_tail)
+        conn->out_tail->next = chunk;
+    else
+        conn->out_head = chunk;
+    conn->out_tail = chunk;
+
+    return connection_set_events(conn, EVENT_READ | EVENT_WRITE);
+}
+
+int connection_sendfile(connection *conn, const connection_file *file)
+{
+    connection_table *table = conn->table;
+    connection_file rest = *file;
+
+    // the response head queued just before must go out first, held back
+    // with MSG_MORE so it shares a segment with the start of the file
+    if (flush_batch(conn, MSG_MORE) == -1)
+    {
+        release_file(&rest);
+        return -1;
+    }
+
+    if (table->io && table->io->sendfile)
+        return table->io->sendfile(conn, &rest);
+
+    connection_account_output(conn, (long)rest.length);
+    if (!conn->out_head && connection_send_file_range(conn, &rest) == -1)
+    {
+        release_file(&rest);
+        return -1;
+    }
+
+    if (rest.length == 0)
+    {
+        release_file(&rest);
+        return 0;
+    }
+
+    if (queue_file(conn, &rest) == -1)
+    {
+        release_file(&rest);
+        return -1;
+    }
+
+    return 0;
+}
+
+int connection_send_file_range(connection *conn, connection_file *file)
+{
+    while (file->length > 0)
+    {
+        io_stats_syscall();
+        ssize_t n = file->pipe ? splice(file->fd, NULL, conn->handler.fd, NULL, file->length,
+                                        SPLICE_F_MOVE | SPLICE_F_NONBLOCK)
+                               : sendfile(conn->handler.fd, file->fd, &file->offset, file->length);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            perror("Failed to send file to client");
+            return -1;
+        }
+        if (n == 0)
+        {
+            // the headers promised more bytes than the file now has
+            fprintf(stderr, "File shrank while it was being sent.\n");
+            return -1;
+        }
+
+        file->length -= n;
+        connection_account_output(conn, -(long)n);
+        metrics_bytes_out(n);
+    }
+
+    return 0;
+}
+
+static void release_file(connection_file *file)
+{
+    if (file->release)
+        file->release(file->arg);
+    file->release = NULL;
+}
+
+int connection_write_queued(connection *conn)
+{
+    while (conn->out_head)
+    {
+        output_chunk *head = conn->out_head;
+        if (head->file.fd != -1)
+        {
+            if (connection_send_file_range(conn, &head->file) == -1)
+                return -1;
+            if (head->file.length > 0)
+                return 0;
+
+            release_file(&head->file);
+            conn->out_head = head->next;
+            if (!conn->out_head)
+                conn->out_tail = NULL;
+            free(head);
+            continue;
+        }
+
+        struct iovec iov[CONNECTION_MAX_IOV];
+        int count = 0;
+        output_chunk *chunk = head;
+        for (; chunk && chunk->file.fd == -1 && count < CONNECTION_MAX_IOV; chunk = chunk->next)
+        {
+            iov[count].iov_base = chunk->data + chunk->offset;
+            iov[count].iov_len = chunk->length - chunk->offset;
+            count++;
+        }
+        int flags = chunk && chunk->file.fd != -1 ? MSG_MORE : 0;
+
+        struct msghdr msg = {.msg_iov = iov, .msg_iovlen = count};
+        io_stats_syscall();
+        ssize_t n = sendmsg(conn->handler.fd, &msg, MSG_NOSIGNAL | flags);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            perror("Failed to send response to client");
+            return -1;
+        }
+        connection_account_output(conn, -(long)n);
+        metrics_bytes_out(n);
+
+        while (n > 0)
+        {
+            output_chunk *chunk = conn->out_head;
+            size_t left = chunk->length - chunk->offset;
+            if ((size_t)n < left)
+            {
+                chunk->offset += n;
+                break;
+            }
+            n -= left;
+            conn->out_head = chunk->next;
+            free(chunk);
+        }
+        if (!conn->out_head)
+            conn->out_tail = NULL;
+    }
+
+    return connection_set_events(conn, EVENT_READ);
+}
+
+void connection_account_output(connection *conn, long delta)
+{
+    conn->out_queued += delta;
+    io_stats_output_queued(delta);
+
+    // a client that is still draining responses is making progress
+    if (delta < 0 && conn->waiting == CONNECTION_WAIT_WRITE)
+        connection_update_deadline(conn);
+}
+
+int connection_output_blocked(const connection *conn)
+{
+    return conn->out_queued >= CONNECTION_OUTPUT_HIGH_WATER;
+}
+
+int connection_input_paused(const connection *conn)
+{
+    return conn->parked || connection_output_blocked(conn);
+}
+
+void connection_close(connection *conn)
+{
+    connection_table *table = conn->table;
+
+    if (conn->handler.fd == -1)
+        return;
+
+    if (table->io && table->io->close)
+        table->io->close(conn);
+    if (conn->handler.callback)
+        event_loop_remove(table->loop, &conn->handler);
+    close(conn->handler.fd);
+    conn->handler.fd = -1;
+    conn->out_count = 0;
+    while (conn->out_head)
+    {
+        output_chunk *next = conn->out_head->next;
+        if (conn->out_head->file.fd != -1)
+            release_file(&conn->out_head->file);
+        free(conn->out_head);
+        conn->out_head = next;
+    }
+    conn->out_tail = NULL;
+    connection_account_output(conn, -(long)conn->out_queued);
+    if (conn->producer.produce)
+        stop_producer(conn);
+    cleanup_http_request(&conn->request);
+    request_body_reset(&conn->body);
+    conn->recv_len = 0;
+    connection_recv_release(conn);
+    arena_destroy(&conn->arena);
+    timer_cancel(&conn->deadline);
+
+    conn->next_free = table->free_list;
+    table->free_list = conn;
+    add_active(table, -1);
+    metrics_connection_closed();
+}
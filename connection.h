@@ -0,0 +1,408 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <stdatomic.h>
+
+#include <stddef.h>    // size_t
+#include <sys/types.h> // off_t
+#include <sys/uio.h>   // struct iovec
+#include <time.h>      // time_t
+
+#include "arena.h"
+#include "buffer_pool.h"
+#include "event_loop.h"
+#include "request.h"
+#include "request_body.h"
+#include "timer_wheel.h"
+
+#define MAX_CONNECTIONS 65536
+#define CONNECTION_RECV_INITIAL MAX_RECV_BUF
+#define CONNECTION_RECV_BODY (64 * 1024) // receive space behind the header section while a body streams
+#define CONNECTION_RECV_MAX (HTTP_MAX_HEADER_SIZE + (1 << 20)) // headers plus requests that arrive while output is blocked
+#define CONNECTION_RECV_RETAIN (4 << 20) // bytes of idle receive buffers a table keeps for reuse
+#define CONNECTION_MAX_IOV 64 // responses queued between flushes, two entries each
+#define CONNECTION_IDLE_TIMEOUT 15   // seconds a keep-alive connection may sit idle
+#define CONNECTION_HEADER_TIMEOUT 10 // seconds from a request's first byte (or the accept) to its blank line
+#define CONNECTION_BODY_TIMEOUT 30   // seconds a request body may go without a byte arriving
+#define CONNECTION_WRITE_TIMEOUT 30  // seconds queued output may go without a byte leaving
+#define CONNECTION_UPSTREAM_TIMEOUT 30 // seconds a proxied request may wait on its upstream without progress
+#define CONNECTION_MAX_REQUESTS 1000 // requests served before the connection is closed
+#define CONNECTION_OUTPUT_HIGH_WATER (256 * 1024) // unsent bytes at which reading stops
+
+typedef struct connection_table connection_table;
+struct connection;
+
+// per-phase limits in seconds, 0 for none
+typedef struct
+{
+    int idle;   // keep-alive: between a response and the next request's first byte
+    int header; // from a request's first byte to the end of its header section
+    int body;   // between two reads of a request body
+    int write;  // between two sends while output is queued
+    int upstream; // between two steps of a proxied exchange while the connection waits on it
+} connection_timeouts;
+
+// what a connection is waiting for, which decides the deadline that applies
+typedef enum
+{
+    CONNECTION_WAIT_IDLE,
+    CONNECTION_WAIT_HEADER,
+    CONNECTION_WAIT_BODY,
+    CONNECTION_WAIT_WRITE,
+    CONNECTION_WAIT_OFFLOAD, // on the server's own offload pool, so no deadline
+    CONNECTION_WAIT_UPSTREAM // on a proxied upstream, which may never answer
+} connection_wait;
+
+// what a parked connection waits for; nothing more is read or answered meanwhile
+typedef enum
+{
+    CONNECTION_RUNNING,
+    CONNECTION_PARKED_OFFLOAD, // a handler's work is out on the offload pool
+    CONNECTION_PARKED_UPSTREAM // a proxied upstream has not answered, or sent more, yet
+} connection_park;
+
+/*
+ * A file range sent with sendfile, so its bytes never pass through user
+ * space. The descriptor must stay open until release is called. A pipe
+ * has no offset: its next length bytes are moved with splice instead.
+ */
+typedef struct
+{
+    int fd;
+    off_t offset;
+    size_t length;
+    int pipe;
+    void (*release)(void *arg); // called once the range is sent or dropped
+    void *arg;
+} connection_file;
+
+/*
+ * Generates a response body while it is sent, so a large one never has to
+ * exist in memory at once. produce is called whenever the connection can
+ * take more output, until it reports that it is done.
+ */
+typedef struct
+{
+    int (*produce)(struct connection *conn, void *arg); // queues more output: 1 when done, 0 if more follows, -1 on failure
+    void (*release)(void *arg); // called once, when done or when the connection closes
+    void *arg;
+} connection_producer;
+
+// unsent output copied off the arena and receive buffer after a short write
+typedef struct output_chunk
+{
+    struct output_chunk *next;
+    connection_file file; // file.fd is -1 for in-memory chunks
+    size_t length;
+    size_t offset; // bytes already sent
+    char data[];
+} output_chunk;
+
+// where the body of the request being received goes
+typedef enum
+{
+    CONNECTION_BODY_BUFFER,  // collected in body for the route's handler
+    CONNECTION_BODY_STREAM,  // handed chunk by chunk to a streaming route
+    CONNECTION_BODY_DISCARD  // no route wants it; read and dropped
+} connection_body_mode;
+
+typedef struct connection
+{
+    event_handler handler; // fd and readable/writable interest
+    connection_table *table;
+    int slot;
+    unsigned int generation; // bumped on every reuse of the slot
+    void *io_data;           // backend-private state, kept across reuse
+    struct connection *next_free;
+
+    // received bytes; [recv_start, recv_len) is not yet consumed by a request.
+    // Lent by the table's pool while there are any, NULL while idle.
+    char *recv_buf;
+    size_t recv_start;
+    size_t recv_len;
+    size_t recv_cap;
+    http_parser parser;
+    http_request request; // request being parsed, resumed on every read
+    connection_body_mode body_mode;
+    request_body body; // body collected in CONNECTION_BODY_BUFFER mode
+
+    unsigned int requests; // requests answered so far
+    int keep_alive;        // the response being built leaves the connection open
+    int closing;           // close once queued output is sent; further input is ignored
+    connection_park parked;
+    connection_wait waiting;
+    timer deadline; // closes the connection when what it waits for takes too long
+
+    // responses queued by connection_sendv, written together by connection_flush
+    struct iovec out_iov[CONNECTION_MAX_IOV];
+    int out_count;
+    output_chunk *out_head; // waiting for the socket to become writable
+    output_chunk *out_tail;
+    size_t out_queued; // flushed bytes the backend has not sent yet
+    connection_producer producer; // produce is set while a response body is being generated
+
+    // responses are built here; reset once they are flushed to the backend
+    arena arena;
+} connection;
+
+/*
+ * I/O backend hooks. Tables without hooks use plain socket calls and
+ * register connections with the event loop.
+ */
+typedef struct
+{
+    int (*send)(connection *conn, const struct iovec *iov, int count);
+    int (*sendfile)(connection *conn, const connection_file *file);
+    void (*close)(connection *conn); // called before the fd is closed
+} connection_io;
+
+/*
+ * Connection slots for one event loop. Slots are allocated on first use and
+ * recycled through a free list, so connection pointers stay stable for the
+ * lifetime of the table.
+ */
+struct connection_table
+{
+    event_loop *loop;
+    const connection_io *io;
+    connection **slots;
+    int capacity; // allocated length of slots
+    int used;     // slots handed out at least once
+    // written only by the owning thread, readable from any thread
+    atomic_int active;     // currently open connections
+    atomic_ulong accepted; // connections opened since start
+    int max_connections;
+    connection *free_list;
+    connection_timeouts timeouts;
+    int max_requests; // per connection, 0 for no limit
+    time_t now;       // coarse monotonic clock, advanced by connection_table_tick
+    timer_wheel timers; // connection deadlines, in seconds of the table clock
+    buffer_pool recv_buffers; // receive buffers, lent to connections while they hold unconsumed bytes
+};
+
+/**
+ * Initializes a connection table.
+ *
+ * @param table Pointer to the connection_table structure to initialize.
+ * @param loop Event loop connections are registered with.
+ * @param max_connections Upper bound on simultaneously open connections.
+ * @return 0 on success, -1 on failure.
+ */
+int connection_table_init(connection_table *table, event_loop *loop, int max_connections);
+
+/**
+ * Closes every open connection and frees the table's memory.
+ *
+ * @param table Pointer to the connection_table structure to clean up.
+ */
+void connection_table_cleanup(connection_table *table);
+
+/**
+ * Advances the table's clock and closes the connections whose deadline has
+ * passed. Costs nothing for connections that are on time.
+ *
+ * @param table Pointer to the connection table.
+ */
+void connection_table_tick(connection_table *table);
+
+/**
+ * Works out what a connection is waiting for (its client to read queued
+ * output, more of a request body, the rest of a header section, or a new
+ * request) and moves its deadline to match. The header deadline stays where
+ * it was set while the same header section is awaited; the others restart,
+ * since getting here means the connection made progress.
+ *
+ * @param conn Pointer to the connection.
+ */
+void connection_update_deadline(connection *conn);
+
+/**
+ * Takes a free slot for a newly accepted socket and registers it with the
+ * table's event loop.
+ *
+ * @param table Pointer to the connection table.
+ * @param fd Accepted, non-blocking client socket.
+ * @param events Initial interest mask.
+ * @param callback Callback invoked when the socket becomes ready, or NULL if
+ *                 the table's I/O backend drives the socket itself.
+ * @return Pointer to the connection, or NULL if the table is full or on failure.
+ */
+connection *connection_open(connection_table *table, int fd, unsigned int events, event_callback callback);
+
+/**
+ * Changes the readable/writable interest of a connection.
+ *
+ * @param conn Pointer to the connection.
+ * @param events New interest mask.
+ * @return 0 on success, -1 on failure.
+ */
+int connection_set_events(connection *conn, unsigned int events);
+
+/**
+ * Returns free space at the end of the receive buffer, compacting consumed
+ * bytes or growing the buffer as needed.
+ *
+ * @param conn Pointer to the connection.
+ * @param space Set to the number of bytes that may be written.
+ * @return Pointer to the free space, or NULL if the buffer is at its size limit
+ *         or memory is exhausted.
+ */
+char *connection_recv_space(connection *conn, size_t *space);
+
+/**
+ * Grows the receive buffer so that at least the given free space follows
+ * the data already in it, within CONNECTION_RECV_MAX. Used before a large
+ * body so it is read in large pieces.
+ *
+ * @param conn Pointer to the connection.
+ * @param space Free space wanted.
+ * @return 0 on success, -1 if memory is exhausted.
+ */
+int connection_recv_reserve(connection *conn, size_t space);
+
+/**
+ * Returns the receive buffer to the table's pool once every byte in it is
+ * consumed, so an idle connection holds none. Responses may point into the
+ * buffer, so call this only after they are flushed.
+ *
+ * @param conn Pointer to the connection.
+ */
+void connection_recv_release(connection *conn);
+
+/**
+ * Cuts bytes out of the unconsumed data, moving the ones after them down.
+ * Request body bytes are dropped this way once handled, so a streaming body
+ * never needs more room than the header section it follows.
+ *
+ * @param conn Pointer to the connection.
+ * @param offset Offset of the bytes from the start of the unconsumed data.
+ * @param length Number of bytes to drop.
+ */
+void connection_drop(connection *conn, size_t offset, size_t length);
+
+/**
+ * Marks the bytes of a completed request as consumed.
+ *
+ * @param conn Pointer to the connection.
+ * @param length Number of bytes to consume from the start of the unconsumed data.
+ */
+void connection_consume(connection *conn, size_t length);
+
+/**
+ * Queues data for the client. Queued responses go out together, in order,
+ * on the next connection_flush, so the data must stay valid until then.
+ *
+ * @param conn Pointer to the connection.
+ * @param data Pointer to the data to send.
+ * @param length Length of the data.
+ * @return 0 on success, -1 on failure.
+ */
+int connection_send(connection *conn, const char *data, size_t length);
+
+/**
+ * Queues several buffers without joining them. The same lifetime rules as
+ * connection_send apply. Flushes first if the queue is full.
+ *
+ * @param conn Pointer to the connection.
+ * @param iov Buffers to send.
+ * @param count Number of buffers, at most CONNECTION_MAX_IOV.
+ * @return 0 on success, -1 on failure.
+ */
+int connection_sendv(connection *conn, const struct iovec *iov, int count);
+
+/**
+ * Sends a file range after everything queued before it. The range is
+ * released on completion or failure, and also if this call fails.
+ *
+ * @param conn Pointer to the connection.
+ * @param file File range to send; copied, so it may live on the stack.
+ * @return 0 on success, -1 on failure.
+ */
+int connection_sendfile(connection *conn, const connection_file *file);
+
+/**
+ * Hands the rest of the current response to a producer. Requests that
+ * follow are not answered until it is done. The producer is released if
+ * this call fails.
+ *
+ * @param conn Pointer to the connection.
+ * @param producer Producer to run; copied, so it may live on the stack.
+ * @return 0 on success, -1 if a producer is already running.
+ */
+int connection_set_producer(connection *conn, const connection_producer *producer);
+
+/**
+ * Runs the connection's producer until it is done, output backs up or the
+ * producer parks the connection, flushing after every call. Called after
+ * requests are handled and again whenever backed-up output drains or the
+ * connection is unparked. A producer that finishes on a connection that
+ * is not kept alive marks it closing.
+ *
+ * @param conn Pointer to the connection.
+ * @return 0 on success (check conn->producer.produce for completion), -1 on failure.
+ */
+int connection_run_producer(connection *conn);
+
+/**
+ * Writes all queued data through the table's I/O backend as one gathering
+ * write. The backend has sent or copied the data by the time this returns.
+ *
+ * @param conn Pointer to the connection.
+ * @return 0 on success, -1 on failure.
+ */
+int connection_flush(connection *conn);
+
+/**
+ * Sends output left over from earlier short writes. Called when the socket
+ * becomes writable; drops write interest once everything is sent.
+ *
+ * @param conn Pointer to the connection.
+ * @return 0 on success (including a partial send), -1 on failure.
+ */
+int connection_write_queued(connection *conn);
+
+/**
+ * Sends a file range with sendfile until it is done or the socket is full,
+ * advancing the range. For I/O backends; accounts the bytes it sends.
+ *
+ * @param conn Pointer to the connection.
+ * @param file File range, advanced past the bytes sent.
+ * @return 0 on success (check file->length for completion), -1 on failure.
+ */
+int connection_send_file_range(connection *conn, connection_file *file);
+
+/**
+ * Records bytes entering (positive) or leaving (negative) a connection's
+ * output queue. Used by I/O backends that queue output themselves.
+ *
+ * @param conn Pointer to the connection.
+ * @param delta Change in queued bytes.
+ */
+void connection_account_output(connection *conn, long delta);
+
+/**
+ * Reports whether a connection has so much unsent output that it should
+ * stop reading requests until the client catches up.
+ *
+ * @param conn Pointer to the connection.
+ * @return Non-zero if queued output is at or above the high-water mark.
+ */
+int connection_output_blocked(const connection *conn);
+
+/**
+ * Reports whether a connection should stop reading and answering requests
+ * for now: its output is backed up, or it is parked.
+ *
+ * @param conn Pointer to the connection.
+ * @return Non-zero if input should wait.
+ */
+int connection_input_paused(const connection *conn);
+
+/**
+ * Unregisters and closes a connection and returns its slot to the free list.
+ *
+ * @param conn Pointer to the connection.
+ */
+void connection_close(connection *conn);
+
+#endif // CONNECTION_H
@@ -0,0 +1,203 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "event_loop.h"
+#include "io_stats.h"
+
+struct event_loop
+{
+    int epoll_fd;
+    int max_events;
+    struct epoll_event *events;
+    int ready;    // events fetched by the current wakeup
+    int dispatch; // index of the event being dispatched
+    int running;
+    event_tick_callback tick;
+    void *tick_data;
+};
+
+static uint32_t to_epoll_events(unsigned int events)
+{
+    uint32_t epoll_events = EPOLLET | EPOLLRDHUP;
+
+    if (events & EVENT_READ)
+        epoll_events |= EPOLLIN;
+    if (events & EVENT_WRITE)
+        epoll_events |= EPOLLOUT;
+
+    return epoll_events;
+}
+
+static unsigned int from_epoll_events(uint32_t epoll_events)
+{
+    unsigned int events = 0;
+
+    if (epoll_events & (EPOLLIN | EPOLLRDHUP))
+        events |= EVENT_READ;
+    if (epoll_events & EPOLLOUT)
+        events |= EVENT_WRITE;
+    if (epoll_events & (EPOLLERR | EPOLLHUP))
+        events |= EVENT_ERROR;
+
+    return events;
+}
+
+event_loop *event_loop_create(int max_events)
+{
+    event_loop *loop = malloc(sizeof(event_loop));
+    if (!loop)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for event loop\n");
+        return NULL;
+    }
+
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd == -1)
+    {
+        perror("epoll_create1");
+        free(loop);
+        return NULL;
+    }
+
+    loop->max_events = max_events > 0 ? max_events : EVENT_LOOP_MAX_EVENTS;
+    loop->events = calloc(loop->max_events, sizeof(struct epoll_event));
+    if (!loop->events)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for event list\n");
+        close(loop->epoll_fd);
+        free(loop);
+        return NULL;
+    }
+
+    loop->ready = 0;
+    loop->dispatch = 0;
+    loop->running = 0;
+    loop->tick = NULL;
+    loop->tick_data = NULL;
+
+    return loop;
+}
+
+void event_loop_destroy(event_loop *loop)
+{
+    if (loop)
+    {
+        close(loop->epoll_fd);
+        free(loop->events);
+        free(loop);
+    }
+}
+
+int event_loop_add(event_loop *loop, event_handler *handler)
+{
+    struct epoll_event ev;
+    ev.events = to_epoll_events(handler->events);
+    ev.data.ptr = handler;
+
+    io_stats_syscall();
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, handler->fd, &ev) == -1)
+    {
+        perror("epoll_ctl add");
+        return -1;
+    }
+
+    return 0;
+}
+
+int event_loop_modify(event_loop *loop, event_handler *handler, unsigned int events)
+{
+    if (handler->events == events)
+        return 0;
+
+    struct epoll_event ev;
+    ev.events = to_epoll_events(events);
+    ev.data.ptr = handler;
+
+    io_stats_syscall();
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, handler->fd, &ev) == -1)
+    {
+        perror("epoll_ctl mod");
+        return -1;
+    }
+
+    handler->events = events;
+    return 0;
+}
+
+int event_loop_remove(event_loop *loop, event_handler *handler)
+{
+    // drop events of this wakeup that still point at the handler
+    for (int i = loop->dispatch + 1; i < loop->ready; i++)
+        if (loop->events[i].data.ptr == handler)
+            loop->events[i].data.ptr = NULL;
+
+    io_stats_syscall();
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, handler->fd, NULL) == -1)
+    {
+        perror("epoll_ctl del");
+        return -1;
+    }
+
+    return 0;
+}
+
+int event_loop_run_once(event_loop *loop, int timeout_ms)
+{
+    io_stats_syscall();
+    int n = epoll_wait(loop->epoll_fd, loop->events, loop->max_events, timeout_ms);
+    if (n == -1)
+    {
+        if (errno == EINTR)
+            return 0;
+        perror("epoll_wait");
+        return -1;
+    }
+
+    loop->ready = n;
+    for (loop->dispatch = 0; loop->dispatch < loop->ready; loop->dispatch++)
+    {
+        event_handler *handler = loop->events[loop->dispatch].data.ptr;
+        if (!handler)
+            continue;
+
+        handler->callback(loop, handler, from_epoll_events(loop->events[loop->dispatch].events));
+    }
+    loop->ready = 0;
+    loop->dispatch = 0;
+
+    return n;
+}
+
+int event_loop_run(event_loop *loop, int timeout_ms)
+{
+    loop->running = 1;
+    while (loop->running)
+    {
+        if (event_loop_run_once(loop, timeout_ms) == -1)
+            return -1;
+        if (loop->tick)
+            loop->tick(loop, loop->tick_data);
+    }
+
+    return 0;
+}
+
+void event_loop_set_tick(event_loop *loop, event_tick_callback tick, void *data)
+{
+    loop->tick = tick;
+    loop->tick_data = data;
+}
+
+int event_loop_fd(const event_loop *loop)
+{
+    return loop->epoll_fd;
+}
+
+void event_loop_stop(event_loop *loop)
+{
+    loop->running = 0;
+}
@@ -0,0 +1,119 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#define EVENT_READ 0x1
+#define EVENT_WRITE 0x2
+#define EVENT_ERROR 0x4 // hangup or socket error, always reported
+
+#define EVENT_LOOP_MAX_EVENTS 1024
+
+typedef struct event_loop event_loop;
+typedef struct event_handler event_handler;
+
+typedef void (*event_callback)(event_loop *loop, event_handler *handler, unsigned int events);
+typedef void (*event_tick_callback)(event_loop *loop, void *data);
+
+/*
+ * Registration record for one file descriptor. The owner embeds it in its own
+ * state (e.g. a connection) so dispatch needs no lookup: epoll hands the
+ * pointer straight back.
+ */
+struct event_handler
+{
+    int fd;
+    unsigned int events; // current interest (EVENT_READ | EVENT_WRITE)
+    event_callback callback;
+    void *data;
+};
+
+/**
+ * Creates an edge-triggered epoll event loop.
+ *
+ * @param max_events Maximum number of ready events fetched per wakeup.
+ * @return Pointer to the new event loop, or NULL on failure.
+ */
+event_loop *event_loop_create(int max_events);
+
+/**
+ * Destroys an event loop. Registered descriptors are not closed.
+ *
+ * @param loop Pointer to the event loop.
+ */
+void event_loop_destroy(event_loop *loop);
+
+/**
+ * Registers a handler with the loop.
+ *
+ * @param loop Pointer to the event loop.
+ * @param handler Handler with fd, interest, callback and data filled in.
+ * @return 0 on success, -1 on failure.
+ */
+int event_loop_add(event_loop *loop, event_handler *handler);
+
+/**
+ * Changes the readable/writable interest of a registered handler.
+ * Does nothing if the interest is unchanged.
+ *
+ * @param loop Pointer to the event loop.
+ * @param handler Registered handler.
+ * @param events New interest mask.
+ * @return 0 on success, -1 on failure.
+ */
+int event_loop_modify(event_loop *loop, event_handler *handler, unsigned int events);
+
+/**
+ * Unregisters a handler. Events already fetched for it in the current
+ * wakeup are discarded, so the handler's memory may be reused immediately.
+ *
+ * @param loop Pointer to the event loop.
+ * @param handler Registered handler.
+ * @return 0 on success, -1 on failure.
+ */
+int event_loop_remove(event_loop *loop, event_handler *handler);
+
+/**
+ * Waits for events once and dispatches them.
+ *
+ * @param loop Pointer to the event loop.
+ * @param timeout_ms Maximum time to wait, -1 to block.
+ * @return Number of events dispatched, or -1 on failure.
+ */
+int event_loop_run_once(event_loop *loop, int timeout_ms);
+
+/**
+ * Runs the loop until event_loop_stop is called or an error occurs.
+ *
+ * @param loop Pointer to the event loop.
+ * @param timeout_ms Maximum time to wait per wakeup, -1 to block.
+ * @return 0 when stopped, -1 on failure.
+ */
+int event_loop_run(event_loop *loop, int timeout_ms);
+
+/**
+ * Sets a callback that event_loop_run invokes after every wakeup, including
+ * ones that time out, for periodic housekeeping.
+ *
+ * @param loop Pointer to the event loop.
+ * @param tick Callback, or NULL to remove it.
+ * @param data Passed to the callback.
+ */
+void event_loop_set_tick(event_loop *loop, event_tick_callback tick, void *data);
+
+/**
+ * Returns the loop's epoll descriptor, which is readable while events are
+ * pending, so the loop can be nested in another one and run from it with
+ * event_loop_run_once(loop, 0).
+ *
+ * @param loop Pointer to the event loop.
+ * @return The descriptor.
+ */
+int event_loop_fd(const event_loop *loop);
+
+/**
+ * Asks a running loop to return after the current wakeup.
+ *
+ * @param loop Pointer to the event loop.
+ */
+void event_loop_stop(event_loop *loop);
+
+#endif // EVENT_LOOP_H
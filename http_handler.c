@@ -1,190 +1,847 @@
 #include "http_handler.h"
+#include "metrics.h"
+#include "offload.h"
+#include "static_file.h"
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/socket.h>
 #include <unistd.h>
 
-static int build_and_send_response(int client_fd, const char *version, int status, const char *content,
-                                   const char *content_type);
-static int send_response(const char *response_str, int client_fd);
+static int build_and_send_response(connection *conn, const char *version, int status, const char *content,
+                                   size_t content_length, const char *content_type, int head_only);
+static int send_response(const struct iovec *iov, int count, http_status_code status, connection *conn);
+static int send_prebuilt_response(const http_prebuilt_response *response, int head_only, connection *conn);
+static int send_prebuilt_response_fields(const http_prebuilt_response *response, const struct iovec *extra,
+                                         int extra_count, int head_only, connection *conn);
+static int is_head_request(const http_request *request);
+static const char *connection_header_value(const connection *conn);
+static int send_chunk(http_stream *stream, const char *data, size_t length);
+
+static route_handler find_route(const router *r, const http_request *request, route_match *match);
+static int dispatch_uri(http_request *request, connection *conn);
+static int send_body(http_request *request, connection *conn, const char *content_type);
+static void close_spool_file(void *arg);
+static int handle_root(http_request *request, connection *conn, const route_match *match);
+static int handle_echo(http_request *request, connection *conn, const route_match *match);
+static int handle_user_agent(http_request *request, connection *conn, const route_match *match);
+static int handle_static(http_request *request, connection *conn, const route_match *match);
+static int offload_encode(connection *conn, static_file *file, http_coding coding, int head_only);
+static void run_encode(offload_job *offload);
+static int finish_encode(offload_job *offload, connection *conn);
+static int send_static(connection *conn, static_file *file, http_coding coding, int head_only,
+                       const char *connection_value);
+static int handle_upload(http_request *request, connection *conn, const route_match *match);
+static int handle_export(http_request *request, connection *conn, const route_match *match);
+static int handle_metrics(http_request *request, connection *conn, const route_match *match);
+static int produce_export(connection *conn, void *arg);
+static void release_export(void *arg);
+static int handle_not_found(http_request *request, connection *conn);
+static int handle_method_not_allowed(http_request *request, connection *conn, unsigned int allowed);
+static int handle_not_implemented(http_request *request, connection *conn);
+
+// a static file's compressed copy, made on the offload pool while its connection is parked
+typedef struct
+{
+    offload_job job;
+    static_file *file; // the request's reference, passed on to the response
+    http_coding coding;
+    int head_only;
+    const char *connection_value;
+    int fd; // the copy, -1 if it could not be made
+    off_t size;
+} encode_job;
+
+// built by http_handler_init before workers start, read-only afterwards
+static router routes;
+static router stream_routes; // handlers that take request bodies chunk by chunk
+
+// routes whose response never changes, serialized by http_handler_init
+static http_prebuilt_response root_response;
+static http_prebuilt_response not_found_response;
+static http_prebuilt_response method_not_allowed_response;
+static http_prebuilt_response not_implemented_response;
+
+int http_handler_init(void)
+{
+    if (router_init(&routes) == -1)
+        return -1;
+    if (router_init(&stream_routes) == -1)
+    {
+        router_destroy(&routes);
+        return -1;
+    }
 
-static int dispatch_method(http_request *request, int client_fd);
-static int handle_http_get(http_request *request, int client_fd);
-static int handle_http_unkown(http_request *request, int client_fd);
-static int handle_http_post(http_request *request, int client_fd);
-static int handle_http_put(http_request *request, int client_fd);
-static int handle_http_delete(http_request *request, int client_fd);
-static int handle_http_head(http_request *request, int client_fd);
-static int handle_http_options(http_request *request, int client_fd);
-static int handle_http_patch(http_request *request, int client_fd);
-static int handle_http_trace(http_request *request, int client_fd);
-static int handle_http_connect(http_request *request, int client_fd);
+    if (prebuild_http_response(&root_response, HTTP_VERSION, HTTP_OK, "OK", 2, "Content-Type: text/html\r\n") == -1 ||
+        prebuild_http_response(&not_found_response, HTTP_VERSION, HTTP_NOT_FOUND, "Not Found", 9,
+                               "Content-Type: text/plain\r\n") == -1 ||
+        prebuild_http_response(&method_not_allowed_response, HTTP_VERSION, HTTP_METHOD_NOT_ALLOWED,
+                               "Method Not Allowed", 18, "Content-Type: text/plain\r\n") == -1 ||
+        prebuild_http_response(&not_implemented_response, HTTP_VERSION, HTTP_NOT_IMPLEMENTED, "Not Implemented", 15,
+                               "Content-Type: text/plain\r\n") == -1)
+    {
+        http_handler_cleanup();
+        return -1;
+    }
+
+    // HEAD is answered by the GET handlers
+    if (http_handler_route(HTTP_METHOD_GET, "/", handle_root) == -1 ||
+        http_handler_route(HTTP_METHOD_GET, "/echo/*", handle_echo) == -1 ||
+        http_handler_route(HTTP_METHOD_POST, "/echo/*", handle_echo) == -1 ||
+        http_handler_route(HTTP_METHOD_GET, "/user-agent", handle_user_agent) == -1 ||
+        http_handler_route_stream(HTTP_METHOD_POST, "/upload", handle_upload) == -1 ||
+        http_handler_route_stream(HTTP_METHOD_PUT, "/upload", handle_upload) == -1 ||
+        http_handler_route(HTTP_METHOD_GET, "/export/:rows", handle_export) == -1 ||
+        http_handler_route(HTTP_METHOD_GET, "/metrics", handle_metrics) == -1)
+    {
+        http_handler_cleanup();
+        return -1;
+    }
 
-static int dispatch_uri(http_request *request, int client_fd);
-static int handle_root(http_request *request, int client_fd);
-static int handle_echo(http_request *request, int client_fd);
-static int handle_user_agent(http_request *request, int client_fd);
-static int handle_not_found(http_request *request, int client_fd);
+    const char *static_prefix = static_files_prefix();
+    if (static_prefix)
+    {
+        char pattern[HTTP_PATH_MAX_LEN + 1];
+        snprintf(pattern, sizeof(pattern), "%s*", static_prefix);
+        if (http_handler_route(HTTP_METHOD_GET, pattern, handle_static) == -1)
+        {
+            http_handler_cleanup();
+            return -1;
+        }
+    }
 
-int (*handle_http_method[])(http_request *request, int client_fd) = {
-    handle_http_get,
-    handle_http_post,
-    handle_http_put,
-    handle_http_delete,
-    handle_http_head,
-    handle_http_options,
-    handle_http_patch,
-    handle_http_trace,
-    handle_http_connect,
-    handle_http_unkown,
-    NULL,
-};
+    return 0;
+}
 
-struct
+void http_handler_cleanup(void)
 {
-    const char *uri;
-    int (*handler)(http_request *request, int client_fd);
-} uri_entry[] = {
-    {"/", handle_root},
-    {"/echo/", handle_echo},
-    {"/user-agent", handle_user_agent},
-    {NULL, NULL},
-};
+    router_destroy(&routes);
+    router_destroy(&stream_routes);
+    free_prebuilt_http_response(&root_response);
+    free_prebuilt_http_response(&not_found_response);
+    free_prebuilt_http_response(&method_not_allowed_response);
+    free_prebuilt_http_response(&not_implemented_response);
+}
 
-int handle_request(http_request *request, int client_fd)
+int http_handler_route(int method, const char *pattern, route_handler handler)
 {
-    return dispatch_method(request, client_fd);
+    return router_add(&routes, method, pattern, handler);
 }
 
-static int dispatch_method(http_request *request, int client_fd)
+int http_handler_route_stream(int method, const char *pattern, route_handler handler)
 {
-    return handle_http_method[request->request_line.method](request, client_fd);
+    return router_add(&stream_routes, method, pattern, handler);
 }
 
-static int build_and_send_response(int client_fd, const char *version, int status, const char *content,
-                                   const char *content_type)
+int handle_request(http_request *request, connection *conn)
 {
-    const char *http_header_format = "Content-Type:%s\r\n";
-    char http_header[HTTP_HEADER_VALUE_MAX_LEN];
-    snprintf(http_header, sizeof(http_header), http_header_format, content_type);
+    return dispatch_uri(request, conn);
+}
 
-    char *response_str = build_http_response(version, status, content, strlen(content), http_header);
-    if (response_str == NULL)
+int handle_request_head(http_request *request, connection *conn)
+{
+    route_match match;
+    if (find_route(&stream_routes, request, &match))
+        conn->body_mode = CONNECTION_BODY_STREAM;
+    else if (find_route(&routes, request, &match))
+        conn->body_mode = CONNECTION_BODY_BUFFER;
+    else
+        conn->body_mode = CONNECTION_BODY_DISCARD; // still read, to find where the next request starts
+
+    // RFC 9110 10.1.1: a client holding its body back until told to send it
+    const http_slice *expect = http_request_find_header(request, HTTP_HEADER_EXPECT);
+    if (expect && http_slice_equals_ignore_case(*expect, "100-continue") &&
+        http_slice_equals(request->request_line.version, "HTTP/1.1"))
+    {
+        static const char continue_response[] = "HTTP/1.1 100 Continue\r\n\r\n";
+        return connection_send(conn, continue_response, sizeof(continue_response) - 1);
+    }
+
+    return 0;
+}
+
+int handle_request_body(http_request *request, connection *conn, const char *data, size_t length, int last)
+{
+    int retval;
+
+    switch (conn->body_mode)
+    {
+    case CONNECTION_BODY_STREAM:
+        request->body = data;
+        request->body_length = length;
+        request->body_partial = !last;
+        retval = dispatch_uri(request, conn);
+        request->body_offset += length;
+        return retval;
+    case CONNECTION_BODY_BUFFER:
+        if (request_body_append(&conn->body, data, length) == -1)
+            return -1;
+        if (!last)
+            return 0;
+        request->body = conn->body.data;
+        request->body_length = conn->body.length;
+        request->body_fd = conn->body.fd;
+        return dispatch_uri(request, conn);
+    default:
+        return last ? dispatch_uri(request, conn) : 0;
+    }
+}
+
+static const char *connection_header_value(const connection *conn)
+{
+    // HTTP/1.1 persists by default; say so only when that is not the outcome
+    if (!conn->keep_alive)
+        return "close";
+    if (!http_slice_equals(conn->request.request_line.version, "HTTP/1.1"))
+        return "keep-alive";
+    return NULL;
+}
+
+int http_stream_begin(http_stream *stream, connection *conn, http_status_code status, const char *content_type,
+                      long long length)
+{
+    int http11 = http_slice_equals(conn->request.request_line.version, "HTTP/1.1");
+    int vary = http_compression_eligible(content_type, length);
+    // the compressed length is not known up front, so only chunks can carry it
+    http_coding coding = vary && http11 ? http_coding_negotiate(&conn->request) : HTTP_CODING_IDENTITY;
+
+    stream->conn = conn;
+    stream->remaining = length;
+    stream->head_only = conn->request.request_line.method == HTTP_METHOD_HEAD;
+    stream->chunked = (length < 0 || coding != HTTP_CODING_IDENTITY) && http11;
+    stream->compressor = NULL;
+
+    // without a length or chunks, only closing the connection ends the body
+    if (length < 0 && !stream->chunked)
+        conn->keep_alive = 0;
+
+    http_response response;
+    init_http_response(&response, &conn->arena, HTTP_VERSION);
+    set_http_status(&response, status);
+
+    char content_length[HTTP_DECIMAL_MAX_LEN];
+    http_format_decimal(content_length, length);
+
+    const char *connection_value = connection_header_value(conn);
+    if (add_http_header(&response, "Content-Type", content_type) == -1 ||
+        (length >= 0 && !stream->chunked && add_http_header(&response, "Content-Length", content_length) == -1) ||
+        (coding != HTTP_CODING_IDENTITY &&
+         add_http_header(&response, "Content-Encoding", http_coding_name(coding)) == -1) ||
+        (vary && add_http_header(&response, "Vary", "Accept-Encoding") == -1) ||
+        (stream->chunked && add_http_header(&response, "Transfer-Encoding", "chunked") == -1) ||
+        (connection_value && add_http_header(&response, "Connection", connection_value) == -1))
         return -1;
 
-    int retval = send_response(response_str, client_fd);
-    free(response_str);
+    struct iovec iov[HTTP_RESPONSE_IOV_COUNT];
+    int count = serialize_http_response(&response, iov);
+    if (count == -1 || send_response(iov, count, status, conn) == -1)
+        return -1;
+    if (coding == HTTP_CODING_IDENTITY || stream->head_only)
+        return 0;
 
-    return retval;
+    stream->compressor = malloc(sizeof(http_compressor));
+    if (!stream->compressor)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for compressor\n");
+        return -1;
+    }
+    if (http_compressor_init(stream->compressor, coding) == -1)
+    {
+        free(stream->compressor);
+        stream->compressor = NULL;
+        return -1;
+    }
+    return 0;
 }
 
-static int send_response(const char *response_str, int client_fd)
+int http_stream_write(http_stream *stream, const char *data, size_t length)
 {
-    ssize_t n = send(client_fd, response_str, strlen(response_str), 0);
-    if (n == -1)
+    // an empty chunk would end the body
+    if (length == 0)
+        return 0;
+
+    if (stream->remaining >= 0)
+    {
+        if ((unsigned long long)stream->remaining < length)
+        {
+            fprintf(stderr, "Error: Streamed body exceeds its Content-Length\n");
+            return -1;
+        }
+        stream->remaining -= length;
+    }
+    if (stream->head_only)
+        return 0;
+
+    if (stream->compressor)
     {
-        perror("Failed to send response to client");
+        data = http_compressor_write(stream->compressor, &stream->conn->arena, data, length, 0, &length);
+        if (!data)
+            return -1;
+    }
+    if (!stream->chunked)
+        return connection_send(stream->conn, data, length);
+    return send_chunk(stream, data, length);
+}
+
+static int send_chunk(http_stream *stream, const char *data, size_t length)
+{
+    char *size = arena_alloc(&stream->conn->arena, 20);
+    if (!size)
+        return -1;
+    int size_length = snprintf(size, 20, "%zx\r\n", length);
+
+    struct iovec iov[3] = {
+        {.iov_base = size, .iov_len = size_length},
+        {.iov_base = (void *)data, .iov_len = length},
+        {.iov_base = "\r\n", .iov_len = 2},
+    };
+    return connection_sendv(stream->conn, iov, 3);
+}
+
+int http_stream_end(http_stream *stream)
+{
+    if (stream->remaining > 0)
+    {
+        fprintf(stderr, "Error: Streamed body ended %lld bytes short of its Content-Length\n", stream->remaining);
         return -1;
     }
+    if (!stream->chunked || stream->head_only)
+        return 0;
 
-    return 0;
+    if (stream->compressor)
+    {
+        size_t length;
+        const char *rest = http_compressor_write(stream->compressor, &stream->conn->arena, NULL, 0, 1, &length);
+        http_stream_release(stream);
+        if (!rest || send_chunk(stream, rest, length) == -1)
+            return -1;
+    }
+
+    // last chunk, no trailer
+    return connection_send(stream->conn, "0\r\n\r\n", 5);
+}
+
+void http_stream_release(http_stream *stream)
+{
+    if (!stream->compressor)
+        return;
+    http_compressor_end(stream->compressor);
+    free(stream->compressor);
+    stream->compressor = NULL;
 }
 
-static int dispatch_uri(http_request *request, int client_fd)
+static int build_and_send_response(connection *conn, const char *version, int status, const char *content,
+                                   size_t content_length, const char *content_type, int head_only)
 {
-    if (request->request_line.uri == NULL)
-        return handle_not_found(request, client_fd);
+    const char *connection_value = connection_header_value(conn);
+
+    int vary = http_compression_eligible(content_type, content_length);
+    http_coding coding = vary ? http_coding_negotiate(&conn->request) : HTTP_CODING_IDENTITY;
+    if (coding != HTTP_CODING_IDENTITY)
+    {
+        int encoded = http_encode_body(coding, content, content_length, &conn->arena, &content, &content_length);
+        if (encoded == -1)
+            return -1;
+        if (!encoded)
+            coding = HTTP_CODING_IDENTITY;
+    }
 
-    if (request->request_line.uri[0] == '/' && request->request_line.uri[1] == '\0')
-        return uri_entry[0].handler(request, client_fd);
+    // fields are copied into the arena, so a content type of any length fits
+    http_response response;
+    init_http_response(&response, &conn->arena, version);
+    set_http_status(&response, status);
+    if (add_http_header(&response, "Content-Type", content_type) == -1 ||
+        (coding != HTTP_CODING_IDENTITY &&
+         add_http_header(&response, "Content-Encoding", http_coding_name(coding)) == -1) ||
+        (vary && add_http_header(&response, "Vary", "Accept-Encoding") == -1) ||
+        (connection_value && add_http_header(&response, "Connection", connection_value) == -1))
+        return -1;
+    set_http_body(&response, content, content_length);
 
-    for (int i = 1; uri_entry[i].uri != NULL; i++)
+    struct iovec iov[HTTP_RESPONSE_IOV_COUNT];
+    int count = serialize_http_response(&response, iov);
+    if (count == -1)
+        return -1;
+
+    // the head alone, its Content-Length still that of the body
+    if (head_only)
+        count = 1;
+    return send_response(iov, count, status, conn);
+}
+
+static int send_response(const struct iovec *iov, int count, http_status_code status, connection *conn)
+{
+    metrics_status(status);
+    return connection_sendv(conn, iov, count);
+}
+
+static int send_prebuilt_response(const http_prebuilt_response *response, int head_only, connection *conn)
+{
+    return send_prebuilt_response_fields(response, NULL, 0, head_only, conn);
+}
+
+static int send_prebuilt_response_fields(const http_prebuilt_response *response, const struct iovec *extra,
+                                         int extra_count, int head_only, connection *conn)
+{
+    struct iovec fields[HTTP_PREBUILT_MAX_FIELDS];
+    size_t date_length;
+    fields[0].iov_base = (void *)http_date_field(&date_length);
+    fields[0].iov_len = date_length;
+    int field_count = 1;
+
+    // room is left for Connection
+    for (int i = 0; i < extra_count && field_count < HTTP_PREBUILT_MAX_FIELDS - 1; i++)
+        fields[field_count++] = extra[i];
+
+    const char *connection_value = connection_header_value(conn);
+    if (connection_value)
     {
-        size_t uri_len = strlen(uri_entry[i].uri);
+        static const char close_field[] = "Connection: close\r\n";
+        static const char keep_alive_field[] = "Connection: keep-alive\r\n";
+        int close = strcmp(connection_value, "close") == 0;
+        fields[field_count].iov_base = (void *)(close ? close_field : keep_alive_field);
+        fields[field_count].iov_len = close ? sizeof(close_field) - 1 : sizeof(keep_alive_field) - 1;
+        field_count++;
+    }
+
+    struct iovec iov[HTTP_PREBUILT_IOV_COUNT];
+    int count = prebuilt_http_response_iov(response, fields, field_count, head_only, iov);
+    if (count == -1)
+        return -1;
+
+    return send_response(iov, count, response->status, conn);
+}
 
-        if (strncmp(request->request_line.uri, uri_entry[i].uri, uri_len) == 0)
-            return uri_entry[i].handler(request, client_fd);
+// a HEAD response carries the head of the GET response, Content-Length included, and no body
+static int is_head_request(const http_request *request)
+{
+    return request->request_line.method == HTTP_METHOD_HEAD;
+}
+
+static route_handler find_route(const router *r, const http_request *request, route_match *match)
+{
+    http_slice uri = request->request_line.uri;
+    match->allowed = 0;
+    if (uri.data == NULL)
+        return NULL;
+
+    const char *query = memchr(uri.data, '?', uri.length);
+    size_t path_length = query ? (size_t)(query - uri.data) : uri.length;
+
+    http_method method = request->request_line.method;
+    route_handler handler = router_lookup(r, method, uri.data, path_length, match);
+
+    // a GET route answers HEAD too unless HEAD has one of its own
+    if (!handler && method == HTTP_METHOD_HEAD && match->allowed & (1u << HTTP_METHOD_GET))
+        handler = router_lookup(r, HTTP_METHOD_GET, uri.data, path_length, match);
+
+    return handler;
+}
+
+static int dispatch_uri(http_request *request, connection *conn)
+{
+    // streaming routes first, as handle_request_head chose them first
+    route_match match;
+    route_handler handler = find_route(&stream_routes, request, &match);
+    unsigned int allowed = match.allowed;
+    int route = match.route;
+    if (!handler)
+    {
+        handler = find_route(&routes, request, &match);
+        allowed |= match.allowed;
+        // numbered after the streaming routes, as handle_metrics labels them
+        route = handler ? stream_routes.route_count + match.route : -1;
     }
 
-    return handle_not_found(request, client_fd);
+    // a streamed body reaches the handler in pieces; count the request once
+    if (!request->body_partial)
+        metrics_route(route);
+
+    if (handler)
+        return handler(request, conn, &match);
+    // RFC 9110 9.1: a method the server does not recognize at all, rather than one this path does not serve
+    if (request->request_line.method == HTTP_METHOD_UNKNOWN)
+        return handle_not_implemented(request, conn);
+    if (allowed)
+        return handle_method_not_allowed(request, conn, allowed);
+    return handle_not_found(request, conn);
 }
 
-static int handle_root(http_request *request, int client_fd)
+/*
+ * Echoes a collected request body: from memory, or with sendfile from the
+ * spool file, which the response takes over and closes once sent.
+ */
+static int send_body(http_request *request, connection *conn, const char *content_type)
 {
-    return build_and_send_response(client_fd, request->request_line.version, HTTP_OK, "OK", "text/html");
+    if (request->body_fd == -1)
+        return build_and_send_response(conn, HTTP_VERSION, HTTP_OK, request->body, request->body_length,
+                                       content_type, is_head_request(request));
+
+    http_response response;
+    init_http_response(&response, &conn->arena, HTTP_VERSION);
+    set_http_status(&response, HTTP_OK);
+
+    char content_length[HTTP_DECIMAL_MAX_LEN];
+    http_format_decimal(content_length, request->body_length);
+
+    const char *connection_value = connection_header_value(conn);
+    if (add_http_header(&response, "Content-Type", content_type) == -1 ||
+        add_http_header(&response, "Content-Length", content_length) == -1 ||
+        (connection_value && add_http_header(&response, "Connection", connection_value) == -1))
+        return -1;
+
+    struct iovec iov[HTTP_RESPONSE_IOV_COUNT];
+    int count = serialize_http_response(&response, iov);
+    if (count == -1 || send_response(iov, count, HTTP_OK, conn) == -1)
+        return -1;
+    if (is_head_request(request))
+        return 0;
+
+    int fd = request_body_take_fd(&conn->body);
+    connection_file body = {
+        .fd = fd,
+        .offset = 0,
+        .length = request->body_length,
+        .release = close_spool_file,
+        .arg = (void *)(intptr_t)fd,
+    };
+    return connection_sendfile(conn, &body);
 }
 
-static int handle_echo(http_request *request, int client_fd)
+static void close_spool_file(void *arg)
 {
-    char *echo = request->request_line.uri + strlen("/echo/");
-    return build_and_send_response(client_fd, request->request_line.version, HTTP_OK, echo, "text/plain");
+    close((int)(intptr_t)arg);
 }
 
-static int handle_user_agent(http_request *request, int client_fd)
+static int handle_root(http_request *request, connection *conn, const route_match *match)
 {
-    for (int i = 0; i < request->header_count; i++)
+    return send_prebuilt_response(&root_response, is_head_request(request), conn);
+}
+
+static int handle_echo(http_request *request, connection *conn, const route_match *match)
+{
+    if (request->body_length > 0)
+        return send_body(request, conn, "application/octet-stream");
+    return build_and_send_response(conn, HTTP_VERSION, HTTP_OK, match->rest.data, match->rest.length, "text/plain",
+                                   is_head_request(request));
+}
+
+static int handle_user_agent(http_request *request, connection *conn, const route_match *match)
+{
+    const http_slice *user_agent = http_request_find_header(request, HTTP_HEADER_USER_AGENT);
+    if (user_agent)
+        return build_and_send_response(conn, HTTP_VERSION, HTTP_OK, user_agent->data, user_agent->length,
+                                       "text/plain", is_head_request(request));
+
+    return send_prebuilt_response(&not_found_response, is_head_request(request), conn);
+}
+
+static int handle_static(http_request *request, connection *conn, const route_match *match)
+{
+    static_file *file = static_file_acquire(match->rest.data, match->rest.length);
+    if (!file)
+        return handle_not_found(request, conn);
+
+    // a compressed copy is made once per cached file and sent the same way
+    int head_only = request->request_line.method == HTTP_METHOD_HEAD;
+    int vary = http_compression_eligible(file->content_type, file->size);
+    http_coding coding = vary ? http_coding_negotiate(request) : HTTP_CODING_IDENTITY;
+    if (coding != HTTP_CODING_IDENTITY)
     {
-        if (strcmp(request->headers[i].name, "User-Agent") == 0)
-            return build_and_send_response(client_fd, request->request_line.version, HTTP_OK, request->headers[i].value,
-                                           "text/plain");
+        int encoded = static_file_encode_begin(file, coding);
+        if (encoded == 1)
+            return offload_encode(conn, file, coding, head_only);
+        if (encoded == -1)
+            coding = HTTP_CODING_IDENTITY;
     }
 
-    return build_and_send_response(client_fd, request->request_line.version, HTTP_NOT_FOUND, "Not Found", "text/plain");
+    return send_static(conn, file, coding, head_only, connection_header_value(conn));
 }
 
-static int handle_not_found(http_request *request, int client_fd)
+/*
+ * Compressing a file of up to STATIC_FILE_COMPRESS_MAX bytes would hold up
+ * every other connection on the worker, so the copy is made on the offload
+ * pool and this request is answered once it exists. With the pool's queue
+ * full, the file goes out as it is and a later request tries again.
+ */
+static int offload_encode(connection *conn, static_file *file, http_coding coding, int head_only)
 {
-    return build_and_send_response(client_fd, request->request_line.version, HTTP_NOT_FOUND, "Not Found", "text/plain");
+    encode_job *job = malloc(sizeof(encode_job));
+    if (!job)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for compression job\n");
+        static_file_encode_finish(file, coding, -1, 0);
+        return send_static(conn, file, HTTP_CODING_IDENTITY, head_only, connection_header_value(conn));
+    }
+    job->job.run = run_encode;
+    job->job.done = finish_encode;
+    job->file = file;
+    job->coding = coding;
+    job->head_only = head_only;
+    job->connection_value = connection_header_value(conn); // the request is gone by the time it is sent
+    job->fd = -1;
+    job->size = -1;
+
+    int submitted = offload_submit(conn, &job->job);
+    if (submitted != 1)
+        return submitted;
+
+    free(job);
+    static_file_encode_finish(file, coding, -1, 0);
+    return send_static(conn, file, HTTP_CODING_IDENTITY, head_only, connection_header_value(conn));
 }
 
-static int handle_http_get(http_request *request, int client_fd)
+// on a pool thread
+static void run_encode(offload_job *offload)
 {
-    return dispatch_uri(request, client_fd);
+    encode_job *job = (encode_job *)offload;
+    job->fd = static_file_encode_make(job->file, job->coding, &job->size);
+    if (job->fd == -1)
+        job->size = -1;
 }
 
-static int handle_http_unkown(http_request *request, int client_fd)
+static int finish_encode(offload_job *offload, connection *conn)
 {
-    return dispatch_uri(request, client_fd);
+    encode_job *job = (encode_job *)offload;
+    static_file_encode_finish(job->file, job->coding, job->fd, job->size);
+
+    int retval = 0;
+    if (conn)
+        retval = send_static(conn, job->file, job->fd != -1 ? job->coding : HTTP_CODING_IDENTITY, job->head_only,
+                             job->connection_value);
+    else
+        static_file_release(job->file);
+    free(job);
+    return retval;
 }
 
-static int handle_http_post(http_request *request, int client_fd)
+/*
+ * Sends a cached file, or its copy in a coding, taking over the caller's
+ * reference to it. The head goes out from the arena, the body straight
+ * from the page cache.
+ */
+static int send_static(connection *conn, static_file *file, http_coding coding, int head_only,
+                       const char *connection_value)
 {
-    return dispatch_uri(request, client_fd);
+    int vary = http_compression_eligible(file->content_type, file->size);
+    int fd = coding != HTTP_CODING_IDENTITY ? file->encoded_fd[coding] : file->fd;
+    off_t size = coding != HTTP_CODING_IDENTITY ? file->encoded_size[coding] : file->size;
+
+    http_response response;
+    init_http_response(&response, &conn->arena, HTTP_VERSION);
+    set_http_status(&response, HTTP_OK);
+
+    char content_length[HTTP_DECIMAL_MAX_LEN];
+    http_format_decimal(content_length, size);
+
+    if (add_http_header(&response, "Content-Type", file->content_type) == -1 ||
+        add_http_header(&response, "Content-Length", content_length) == -1 ||
+        (coding != HTTP_CODING_IDENTITY &&
+         add_http_header(&response, "Content-Encoding", http_coding_name(coding)) == -1) ||
+        (vary && add_http_header(&response, "Vary", "Accept-Encoding") == -1) ||
+        (connection_value && add_http_header(&response, "Connection", connection_value) == -1))
+    {
+        static_file_release(file);
+        return -1;
+    }
+
+    struct iovec iov[HTTP_RESPONSE_IOV_COUNT];
+    int count = serialize_http_response(&response, iov);
+    if (count == -1 || send_response(iov, count, HTTP_OK, conn) == -1)
+    {
+        static_file_release(file);
+        return -1;
+    }
+
+    if (head_only || size == 0)
+    {
+        static_file_release(file);
+        return 0;
+    }
+
+    connection_file body = {
+        .fd = fd,
+        .offset = 0,
+        .length = size,
+        .release = static_file_release,
+        .arg = file,
+    };
+    return connection_sendfile(conn, &body);
 }
 
-static int handle_http_put(http_request *request, int client_fd)
+// counts an upload as it streams in, so it never occupies memory or disk
+static int handle_upload(http_request *request, connection *conn, const route_match *match)
 {
-    return dispatch_uri(request, client_fd);
+    if (request->body_partial)
+        return 0;
+
+    char *text = arena_alloc(&conn->arena, HTTP_DECIMAL_MAX_LEN);
+    if (!text)
+        return -1;
+    size_t length = http_format_decimal(text, request->body_offset + request->body_length);
+    return build_and_send_response(conn, HTTP_VERSION, HTTP_OK, text, length, "text/plain", is_head_request(request));
 }
 
-static int handle_http_delete(http_request *request, int client_fd)
+#define EXPORT_MAX_ROWS 100000000
+#define EXPORT_BATCH_SIZE 16384
+
+// rows of a generated CSV export, written a batch at a time as the client reads them
+typedef struct
+{
+    http_stream stream;
+    unsigned long next;
+    unsigned long rows;
+    char batch[EXPORT_BATCH_SIZE];
+} export_state;
+
+static int handle_export(http_request *request, connection *conn, const route_match *match)
 {
-    return dispatch_uri(request, client_fd);
+    http_slice digits = match->params[0].value;
+    unsigned long rows = 0;
+    for (size_t i = 0; i < digits.length; i++)
+    {
+        if (digits.data[i] < '0' || digits.data[i] > '9' || rows > EXPORT_MAX_ROWS)
+            return handle_not_found(request, conn);
+        rows = rows * 10 + (digits.data[i] - '0');
+    }
+    if (rows > EXPORT_MAX_ROWS)
+        return handle_not_found(request, conn);
+
+    export_state *state = malloc(sizeof(export_state));
+    if (!state)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for export\n");
+        return -1;
+    }
+    state->next = 0;
+    state->rows = rows;
+
+    if (http_stream_begin(&state->stream, conn, HTTP_OK, "text/csv", -1) == -1)
+    {
+        free(state);
+        return -1;
+    }
+    if (state->stream.head_only)
+    {
+        free(state);
+        return 0;
+    }
+
+    connection_producer producer = {.produce = produce_export, .release = release_export, .arg = state};
+    return connection_set_producer(conn, &producer);
+}
+
+static int produce_export(connection *conn, void *arg)
+{
+    export_state *state = arg;
+    size_t length = 0;
+
+    if (state->next == 0)
+        length = (size_t)snprintf(state->batch, sizeof(state->batch), "id,square\n");
+
+    // the longest row is 30 bytes
+    while (state->next < state->rows && length + 32 < sizeof(state->batch))
+    {
+        length += (size_t)snprintf(state->batch + length, sizeof(state->batch) - length, "%lu,%llu\n", state->next,
+                                   (unsigned long long)state->next * state->next);
+        state->next++;
+    }
+
+    if (http_stream_write(&state->stream, state->batch, length) == -1)
+        return -1;
+    if (state->next < state->rows)
+        return 0;
+    return http_stream_end(&state->stream) == -1 ? -1 : 1;
 }
 
-static int handle_http_head(http_request *request, int client_fd)
+static void release_export(void *arg)
 {
-    return dispatch_uri(request, client_fd);
+    export_state *state = arg;
+    http_stream_release(&state->stream);
+    free(state);
 }
 
-static int handle_http_options(http_request *request, int client_fd)
+static int handle_metrics(http_request *request, connection *conn, const route_match *match)
 {
-    return dispatch_uri(request, client_fd);
+    const char *labels[METRICS_MAX_ROUTES];
+    int count = 0;
+    for (int i = 0; i < stream_routes.route_count && count < METRICS_MAX_ROUTES; i++)
+        labels[count++] = router_route_pattern(&stream_routes, i);
+    for (int i = 0; i < routes.route_count && count < METRICS_MAX_ROUTES; i++)
+        labels[count++] = router_route_pattern(&routes, i);
+
+    char *text = NULL;
+    size_t length = 0;
+    FILE *out = open_memstream(&text, &length);
+    if (!out)
+    {
+        perror("Failed to format metrics");
+        return -1;
+    }
+    int written = metrics_write(out, labels, count);
+    if (fclose(out) != 0 || written == -1)
+    {
+        fprintf(stderr, "Error: Unable to format metrics\n");
+        free(text);
+        return -1;
+    }
+
+    // the response is sent from the arena when the batch is flushed
+    char *body = arena_alloc(&conn->arena, length);
+    if (body)
+        memcpy(body, text, length);
+    free(text);
+    if (!body)
+        return -1;
+
+    return build_and_send_response(conn, HTTP_VERSION, HTTP_OK, body, length, "text/plain; version=0.0.4",
+                                   is_head_request(request));
 }
 
-static int handle_http_patch(http_request *request, int client_fd)
+static int handle_not_found(http_request *request, connection *conn)
 {
-    return dispatch_uri(request, client_fd);
+    return send_prebuilt_response(&not_found_response, is_head_request(request), conn);
 }
 
-static int handle_http_trace(http_request *request, int client_fd)
+static int handle_method_not_allowed(http_request *request, connection *conn, unsigned int allowed)
 {
-    return dispatch_uri(request, client_fd);
+    // "Allow: GET, HEAD\r\n" built from the methods the path does serve
+    if (allowed & (1u << HTTP_METHOD_GET))
+        allowed |= 1u << HTTP_METHOD_HEAD;
+
+    size_t size = sizeof("Allow: \r\n");
+    for (int i = 0; i < HTTP_METHOD_COUNT; i++)
+        size += strlen(http_methods[i].name) + 2;
+
+    char *allow = arena_alloc(&conn->arena, size);
+    if (!allow)
+        return -1;
+
+    size_t length = 0;
+    memcpy(allow, "Allow: ", 7);
+    length += 7;
+    for (int i = 0; i < HTTP_METHOD_COUNT; i++)
+    {
+        if (!(allowed & (1u << http_methods[i].method)))
+            continue;
+        if (length > 7)
+        {
+            memcpy(allow + length, ", ", 2);
+            length += 2;
+        }
+        size_t name_length = strlen(http_methods[i].name);
+        memcpy(allow + length, http_methods[i].name, name_length);
+        length += name_length;
+    }
+    memcpy(allow + length, "\r\n", 2);
+    length += 2;
+
+    struct iovec field = {.iov_base = allow, .iov_len = length};
+    return send_prebuilt_response_fields(&method_not_allowed_response, &field, 1, is_head_request(request), conn);
 }
 
-static int handle_http_connect(http_request *request, int client_fd)
+static int handle_not_implemented(http_request *request, connection *conn)
 {
-    return dispatch_uri(request, client_fd);
+    return send_prebuilt_response(&not_implemented_response, 0, conn);
 }
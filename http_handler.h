@@ -1,9 +1,146 @@
 #ifndef HTTP_HANDLER_H
 #define HTTP_HANDLER_H
 
+#include "compression.h"
+#include "connection.h"
 #include "request.h"
 #include "response.h"
+#include "router.h"
 
-int handle_request(http_request *request, int client_fd);
+/**
+ * Answers a complete request that has no body.
+ *
+ * @param request Pointer to the parsed request.
+ * @param conn Connection the request arrived on.
+ * @return 0 on success, -1 if the connection should be closed.
+ */
+int handle_request(http_request *request, connection *conn);
+
+/*
+ * A response whose body is written in pieces after its head has gone out:
+ * with Content-Length when the length is known up front, else with chunked
+ * transfer-coding, or for HTTP/1.0 clients by closing the connection. A
+ * textual body is compressed on the way out when the client accepts it,
+ * which always makes it chunked.
+ */
+typedef struct
+{
+    connection *conn;
+    long long remaining; // bytes left of a declared length, -1 if none was declared
+    int chunked;
+    int head_only; // HEAD: the body is checked against the length but not sent
+    http_compressor *compressor; // NULL when the body goes out as written
+} http_stream;
+
+/**
+ * Sends the head of a streamed response. The body follows with
+ * http_stream_write, either from the handler or, for a body too large to
+ * generate at once, from a producer set with connection_set_producer; a
+ * producer must not keep pointers into the request, which is gone by then.
+ *
+ * @param stream Stream to initialize.
+ * @param conn Connection the request arrived on.
+ * @param status Response status.
+ * @param content_type Value of the Content-Type header.
+ * @param length Body length, or -1 if it is not known yet.
+ * @return 0 on success, -1 on failure.
+ */
+int http_stream_begin(http_stream *stream, connection *conn, http_status_code status, const char *content_type,
+                      long long length);
+
+/**
+ * Queues a piece of the body, framed as a chunk if the stream is chunked.
+ * The data must stay valid until the next flush, which follows every
+ * producer call.
+ *
+ * @param stream Stream started by http_stream_begin.
+ * @param data Body bytes.
+ * @param length Number of bytes; an empty write sends nothing.
+ * @return 0 on success, -1 on failure or if the declared length is exceeded.
+ */
+int http_stream_write(http_stream *stream, const char *data, size_t length);
+
+/**
+ * Ends the body, sending the last chunk of a chunked stream.
+ *
+ * @param stream Stream started by http_stream_begin.
+ * @return 0 on success, -1 on failure or if less than the declared length was written.
+ */
+int http_stream_end(http_stream *stream);
+
+/**
+ * Frees what a stream holds without ending its body, for a producer
+ * released before it finished. Does nothing after http_stream_end.
+ *
+ * @param stream Stream started by http_stream_begin.
+ */
+void http_stream_release(http_stream *stream);
+
+/**
+ * Called once the header section of a request with a body is complete.
+ * Picks where the body goes (conn->body_mode): to a streaming route if one
+ * matches, else collected for the route's handler, else discarded. Answers
+ * "Expect: 100-continue".
+ *
+ * @param request Pointer to the request, headers parsed.
+ * @param conn Connection the request arrived on.
+ * @return 0 on success, -1 if the connection should be closed.
+ */
+int handle_request_head(http_request *request, connection *conn);
+
+/**
+ * Delivers decoded body bytes as they arrive. The last call, possibly with
+ * no data, runs the route's handler: once with the whole body, or for a
+ * streaming route, once per chunk with request->body_partial set on all but
+ * the last.
+ *
+ * @param request Pointer to the request.
+ * @param conn Connection the request arrived on.
+ * @param data Body bytes, valid until the call returns and any response is flushed.
+ * @param length Number of bytes.
+ * @param last Non-zero if the body ends with these bytes.
+ * @return 0 on success, -1 if the connection should be closed.
+ */
+int handle_request_body(http_request *request, connection *conn, const char *data, size_t length, int last);
+
+/**
+ * Registers the built-in routes, including the static file prefix if one is
+ * mounted, and serializes the responses of constant routes. Call once before
+ * workers start.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int http_handler_init(void);
+
+/**
+ * Frees the routes and responses set up by http_handler_init.
+ */
+void http_handler_cleanup(void);
+
+/**
+ * Registers a route on top of the built-in ones. Call after
+ * http_handler_init and before workers start; see router_add for the
+ * pattern syntax. A GET route also answers HEAD.
+ *
+ * @param method Method the handler serves, or ROUTER_ANY_METHOD.
+ * @param pattern Route pattern (e.g., "/users/:id").
+ * @param handler Handler called with the captured parameters.
+ * @return 0 on success, -1 if the pattern is invalid or already registered.
+ */
+int http_handler_route(int method, const char *pattern, route_handler handler);
+
+/**
+ * Registers a route whose handler receives the request body as it arrives
+ * instead of after it has been collected: request->body holds each chunk,
+ * request->body_offset counts the bytes before it, and request->body_partial
+ * is cleared on the final call, which must answer the request. Streaming
+ * routes are matched before those of http_handler_route.
+ *
+ * @param method Method the handler serves, or ROUTER_ANY_METHOD.
+ * @param pattern Route pattern, as for http_handler_route.
+ * @param handler Handler called for every chunk.
+ * @return 0 on success, -1 if the pattern is invalid or already registered.
+ */
+int http_handler_route_stream(int method, const char *pattern, route_handler handler);
 
 #endif // HTTP_HANDLER_H
\ No newline at end of file
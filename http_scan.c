@@ -0,0 +1,155 @@
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HTTP_SCAN_X86 1
+#endif
+
+#include "http_scan.h"
+
+typedef size_t (*scan_function)(const char *data, size_t length, http_scan_set set);
+
+// second delimiter of each set; every set also contains '\n'
+static const char scan_delimiters[HTTP_SCAN_SET_COUNT] = {'\n', ' ', ':'};
+
+static unsigned char scan_table[HTTP_SCAN_SET_COUNT][256];
+
+static size_t scan_scalar(const char *data, size_t length, http_scan_set set);
+#ifdef HTTP_SCAN_X86
+static size_t scan_sse42(const char *data, size_t length, http_scan_set set);
+static size_t scan_avx2(const char *data, size_t length, http_scan_set set);
+#endif
+
+static const scan_function scan_functions[HTTP_SCANNER_COUNT] = {
+    scan_scalar,
+#ifdef HTTP_SCAN_X86
+    scan_sse42,
+    scan_avx2,
+#else
+    NULL,
+    NULL,
+#endif
+};
+
+static const char *const scanner_names[HTTP_SCANNER_COUNT] = {"scalar", "sse4.2", "avx2"};
+
+static scan_function scan_impl = scan_scalar;
+static http_scanner_kind scan_kind = HTTP_SCANNER_SCALAR;
+
+__attribute__((constructor)) static void http_scan_init(void)
+{
+    for (int set = 0; set < HTTP_SCAN_SET_COUNT; set++)
+    {
+        scan_table[set]['\n'] = 1;
+        scan_table[set][(unsigned char)scan_delimiters[set]] = 1;
+    }
+
+    if (http_scanner_select(HTTP_SCANNER_AVX2) == -1)
+        http_scanner_select(HTTP_SCANNER_SSE42);
+}
+
+size_t http_scan(const char *data, size_t length, http_scan_set set)
+{
+    return scan_impl(data, length, set);
+}
+
+int http_scanner_supported(http_scanner_kind kind)
+{
+    switch (kind)
+    {
+    case HTTP_SCANNER_SCALAR:
+        return 1;
+#ifdef HTTP_SCAN_X86
+    case HTTP_SCANNER_SSE42:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse4.2");
+    case HTTP_SCANNER_AVX2:
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+#endif
+    default:
+        return 0;
+    }
+}
+
+int http_scanner_select(http_scanner_kind kind)
+{
+    if (kind < 0 || kind >= HTTP_SCANNER_COUNT || !http_scanner_supported(kind))
+        return -1;
+
+    scan_impl = scan_functions[kind];
+    scan_kind = kind;
+    return 0;
+}
+
+http_scanner_kind http_scanner_active(void)
+{
+    return scan_kind;
+}
+
+const char *http_scanner_name(http_scanner_kind kind)
+{
+    return kind >= 0 && kind < HTTP_SCANNER_COUNT ? scanner_names[kind] : "unknown";
+}
+
+static size_t scan_scalar(const char *data, size_t length, http_scan_set set)
+{
+    const unsigned char *table = scan_table[set];
+
+    for (size_t i = 0; i < length; i++)
+        if (table[(unsigned char)data[i]])
+            return i;
+
+    return length;
+}
+
+#ifdef HTTP_SCAN_X86
+
+__attribute__((target("sse4.2"))) static size_t scan_sse42(const char *data, size_t length, http_scan_set set)
+{
+    const __m128i needle = _mm_setr_epi8('\n', scan_delimiters[set], 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(data + i));
+        int index = _mm_cmpestri(needle, 2, chunk, 16, _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_LEAST_SIGNIFICANT);
+        if (index < 16)
+            return i + index;
+    }
+
+    // never load past the end: the tail may sit at the edge of a page
+    return i + scan_scalar(data + i, length - i, set);
+}
+
+__attribute__((target("avx2"))) static size_t scan_avx2(const char *data, size_t length, http_scan_set set)
+{
+    const __m256i newline = _mm256_set1_epi8('\n');
+    const __m256i delimiter = _mm256_set1_epi8(scan_delimiters[set]);
+    size_t i = 0;
+
+    for (; i + 32 <= length; i += 32)
+    {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(data + i));
+        __m256i hits = _mm256_or_si256(_mm256_cmpeq_epi8(chunk, newline), _mm256_cmpeq_epi8(chunk, delimiter));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(hits);
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+
+    if (i + 16 <= length)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(data + i));
+        __m128i hits = _mm_or_si128(_mm_cmpeq_epi8(chunk, _mm256_castsi256_si128(newline)),
+                                    _mm_cmpeq_epi8(chunk, _mm256_castsi256_si128(delimiter)));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(hits);
+        if (mask)
+            return i + __builtin_ctz(mask);
+        i += 16;
+    }
+
+    return i + scan_scalar(data + i, length - i, set);
+}
+
+#endif // HTTP_SCAN_X86
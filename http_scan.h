@@ -0,0 +1,65 @@
+#ifndef HTTP_SCAN_H
+#define HTTP_SCAN_H
+
+#include <stddef.h> // size_t
+
+typedef enum
+{
+    HTTP_SCAN_LF,       // end of line
+    HTTP_SCAN_SPACE_LF, // request line token boundary or end of line
+    HTTP_SCAN_COLON_LF, // header name end or end of line
+    HTTP_SCAN_SET_COUNT
+} http_scan_set;
+
+typedef enum
+{
+    HTTP_SCANNER_SCALAR,
+    HTTP_SCANNER_SSE42,
+    HTTP_SCANNER_AVX2,
+    HTTP_SCANNER_COUNT
+} http_scanner_kind;
+
+/**
+ * Finds the first delimiter of a set. Dispatches to the widest
+ * implementation the CPU supports, detected once at startup.
+ *
+ * @param data Pointer to the bytes to scan.
+ * @param length Number of bytes to scan.
+ * @param set Delimiter set to look for.
+ * @return Index of the first delimiter, or length if there is none.
+ */
+size_t http_scan(const char *data, size_t length, http_scan_set set);
+
+/**
+ * Forces a specific implementation, e.g. to benchmark them against each
+ * other. Must not be called while other threads are scanning.
+ *
+ * @param kind Implementation to use.
+ * @return 0 on success, -1 if the CPU does not support it.
+ */
+int http_scanner_select(http_scanner_kind kind);
+
+/**
+ * Reports whether the CPU supports an implementation.
+ *
+ * @param kind Implementation to check.
+ * @return Non-zero if supported.
+ */
+int http_scanner_supported(http_scanner_kind kind);
+
+/**
+ * Returns the implementation currently in use.
+ *
+ * @return The active scanner kind.
+ */
+http_scanner_kind http_scanner_active(void);
+
+/**
+ * Returns a printable name for an implementation.
+ *
+ * @param kind Implementation.
+ * @return Static name string (e.g., "avx2").
+ */
+const char *http_scanner_name(http_scanner_kind kind);
+
+#endif // HTTP_SCAN_H
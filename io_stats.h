@@ -0,0 +1,50 @@
+#ifndef IO_STATS_H
+#define IO_STATS_H
+
+#include <stdatomic.h>
+
+/*
+ * Per-worker I/O counters used to compare backends. Each worker points
+ * io_stats_current at its own block; threads that never do so count into a
+ * shared scratch block nobody reads.
+ */
+typedef struct
+{
+    atomic_ulong syscalls;
+    atomic_ulong requests;
+    atomic_ulong allocations; // heap allocations made while serving requests
+    atomic_long output_queued; // bytes accepted for sending but not yet sent
+} io_stats;
+
+extern __thread io_stats *io_stats_current;
+
+static inline void io_stats_add(atomic_ulong *counter, unsigned long n)
+{
+    // single writer: a relaxed load and store avoids a locked add
+    unsigned long value = atomic_load_explicit(counter, memory_order_relaxed);
+    atomic_store_explicit(counter, value + n, memory_order_relaxed);
+}
+
+static inline void io_stats_syscall(void)
+{
+    io_stats_add(&io_stats_current->syscalls, 1);
+}
+
+static inline void io_stats_request(void)
+{
+    io_stats_add(&io_stats_current->requests, 1);
+}
+
+static inline void io_stats_allocations(unsigned long n)
+{
+    if (n)
+        io_stats_add(&io_stats_current->allocations, n);
+}
+
+static inline void io_stats_output_queued(long delta)
+{
+    long value = atomic_load_explicit(&io_stats_current->output_queued, memory_order_relaxed);
+    atomic_store_explicit(&io_stats_current->output_queued, value + delta, memory_order_relaxed);
+}
+
+#endif // IO_STATS_H
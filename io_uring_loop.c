@@ -0,0 +1,1143 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "compression.h"
+#include "io_stats.h"
+#include "io_uring_loop.h"
+#include "metrics.h"
+#include "my_socket.h"
+#include "offload.h"
+#include "proxy.h"
+#include "static_file.h"
+
+/*
+ * user_data layout: the low four bits hold the operation. Sends and file
+ * polls carry a pointer to their send_buffer (malloc alignment keeps those
+ * bits clear);
+ * accept, recv and cancel carry the connection slot and generation.
+ * The tick timeout and the offload, upstream and wakeup polls carry nothing else.
+ */
+enum
+{
+    URING_OP_ACCEPT = 1,
+    URING_OP_RECV,
+    URING_OP_SEND,
+    URING_OP_CANCEL,
+    URING_OP_TIMEOUT,
+    URING_OP_FILE_POLL,
+    URING_OP_OFFLOAD,
+    URING_OP_UPSTREAM,
+    URING_OP_WAKE,
+};
+
+#define URING_OP_MASK 0xfULL
+#define URING_GENERATION_MASK 0xffffffU
+#define URING_BUFFER_GROUP 0
+
+typedef struct send_buffer
+{
+    struct send_buffer *next;
+    connection *conn;
+    unsigned int generation;
+    connection_file file; // file.fd is -1 unless this sends a file range
+    size_t capacity;
+    size_t length;
+    size_t offset; // bytes already sent
+    char data[];
+} send_buffer;
+
+typedef struct uring_conn
+{
+    connection *conn;
+    send_buffer *queue_head; // waiting for the in-flight chain to finish
+    send_buffer *queue_tail;
+    send_buffer *retry_head; // cut short or canceled, resent first
+    send_buffer *retry_tail;
+    int in_flight;
+    send_buffer *file_poll; // file range waiting for the socket to drain
+    int recv_armed;  // a multishot recv is pending
+    int recv_paused; // stopped until queued output drains
+    int dirty;       // on the ring's dirty list
+    struct uring_conn *next_dirty;
+} uring_conn;
+
+typedef struct
+{
+    int fd;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    unsigned int sq_entries;
+    unsigned int sq_local_tail;
+    unsigned int to_submit;
+    struct io_uring_sqe *sqes;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *ring_ptr;
+    size_t ring_len;
+    void *sqes_ptr;
+    size_t sqes_len;
+
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_len;
+    char *buffers;
+    unsigned short buf_tail;
+
+    worker *w;
+    connection_data_callback on_data;
+    uring_conn *dirty_head;
+    send_buffer *free_sends; // completed buffers, reused before the heap
+    int free_send_count;
+    struct __kernel_timespec tick; // housekeeping interval
+    int accept_paused;             // out of descriptors with nothing to shed; the next tick re-arms accept
+    int stopping;                  // the worker's wakeup fired; the loop ends after this batch
+    offload_queue offload; // jobs back from the offload pool, watched with a poll
+    event_loop *upstreams; // proxied upstream sockets, whose epoll fd is watched with a poll; NULL if none
+} uring;
+
+static __thread uring *current_ring;
+
+static int ring_setup(uring *ring, unsigned int entries);
+static void ring_teardown(uring *ring);
+static int ring_enter(uring *ring, unsigned int min_complete, unsigned int flags);
+static struct io_uring_sqe *get_sqe(uring *ring);
+static int buffers_setup(uring *ring);
+static void recycle_buffer(uring *ring, int bid);
+static void arm_accept(uring *ring);
+static void arm_recv(uring *ring, connection *conn);
+static void arm_tick(uring *ring);
+static void arm_offload(uring *ring);
+static void arm_upstreams(uring *ring);
+static void arm_wakeup(uring *ring);
+static void pause_recv(uring *ring, uring_conn *uc);
+static void submit_cancel(uring *ring, uint64_t target);
+static void flush_dirty(uring *ring);
+static void reap_completions(uring *ring);
+static void handle_accept(uring *ring, int res, unsigned int flags);
+static void handle_recv(uring *ring, uint64_t user_data, int res, unsigned int flags);
+static void handle_send(uring *ring, send_buffer *sb, int res);
+static void handle_file_poll(uring *ring, send_buffer *sb, int res);
+static int resume_recv(uring *ring, uring_conn *uc);
+static void resume_parked(connection *conn);
+static int send_file_head(uring *ring, uring_conn *uc);
+static send_buffer *take_send_buffer(uring *ring, size_t length);
+static void release_send_buffer(uring *ring, send_buffer *sb);
+static void release_send_list(uring *ring, send_buffer *sb);
+static int uring_send(connection *conn, const struct iovec *iov, int count);
+static int uring_sendfile(connection *conn, const connection_file *file);
+static void uring_close(connection *conn);
+
+static const connection_io uring_io = {
+    .send = uring_send,
+    .sendfile = uring_sendfile,
+    .close = uring_close,
+};
+
+int run_io_uring_loop(worker *w, connection_data_callback on_data)
+{
+    uring ring;
+    if (ring_setup(&ring, URING_ENTRIES) == -1)
+        return -1;
+
+    if (buffers_setup(&ring) == -1)
+    {
+        ring_teardown(&ring);
+        return -1;
+    }
+
+    ring.w = w;
+    ring.on_data = on_data;
+    ring.dirty_head = NULL;
+    ring.free_sends = NULL;
+    ring.free_send_count = 0;
+    ring.upstreams = NULL;
+    ring.accept_paused = 0;
+    ring.stopping = 0;
+    current_ring = &ring;
+
+    if (connection_table_init(&w->connections, NULL, MAX_CONNECTIONS) == -1)
+    {
+        ring_teardown(&ring);
+        current_ring = NULL;
+        return -1;
+    }
+    w->connections.io = &uring_io;
+    w->connections.timeouts = w->timeouts;
+    w->connections.max_requests = w->max_requests;
+
+    if (offload_queue_init(&ring.offload, resume_parked) == -1)
+    {
+        connection_table_cleanup(&w->connections);
+        ring_teardown(&ring);
+        current_ring = NULL;
+        return -1;
+    }
+
+    /*
+     * Upstream connections are few and long-lived next to client ones, so
+     * they keep their edge-triggered handlers in a nested epoll loop, run
+     * whenever its fd polls readable, rather than a second set of ring ops.
+     */
+    if (proxy_enabled() && (!(ring.upstreams = event_loop_create(EVENT_LOOP_MAX_EVENTS)) ||
+                            proxy_worker_init(ring.upstreams, resume_parked) == -1))
+    {
+        if (ring.upstreams)
+            event_loop_destroy(ring.upstreams);
+        connection_table_cleanup(&w->connections);
+        offload_queue_cleanup(&ring.offload);
+        ring_teardown(&ring);
+        current_ring = NULL;
+        return -1;
+    }
+
+    accept_reserve_init();
+    arm_accept(&ring);
+    arm_tick(&ring);
+    arm_offload(&ring);
+    arm_upstreams(&ring);
+    arm_wakeup(&ring);
+    while (!ring.stopping)
+    {
+        flush_dirty(&ring);
+        if (ring_enter(&ring, 1, IORING_ENTER_GETEVENTS) == -1)
+            break;
+        reap_completions(&ring);
+        connection_table_tick(&w->connections);
+    }
+
+    connection_table *table = &w->connections;
+    for (int i = 0; i < table->used; i++)
+    {
+        connection_close(table->slots[i]);
+        free(table->slots[i]->io_data);
+        table->slots[i]->io_data = NULL;
+    }
+    connection_table_cleanup(table);
+    if (ring.upstreams)
+    {
+        proxy_worker_cleanup();
+        event_loop_destroy(ring.upstreams);
+    }
+    offload_queue_cleanup(&ring.offload);
+    static_files_thread_cleanup();
+    compression_thread_cleanup();
+    accept_reserve_cleanup();
+    while (ring.free_sends)
+    {
+        send_buffer *next = ring.free_sends->next;
+        free(ring.free_sends);
+        ring.free_sends = next;
+    }
+    ring_teardown(&ring);
+    current_ring = NULL;
+
+    return 0;
+}
+
+static int ring_setup(uring *ring, unsigned int entries)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    params.cq_entries = entries * 4; // multishot requests post many completions each
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd == -1 && errno == EINVAL)
+    {
+        // kernels before 6.1 lack the single-issuer task-work flags
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE;
+        params.cq_entries = entries * 4;
+        ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    }
+    if (ring->fd == -1)
+    {
+        perror("io_uring_setup");
+        return -1;
+    }
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP))
+    {
+        fprintf(stderr, "io_uring: kernel lacks single mmap or no-drop completions\n");
+        close(ring->fd);
+        return -1;
+    }
+
+    size_t sq_len = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+    size_t cq_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_len = sq_len > cq_len ? sq_len : cq_len;
+    ring->ring_ptr = mmap(NULL, ring->ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                          IORING_OFF_SQ_RING);
+    if (ring->ring_ptr == MAP_FAILED)
+    {
+        perror("io_uring mmap");
+        close(ring->fd);
+        return -1;
+    }
+
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes_ptr = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd,
+                          IORING_OFF_SQES);
+    if (ring->sqes_ptr == MAP_FAILED)
+    {
+        perror("io_uring mmap");
+        munmap(ring->ring_ptr, ring->ring_len);
+        close(ring->fd);
+        return -1;
+    }
+
+    char *base = ring->ring_ptr;
+    ring->sq_head = (unsigned int *)(base + params.sq_off.head);
+    ring->sq_tail = (unsigned int *)(base + params.sq_off.tail);
+    ring->sq_mask = (unsigned int *)(base + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned int *)(base + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+    ring->to_submit = 0;
+    ring->sqes = ring->sqes_ptr;
+    ring->cq_head = (unsigned int *)(base + params.cq_off.head);
+    ring->cq_tail = (unsigned int *)(base + params.cq_off.tail);
+    ring->cq_mask = (unsigned int *)(base + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(base + params.cq_off.cqes);
+
+    // SQEs are always filled in ring order, so the index array is the identity
+    for (unsigned int i = 0; i < ring->sq_entries; i++)
+        ring->sq_array[i] = i;
+
+    ring->buf_ring = NULL;
+    ring->buffers = NULL;
+
+    return 0;
+}
+
+static void ring_teardown(uring *ring)
+{
+    close(ring->fd);
+    munmap(ring->sqes_ptr, ring->sqes_len);
+    munmap(ring->ring_ptr, ring->ring_len);
+    if (ring->buf_ring)
+        munmap(ring->buf_ring, ring->buf_ring_len);
+    free(ring->buffers);
+}
+
+static int ring_enter(uring *ring, unsigned int min_complete, unsigned int flags)
+{
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+
+    for (;;)
+    {
+        io_stats_syscall();
+        int ret = syscall(__NR_io_uring_enter, ring->fd, ring->to_submit, min_complete, flags, NULL, 0);
+        if (ret >= 0)
+        {
+            ring->to_submit -= ret;
+            return 0;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno == EAGAIN || errno == EBUSY)
+            return 0; // completions pending; reaping frees room
+        perror("io_uring_enter");
+        return -1;
+    }
+}
+
+static struct io_uring_sqe *get_sqe(uring *ring)
+{
+    while (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+    {
+        if (ring_enter(ring, 0, 0) == -1)
+            return NULL;
+    }
+
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sq_local_tail & *ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_local_tail++;
+    ring->to_submit++;
+
+    return sqe;
+}
+
+static unsigned int sq_space(uring *ring)
+{
+    return ring->sq_entries - (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE));
+}
+
+static int buffers_setup(uring *ring)
+{
+    ring->buf_ring_len = URING_BUFFER_COUNT * sizeof(struct io_uring_buf);
+    ring->buf_ring = mmap(NULL, ring->buf_ring_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buf_ring == MAP_FAILED)
+    {
+        perror("io_uring buffer ring mmap");
+        ring->buf_ring = NULL;
+        return -1;
+    }
+
+    ring->buffers = malloc((size_t)URING_BUFFER_COUNT * URING_BUFFER_SIZE);
+    if (!ring->buffers)
+    {
+        fprintf(stderr, "Error: Unable to allocate io_uring receive buffers\n");
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+    reg.ring_entries = URING_BUFFER_COUNT;
+    reg.bgid = URING_BUFFER_GROUP;
+
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+    {
+        perror("io_uring provided buffer ring");
+        return -1;
+    }
+
+    ring->buf_tail = 0;
+    for (int bid = 0; bid < URING_BUFFER_COUNT; bid++)
+        recycle_buffer(ring, bid);
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+static void recycle_buffer(uring *ring, int bid)
+{
+    struct io_uring_buf *buf = &ring->buf_ring->bufs[ring->buf_tail & (URING_BUFFER_COUNT - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(ring->buffers + (size_t)bid * URING_BUFFER_SIZE);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = bid;
+    ring->buf_tail++;
+}
+
+static uint64_t conn_user_data(connection *conn, int op)
+{
+    return ((uint64_t)conn->slot << 32) | ((uint64_t)(conn->generation & URING_GENERATION_MASK) << 8) | op;
+}
+
+static connection *lookup_conn(uring *ring, uint64_t user_data)
+{
+    connection_table *table = &ring->w->connections;
+    int slot = (int)(user_data >> 32);
+    unsigned int generation = (user_data >> 8) & URING_GENERATION_MASK;
+
+    if (slot >= table->used)
+        return NULL;
+
+    connection *conn = table->slots[slot];
+    if (conn->handler.fd == -1 || (conn->generation & URING_GENERATION_MASK) != generation)
+        return NULL;
+
+    return conn;
+}
+
+static void arm_accept(uring *ring)
+{
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (!sqe)
+        return;
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = ring->w->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = URING_OP_ACCEPT;
+}
+
+static void arm_recv(uring *ring, connection *conn)
+{
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (!sqe)
+        return;
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->handler.fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = conn_user_data(conn, URING_OP_RECV);
+    ((uring_conn *)conn->io_data)->recv_armed = 1;
+}
+
+/*
+ * Stops reading from a client whose output is backed up. Data already in
+ * flight still arrives and is buffered; the rest waits in the socket.
+ */
+static void pause_recv(uring *ring, uring_conn *uc)
+{
+    if (uc->recv_paused)
+        return;
+
+    uc->recv_paused = 1;
+    if (uc->recv_armed)
+        submit_cancel(ring, conn_user_data(uc->conn, URING_OP_RECV));
+}
+
+static void arm_tick(uring *ring)
+{
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (!sqe)
+        return;
+
+    ring->tick.tv_sec = URING_TICK_SECONDS;
+    ring->tick.tv_nsec = 0;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)&ring->tick;
+    sqe->len = 1;
+    sqe->user_data = URING_OP_TIMEOUT;
+}
+
+static void arm_offload(uring *ring)
+{
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (!sqe)
+        return;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = ring->offload.event_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = URING_OP_OFFLOAD;
+}
+
+static void arm_wakeup(uring *ring)
+{
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (!sqe)
+        return;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = ring->w->wake_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = URING_OP_WAKE;
+}
+
+static void arm_upstreams(uring *ring)
+{
+    if (!ring->upstreams)
+        return;
+
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (!sqe)
+        return;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = event_loop_fd(ring->upstreams);
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = URING_OP_UPSTREAM;
+}
+
+static void submit_cancel(uring *ring, uint64_t target)
+{
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (!sqe)
+        return;
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = URING_OP_CANCEL;
+}
+
+static void mark_dirty(uring *ring, uring_conn *uc)
+{
+    if (uc->dirty)
+        return;
+
+    uc->dirty = 1;
+    uc->next_dirty = ring->dirty_head;
+    ring->dirty_head = uc;
+}
+
+/*
+ * Submits one linked chain of queued sends for the connection. The link
+ * keeps the sends in order; the next chain waits until this one completes.
+ */
+static void submit_chain(uring *ring, uring_conn *uc)
+{
+    if (uc->retry_head)
+    {
+        uc->retry_tail->next = uc->queue_head;
+        if (!uc->queue_head)
+            uc->queue_tail = uc->retry_tail;
+        uc->queue_head = uc->retry_head;
+        uc->retry_head = uc->retry_tail = NULL;
+    }
+
+    while (uc->queue_head && uc->queue_head->file.fd != -1)
+    {
+        int done = send_file_head(ring, uc);
+        if (done == -1)
+        {
+            connection_close(uc->conn);
+            return;
+        }
+        if (done == 0)
+            return;
+    }
+
+    // a chain stops before a file range, which is sent on its own
+    int count = 0;
+    for (send_buffer *sb = uc->queue_head; sb && sb->file.fd == -1 && count < URING_MAX_LINKED_SENDS; sb = sb->next)
+        count++;
+
+    if (count == 0)
+        return;
+
+    // a chain must not straddle two submissions
+    if (sq_space(ring) < (unsigned int)count && ring_enter(ring, 0, 0) == -1)
+        return;
+
+    for (int i = 0; i < count; i++)
+    {
+        send_buffer *sb = uc->queue_head;
+        // a head followed by a file range waits to share a segment with it
+        int more = i + 1 == count && sb->next && sb->next->file.fd != -1 ? MSG_MORE : 0;
+        uc->queue_head = sb->next;
+        if (!uc->queue_head)
+            uc->queue_tail = NULL;
+        sb->next = NULL;
+
+        struct io_uring_sqe *sqe = get_sqe(ring);
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = uc->conn->handler.fd;
+        sqe->addr = (uint64_t)(uintptr_t)(sb->data + sb->offset);
+        sqe->len = sb->length - sb->offset;
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL | more;
+        sqe->flags = i + 1 < count ? IOSQE_IO_LINK : 0;
+        sqe->user_data = (uint64_t)(uintptr_t)sb | URING_OP_SEND;
+        uc->in_flight++;
+    }
+}
+
+static void flush_dirty(uring *ring)
+{
+    while (ring->dirty_head)
+    {
+        uring_conn *uc = ring->dirty_head;
+        ring->dirty_head = uc->next_dirty;
+        uc->dirty = 0;
+
+        if (uc->conn->handler.fd == -1 || uc->in_flight > 0)
+            continue;
+
+        submit_chain(ring, uc);
+        if (uc->conn->closing && uc->in_flight == 0)
+            connection_close(uc->conn);
+    }
+}
+
+static void reap_completions(uring *ring)
+{
+    unsigned int head = *ring->cq_head;
+    unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail)
+    {
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        uint64_t user_data = cqe->user_data;
+        int res = cqe->res;
+        unsigned int flags = cqe->flags;
+        head++;
+
+        switch (user_data & URING_OP_MASK)
+        {
+        case URING_OP_ACCEPT:
+            handle_accept(ring, res, flags);
+            break;
+        case URING_OP_RECV:
+            handle_recv(ring, user_data, res, flags);
+            break;
+        case URING_OP_SEND:
+            handle_send(ring, (send_buffer *)(uintptr_t)(user_data & ~URING_OP_MASK), res);
+            break;
+        case URING_OP_FILE_POLL:
+            handle_file_poll(ring, (send_buffer *)(uintptr_t)(user_data & ~URING_OP_MASK), res);
+            break;
+        case URING_OP_TIMEOUT:
+            // only wakes the loop; the tick runs after every batch
+            arm_tick(ring);
+            if (ring->accept_paused)
+            {
+                ring->accept_paused = 0;
+                arm_accept(ring);
+            }
+            break;
+        case URING_OP_OFFLOAD:
+            offload_queue_drain(&ring->offload);
+            arm_offload(ring);
+            break;
+        case URING_OP_UPSTREAM:
+            if (event_loop_run_once(ring->upstreams, 0) == -1)
+                fprintf(stderr, "Worker %d: upstream poll failed.\n", ring->w->id);
+            arm_upstreams(ring);
+            break;
+        case URING_OP_WAKE:
+            ring->stopping = 1;
+            break;
+        default:
+            break;
+        }
+    }
+
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+}
+
+static int attach_conn(connection *conn)
+{
+    uring_conn *uc = conn->io_data;
+    if (!uc)
+    {
+        uc = malloc(sizeof(uring_conn));
+        if (!uc)
+        {
+            fprintf(stderr, "Error: Unable to allocate memory for io_uring connection\n");
+            return -1;
+        }
+        uc->dirty = 0;
+        uc->next_dirty = NULL;
+        conn->io_data = uc;
+    }
+
+    // a recycled slot may still sit on the dirty list; leave that link alone
+    uc->conn = conn;
+    uc->queue_head = uc->queue_tail = NULL;
+    uc->retry_head = uc->retry_tail = NULL;
+    uc->in_flight = 0;
+    uc->file_poll = NULL;
+    uc->recv_armed = 0;
+    uc->recv_paused = 0;
+
+    return 0;
+}
+
+static void handle_accept(uring *ring, int res, unsigned int flags)
+{
+    if (res >= 0)
+    {
+        connection *conn = connection_open(&ring->w->connections, res, EVENT_READ, NULL);
+        if (!conn)
+        {
+            fprintf(stderr, "Too many clients. Connection rejected.\n");
+            close(res);
+        }
+        else if (attach_conn(conn) == -1)
+        {
+            connection_close(conn);
+        }
+        else
+        {
+            arm_recv(ring, conn);
+        }
+    }
+    else if (res == -EMFILE || res == -ENFILE)
+    {
+        /*
+         * The accept fails before it looks at the queue, so re-armed as is it
+         * would fail again at once. Shed the connection that is waiting, if
+         * any; with none, wait for the tick, as descriptors may free up by then.
+         */
+        if (shed_client(ring->w->listen_fd) != 1 && !(flags & IORING_CQE_F_MORE))
+        {
+            ring->accept_paused = 1;
+            return;
+        }
+    }
+    else if (res != -ECANCELED)
+    {
+        fprintf(stderr, "Failed to accept client connection: %s\n", strerror(-res));
+    }
+
+    if (!(flags & IORING_CQE_F_MORE))
+        arm_accept(ring);
+}
+
+static void handle_recv(uring *ring, uint64_t user_data, int res, unsigned int flags)
+{
+    int bid = flags & IORING_CQE_F_BUFFER ? (int)(flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+    connection *conn = lookup_conn(ring, user_data);
+
+    if (!conn)
+    {
+        if (bid >= 0)
+            recycle_buffer(ring, bid);
+        return;
+    }
+
+    uring_conn *uc = conn->io_data;
+    if (!(flags & IORING_CQE_F_MORE))
+        uc->recv_armed = 0;
+
+    if (res > 0 && bid >= 0)
+    {
+        metrics_bytes_in(res);
+        int retval = ring->on_data(conn, ring->buffers + (size_t)bid * URING_BUFFER_SIZE, res);
+        recycle_buffer(ring, bid);
+
+        if (retval == -1)
+            connection_close(conn);
+        else if (conn->closing)
+            mark_dirty(ring, uc); // closes once the queued responses are sent
+        else if (connection_input_paused(conn))
+            pause_recv(ring, uc);
+        else if (!uc->recv_armed)
+            arm_recv(ring, conn);
+        return;
+    }
+
+    if (bid >= 0)
+        recycle_buffer(ring, bid);
+
+    // ENOBUFS: the buffer ring ran dry; buffers recycled in this batch refill it.
+    // ECANCELED: pause_recv; a live connection is never canceled otherwise.
+    if (res == -ENOBUFS || res == -ECANCELED)
+    {
+        if (!uc->recv_paused && !conn->closing && !uc->recv_armed)
+            arm_recv(ring, conn);
+        return;
+    }
+
+    if (res == 0)
+        fprintf(stderr, "Client closed the connection.\n");
+    else if (res == -ECONNRESET)
+        fprintf(stderr, "Connection reset by peer.\n");
+    else
+        fprintf(stderr, "Failed to receive data from client: %s\n", strerror(-res));
+
+    connection_close(conn);
+}
+
+static void handle_send(uring *ring, send_buffer *sb, int res)
+{
+    connection *conn = sb->conn;
+
+    if (conn->handler.fd == -1 || conn->generation != sb->generation)
+    {
+        release_send_buffer(ring, sb);
+        return;
+    }
+
+    uring_conn *uc = conn->io_data;
+    uc->in_flight--;
+
+    if (res < 0 && res != -ECANCELED)
+    {
+        fprintf(stderr, "Failed to send response to client: %s\n", strerror(-res));
+        release_send_buffer(ring, sb);
+        connection_close(conn);
+        return;
+    }
+    if (res > 0)
+    {
+        connection_account_output(conn, -(long)res);
+        metrics_bytes_out(res);
+    }
+
+    if (res == -ECANCELED || (size_t)res < sb->length - sb->offset)
+    {
+        // a short send breaks the chain; resend the rest in order
+        if (res > 0)
+            sb->offset += res;
+        sb->next = NULL;
+        if (uc->retry_tail)
+            uc->retry_tail->next = sb;
+        else
+            uc->retry_head = sb;
+        uc->retry_tail = sb;
+    }
+    else
+    {
+        release_send_buffer(ring, sb);
+    }
+
+    if (resume_recv(ring, uc) == -1)
+        return;
+
+    if (uc->in_flight == 0 && (uc->retry_head || uc->queue_head))
+        mark_dirty(ring, uc);
+    else if (uc->in_flight == 0 && conn->closing)
+        connection_close(conn);
+}
+
+static int uring_send(connection *conn, const struct iovec *iov, int count)
+{
+    uring_conn *uc = conn->io_data;
+
+    size_t length = 0;
+    for (int i = 0; i < count; i++)
+        length += iov[i].iov_len;
+
+    // the caller's buffers may not outlive this call; gather them for the kernel
+    send_buffer *sb = take_send_buffer(current_ring, length);
+    if (!sb)
+        return -1;
+    connection_account_output(conn, (long)length);
+
+    size_t offset = 0;
+    for (int i = 0; i < count; i++)
+    {
+        memcpy(sb->data + offset, iov[i].iov_base, iov[i].iov_len);
+        offset += iov[i].iov_len;
+    }
+    sb->next = NULL;
+    sb->conn = conn;
+    sb->generation = conn->generation;
+    sb->length = length;
+    sb->offset = 0;
+
+    if (uc->queue_tail)
+        uc->queue_tail->next = sb;
+    else
+        uc->queue_head = sb;
+    uc->queue_tail = sb;
+
+    if (uc->in_flight == 0)
+        mark_dirty(current_ring, uc);
+
+    return 0;
+}
+
+/*
+ * io_uring has no sendfile, so a file range at the head of the queue goes
+ * out with sendfile(2) on the non-blocking socket. When the socket fills up
+ * the range waits for POLLOUT through the ring.
+ * Returns 1 when the range is done, 0 when it is waiting, -1 on failure.
+ */
+static int send_file_head(uring *ring, uring_conn *uc)
+{
+    send_buffer *sb = uc->queue_head;
+
+    if (connection_send_file_range(uc->conn, &sb->file) == -1)
+        return -1;
+
+    uc->queue_head = sb->next;
+    if (!uc->queue_head)
+        uc->queue_tail = NULL;
+    sb->next = NULL;
+
+    if (sb->file.length == 0)
+    {
+        release_send_buffer(ring, sb);
+        return resume_recv(ring, uc) == -1 ? -1 : 1;
+    }
+
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (!sqe)
+    {
+        release_send_buffer(ring, sb);
+        return -1;
+    }
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = uc->conn->handler.fd;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = (uint64_t)(uintptr_t)sb | URING_OP_FILE_POLL;
+    uc->file_poll = sb;
+    uc->in_flight++;
+
+    return 0;
+}
+
+/*
+ * Reads again once the client has caught up with output held back by
+ * backpressure, answering requests buffered in the meantime first.
+ * Returns -1 if the connection was closed.
+ */
+static int resume_recv(uring *ring, uring_conn *uc)
+{
+    connection *conn = uc->conn;
+
+    if (!uc->recv_paused || conn->closing || connection_input_paused(conn))
+        return 0;
+
+    uc->recv_paused = 0;
+    if (ring->on_data(conn, NULL, 0) == -1)
+    {
+        connection_close(conn);
+        return -1;
+    }
+    if (connection_input_paused(conn))
+        uc->recv_paused = 1;
+    else if (!conn->closing && !uc->recv_armed)
+        arm_recv(ring, conn);
+
+    return 0;
+}
+
+/*
+ * Back from the offload pool or an upstream: the connection's reads were paused when it
+ * parked. Sends the response, answers requests that arrived meanwhile and
+ * reads again.
+ */
+static void resume_parked(connection *conn)
+{
+    uring *ring = current_ring;
+    uring_conn *uc = conn->io_data;
+
+    if (ring->on_data(conn, NULL, 0) == -1)
+    {
+        connection_close(conn);
+        return;
+    }
+    if (conn->closing)
+        mark_dirty(ring, uc); // closes once the response is sent
+    else if (connection_input_paused(conn))
+        pause_recv(ring, uc);
+    else
+    {
+        uc->recv_paused = 0;
+        if (!uc->recv_armed)
+            arm_recv(ring, conn);
+    }
+}
+
+static void handle_file_poll(uring *ring, send_buffer *sb, int res)
+{
+    connection *conn = sb->conn;
+
+    if (conn->handler.fd == -1 || conn->generation != sb->generation)
+    {
+        release_send_buffer(ring, sb);
+        return;
+    }
+
+    uring_conn *uc = conn->io_data;
+    uc->in_flight--;
+    uc->file_poll = NULL;
+
+    if (res < 0)
+    {
+        fprintf(stderr, "Failed to wait for client socket: %s\n", strerror(-res));
+        release_send_buffer(ring, sb);
+        connection_close(conn);
+        return;
+    }
+
+    // back to the head of the queue; flush_dirty resumes sending it
+    sb->next = uc->queue_head;
+    uc->queue_head = sb;
+    if (!uc->queue_tail)
+        uc->queue_tail = sb;
+    mark_dirty(ring, uc);
+}
+
+static int uring_sendfile(connection *conn, const connection_file *file)
+{
+    uring_conn *uc = conn->io_data;
+
+    send_buffer *sb = take_send_buffer(current_ring, 0);
+    if (!sb)
+    {
+        if (file->release)
+            file->release(file->arg);
+        return -1;
+    }
+    connection_account_output(conn, (long)file->length);
+
+    sb->file = *file;
+    sb->next = NULL;
+    sb->conn = conn;
+    sb->generation = conn->generation;
+    sb->length = 0;
+    sb->offset = 0;
+
+    if (uc->queue_tail)
+        uc->queue_tail->next = sb;
+    else
+        uc->queue_head = sb;
+    uc->queue_tail = sb;
+
+    if (uc->in_flight == 0)
+        mark_dirty(current_ring, uc);
+
+    return 0;
+}
+
+static send_buffer *take_send_buffer(uring *ring, size_t length)
+{
+    send_buffer *sb = ring->free_sends;
+    if (sb)
+    {
+        ring->free_sends = sb->next;
+        ring->free_send_count--;
+        if (sb->capacity >= length)
+        {
+            sb->file.fd = -1;
+            return sb;
+        }
+        free(sb);
+    }
+
+    size_t capacity = length > URING_SEND_BUFFER_MIN ? length : URING_SEND_BUFFER_MIN;
+    sb = malloc(sizeof(send_buffer) + capacity);
+    if (!sb)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for send buffer\n");
+        return NULL;
+    }
+    io_stats_allocations(1);
+    sb->capacity = capacity;
+    sb->file.fd = -1;
+
+    return sb;
+}
+
+static void release_send_buffer(uring *ring, send_buffer *sb)
+{
+    if (sb->file.fd != -1 && sb->file.release)
+        sb->file.release(sb->file.arg);
+    sb->file.fd = -1;
+
+    if (ring->free_send_count >= URING_SEND_POOL_MAX)
+    {
+        free(sb);
+        return;
+    }
+
+    sb->next = ring->free_sends;
+    ring->free_sends = sb;
+    ring->free_send_count++;
+}
+
+static void release_send_list(uring *ring, send_buffer *sb)
+{
+    while (sb)
+    {
+        send_buffer *next = sb->next;
+        release_send_buffer(ring, sb);
+        sb = next;
+    }
+}
+
+static void uring_close(connection *conn)
+{
+    uring_conn *uc = conn->io_data;
+    if (!uc)
+        return;
+
+    // the pending multishot recv holds a file reference until canceled
+    submit_cancel(current_ring, conn_user_data(conn, URING_OP_RECV));
+    if (uc->file_poll)
+        submit_cancel(current_ring, (uint64_t)(uintptr_t)uc->file_poll | URING_OP_FILE_POLL);
+    uc->file_poll = NULL;
+
+    release_send_list(current_ring, uc->queue_head);
+    release_send_list(current_ring, uc->retry_head);
+    uc->queue_head = uc->queue_tail = NULL;
+    uc->retry_head = uc->retry_tail = NULL;
+}
@@ -0,0 +1,38 @@
+#ifndef IO_URING_LOOP_H
+#define IO_URING_LOOP_H
+
+#include <stddef.h> // size_t
+
+#include "connection.h"
+#include "worker.h"
+
+#define URING_ENTRIES 4096
+#define URING_BUFFER_COUNT 4096 // provided receive buffers, power of two
+#define URING_BUFFER_SIZE 4096
+#define URING_MAX_LINKED_SENDS 32
+#define URING_SEND_POOL_MAX 256     // completed send buffers kept for reuse
+#define URING_SEND_BUFFER_MIN 1024 // smallest send buffer allocated
+#define URING_TICK_SECONDS 1       // connection deadline granularity
+
+/*
+ * Called for every chunk of data received on a connection. The data lives in
+ * a provided buffer that is recycled as soon as the callback returns.
+ * Called with no data when reading resumes after output backpressure, so
+ * requests already buffered can be answered. Returning -1 closes the
+ * connection.
+ */
+typedef int (*connection_data_callback)(connection *conn, char *data, size_t length);
+
+/**
+ * Runs a worker on an io_uring completion loop: multishot accept on the
+ * worker's listener, multishot recv into a provided buffer ring, and
+ * per-connection sends submitted as linked chains so they complete in order.
+ *
+ * @param w Worker whose listener and connection table to use.
+ * @param on_data Callback invoked with received data.
+ * @return 0 when the loop ends, -1 if io_uring could not be set up, in which
+ *         case nothing was accepted and the caller may fall back to epoll.
+ */
+int run_io_uring_loop(worker *w, connection_data_callback on_data);
+
+#endif // IO_URING_LOOP_H
@@ -0,0 +1,158 @@
+#include <stddef.h>
+#include <string.h>
+
+#include "metrics.h"
+
+static metrics scratch_metrics;
+__thread metrics *metrics_current = &scratch_metrics;
+
+static _Atomic(metrics *) blocks[METRICS_MAX_BLOCKS];
+static atomic_int block_count;
+
+static unsigned long sum_counter(size_t offset);
+static void write_label(FILE *out, const char *value);
+static double bucket_bound(int bucket);
+
+static const char *const phase_names[METRICS_PHASE_COUNT] = {"parse", "handle", "flush"};
+
+int metrics_register(metrics *m)
+{
+    int index = atomic_fetch_add(&block_count, 1);
+    if (index >= METRICS_MAX_BLOCKS)
+    {
+        fprintf(stderr, "Error: Too many threads for metrics\n");
+        return -1;
+    }
+    atomic_store_explicit(&blocks[index], m, memory_order_release);
+    return 0;
+}
+
+#define SUM(field) sum_counter(offsetof(metrics, field))
+
+int metrics_write(FILE *out, const char *const *routes, int route_count)
+{
+    if (route_count > METRICS_MAX_ROUTES)
+        route_count = METRICS_MAX_ROUTES;
+
+    fprintf(out, "# HELP http_requests_total Requests answered, by matched route.\n");
+    fprintf(out, "# TYPE http_requests_total counter\n");
+    for (int i = 0; i < route_count; i++)
+    {
+        // a pattern may be registered both as a streaming and a buffered route
+        int seen = 0;
+        for (int j = 0; j < i && !seen; j++)
+            seen = strcmp(routes[i], routes[j]) == 0;
+        if (seen)
+            continue;
+
+        unsigned long count = 0;
+        for (int j = i; j < route_count; j++)
+            if (strcmp(routes[i], routes[j]) == 0)
+                count += SUM(routes[j]);
+        fprintf(out, "http_requests_total{route=\"");
+        write_label(out, routes[i]);
+        fprintf(out, "\"} %lu\n", count);
+    }
+    fprintf(out, "http_requests_total{route=\"none\"} %lu\n", SUM(routes[METRICS_MAX_ROUTES]));
+
+    fprintf(out, "# HELP http_responses_total Responses sent, by status code.\n");
+    fprintf(out, "# TYPE http_responses_total counter\n");
+    for (int status = 0; status < METRICS_MAX_STATUS; status++)
+    {
+        unsigned long count = SUM(statuses[status]);
+        if (count)
+            fprintf(out, "http_responses_total{code=\"%d\"} %lu\n", status, count);
+    }
+
+    unsigned long opened = SUM(connections_opened);
+    unsigned long closed = SUM(connections_closed);
+    fprintf(out, "# HELP http_received_bytes_total Bytes read from clients.\n");
+    fprintf(out, "# TYPE http_received_bytes_total counter\n");
+    fprintf(out, "http_received_bytes_total %lu\n", SUM(bytes_in));
+    fprintf(out, "# HELP http_sent_bytes_total Bytes written to clients.\n");
+    fprintf(out, "# TYPE http_sent_bytes_total counter\n");
+    fprintf(out, "http_sent_bytes_total %lu\n", SUM(bytes_out));
+    fprintf(out, "# HELP http_connections_total Connections accepted.\n");
+    fprintf(out, "# TYPE http_connections_total counter\n");
+    fprintf(out, "http_connections_total %lu\n", opened);
+    fprintf(out, "# HELP http_connections_open Connections currently open.\n");
+    fprintf(out, "# TYPE http_connections_open gauge\n");
+    fprintf(out, "http_connections_open %ld\n", (long)(opened - closed));
+    fprintf(out, "# HELP http_recv_buffers Receive buffers lent to connections with unconsumed input.\n");
+    fprintf(out, "# TYPE http_recv_buffers gauge\n");
+    fprintf(out, "http_recv_buffers %lu\n", SUM(recv_buffers));
+    fprintf(out, "# HELP http_recv_buffer_bytes Bytes of receive buffers lent to connections.\n");
+    fprintf(out, "# TYPE http_recv_buffer_bytes gauge\n");
+    fprintf(out, "http_recv_buffer_bytes %lu\n", SUM(recv_buffer_bytes));
+    fprintf(out, "# HELP http_recv_buffer_peak_bytes Sum over workers of the most receive buffer bytes each has lent at once.\n");
+    fprintf(out, "# TYPE http_recv_buffer_peak_bytes gauge\n");
+    fprintf(out, "http_recv_buffer_peak_bytes %lu\n", SUM(recv_buffer_peak_bytes));
+    fprintf(out, "# HELP http_recv_pool_free_bytes Bytes of returned receive buffers kept for reuse.\n");
+    fprintf(out, "# TYPE http_recv_pool_free_bytes gauge\n");
+    fprintf(out, "http_recv_pool_free_bytes %lu\n", SUM(recv_pool_free_bytes));
+
+    fprintf(out, "# HELP http_phase_seconds Time spent parsing requests, running handlers and flushing responses.\n");
+    fprintf(out, "# TYPE http_phase_seconds histogram\n");
+    for (int phase = 0; phase < METRICS_PHASE_COUNT; phase++)
+    {
+        // Prometheus buckets are cumulative
+        unsigned long cumulative = 0;
+        for (int bucket = 0; bucket < METRICS_BUCKETS; bucket++)
+        {
+            cumulative += SUM(latency[phase].buckets[bucket]);
+            if (bucket == METRICS_BUCKETS - 1)
+                fprintf(out, "http_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %lu\n", phase_names[phase],
+                        cumulative);
+            else
+                fprintf(out, "http_phase_seconds_bucket{phase=\"%s\",le=\"%.9g\"} %lu\n", phase_names[phase],
+                        bucket_bound(bucket), cumulative);
+        }
+        fprintf(out, "http_phase_seconds_sum{phase=\"%s\"} %.9f\n", phase_names[phase],
+                SUM(latency[phase].sum_ns) / 1e9);
+        fprintf(out, "http_phase_seconds_count{phase=\"%s\"} %lu\n", phase_names[phase],
+                SUM(latency[phase].count));
+    }
+
+    return ferror(out) ? -1 : 0;
+}
+
+static unsigned long sum_counter(size_t offset)
+{
+    unsigned long total = 0;
+    int count = atomic_load_explicit(&block_count, memory_order_acquire);
+    if (count > METRICS_MAX_BLOCKS)
+        count = METRICS_MAX_BLOCKS;
+
+    for (int i = 0; i < count; i++)
+    {
+        metrics *m = atomic_load_explicit(&blocks[i], memory_order_acquire);
+        if (m) // registered but not yet stored
+            total += atomic_load_explicit((atomic_ulong *)((char *)m + offset), memory_order_relaxed);
+    }
+    return total;
+}
+
+static void write_label(FILE *out, const char *value)
+{
+    for (; *value; value++)
+    {
+        if (*value == '\\' || *value == '"')
+            fputc('\\', out);
+        if (*value == '\n')
+            fputs("\\n", out);
+        else
+            fputc(*value, out);
+    }
+}
+
+// upper bound of a bucket in seconds; the last bucket has none
+static double bucket_bound(int bucket)
+{
+    if (bucket == 0)
+        return (1UL << METRICS_MIN_BITS) / 1e9;
+
+    int index = bucket - 1;
+    int exponent = METRICS_MIN_BITS + (index >> METRICS_SUB_BUCKET_BITS);
+    unsigned long steps = (1UL << METRICS_SUB_BUCKET_BITS) + (index & ((1 << METRICS_SUB_BUCKET_BITS) - 1)) + 1;
+    return (double)(steps << (exponent - METRICS_SUB_BUCKET_BITS)) / 1e9;
+}
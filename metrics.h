@@ -0,0 +1,161 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <time.h>
+
+#define METRICS_MAX_BLOCKS 256  // threads whose metrics are reported
+#define METRICS_MAX_ROUTES 64   // routes counted separately; the rest share the "none" series
+#define METRICS_MAX_STATUS 600
+
+// log-linear latency buckets: 4 per power of two from 64 ns to 2^36 ns (about 69 s)
+#define METRICS_SUB_BUCKET_BITS 2
+#define METRICS_MIN_BITS 6
+#define METRICS_OCTAVES 30
+#define METRICS_BUCKETS ((METRICS_OCTAVES << METRICS_SUB_BUCKET_BITS) + 2) // plus under 64 ns and +Inf
+
+typedef enum
+{
+    METRICS_PARSE,  // request head parsed
+    METRICS_HANDLE, // handler ran
+    METRICS_FLUSH,  // a batch of responses written out
+    METRICS_PHASE_COUNT
+} metrics_phase;
+
+typedef struct
+{
+    atomic_ulong buckets[METRICS_BUCKETS];
+    atomic_ulong count;
+    atomic_ulong sum_ns;
+} metrics_histogram;
+
+/*
+ * Counters of one thread. Only that thread writes them, so recording is a
+ * relaxed load and store with no locked instruction; readers add up every
+ * registered block. Each block starts on its own cache line so the writers
+ * never share one.
+ */
+typedef struct
+{
+    atomic_ulong bytes_in;
+    atomic_ulong bytes_out;
+    atomic_ulong connections_opened;
+    atomic_ulong connections_closed;
+    // receive buffer pool gauges, set rather than added to
+    atomic_ulong recv_buffers;           // lent to connections
+    atomic_ulong recv_buffer_bytes;      // size of those lent
+    atomic_ulong recv_buffer_peak_bytes; // highest recv_buffer_bytes so far
+    atomic_ulong recv_pool_free_bytes;   // returned and kept for reuse
+    atomic_ulong routes[METRICS_MAX_ROUTES + 1]; // last slot: no route matched
+    atomic_ulong statuses[METRICS_MAX_STATUS];
+    metrics_histogram latency[METRICS_PHASE_COUNT];
+} __attribute__((aligned(64))) metrics;
+
+extern __thread metrics *metrics_current;
+
+static inline void metrics_add(atomic_ulong *counter, unsigned long n)
+{
+    unsigned long value = atomic_load_explicit(counter, memory_order_relaxed);
+    atomic_store_explicit(counter, value + n, memory_order_relaxed);
+}
+
+static inline void metrics_set(atomic_ulong *gauge, unsigned long value)
+{
+    atomic_store_explicit(gauge, value, memory_order_relaxed);
+}
+
+static inline unsigned long metrics_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static inline int metrics_bucket(unsigned long ns)
+{
+    if (ns < (1UL << METRICS_MIN_BITS))
+        return 0;
+
+    int exponent = 63 - __builtin_clzl(ns);
+    if (exponent >= METRICS_MIN_BITS + METRICS_OCTAVES)
+        return METRICS_BUCKETS - 1;
+
+    // the bits after the leading one pick the sub-bucket
+    int sub = (ns >> (exponent - METRICS_SUB_BUCKET_BITS)) & ((1 << METRICS_SUB_BUCKET_BITS) - 1);
+    return 1 + ((exponent - METRICS_MIN_BITS) << METRICS_SUB_BUCKET_BITS) + sub;
+}
+
+static inline void metrics_observe(metrics_phase phase, unsigned long ns)
+{
+    metrics_histogram *histogram = &metrics_current->latency[phase];
+    metrics_add(&histogram->buckets[metrics_bucket(ns)], 1);
+    metrics_add(&histogram->count, 1);
+    metrics_add(&histogram->sum_ns, ns);
+}
+
+static inline void metrics_route(int route)
+{
+    if (route < 0 || route >= METRICS_MAX_ROUTES)
+        route = METRICS_MAX_ROUTES;
+    metrics_add(&metrics_current->routes[route], 1);
+}
+
+static inline void metrics_status(int status)
+{
+    if (status >= 0 && status < METRICS_MAX_STATUS)
+        metrics_add(&metrics_current->statuses[status], 1);
+}
+
+static inline void metrics_bytes_in(unsigned long n)
+{
+    metrics_add(&metrics_current->bytes_in, n);
+}
+
+static inline void metrics_bytes_out(unsigned long n)
+{
+    metrics_add(&metrics_current->bytes_out, n);
+}
+
+static inline void metrics_connection_opened(void)
+{
+    metrics_add(&metrics_current->connections_opened, 1);
+}
+
+static inline void metrics_connection_closed(void)
+{
+    metrics_add(&metrics_current->connections_closed, 1);
+}
+
+static inline void metrics_recv_buffers(unsigned long count, unsigned long bytes, unsigned long peak_bytes,
+                                        unsigned long free_bytes)
+{
+    metrics_set(&metrics_current->recv_buffers, count);
+    metrics_set(&metrics_current->recv_buffer_bytes, bytes);
+    metrics_set(&metrics_current->recv_buffer_peak_bytes, peak_bytes);
+    metrics_set(&metrics_current->recv_pool_free_bytes, free_bytes);
+}
+
+/**
+ * Makes a thread's block visible to metrics_write. The thread must also
+ * point metrics_current at it; threads that never do count into a scratch
+ * block that is not reported.
+ *
+ * @param m Pointer to a zeroed block that lives as long as the process.
+ * @return 0 on success, -1 if METRICS_MAX_BLOCKS blocks are registered.
+ */
+int metrics_register(metrics *m);
+
+/**
+ * Writes the sum of all registered blocks in the Prometheus text exposition
+ * format. Safe to call from any thread while others record; each counter is
+ * read once, so totals may be a moment apart but never torn.
+ *
+ * @param out Stream to write to.
+ * @param routes Label for each route number; routes sharing a label are summed.
+ * @param route_count Number of labels, at most METRICS_MAX_ROUTES are used.
+ * @return 0 on success, -1 if writing failed.
+ */
+int metrics_write(FILE *out, const char *const *routes, int route_count);
+
+#endif // METRICS_H
@@ -1,16 +1,19 @@
 #ifndef MY_HTTP_H
 #define MY_HTTP_H
 
+#define HTTP_VERSION "HTTP/1.1" // version of every response we send
 #define MAX_RECV_BUF 2048
 #define MAX_STATUS_LEN 64
 #define HTTP_MAX_HEADERS 100
-#define HTTP_STATUS_COUNT 3
+#define HTTP_STATUS_MIN 100
+#define HTTP_STATUS_COUNT 500 // codes 100-599, indexed from HTTP_STATUS_MIN
 #define HTTP_REASON_MAX_LEN 64
 #define HTTP_METHOD_MAX_LEN 16
 #define HTTP_PATH_MAX_LEN 256
 #define HTTP_VERSION_MAX_LEN 16
 #define HTTP_HEADER_NAME_MAX_LEN 64
 #define HTTP_HEADER_VALUE_MAX_LEN 256
-#define HTTP_MAX_RESPONSE_SIZE 8192
+#define HTTP_MAX_HEADER_SIZE 65536     // request line plus headers
+#define HTTP_MAX_BODY_SIZE ((size_t)1 << 30) // request body, streamed or spooled
 
 #endif // MY_HTTP_H
\ No newline at end of file
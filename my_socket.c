@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <assert.h>
 #include <errno.h>
 #include <netinet/in.h>
@@ -9,9 +10,10 @@
 #include <unistd.h>
 #include <fcntl.h>
 
+#include "io_stats.h"
 #include "my_socket.h"
 
-int create_server_socket(void)
+int create_server_socket(int reuse_port)
 {
     int server_fd = socket(AF_INET, SOCK_STREAM, 0);
     if (server_fd == -1)
@@ -24,6 +26,15 @@ int create_server_socket(void)
     if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0)
     {
         printf("SO_REUSEADDR failed: %s \n", strerror(errno));
+        close(server_fd);
+        return -1;
+    }
+
+    // lets every worker bind its own listener; the kernel spreads connections across them
+    if (reuse_port && setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0)
+    {
+        printf("SO_REUSEPORT failed: %s \n", strerror(errno));
+        close(server_fd);
         return -1;
     }
 
@@ -59,27 +70,97 @@ int listen_server_socket(int server_fd, int connection_backlog)
     return 0;
 }
 
+/*
+ * A descriptor each worker holds back. Out of descriptors, a worker cannot
+ * accept, so under edge-triggered readiness the queue would sit until the
+ * next connection arrived; giving this one up lets it take a waiting
+ * connection and close it instead.
+ */
+static __thread int reserve_fd = -1;
+
+int accept_reserve_init(void)
+{
+    reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    if (reserve_fd == -1)
+    {
+        perror("Failed to reserve a descriptor for accept");
+        return -1;
+    }
+    return 0;
+}
+
+void accept_reserve_cleanup(void)
+{
+    if (reserve_fd != -1)
+        close(reserve_fd);
+    reserve_fd = -1;
+}
+
 int accept_client(int server_fd)
 {
     struct sockaddr_in client_addr;
-    socklen_t client_addr_len = sizeof(client_addr);
-    int client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &client_addr_len);
-    if (client_fd == -1)
+
+    for (;;)
     {
-        if (errno == EAGAIN || errno == EWOULDBLOCK)
-            return -1;
-        perror("Failed to accept client connection");
-        return -1;
+        socklen_t client_addr_len = sizeof(client_addr);
+        // accept4 sets O_NONBLOCK atomically, saving two fcntl calls per connection
+        io_stats_syscall();
+        int client_fd =
+            accept4(server_fd, (struct sockaddr *)&client_addr, &client_addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd != -1)
+            return client_fd;
+
+        switch (errno)
+        {
+        case EAGAIN:
+#if EWOULDBLOCK != EAGAIN
+        case EWOULDBLOCK:
+#endif
+            return ACCEPT_EMPTY;
+        case EINTR:
+        case ECONNABORTED: // reset while queued; the rest of the queue is unaffected
+        case EPROTO:
+        case EPERM: // refused by a firewall rule
+            continue;
+        case EMFILE: // reported before the queue is looked at, so it may well be empty
+        case ENFILE:
+            switch (shed_client(server_fd))
+            {
+            case 1:
+                return ACCEPT_SHED;
+            case 0:
+                return ACCEPT_EMPTY;
+            default:
+                return ACCEPT_FAILED;
+            }
+        default:
+            perror("Failed to accept client connection");
+            return ACCEPT_FAILED;
+        }
     }
+}
 
-    if (set_socket_nonblocking(client_fd) == -1)
+int shed_client(int server_fd)
+{
+    if (reserve_fd == -1)
     {
-        perror("Failed to set client socket to non-blocking mode");
-        close(client_fd);
+        fprintf(stderr, "Out of file descriptors; connections wait in the accept queue.\n");
         return -1;
     }
 
-    return client_fd;
+    close(reserve_fd);
+    io_stats_syscall();
+    int client_fd = accept(server_fd, NULL, NULL);
+    int err = errno;
+    if (client_fd != -1)
+        close(client_fd);
+    reserve_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    if (client_fd == -1)
+        return err == EAGAIN || err == EWOULDBLOCK ? 0 : -1;
+
+    fprintf(stderr, "Out of file descriptors. Connection dropped.\n");
+    return 1;
 }
 
 int set_socket_nonblocking(int socket_fd)
@@ -94,9 +175,9 @@ int set_socket_nonblocking(int socket_fd)
     return fcntl(socket_fd, F_SETFL, flags);
 }
 
-int init_server(void)
+int init_server(int reuse_port)
 {
-    int server_fd = create_server_socket();
+    int server_fd = create_server_socket(reuse_port);
     if (server_fd == -1)
         return -1;
 
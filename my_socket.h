@@ -1,13 +1,36 @@
 #ifndef MY_SOCKET_H
 #define MY_SOCKET_H
 
-#define BACKLOG 5
+#define BACKLOG SOMAXCONN
 #define PORT 4221
 
 #include <netinet/in.h>
 
-int init_server(void);
+// accept_client results other than a descriptor
+#define ACCEPT_EMPTY -1  // the queue is drained; the next connection raises a new edge
+#define ACCEPT_SHED -2   // out of descriptors, so a waiting connection was closed; go on with the queue
+#define ACCEPT_FAILED -3 // the listener failed, or no connection could be taken or shed
+
+int init_server(int reuse_port);
+/**
+ * Accepts one connection, retrying the errors that concern only the
+ * connection being accepted (ECONNABORTED, EPROTO, EPERM, EINTR).
+ *
+ * @return The client descriptor, or ACCEPT_EMPTY, ACCEPT_SHED or ACCEPT_FAILED.
+ */
 int accept_client(int server_fd);
+
+/**
+ * Takes one waiting connection and closes it, using the calling thread's
+ * reserved descriptor, when the process has none left to accept it with.
+ *
+ * @return 1 if a connection was shed, 0 if none was waiting, -1 if nothing could be done.
+ */
+int shed_client(int server_fd);
+
+// reserve, and release, the calling thread's spare descriptor for shed_client
+int accept_reserve_init(void);
+void accept_reserve_cleanup(void);
 int set_socket_nonblocking(int socket_fd);
 
 #endif // MY_SOCKET_H
\ No newline at end of file
@@ -0,0 +1,297 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "compression.h"
+#include "io_stats.h"
+#include "offload.h"
+
+/*
+ * Submissions go through one mutex-guarded FIFO: they come from a handful of
+ * event loops, each job is worth far more than the lock, and a bounded
+ * queue needs a count anyway. Completions go the other way without a lock,
+ * since the loop they return to may be answering thousands of requests.
+ */
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    offload_job *head; // waiting for a thread, oldest first
+    offload_job *tail;
+    int queued;
+    int queue_max;
+    int stopping;
+    int thread_count;
+    pthread_t *threads;
+} offload_pool;
+
+static offload_pool pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .ready = PTHREAD_COND_INITIALIZER,
+};
+
+// the completion queue of the event loop running on this thread
+static __thread offload_queue *current_queue;
+
+static void *pool_thread(void *arg);
+static void finish(offload_job *job);
+static offload_job *withdraw_jobs(const offload_queue *queue);
+static void drop_jobs(offload_queue *queue, offload_job *job);
+
+int offload_start(int threads, int queue_max)
+{
+    if (threads == 0)
+        return 0;
+
+    pool.threads = calloc(threads, sizeof(pthread_t));
+    if (!pool.threads)
+    {
+        fprintf(stderr, "Error: Unable to allocate offload threads\n");
+        return -1;
+    }
+    pool.queue_max = queue_max;
+
+    for (int i = 0; i < threads; i++)
+    {
+        int err = pthread_create(&pool.threads[i], NULL, pool_thread, NULL);
+        if (err != 0)
+        {
+            fprintf(stderr, "Failed to start offload thread %d: %s\n", i, strerror(err));
+            offload_stop();
+            return -1;
+        }
+        pool.thread_count++;
+    }
+
+    return 0;
+}
+
+void offload_stop(void)
+{
+    pthread_mutex_lock(&pool.lock);
+    pool.stopping = 1;
+    pool.head = pool.tail = NULL;
+    pool.queued = 0;
+    pthread_cond_broadcast(&pool.ready);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (int i = 0; i < pool.thread_count; i++)
+        pthread_join(pool.threads[i], NULL);
+    free(pool.threads);
+    pool.threads = NULL;
+    pool.thread_count = 0;
+}
+
+int offload_queue_init(offload_queue *queue, void (*resume)(connection *conn))
+{
+    queue->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (queue->event_fd == -1)
+    {
+        perror("Failed to create offload eventfd");
+        return -1;
+    }
+    atomic_init(&queue->finished, NULL);
+    queue->outstanding = 0;
+    queue->resume = resume;
+    current_queue = queue;
+    return 0;
+}
+
+void offload_queue_cleanup(offload_queue *queue)
+{
+    if (current_queue == queue)
+        current_queue = NULL;
+
+    drop_jobs(queue, withdraw_jobs(queue));
+    for (;;)
+    {
+        drop_jobs(queue, atomic_exchange_explicit(&queue->finished, NULL, memory_order_acquire));
+        if (queue->outstanding == 0)
+            break;
+
+        // the rest are running; each wakes the queue when it finishes
+        struct pollfd pfd = {.fd = queue->event_fd, .events = POLLIN};
+        uint64_t count;
+        if (poll(&pfd, 1, -1) == -1 && errno != EINTR)
+        {
+            perror("Failed to wait for offloaded jobs");
+            return;
+        }
+        while (read(queue->event_fd, &count, sizeof(count)) == -1 && errno == EINTR)
+            ;
+    }
+
+    if (queue->event_fd != -1)
+        close(queue->event_fd);
+    queue->event_fd = -1;
+}
+
+void offload_queue_drain(offload_queue *queue)
+{
+    // clear the wakeup first: a job pushed after the exchange below wakes the loop again
+    uint64_t count;
+    io_stats_syscall();
+    while (read(queue->event_fd, &count, sizeof(count)) == -1 && errno == EINTR)
+        ;
+
+    offload_job *job = atomic_exchange_explicit(&queue->finished, NULL, memory_order_acquire);
+
+    // the stack holds the newest first
+    offload_job *oldest = NULL;
+    while (job)
+    {
+        offload_job *next = job->next;
+        job->next = oldest;
+        oldest = job;
+        job = next;
+        queue->outstanding--;
+    }
+
+    while (oldest)
+    {
+        job = oldest;
+        oldest = job->next;
+
+        connection *conn = job->conn;
+        // the connection may have closed, and its slot been reused, while the job ran
+        if (conn->handler.fd == -1 || conn->generation != job->generation)
+        {
+            job->done(job, NULL);
+            continue;
+        }
+
+        conn->parked = CONNECTION_RUNNING;
+        if (job->done(job, conn) == -1)
+        {
+            connection_close(conn);
+            continue;
+        }
+        // as after a producer: the response is complete, so a connection not kept alive ends here
+        if (!conn->keep_alive)
+            conn->closing = 1;
+        queue->resume(conn);
+    }
+}
+
+int offload_submit(connection *conn, offload_job *job)
+{
+    job->conn = conn;
+    job->generation = conn->generation;
+    job->owner = current_queue;
+    job->next = NULL;
+
+    if (pool.thread_count == 0 || !current_queue)
+    {
+        job->run(job);
+        return job->done(job, conn) == -1 ? -1 : 0;
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    if (pool.queued >= pool.queue_max)
+    {
+        pthread_mutex_unlock(&pool.lock);
+        return 1;
+    }
+    if (pool.tail)
+        pool.tail->next = job;
+    else
+        pool.head = job;
+    pool.tail = job;
+    pool.queued++;
+    pthread_cond_signal(&pool.ready);
+    pthread_mutex_unlock(&pool.lock);
+
+    current_queue->outstanding++;
+    conn->parked = CONNECTION_PARKED_OFFLOAD;
+    return 0;
+}
+
+static void *pool_thread(void *arg)
+{
+    for (;;)
+    {
+        pthread_mutex_lock(&pool.lock);
+        while (!pool.head && !pool.stopping)
+            pthread_cond_wait(&pool.ready, &pool.lock);
+        if (pool.stopping)
+        {
+            pthread_mutex_unlock(&pool.lock);
+            compression_thread_cleanup();
+            return NULL;
+        }
+
+        offload_job *job = pool.head;
+        pool.head = job->next;
+        if (!pool.head)
+            pool.tail = NULL;
+        pool.queued--;
+        pthread_mutex_unlock(&pool.lock);
+
+        job->run(job);
+        finish(job);
+    }
+}
+
+// hands a job back to the loop it came from
+static void finish(offload_job *job)
+{
+    offload_queue *queue = job->owner;
+    offload_job *head = atomic_load_explicit(&queue->finished, memory_order_relaxed);
+    do
+        job->next = head;
+    while (!atomic_compare_exchange_weak_explicit(&queue->finished, &head, job, memory_order_release,
+                                                  memory_order_relaxed));
+
+    // only the push onto an empty stack wakes the loop; later ones ride along
+    if (!head)
+    {
+        uint64_t one = 1;
+        while (write(queue->event_fd, &one, sizeof(one)) == -1 && errno == EINTR)
+            ;
+    }
+}
+
+// unlinks the jobs of one queue that no thread has taken yet
+static offload_job *withdraw_jobs(const offload_queue *queue)
+{
+    offload_job *withdrawn = NULL;
+
+    pthread_mutex_lock(&pool.lock);
+    offload_job **link = &pool.head;
+    pool.tail = NULL;
+    while (*link)
+    {
+        offload_job *job = *link;
+        if (job->owner != queue)
+        {
+            pool.tail = job;
+            link = &job->next;
+            continue;
+        }
+        *link = job->next;
+        job->next = withdrawn;
+        withdrawn = job;
+        pool.queued--;
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    return withdrawn;
+}
+
+// ends jobs whose connections are going away with the loop
+static void drop_jobs(offload_queue *queue, offload_job *job)
+{
+    while (job)
+    {
+        offload_job *next = job->next;
+        queue->outstanding--;
+        job->done(job, NULL);
+        job = next;
+    }
+}
@@ -0,0 +1,102 @@
+#ifndef OFFLOAD_H
+#define OFFLOAD_H
+
+#include <stdatomic.h>
+
+#include "connection.h"
+
+#define OFFLOAD_DEFAULT_THREADS 2
+#define OFFLOAD_DEFAULT_QUEUE 256 // jobs waiting for a thread before submissions are refused
+
+typedef struct offload_job offload_job;
+typedef struct offload_queue offload_queue;
+
+/*
+ * Work a handler takes off its event loop. run executes on a pool thread
+ * and must not touch the connection, its request or its arena, so whatever
+ * it needs is copied into the job (which the caller embeds in its own
+ * allocation) before submitting. done runs back on the connection's loop.
+ */
+struct offload_job
+{
+    void (*run)(offload_job *job);
+    // conn is NULL if the connection closed meanwhile; frees the job. -1 closes the connection.
+    int (*done)(offload_job *job, connection *conn);
+
+    // set by offload_submit
+    offload_job *next;
+    connection *conn;
+    unsigned int generation;
+    offload_queue *owner;
+};
+
+/*
+ * Finished jobs for one event loop. Pool threads push onto a lock-free
+ * stack and wake the loop through an eventfd only when the stack was empty;
+ * the loop takes the whole stack at once, so there is no ABA to guard
+ * against.
+ */
+struct offload_queue
+{
+    _Atomic(offload_job *) finished;
+    int event_fd; // readable while finished jobs wait; the loop watches it
+    int outstanding; // handed to the pool and not drained yet; touched only by the loop
+    void (*resume)(connection *conn); // backend hook: answers what queued up and reads again
+};
+
+/**
+ * Starts the pool threads. Call once before workers start; without a pool
+ * offload_submit runs jobs inline.
+ *
+ * @param threads Number of threads, 0 to run every job on its event loop.
+ * @param queue_max Jobs that may wait for a thread before offload_submit refuses more.
+ * @return 0 on success, -1 if a thread could not be started.
+ */
+int offload_start(int threads, int queue_max);
+
+/**
+ * Stops the pool threads once their current jobs are done. Jobs still
+ * waiting are dropped without their done callbacks.
+ */
+void offload_stop(void);
+
+/**
+ * Sets up the calling event loop's completion queue. Jobs submitted from
+ * this thread afterwards come back through it.
+ *
+ * @param queue Queue to initialize.
+ * @param resume Called after a job's done callback on a live connection.
+ * @return 0 on success, -1 if the eventfd could not be created.
+ */
+int offload_queue_init(offload_queue *queue, void (*resume)(connection *conn));
+
+/**
+ * Takes back the queue's jobs still waiting for a thread and waits for those
+ * running, calling every done callback without a connection, then closes the
+ * eventfd. No pool thread touches the queue afterwards, so its memory may go.
+ *
+ * @param queue Queue from offload_queue_init.
+ */
+void offload_queue_cleanup(offload_queue *queue);
+
+/**
+ * Runs the done callbacks of finished jobs, oldest first, unparking their
+ * connections and resuming them. Call when the queue's eventfd is readable.
+ *
+ * @param queue Queue from offload_queue_init.
+ */
+void offload_queue_drain(offload_queue *queue);
+
+/**
+ * Hands a job to the pool and parks the connection until its done callback
+ * has run. Without a pool or a queue on this thread, runs the job and its
+ * done callback before returning.
+ *
+ * @param conn Connection the job answers.
+ * @param job Job with run and done set.
+ * @return 0 if submitted or run, 1 if the pool's queue is full (the job is
+ *         untouched and still the caller's), -1 if a job run inline failed.
+ */
+int offload_submit(connection *conn, offload_job *job);
+
+#endif // OFFLOAD_H
@@ -0,0 +1,1533 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "buffer_pool.h"
+#include "http_handler.h"
+#include "io_stats.h"
+#include "metrics.h"
+#include "proxy.h"
+
+/*
+ * A proxied request is answered by a producer. The handler copies the
+ * request into an exchange, hands it to a pooled or new connection to the
+ * least loaded upstream and parks the client connection; the upstream's
+ * socket, registered with the worker's loop, moves the exchange along and
+ * unparks the client once there is something to forward. The producer then
+ * sends the response head and forwards the body as it arrives, so the
+ * client's backpressure reaches the upstream through TCP. A body of known
+ * length, or one ending with the upstream's connection, is spliced from
+ * the upstream socket into a pipe and from the pipe into the client socket
+ * as a queued file range, so it never enters user space.
+ */
+
+// where an upstream listens; resolved once, before workers start
+typedef struct
+{
+    char *name; // as given, for messages
+    char *host; // Host for requests that came without one
+    struct sockaddr_storage addr;
+    socklen_t addr_length;
+} upstream_address;
+
+typedef struct
+{
+    char *prefix;
+    size_t prefix_length;
+    int first; // index of its first upstream in upstreams
+    int count;
+} proxy_route;
+
+static upstream_address upstreams[PROXY_MAX_UPSTREAMS];
+static int upstream_count;
+static proxy_route routes[PROXY_MAX_ROUTES];
+static int route_count;
+
+typedef struct upstream_conn upstream_conn;
+typedef struct proxy_exchange proxy_exchange;
+
+// one upstream as seen by one worker
+typedef struct
+{
+    int outstanding; // exchanges assigned to it and not yet finished
+    int failures;    // in a row; a success resets them
+    time_t ejected_until;
+    upstream_conn *idle; // kept-alive connections, most recently used first
+    int idle_count;
+} upstream_state;
+
+/*
+ * A pipe response bodies are spliced through. Every range of it queued on
+ * a connection holds a reference, so it outlives the exchange that filled
+ * it until the client has read its last byte.
+ */
+typedef struct proxy_pipe
+{
+    int fds[2];
+    size_t capacity;
+    int refs;
+    struct proxy_pipe *next;
+} proxy_pipe;
+
+typedef struct
+{
+    event_loop *loop;
+    void (*resume)(connection *conn);
+    upstream_state *upstreams;
+    unsigned int next_pick; // rotates ties between equally loaded upstreams
+    buffer_pool buffers;    // response buffers, lent to exchanges while they read
+    proxy_pipe *free_pipes; // empty, sized pipes
+    int free_pipe_count;
+} proxy_worker;
+
+static __thread proxy_worker *current_worker;
+
+struct upstream_conn
+{
+    event_handler handler; // registered for reads and writes for its whole life
+    int upstream;
+    int reused;          // answered an exchange before the current one
+    time_t idle_since;
+    upstream_conn *next; // on its upstream's idle list
+    proxy_exchange *exchange; // NULL while idle
+};
+
+typedef enum
+{
+    EXCHANGE_CONNECTING,
+    EXCHANGE_SENDING,
+    EXCHANGE_HEAD,   // request sent, response head not complete yet
+    EXCHANGE_BODY,   // head received; the producer forwards it and the body
+    EXCHANGE_FAILED  // nothing usable came back; the producer answers with status
+} exchange_state;
+
+// how the upstream's response body ends
+typedef enum
+{
+    PROXY_BODY_NONE,
+    PROXY_BODY_LENGTH,
+    PROXY_BODY_CHUNKED,
+    PROXY_BODY_UNTIL_CLOSE
+} proxy_framing;
+
+struct proxy_exchange
+{
+    connection *conn;
+    const proxy_route *route;
+    upstream_conn *upstream; // counted in its upstream's outstanding while set
+    exchange_state state;
+    http_status_code status; // EXCHANGE_FAILED: what the client is told
+    int attempts;            // upstreams tried on fresh connections
+    int failed;              // upstream that failed last, avoided on a retry; -1 if none
+    time_t since;            // when the current state began
+    int idempotent;
+    int head_only; // HEAD: the response has no body whatever its head says
+    int http11;    // the client speaks HTTP/1.1
+
+    // request head and in-memory body, then the spooled body
+    char *out;
+    size_t out_length;
+    size_t out_sent;
+    size_t host_at;     // where the chosen upstream's Host line goes, for a request without one; 0 if it had one
+    size_t host_length; // of the Host line now at host_at
+    int body_fd; // -1 if the body is not spooled
+    size_t body_length;
+    off_t body_sent;
+
+    // response
+    char *buf; // lent by the worker's pool
+    size_t buf_capacity;
+    size_t buf_start; // first byte not yet forwarded
+    size_t buf_length;
+    size_t head_length; // of the final head at the start of buf, once complete
+    int response_status;
+    http_slice connection_list; // the head's Connection field, naming more hop-by-hop fields
+    proxy_framing framing;
+    int transfer_encoded; // the head has Transfer-Encoding, whose framing overrides any Content-Length
+    http_parser body;   // length or chunk framing of the body
+    int keep_alive;     // the upstream connection may serve another exchange
+    int decode;         // chunks are unwrapped for an HTTP/1.0 client
+    int head_sent;
+    proxy_pipe *pipe;   // NULL while the body is copied
+    int reusable;       // the body ended cleanly on a kept-alive connection
+};
+
+static int resolve_upstream(const char *text, size_t length, upstream_address *address);
+static const proxy_route *find_proxy_route(const http_request *request);
+static int handle_proxy(http_request *request, connection *conn, const route_match *match);
+static int build_request(proxy_exchange *ex, const http_request *request, connection *conn);
+static void set_upstream_host(proxy_exchange *ex, int upstream);
+static int hop_by_hop(http_slice name, const http_slice *connection_list);
+static void start_exchange(proxy_exchange *ex);
+static int pick_upstream(const proxy_route *route, int avoid, time_t now);
+static upstream_conn *take_idle(int upstream, time_t now);
+static upstream_conn *open_upstream(int upstream, int *connected);
+static void close_upstream(upstream_conn *uc);
+static void drop_idle(upstream_conn *uc);
+static void keep_idle(upstream_conn *uc, time_t now);
+static void close_idle(int upstream);
+static void record_failure(int upstream, time_t now);
+static void upstream_failed(proxy_exchange *ex, int connect_failed);
+static void handle_upstream(event_loop *loop, event_handler *handler, unsigned int events);
+static int send_request(proxy_exchange *ex);
+static void read_head(proxy_exchange *ex);
+static size_t head_end(const char *data, size_t length, size_t from);
+static int parse_response_head(proxy_exchange *ex);
+static void wake(proxy_exchange *ex);
+static int produce_proxy(connection *conn, void *arg);
+static int send_head(connection *conn, proxy_exchange *ex);
+static int forward_body(connection *conn, proxy_exchange *ex);
+static int splice_body(connection *conn, proxy_exchange *ex);
+static int send_failure(connection *conn, proxy_exchange *ex);
+static void release_exchange(void *arg);
+static proxy_pipe *take_pipe(void);
+static void release_pipe(void *arg);
+
+int proxy_configure(const char *spec)
+{
+    const char *equals = strchr(spec, '=');
+    if (!equals || spec[0] != '/' || equals[1] == '\0')
+    {
+        fprintf(stderr, "Proxy must be given as PREFIX=ADDRESS[,ADDRESS...] with PREFIX starting with '/'.\n");
+        return -1;
+    }
+    if (route_count == PROXY_MAX_ROUTES)
+    {
+        fprintf(stderr, "At most %d prefixes can be proxied.\n", PROXY_MAX_ROUTES);
+        return -1;
+    }
+
+    size_t prefix_length = equals - spec;
+    if (prefix_length >= HTTP_PATH_MAX_LEN)
+    {
+        fprintf(stderr, "Proxy prefix is longer than %d bytes.\n", HTTP_PATH_MAX_LEN - 1);
+        return -1;
+    }
+
+    proxy_route *route = &routes[route_count];
+    route->first = upstream_count;
+    route->count = 0;
+
+    const char *address = equals + 1;
+    for (;;)
+    {
+        const char *comma = strchr(address, ',');
+        size_t length = comma ? (size_t)(comma - address) : strlen(address);
+        if (upstream_count == PROXY_MAX_UPSTREAMS)
+        {
+            fprintf(stderr, "At most %d upstreams can be configured.\n", PROXY_MAX_UPSTREAMS);
+            return -1;
+        }
+        if (resolve_upstream(address, length, &upstreams[upstream_count]) == -1)
+            return -1;
+        upstream_count++;
+        route->count++;
+
+        if (!comma)
+            break;
+        address = comma + 1;
+    }
+
+    route->prefix = strndup(spec, prefix_length);
+    if (!route->prefix)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for proxy prefix\n");
+        return -1;
+    }
+    route->prefix_length = prefix_length;
+    route_count++;
+    return 0;
+}
+
+static int resolve_upstream(const char *text, size_t length, upstream_address *address)
+{
+    memset(address, 0, sizeof(*address));
+    address->name = strndup(text, length);
+    if (!address->name)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for upstream address\n");
+        return -1;
+    }
+
+    if (strncmp(address->name, "unix:", 5) == 0)
+    {
+        struct sockaddr_un *un = (struct sockaddr_un *)&address->addr;
+        const char *path = address->name + 5;
+        if (path[0] == '\0' || strlen(path) >= sizeof(un->sun_path))
+        {
+            fprintf(stderr, "Upstream socket path %s is empty or too long.\n", path);
+            return -1;
+        }
+        un->sun_family = AF_UNIX;
+        strcpy(un->sun_path, path);
+        address->addr_length = sizeof(struct sockaddr_un);
+        address->host = strdup("localhost");
+        return address->host ? 0 : -1;
+    }
+
+    // "host:port" or "[v6-address]:port"
+    char *colon = strrchr(address->name, ':');
+    if (!colon || colon == address->name || colon[1] == '\0')
+    {
+        fprintf(stderr, "Upstream %s must be host:port or unix:/path.\n", address->name);
+        return -1;
+    }
+    char host[256];
+    const char *host_start = address->name;
+    size_t host_length = colon - address->name;
+    if (host_start[0] == '[' && host_length >= 2 && colon[-1] == ']')
+    {
+        host_start++;
+        host_length -= 2;
+    }
+    if (host_length == 0 || host_length >= sizeof(host))
+    {
+        fprintf(stderr, "Upstream %s has an invalid host.\n", address->name);
+        return -1;
+    }
+    memcpy(host, host_start, host_length);
+    host[host_length] = '\0';
+
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    struct addrinfo *result;
+    int err = getaddrinfo(host, colon + 1, &hints, &result);
+    if (err != 0)
+    {
+        fprintf(stderr, "Upstream %s does not resolve: %s\n", address->name, gai_strerror(err));
+        return -1;
+    }
+    memcpy(&address->addr, result->ai_addr, result->ai_addrlen);
+    address->addr_length = result->ai_addrlen;
+    freeaddrinfo(result);
+
+    address->host = strdup(address->name);
+    return address->host ? 0 : -1;
+}
+
+int proxy_routes_init(void)
+{
+    for (int i = 0; i < route_count; i++)
+    {
+        char pattern[HTTP_PATH_MAX_LEN + 1];
+        snprintf(pattern, sizeof(pattern), "%s*", routes[i].prefix);
+        if (http_handler_route(ROUTER_ANY_METHOD, pattern, handle_proxy) == -1)
+        {
+            fprintf(stderr, "Proxy prefix %s clashes with another route.\n", routes[i].prefix);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+int proxy_enabled(void)
+{
+    return route_count > 0;
+}
+
+void proxy_cleanup(void)
+{
+    for (int i = 0; i < route_count; i++)
+        free(routes[i].prefix);
+    for (int i = 0; i < upstream_count; i++)
+    {
+        free(upstreams[i].name);
+        free(upstreams[i].host);
+    }
+    route_count = 0;
+    upstream_count = 0;
+}
+
+int proxy_worker_init(event_loop *loop, void (*resume)(connection *conn))
+{
+    if (!proxy_enabled())
+        return 0;
+
+    proxy_worker *w = calloc(1, sizeof(proxy_worker));
+    if (!w || !(w->upstreams = calloc(upstream_count, sizeof(upstream_state))))
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for upstream pools\n");
+        free(w);
+        return -1;
+    }
+    if (buffer_pool_init(&w->buffers, PROXY_BUFFER_SIZE, PROXY_BUFFER_SIZE, PROXY_BUFFER_RETAIN) == -1)
+    {
+        free(w->upstreams);
+        free(w);
+        return -1;
+    }
+    w->loop = loop;
+    w->resume = resume;
+    current_worker = w;
+    return 0;
+}
+
+void proxy_worker_cleanup(void)
+{
+    proxy_worker *w = current_worker;
+    if (!w)
+        return;
+
+    for (int i = 0; i < upstream_count; i++)
+        close_idle(i);
+    while (w->free_pipes)
+    {
+        proxy_pipe *next = w->free_pipes->next;
+        close(w->free_pipes->fds[0]);
+        close(w->free_pipes->fds[1]);
+        free(w->free_pipes);
+        w->free_pipes = next;
+    }
+    buffer_pool_cleanup(&w->buffers);
+    free(w->upstreams);
+    free(w);
+    current_worker = NULL;
+}
+
+// the longest configured prefix of the path, which is the route the router picked
+static const proxy_route *find_proxy_route(const http_request *request)
+{
+    http_slice uri = request->request_line.uri;
+    const proxy_route *best = NULL;
+    for (int i = 0; i < route_count; i++)
+    {
+        if (routes[i].prefix_length <= uri.length && memcmp(uri.data, routes[i].prefix, routes[i].prefix_length) == 0 &&
+            (!best || routes[i].prefix_length > best->prefix_length))
+            best = &routes[i];
+    }
+    return best;
+}
+
+static int handle_proxy(http_request *request, connection *conn, const route_match *match)
+{
+    http_method method = request->request_line.method;
+
+    proxy_exchange *ex = calloc(1, sizeof(proxy_exchange));
+    if (!ex)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for proxied request\n");
+        return -1;
+    }
+    ex->conn = conn;
+    ex->route = find_proxy_route(request);
+    ex->failed = -1;
+    ex->since = conn->table->now;
+    ex->body_fd = -1;
+    ex->http11 = http_slice_equals(request->request_line.version, "HTTP/1.1");
+    ex->head_only = method == HTTP_METHOD_HEAD;
+    ex->idempotent = method != HTTP_METHOD_POST && method != HTTP_METHOD_PATCH;
+
+    if (!ex->route || !current_worker || method == HTTP_METHOD_UNKNOWN || method == HTTP_METHOD_CONNECT)
+    {
+        ex->state = EXCHANGE_FAILED;
+        ex->status = ex->route && current_worker ? HTTP_NOT_IMPLEMENTED : HTTP_BAD_GATEWAY;
+    }
+    else if (build_request(ex, request, conn) == -1)
+    {
+        free(ex);
+        return -1;
+    }
+
+    // the producer answers once the upstream has; a failure below is answered by it at once
+    connection_producer producer = {.produce = produce_proxy, .release = release_exchange, .arg = ex};
+    if (connection_set_producer(conn, &producer) == -1)
+        return -1;
+
+    if (ex->state != EXCHANGE_FAILED)
+        start_exchange(ex);
+    if (ex->state != EXCHANGE_FAILED)
+        conn->parked = CONNECTION_PARKED_UPSTREAM;
+    return 0;
+}
+
+/*
+ * Copies the request into the exchange, since the request is gone by the
+ * time the upstream is written to: the request line, as HTTP/1.1 so the
+ * upstream connection can be kept alive, the end-to-end header fields,
+ * the client's Host among them, Content-Length for a body, and an
+ * in-memory body. A spooled body's file is taken over and sent from with
+ * sendfile. HTTP/1.1 needs a Host the client may not have sent, so room is
+ * left for the longest on the route and set_upstream_host fills it in once
+ * an upstream is chosen.
+ */
+static int build_request(proxy_exchange *ex, const http_request *request, connection *conn)
+{
+    const http_request_line *line = &request->request_line;
+    const char *method = http_methods[line->method].name;
+    const http_slice *connection_list = http_request_find_header(request, HTTP_HEADER_CONNECTION);
+    int spooled = request->body_fd != -1;
+    size_t memory_body = spooled ? 0 : request->body_length;
+    int has_body = request->body_length > 0 || conn->parser.framing != HTTP_BODY_NONE;
+    int has_host = http_request_find_header(request, HTTP_HEADER_HOST) != NULL;
+
+    size_t host_room = 0;
+    for (int i = 0; !has_host && i < ex->route->count; i++)
+    {
+        size_t room = sizeof("Host: \r\n") + strlen(upstreams[ex->route->first + i].host);
+        if (room > host_room)
+            host_room = room;
+    }
+
+    size_t size = strlen(method) + 1 + line->uri.length + sizeof(" HTTP/1.1\r\n") + host_room +
+                  sizeof("Content-Length: \r\n") + HTTP_DECIMAL_MAX_LEN + 2;
+    for (int i = 0; i < request->header_count; i++)
+        size += request->headers[i].name.length + request->headers[i].value.length + 4;
+
+    char *out = malloc(size + memory_body);
+    if (!out)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for proxied request\n");
+        return -1;
+    }
+
+    size_t length = 0;
+#define APPEND(data, n)                                                                                               \
+    do                                                                                                                \
+    {                                                                                                                 \
+        memcpy(out + length, data, n);                                                                                \
+        length += n;                                                                                                  \
+    } while (0)
+
+    APPEND(method, strlen(method));
+    APPEND(" ", 1);
+    APPEND(line->uri.data, line->uri.length);
+    APPEND(" HTTP/1.1\r\n", 11);
+    for (int i = 0; i < request->header_count; i++)
+    {
+        const http_request_header *header = &request->headers[i];
+        if (header->id == HTTP_HEADER_CONTENT_LENGTH || header->id == HTTP_HEADER_EXPECT ||
+            hop_by_hop(header->name, connection_list))
+            continue;
+        APPEND(header->name.data, header->name.length);
+        APPEND(": ", 2);
+        APPEND(header->value.data, header->value.length);
+        APPEND("\r\n", 2);
+    }
+    ex->host_at = has_host ? 0 : length;
+    ex->host_length = 0;
+    if (has_body)
+    {
+        char content_length[HTTP_DECIMAL_MAX_LEN];
+        size_t digits = http_format_decimal(content_length, request->body_length);
+        APPEND("Content-Length: ", 16);
+        APPEND(content_length, digits);
+        APPEND("\r\n", 2);
+    }
+    APPEND("\r\n", 2);
+    if (memory_body > 0)
+        APPEND(request->body, memory_body);
+#undef APPEND
+
+    ex->out = out;
+    ex->out_length = length;
+    if (spooled)
+    {
+        ex->body_fd = request_body_take_fd(&conn->body);
+        ex->body_length = request->body_length;
+    }
+    return 0;
+}
+
+/*
+ * RFC 9110 7.6.1: fields that describe one connection, not the message,
+ * and are not forwarded: the fixed ones and those the Connection field names.
+ */
+static int hop_by_hop(http_slice name, const http_slice *connection_list)
+{
+    switch (http_header_lookup(name.data, name.length))
+    {
+    case HTTP_HEADER_CONNECTION:
+    case HTTP_HEADER_KEEP_ALIVE:
+    case HTTP_HEADER_TE:
+    case HTTP_HEADER_TRANSFER_ENCODING:
+    case HTTP_HEADER_UPGRADE:
+        return 1;
+    default:
+        break;
+    }
+    if (http_slice_equals_ignore_case(name, "Proxy-Connection"))
+        return 1;
+    if (!connection_list || name.length >= HTTP_HEADER_NAME_MAX_LEN)
+        return 0;
+
+    char token[HTTP_HEADER_NAME_MAX_LEN];
+    memcpy(token, name.data, name.length);
+    token[name.length] = '\0';
+    return http_slice_has_token(*connection_list, token);
+}
+
+/*
+ * Assigns the exchange to an upstream and starts sending the request, on a
+ * pooled connection when there is one. When no connection can be opened
+ * the next upstream is tried, and when none is left the exchange fails.
+ */
+static void start_exchange(proxy_exchange *ex)
+{
+    proxy_worker *w = current_worker;
+    time_t now = ex->conn->table->now;
+
+    while (ex->attempts < PROXY_MAX_ATTEMPTS)
+    {
+        int u = pick_upstream(ex->route, ex->failed, now);
+        set_upstream_host(ex, u);
+        upstream_conn *uc = take_idle(u, now);
+        int connected = 1;
+        if (!uc)
+        {
+            ex->attempts++;
+            uc = open_upstream(u, &connected);
+            if (!uc)
+            {
+                record_failure(u, now);
+                ex->failed = u;
+                continue;
+            }
+        }
+
+        w->upstreams[u].outstanding++;
+        uc->exchange = ex;
+        ex->upstream = uc;
+        ex->since = now;
+        ex->out_sent = 0;
+        ex->body_sent = 0;
+        ex->buf_length = 0;
+        ex->state = connected ? EXCHANGE_SENDING : EXCHANGE_CONNECTING;
+        // once written, the response raises a fresh edge on the socket
+        if (connected && send_request(ex) == 1)
+        {
+            ex->state = EXCHANGE_HEAD;
+            ex->since = now;
+        }
+        return;
+    }
+
+    ex->state = EXCHANGE_FAILED;
+    ex->status = HTTP_BAD_GATEWAY;
+}
+
+// writes the upstream's Host line into the room build_request left, replacing that of an earlier attempt
+static void set_upstream_host(proxy_exchange *ex, int upstream)
+{
+    if (ex->host_at == 0)
+        return;
+
+    const char *host = upstreams[upstream].host;
+    size_t host_length = strlen(host) + sizeof("Host: \r\n") - 1;
+    char *at = ex->out + ex->host_at;
+    memmove(at + host_length, at + ex->host_length, ex->out_length - ex->host_at - ex->host_length);
+    memcpy(at, "Host: ", 6);
+    memcpy(at + 6, host, host_length - 8);
+    memcpy(at + host_length - 2, "\r\n", 2);
+    ex->out_length = ex->out_length - ex->host_length + host_length;
+    ex->host_length = host_length;
+}
+
+/*
+ * Least outstanding requests among the upstreams not ejected, ties broken
+ * by a rotating start so equally loaded upstreams share the work. When
+ * every upstream is ejected, the one due back first is tried rather than
+ * failing the request outright.
+ */
+static int pick_upstream(const proxy_route *route, int avoid, time_t now)
+{
+    proxy_worker *w = current_worker;
+    int best = -1;
+    int soonest = route->first;
+
+    for (int i = 0; i < route->count; i++)
+    {
+        int u = route->first + (int)((i + w->next_pick) % route->count);
+        upstream_state *state = &w->upstreams[u];
+        if (state->ejected_until < w->upstreams[soonest].ejected_until)
+            soonest = u;
+        if (state->ejected_until > now || (u == avoid && route->count > 1))
+            continue;
+        if (best == -1 || state->outstanding < w->upstreams[best].outstanding)
+            best = u;
+    }
+    w->next_pick++;
+
+    return best != -1 ? best : soonest;
+}
+
+// the most recently used pooled connection; if it has sat too long, so have the others
+static upstream_conn *take_idle(int upstream, time_t now)
+{
+    upstream_state *state = &current_worker->upstreams[upstream];
+    upstream_conn *uc = state->idle;
+    if (!uc)
+        return NULL;
+
+    if (uc->idle_since + PROXY_IDLE_TIMEOUT < now)
+    {
+        close_idle(upstream);
+        return NULL;
+    }
+    state->idle = uc->next;
+    state->idle_count--;
+    uc->next = NULL;
+    return uc;
+}
+
+static upstream_conn *open_upstream(int upstream, int *connected)
+{
+    const upstream_address *address = &upstreams[upstream];
+
+    io_stats_syscall();
+    int fd = socket(address->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+        fprintf(stderr, "Upstream %s: socket: %s\n", address->name, strerror(errno));
+        return NULL;
+    }
+    if (address->addr.ss_family != AF_UNIX)
+    {
+        // heads and small bodies go out in one write each; nothing is gained by holding them
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    io_stats_syscall();
+    *connected = connect(fd, (const struct sockaddr *)&address->addr, address->addr_length) == 0;
+    if (!*connected && errno != EINPROGRESS)
+    {
+        fprintf(stderr, "Upstream %s: connect: %s\n", address->name, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    upstream_conn *uc = calloc(1, sizeof(upstream_conn));
+    if (!uc)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for upstream connection\n");
+        close(fd);
+        return NULL;
+    }
+    io_stats_allocations(1);
+    uc->upstream = upstream;
+    uc->handler = (event_handler){
+        .fd = fd,
+        .events = EVENT_READ | EVENT_WRITE,
+        .callback = handle_upstream,
+        .data = uc,
+    };
+    if (event_loop_add(current_worker->loop, &uc->handler) == -1)
+    {
+        close(fd);
+        free(uc);
+        return NULL;
+    }
+
+    return uc;
+}
+
+static void close_upstream(upstream_conn *uc)
+{
+    event_loop_remove(current_worker->loop, &uc->handler);
+    close(uc->handler.fd);
+    free(uc);
+}
+
+static void drop_idle(upstream_conn *uc)
+{
+    upstream_state *state = &current_worker->upstreams[uc->upstream];
+    for (upstream_conn **link = &state->idle; *link; link = &(*link)->next)
+    {
+        if (*link == uc)
+        {
+            *link = uc->next;
+            state->idle_count--;
+            break;
+        }
+    }
+    close_upstream(uc);
+}
+
+static void keep_idle(upstream_conn *uc, time_t now)
+{
+    upstream_state *state = &current_worker->upstreams[uc->upstream];
+    if (state->idle_count >= PROXY_IDLE_MAX)
+    {
+        close_upstream(uc);
+        return;
+    }
+
+    uc->reused = 1;
+    uc->idle_since = now;
+    uc->next = state->idle;
+    state->idle = uc;
+    state->idle_count++;
+}
+
+static void close_idle(int upstream)
+{
+    upstream_state *state = &current_worker->upstreams[upstream];
+    while (state->idle)
+    {
+        upstream_conn *next = state->idle->next;
+        close_upstream(state->idle);
+        state->idle = next;
+    }
+    state->idle_count = 0;
+}
+
+/*
+ * Passive health checking: an upstream that fails PROXY_EJECT_FAILURES
+ * times in a row is left out of rotation for PROXY_EJECT_SECONDS. It is
+ * then one failure away from the next ejection until it answers again.
+ */
+static void record_failure(int upstream, time_t now)
+{
+    upstream_state *state = &current_worker->upstreams[upstream];
+    if (++state->failures < PROXY_EJECT_FAILURES)
+        return;
+
+    if (state->ejected_until <= now)
+        fprintf(stderr, "Upstream %s ejected for %d seconds.\n", upstreams[upstream].name, PROXY_EJECT_SECONDS);
+    state->ejected_until = now + PROXY_EJECT_SECONDS;
+    state->failures = PROXY_EJECT_FAILURES - 1;
+    close_idle(upstream);
+}
+
+/*
+ * The upstream connection broke before a response head came back. A
+ * pooled connection may simply have been closed by the upstream while it
+ * sat idle, which says nothing of the upstream's health but suggests the
+ * rest of the pool is stale too. The request is tried again if it cannot
+ * have reached the upstream or is safe to repeat.
+ */
+static void upstream_failed(proxy_exchange *ex, int connect_failed)
+{
+    proxy_worker *w = current_worker;
+    upstream_conn *uc = ex->upstream;
+    int u = uc->upstream;
+    time_t now = ex->conn->table->now;
+
+    if (uc->reused)
+        close_idle(u);
+    else
+        record_failure(u, now);
+
+    w->upstreams[u].outstanding--;
+    uc->exchange = NULL;
+    ex->upstream = NULL;
+    close_upstream(uc);
+    ex->failed = u;
+
+    if (connect_failed || ex->idempotent)
+        start_exchange(ex);
+    else
+        ex->state = EXCHANGE_FAILED;
+    if (ex->state == EXCHANGE_FAILED)
+        ex->status = HTTP_BAD_GATEWAY;
+    if (ex->state == EXCHANGE_FAILED)
+        wake(ex);
+}
+
+static void handle_upstream(event_loop *loop, event_handler *handler, unsigned int events)
+{
+    upstream_conn *uc = handler->data;
+    proxy_exchange *ex = uc->exchange;
+
+    if (!ex)
+    {
+        // an idle connection becomes readable only when the upstream closes it or misbehaves
+        if (events & (EVENT_READ | EVENT_ERROR))
+            drop_idle(uc);
+        return;
+    }
+
+    switch (ex->state)
+    {
+    case EXCHANGE_CONNECTING:
+    {
+        if (!(events & (EVENT_WRITE | EVENT_ERROR)))
+            return;
+        int err = 0;
+        socklen_t length = sizeof(err);
+        io_stats_syscall();
+        if (getsockopt(handler->fd, SOL_SOCKET, SO_ERROR, &err, &length) == -1)
+            err = errno;
+        if (err != 0)
+        {
+            fprintf(stderr, "Upstream %s: connect: %s\n", upstreams[uc->upstream].name, strerror(err));
+            upstream_failed(ex, 1);
+            return;
+        }
+        ex->state = EXCHANGE_SENDING;
+    }
+        // fall through
+    case EXCHANGE_SENDING:
+        if (send_request(ex) != 1)
+            return;
+        ex->state = EXCHANGE_HEAD;
+        ex->since = ex->conn->table->now;
+        // fall through
+    case EXCHANGE_HEAD:
+        read_head(ex);
+        return;
+    case EXCHANGE_BODY:
+        if (events & (EVENT_READ | EVENT_ERROR))
+            wake(ex);
+        return;
+    default:
+        return;
+    }
+}
+
+/*
+ * Writes what is left of the request. Returns 1 once it is all sent, 0 if
+ * the socket is full (its next writable edge resumes it), -1 if the
+ * connection failed, in which case the exchange has moved on.
+ */
+static int send_request(proxy_exchange *ex)
+{
+    int fd = ex->upstream->handler.fd;
+
+    while (ex->out_sent < ex->out_length)
+    {
+        io_stats_syscall();
+        ssize_t n = send(fd, ex->out + ex->out_sent, ex->out_length - ex->out_sent, MSG_NOSIGNAL);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            fprintf(stderr, "Upstream %s: send: %s\n", upstreams[ex->upstream->upstream].name, strerror(errno));
+            upstream_failed(ex, 0);
+            return -1;
+        }
+        ex->out_sent += n;
+    }
+
+    while (ex->body_fd != -1 && (size_t)ex->body_sent < ex->body_length)
+    {
+        io_stats_syscall();
+        ssize_t n = sendfile(fd, ex->body_fd, &ex->body_sent, ex->body_length - ex->body_sent);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+        }
+        if (n <= 0)
+        {
+            fprintf(stderr, "Upstream %s: sending the request body failed.\n", upstreams[ex->upstream->upstream].name);
+            upstream_failed(ex, 0);
+            return -1;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Reads until the response head is complete, skipping interim 1xx heads,
+ * then wakes the client connection to forward it. Body bytes read along
+ * with the head stay in the buffer behind it.
+ */
+static void read_head(proxy_exchange *ex)
+{
+    proxy_worker *w = current_worker;
+    int fd = ex->upstream->handler.fd;
+
+    if (!ex->buf)
+    {
+        ex->buf = buffer_pool_get(&w->buffers, PROXY_BUFFER_SIZE, &ex->buf_capacity);
+        if (!ex->buf)
+        {
+            ex->state = EXCHANGE_FAILED;
+            ex->status = HTTP_BAD_GATEWAY;
+            wake(ex);
+            return;
+        }
+    }
+
+    for (;;)
+    {
+        if (ex->buf_length == ex->buf_capacity)
+        {
+            fprintf(stderr, "Upstream %s: response head exceeds %d bytes.\n", upstreams[ex->upstream->upstream].name,
+                    PROXY_BUFFER_SIZE);
+            ex->state = EXCHANGE_FAILED;
+            ex->status = HTTP_BAD_GATEWAY;
+            wake(ex);
+            return;
+        }
+
+        io_stats_syscall();
+        ssize_t n = recv(fd, ex->buf + ex->buf_length, ex->buf_capacity - ex->buf_length, 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (n <= 0)
+        {
+            fprintf(stderr, "Upstream %s closed the connection before responding.\n",
+                    upstreams[ex->upstream->upstream].name);
+            // a byte of response means the request was acted on; it is not tried again
+            if (ex->buf_length > 0)
+                ex->idempotent = 0;
+            upstream_failed(ex, 0);
+            return;
+        }
+
+        size_t scanned = ex->buf_length;
+        ex->buf_length += n;
+
+        for (;;)
+        {
+            ex->head_length = head_end(ex->buf, ex->buf_length, scanned >= 3 ? scanned - 3 : 0);
+            if (ex->head_length == 0)
+                break;
+
+            int status = parse_response_head(ex);
+            if (status == -1)
+            {
+                fprintf(stderr, "Upstream %s sent a malformed response head.\n",
+                        upstreams[ex->upstream->upstream].name);
+                ex->state = EXCHANGE_FAILED;
+                ex->status = HTTP_BAD_GATEWAY;
+                wake(ex);
+                return;
+            }
+            if (status == 1)
+            {
+                current_worker->upstreams[ex->upstream->upstream].failures = 0;
+                ex->state = EXCHANGE_BODY;
+                ex->buf_start = ex->head_length;
+                wake(ex);
+                return;
+            }
+
+            // an interim response: the final one follows it
+            memmove(ex->buf, ex->buf + ex->head_length, ex->buf_length - ex->head_length);
+            ex->buf_length -= ex->head_length;
+            scanned = 0;
+        }
+    }
+}
+
+// length of a head ending in an empty line, scanning from an offset; 0 if it is not complete
+static size_t head_end(const char *data, size_t length, size_t from)
+{
+    const char *end = data + length;
+    for (const char *p = data + from; p < end && (p = memchr(p, '\n', end - p)); p++)
+    {
+        if (p + 1 < end && p[1] == '\n')
+            return p + 2 - data;
+        if (p + 2 < end && p[1] == '\r' && p[2] == '\n')
+            return p + 3 - data;
+    }
+    return 0;
+}
+
+/*
+ * Reads a header line at *cursor and moves past it. Returns 1 for a field,
+ * 0 at the empty line that ends the head, -1 for a malformed line.
+ */
+static int next_field(const char **cursor, const char *end, http_slice *line, http_slice *name, http_slice *value)
+{
+    const char *start = *cursor;
+    const char *newline = memchr(start, '\n', end - start);
+    if (!newline)
+        return -1;
+    *cursor = newline + 1;
+
+    const char *stop = newline > start && newline[-1] == '\r' ? newline - 1 : newline;
+    if (stop == start)
+        return 0;
+
+    // obsolete line folding is refused, as RFC 9112 5.2 allows
+    const char *colon = memchr(start, ':', stop - start);
+    if (!colon || colon == start || *start == ' ' || *start == '\t')
+        return -1;
+
+    const char *v = colon + 1;
+    while (v < stop && (*v == ' ' || *v == '\t'))
+        v++;
+    const char *v_end = stop;
+    while (v_end > v && (v_end[-1] == ' ' || v_end[-1] == '\t'))
+        v_end--;
+
+    *line = (http_slice){start, (size_t)(stop - start)};
+    *name = (http_slice){start, (size_t)(colon - start)};
+    *value = (http_slice){v, (size_t)(v_end - v)};
+    return 1;
+}
+
+/*
+ * Reads the status and the fields that decide how the body is framed and
+ * whether the connection can be reused (RFC 9112 6.3). Returns 1 for a
+ * final head, 0 for an interim one, -1 for one that cannot be forwarded.
+ */
+static int parse_response_head(proxy_exchange *ex)
+{
+    const char *cursor = ex->buf;
+    const char *end = ex->buf + ex->head_length;
+    const char *newline = memchr(cursor, '\n', end - cursor);
+    size_t line_length = newline - cursor;
+
+    // "HTTP/1.1 200", then a reason phrase
+    if (line_length < 12 || memcmp(cursor, "HTTP/1.", 7) != 0 || (cursor[7] != '0' && cursor[7] != '1') ||
+        cursor[8] != ' ' || cursor[9] < '1' || cursor[9] > '5' || cursor[10] < '0' || cursor[10] > '9' ||
+        cursor[11] < '0' || cursor[11] > '9' || (line_length > 12 && cursor[12] != ' ' && cursor[12] != '\r'))
+        return -1;
+    int http11 = cursor[7] == '1';
+    int status = (cursor[9] - '0') * 100 + (cursor[10] - '0') * 10 + (cursor[11] - '0');
+    cursor = newline + 1;
+
+    // switching protocols would hand the client's connection to the upstream, which is not supported
+    if (status == 101)
+        return -1;
+    if (status < 200)
+        return 0;
+
+    int transfer_encoding = 0;
+    int chunked = 0;
+    int close = 0;
+    int keep_alive = 0;
+    long long length = -1;
+    ex->connection_list = (http_slice){NULL, 0};
+
+    http_slice line, name, value;
+    int found;
+    while ((found = next_field(&cursor, end, &line, &name, &value)) == 1)
+    {
+        switch (http_header_lookup(name.data, name.length))
+        {
+        case HTTP_HEADER_CONTENT_LENGTH:
+        {
+            long long n = 0;
+            if (value.length == 0 || value.length > 18)
+                return -1;
+            for (size_t i = 0; i < value.length; i++)
+            {
+                if (value.data[i] < '0' || value.data[i] > '9')
+                    return -1;
+                n = n * 10 + (value.data[i] - '0');
+            }
+            if (length != -1 && length != n)
+                return -1;
+            length = n;
+            break;
+        }
+        case HTTP_HEADER_TRANSFER_ENCODING:
+            transfer_encoding = 1;
+            chunked = http_slice_has_token(value, "chunked");
+            break;
+        case HTTP_HEADER_CONNECTION:
+            close |= http_slice_has_token(value, "close");
+            keep_alive |= http_slice_has_token(value, "keep-alive");
+            ex->connection_list = value;
+            break;
+        default:
+            break;
+        }
+    }
+    if (found == -1)
+        return -1;
+
+    ex->response_status = status;
+    ex->transfer_encoded = transfer_encoding;
+    if (ex->head_only || status == 204 || status == 304)
+        ex->framing = PROXY_BODY_NONE;
+    else if (transfer_encoding)
+        ex->framing = chunked ? PROXY_BODY_CHUNKED : PROXY_BODY_UNTIL_CLOSE;
+    else if (length >= 0)
+        ex->framing = length > 0 ? PROXY_BODY_LENGTH : PROXY_BODY_NONE;
+    else
+        ex->framing = PROXY_BODY_UNTIL_CLOSE;
+
+    if (ex->framing == PROXY_BODY_LENGTH)
+        http_parser_init_body(&ex->body, HTTP_BODY_LENGTH, length);
+    else if (ex->framing == PROXY_BODY_CHUNKED)
+        http_parser_init_body(&ex->body, HTTP_BODY_CHUNKED, 0);
+
+    ex->keep_alive = !close && (http11 || keep_alive) && ex->framing != PROXY_BODY_UNTIL_CLOSE;
+    return 1;
+}
+
+// lets a client connection parked on this exchange go on
+static void wake(proxy_exchange *ex)
+{
+    connection *conn = ex->conn;
+    if (conn->parked != CONNECTION_PARKED_UPSTREAM)
+        return;
+
+    conn->parked = CONNECTION_RUNNING;
+    current_worker->resume(conn);
+}
+
+static int produce_proxy(connection *conn, void *arg)
+{
+    proxy_exchange *ex = arg;
+
+    switch (ex->state)
+    {
+    case EXCHANGE_FAILED:
+        return send_failure(conn, ex) == -1 ? -1 : 1;
+    case EXCHANGE_BODY:
+        if (!ex->head_sent)
+        {
+            if (send_head(conn, ex) == -1)
+                return -1;
+            ex->head_sent = 1;
+            if (ex->framing == PROXY_BODY_NONE)
+            {
+                ex->reusable = ex->keep_alive && ex->buf_start == ex->buf_length;
+                return 1;
+            }
+        }
+        return forward_body(conn, ex);
+    default:
+        // the upstream's socket wakes the connection once there is something to send
+        conn->parked = CONNECTION_PARKED_UPSTREAM;
+        return 0;
+    }
+}
+
+/*
+ * Sends the upstream's head as the client's: the status line under our
+ * HTTP version, the end-to-end fields as they came, and a Connection field
+ * for the client's connection. Chunks are kept for an HTTP/1.1 client and
+ * unwrapped for an HTTP/1.0 one, whose body then ends with the connection,
+ * as a body the upstream ends by closing does.
+ */
+static int send_head(connection *conn, proxy_exchange *ex)
+{
+    ex->decode = ex->framing == PROXY_BODY_CHUNKED && !ex->http11;
+    if (ex->decode || ex->framing == PROXY_BODY_UNTIL_CLOSE)
+        conn->keep_alive = 0;
+
+    // line breaks may grow from "\n" to "\r\n"; a Connection field is added
+    char *head = arena_alloc(&conn->arena, 2 * ex->head_length + 32);
+    if (!head)
+        return -1;
+
+    const char *cursor = ex->buf;
+    const char *end = ex->buf + ex->head_length;
+    const char *newline = memchr(cursor, '\n', end - cursor);
+    const char *stop = newline[-1] == '\r' ? newline - 1 : newline;
+
+    size_t length = 0;
+    memcpy(head, HTTP_VERSION, 8);
+    memcpy(head + 8, cursor + 8, stop - (cursor + 8));
+    length = stop - cursor;
+    memcpy(head + length, "\r\n", 2);
+    length += 2;
+    cursor = newline + 1;
+
+    const http_slice *connection_list = ex->connection_list.data ? &ex->connection_list : NULL;
+    http_slice line, name, value;
+    while (next_field(&cursor, end, &line, &name, &value) == 1)
+    {
+        if (hop_by_hop(name, connection_list) &&
+            !(http_slice_equals_ignore_case(name, "Transfer-Encoding") && !ex->decode))
+            continue;
+        // RFC 9112 6.3: sent on beside Transfer-Encoding, it would frame the body differently downstream
+        if (ex->transfer_encoded && http_header_lookup(name.data, name.length) == HTTP_HEADER_CONTENT_LENGTH)
+            continue;
+        memcpy(head + length, line.data, line.length);
+        length += line.length;
+        memcpy(head + length, "\r\n", 2);
+        length += 2;
+    }
+
+    static const char close_field[] = "Connection: close\r\n";
+    static const char keep_alive_field[] = "Connection: keep-alive\r\n";
+    const char *field = !conn->keep_alive ? close_field : !ex->http11 ? keep_alive_field : NULL;
+    if (field)
+    {
+        memcpy(head + length, field, strlen(field));
+        length += strlen(field);
+    }
+    memcpy(head + length, "\r\n", 2);
+    length += 2;
+
+    metrics_status(ex->response_status);
+    if (connection_send(conn, head, length) == -1)
+        return -1;
+
+    // a large remainder is spliced; a small one is not worth a pipe
+    size_t buffered = ex->buf_length - ex->buf_start;
+    if (ex->framing == PROXY_BODY_UNTIL_CLOSE ||
+        (ex->framing == PROXY_BODY_LENGTH && ex->body.body_remaining > buffered + PROXY_BUFFER_SIZE))
+        ex->pipe = take_pipe();
+    return 0;
+}
+
+/*
+ * Forwards body bytes already read, or else reads (or splices) the next
+ * piece. Returns 1 once the body has ended, 0 if more follows (the
+ * connection is parked if the upstream has nothing yet), -1 on failure,
+ * which closes the client connection, since its response is cut short.
+ */
+static int forward_body(connection *conn, proxy_exchange *ex)
+{
+    if (ex->buf_start == ex->buf_length)
+    {
+        if (ex->pipe)
+            return splice_body(conn, ex);
+
+        io_stats_syscall();
+        ssize_t n = recv(ex->upstream->handler.fd, ex->buf, ex->buf_capacity, 0);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                return 0;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                conn->parked = CONNECTION_PARKED_UPSTREAM;
+                return 0;
+            }
+            fprintf(stderr, "Upstream %s: recv: %s\n", upstreams[ex->upstream->upstream].name, strerror(errno));
+            return -1;
+        }
+        if (n == 0)
+        {
+            if (ex->framing == PROXY_BODY_UNTIL_CLOSE)
+                return 1;
+            fprintf(stderr, "Upstream %s closed the connection mid-body.\n", upstreams[ex->upstream->upstream].name);
+            return -1;
+        }
+        ex->buf_start = 0;
+        ex->buf_length = n;
+    }
+
+    const char *data = ex->buf + ex->buf_start;
+    size_t available = ex->buf_length - ex->buf_start;
+
+    if (ex->framing == PROXY_BODY_UNTIL_CLOSE)
+    {
+        ex->buf_start = ex->buf_length;
+        return connection_send(conn, data, available) == -1 ? -1 : 0;
+    }
+
+    // the framing is tracked as the bytes pass; they go out as they came unless chunks are unwrapped
+    size_t offset = 0;
+    http_parse_status status = HTTP_PARSE_NEED_MORE;
+    while (status == HTTP_PARSE_NEED_MORE && offset < available)
+    {
+        size_t used;
+        http_slice chunk;
+        status = http_parser_body(&ex->body, data + offset, available - offset, &used, &chunk);
+        if (status == HTTP_PARSE_ERROR)
+            return -1;
+        offset += used;
+        if (ex->decode && chunk.length > 0 && connection_send(conn, chunk.data, chunk.length) == -1)
+            return -1;
+        // a response body has no size limit
+        ex->body.body_received = 0;
+    }
+    if (!ex->decode && connection_send(conn, data, offset) == -1)
+        return -1;
+    ex->buf_start += offset;
+
+    if (status != HTTP_PARSE_COMPLETE)
+        return 0;
+    // bytes past the body were not asked for, so the connection is not trusted again
+    ex->reusable = ex->keep_alive && ex->buf_start == ex->buf_length;
+    return 1;
+}
+
+/*
+ * Moves the next piece of the body from the upstream socket into the pipe
+ * and queues it for the client as a pipe range. Every byte in the pipe
+ * belongs to a range the connection still has queued, and producers only
+ * run below the output high-water mark, so a pipe of at least the mark
+ * plus PROXY_SPLICE_MAX never fills.
+ */
+static int splice_body(connection *conn, proxy_exchange *ex)
+{
+    proxy_pipe *pipe = ex->pipe;
+    size_t want = PROXY_SPLICE_MAX;
+    if (ex->framing == PROXY_BODY_LENGTH && ex->body.body_remaining < want)
+        want = ex->body.body_remaining;
+
+    ssize_t n;
+    do
+    {
+        io_stats_syscall();
+        n = splice(ex->upstream->handler.fd, NULL, pipe->fds[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    } while (n == -1 && errno == EINTR);
+
+    if (n == -1)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            conn->parked = CONNECTION_PARKED_UPSTREAM;
+            return 0;
+        }
+        fprintf(stderr, "Upstream %s: splice: %s\n", upstreams[ex->upstream->upstream].name, strerror(errno));
+        return -1;
+    }
+    if (n == 0)
+    {
+        if (ex->framing == PROXY_BODY_UNTIL_CLOSE)
+            return 1;
+        fprintf(stderr, "Upstream %s closed the connection mid-body.\n", upstreams[ex->upstream->upstream].name);
+        return -1;
+    }
+
+    pipe->refs++;
+    connection_file range = {
+        .fd = pipe->fds[0],
+        .length = n,
+        .pipe = 1,
+        .release = release_pipe,
+        .arg = pipe,
+    };
+    if (connection_sendfile(conn, &range) == -1)
+        return -1;
+
+    if (ex->framing != PROXY_BODY_LENGTH)
+        return 0;
+    ex->body.body_remaining -= n;
+    if (ex->body.body_remaining > 0)
+        return 0;
+    ex->reusable = ex->keep_alive;
+    return 1;
+}
+
+static int send_failure(connection *conn, proxy_exchange *ex)
+{
+    const http_status_entry *entry = find_http_status(ex->status);
+    const char *connection_value = !conn->keep_alive ? "close" : !ex->http11 ? "keep-alive" : NULL;
+
+    char headers[64];
+    snprintf(headers, sizeof(headers), "Content-Type: text/plain\r\n%s%s%s", connection_value ? "Connection: " : "",
+             connection_value ? connection_value : "", connection_value ? "\r\n" : "");
+
+    struct iovec iov[HTTP_RESPONSE_IOV_COUNT];
+    int count = build_http_response(&conn->arena, HTTP_VERSION, ex->status, entry->reason, strlen(entry->reason),
+                                    headers, iov);
+    if (count == -1)
+        return -1;
+
+    // a HEAD response carries no body
+    if (ex->head_only)
+        count = 1;
+    metrics_status(ex->status);
+    return connection_sendv(conn, iov, count);
+}
+
+/*
+ * The producer's release: when the response is complete, or when the
+ * client connection closes first (on failure, its deadline or the
+ * worker stopping). A connection that finished its exchange cleanly goes
+ * back to the pool; any other is closed, since the upstream may still
+ * be sending. An upstream that let the deadline pass without answering
+ * counts as failed.
+ */
+static void release_exchange(void *arg)
+{
+    proxy_exchange *ex = arg;
+    proxy_worker *w = current_worker;
+    connection *conn = ex->conn;
+    upstream_conn *uc = ex->upstream;
+
+    if (uc)
+    {
+        time_t now = conn->table->now;
+        int timeout = conn->table->timeouts.upstream;
+        if (ex->state < EXCHANGE_BODY && timeout > 0 && now - ex->since >= timeout)
+        {
+            fprintf(stderr, "Upstream %s timed out.\n", upstreams[uc->upstream].name);
+            record_failure(uc->upstream, now);
+        }
+
+        w->upstreams[uc->upstream].outstanding--;
+        uc->exchange = NULL;
+        if (ex->reusable)
+            keep_idle(uc, now);
+        else
+            close_upstream(uc);
+    }
+
+    if (ex->pipe)
+        release_pipe(ex->pipe);
+    if (ex->buf)
+        buffer_pool_put(&w->buffers, ex->buf, ex->buf_capacity);
+    if (ex->body_fd != -1)
+        close(ex->body_fd);
+    free(ex->out);
+    free(ex);
+}
+
+/*
+ * A pipe sized so it never fills (see splice_body), or NULL if the kernel
+ * will not make one that large, in which case the body is copied.
+ */
+static proxy_pipe *take_pipe(void)
+{
+    proxy_worker *w = current_worker;
+    proxy_pipe *pipe = w->free_pipes;
+    if (pipe)
+    {
+        w->free_pipes = pipe->next;
+        w->free_pipe_count--;
+        pipe->refs = 1;
+        return pipe;
+    }
+
+    pipe = malloc(sizeof(proxy_pipe));
+    if (!pipe)
+        return NULL;
+    io_stats_syscall();
+    if (pipe2(pipe->fds, O_NONBLOCK | O_CLOEXEC) == -1)
+    {
+        free(pipe);
+        return NULL;
+    }
+    io_stats_syscall();
+    int capacity = fcntl(pipe->fds[1], F_SETPIPE_SZ, PROXY_PIPE_SIZE);
+    if (capacity < CONNECTION_OUTPUT_HIGH_WATER + PROXY_SPLICE_MAX)
+    {
+        close(pipe->fds[0]);
+        close(pipe->fds[1]);
+        free(pipe);
+        return NULL;
+    }
+    pipe->capacity = capacity;
+    pipe->refs = 1;
+    pipe->next = NULL;
+    return pipe;
+}
+
+// drops a reference; the last one keeps the pipe for reuse if its ranges were all sent
+static void release_pipe(void *arg)
+{
+    proxy_pipe *pipe = arg;
+    if (--pipe->refs > 0)
+        return;
+
+    proxy_worker *w = current_worker;
+    int unread = 1;
+    io_stats_syscall();
+    if (w && w->free_pipe_count < PROXY_PIPE_RETAIN && ioctl(pipe->fds[0], FIONREAD, &unread) == 0 && unread == 0)
+    {
+        pipe->next = w->free_pipes;
+        w->free_pipes = pipe;
+        w->free_pipe_count++;
+        return;
+    }
+
+    close(pipe->fds[0]);
+    close(pipe->fds[1]);
+    free(pipe);
+}
@@ -0,0 +1,69 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include "connection.h"
+#include "event_loop.h"
+
+#define PROXY_MAX_ROUTES 16
+#define PROXY_MAX_UPSTREAMS 64 // across all routes
+#define PROXY_IDLE_MAX 32      // kept-alive connections pooled per upstream and worker
+#define PROXY_IDLE_TIMEOUT 30  // seconds a pooled connection may sit unused before it is dropped
+#define PROXY_MAX_ATTEMPTS 2   // upstreams a request is tried on before the client gets a 502
+#define PROXY_EJECT_FAILURES 3 // consecutive failures that take an upstream out of rotation
+#define PROXY_EJECT_SECONDS 10 // how long it stays out
+#define PROXY_BUFFER_SIZE (16 * 1024)   // response head and copied body pieces; also the largest head accepted
+#define PROXY_BUFFER_RETAIN (1 << 20)   // bytes of idle response buffers a worker keeps for reuse
+#define PROXY_PIPE_SIZE (512 * 1024)    // asked of the kernel for each splice pipe
+#define PROXY_SPLICE_MAX (128 * 1024)   // body bytes moved into the pipe per producer call
+#define PROXY_PIPE_RETAIN 16            // empty pipes a worker keeps for reuse
+
+/**
+ * Adds a proxied prefix: requests whose path starts with it are forwarded,
+ * unchanged, to one of the given upstreams. Call before workers start.
+ *
+ * @param spec "PREFIX=ADDRESS[,ADDRESS...]", each address "host:port",
+ *             "[v6-address]:port" or "unix:/path/to/socket".
+ * @return 0 on success, -1 if the spec is malformed or an address does not resolve.
+ */
+int proxy_configure(const char *spec);
+
+/**
+ * Registers a route for every configured prefix. Call after
+ * http_handler_init and before workers start.
+ *
+ * @return 0 on success, -1 if a prefix clashes with an existing route.
+ */
+int proxy_routes_init(void);
+
+/**
+ * Reports whether any prefix is proxied, so backends know whether to set
+ * up a loop for upstream sockets.
+ *
+ * @return Non-zero if proxy_configure added a route.
+ */
+int proxy_enabled(void);
+
+/**
+ * Frees the configuration. Call after workers have stopped.
+ */
+void proxy_cleanup(void);
+
+/**
+ * Sets up the calling worker's upstream pools. Its upstream sockets are
+ * registered with loop, edge-triggered, for their whole life. Does
+ * nothing when no prefix is proxied.
+ *
+ * @param loop Event loop that runs on this worker's thread.
+ * @param resume Backend hook called when a connection parked on an
+ *               upstream can go on: answers what queued up and reads again.
+ * @return 0 on success, -1 on allocation failure.
+ */
+int proxy_worker_init(event_loop *loop, void (*resume)(connection *conn));
+
+/**
+ * Closes the calling worker's pooled upstream connections and frees its
+ * pools. Call after its connection table is cleaned up.
+ */
+void proxy_worker_cleanup(void);
+
+#endif // PROXY_H
@@ -1,8 +1,11 @@
+#include "http_scan.h"
 #include "request.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <strings.h>
 
 
 const http_method_entry http_methods[HTTP_METHOD_COUNT] = {
@@ -10,37 +13,99 @@ const http_method_entry http_methods[HTTP_METHOD_COUNT] = {
     {HTTP_METHOD_DELETE, "DELETE"}, {HTTP_METHOD_HEAD, "HEAD"},   {HTTP_METHOD_OPTIONS, "OPTIONS"},
     {HTTP_METHOD_PATCH, "PATCH"},   {HTTP_METHOD_TRACE, "TRACE"}, {HTTP_METHOD_CONNECT, "CONNECT"}};
 
-static char *duplicate_string_or_exit(const char *source)
+static const struct
 {
-    char *dup = strdup(source);
-    if (!dup)
-    {
-        fprintf(stderr, "Failed to allocate memory for string duplication.\n");
-        return NULL;
-    }
+    const char *name;
+    size_t length;
+} header_names[HTTP_HEADER_COUNT] = {
+    [HTTP_HEADER_HOST] = {"Host", sizeof("Host") - 1},
+    [HTTP_HEADER_CONNECTION] = {"Connection", sizeof("Connection") - 1},
+    [HTTP_HEADER_CONTENT_LENGTH] = {"Content-Length", sizeof("Content-Length") - 1},
+    [HTTP_HEADER_CONTENT_TYPE] = {"Content-Type", sizeof("Content-Type") - 1},
+    [HTTP_HEADER_CONTENT_ENCODING] = {"Content-Encoding", sizeof("Content-Encoding") - 1},
+    [HTTP_HEADER_TRANSFER_ENCODING] = {"Transfer-Encoding", sizeof("Transfer-Encoding") - 1},
+    [HTTP_HEADER_TE] = {"TE", sizeof("TE") - 1},
+    [HTTP_HEADER_TRAILER] = {"Trailer", sizeof("Trailer") - 1},
+    [HTTP_HEADER_EXPECT] = {"Expect", sizeof("Expect") - 1},
+    [HTTP_HEADER_UPGRADE] = {"Upgrade", sizeof("Upgrade") - 1},
+    [HTTP_HEADER_KEEP_ALIVE] = {"Keep-Alive", sizeof("Keep-Alive") - 1},
+    [HTTP_HEADER_USER_AGENT] = {"User-Agent", sizeof("User-Agent") - 1},
+    [HTTP_HEADER_ACCEPT] = {"Accept", sizeof("Accept") - 1},
+    [HTTP_HEADER_ACCEPT_ENCODING] = {"Accept-Encoding", sizeof("Accept-Encoding") - 1},
+    [HTTP_HEADER_ACCEPT_LANGUAGE] = {"Accept-Language", sizeof("Accept-Language") - 1},
+    [HTTP_HEADER_AUTHORIZATION] = {"Authorization", sizeof("Authorization") - 1},
+    [HTTP_HEADER_COOKIE] = {"Cookie", sizeof("Cookie") - 1},
+    [HTTP_HEADER_CACHE_CONTROL] = {"Cache-Control", sizeof("Cache-Control") - 1},
+    [HTTP_HEADER_PRAGMA] = {"Pragma", sizeof("Pragma") - 1},
+    [HTTP_HEADER_DATE] = {"Date", sizeof("Date") - 1},
+    [HTTP_HEADER_IF_MODIFIED_SINCE] = {"If-Modified-Since", sizeof("If-Modified-Since") - 1},
+    [HTTP_HEADER_IF_NONE_MATCH] = {"If-None-Match", sizeof("If-None-Match") - 1},
+    [HTTP_HEADER_IF_RANGE] = {"If-Range", sizeof("If-Range") - 1},
+    [HTTP_HEADER_RANGE] = {"Range", sizeof("Range") - 1},
+    [HTTP_HEADER_ORIGIN] = {"Origin", sizeof("Origin") - 1},
+    [HTTP_HEADER_REFERER] = {"Referer", sizeof("Referer") - 1},
+    [HTTP_HEADER_X_FORWARDED_FOR] = {"X-Forwarded-For", sizeof("X-Forwarded-For") - 1},
+    [HTTP_HEADER_X_REQUEST_ID] = {"X-Request-Id", sizeof("X-Request-Id") - 1},
+};
 
-    return dup;
-}
+/*
+ * Perfect hash of the known names: no two of them share a slot, so a lookup
+ * is one table load and one comparison. The multipliers were searched for
+ * offline; when adding a name, check it still lands in an empty slot.
+ */
+#define HEADER_HASH_SIZE 64
+#define HEADER_HASH(length, first, last) ((((length) + ((first) | 0x20)) * 12 + ((last) | 0x20)) & (HEADER_HASH_SIZE - 1))
+#define HEADER_SLOT(name, first, last, id) [HEADER_HASH(sizeof(name) - 1, first, last)] = id
+
+static const unsigned char header_hash[HEADER_HASH_SIZE] = {
+    HEADER_SLOT("Host", 'H', 't', HTTP_HEADER_HOST),
+    HEADER_SLOT("Connection", 'C', 'n', HTTP_HEADER_CONNECTION),
+    HEADER_SLOT("Content-Length", 'C', 'h', HTTP_HEADER_CONTENT_LENGTH),
+    HEADER_SLOT("Content-Type", 'C', 'e', HTTP_HEADER_CONTENT_TYPE),
+    HEADER_SLOT("Content-Encoding", 'C', 'g', HTTP_HEADER_CONTENT_ENCODING),
+    HEADER_SLOT("Transfer-Encoding", 'T', 'g', HTTP_HEADER_TRANSFER_ENCODING),
+    HEADER_SLOT("TE", 'T', 'E', HTTP_HEADER_TE),
+    HEADER_SLOT("Trailer", 'T', 'r', HTTP_HEADER_TRAILER),
+    HEADER_SLOT("Expect", 'E', 't', HTTP_HEADER_EXPECT),
+    HEADER_SLOT("Upgrade", 'U', 'e', HTTP_HEADER_UPGRADE),
+    HEADER_SLOT("Keep-Alive", 'K', 'e', HTTP_HEADER_KEEP_ALIVE),
+    HEADER_SLOT("User-Agent", 'U', 't', HTTP_HEADER_USER_AGENT),
+    HEADER_SLOT("Accept", 'A', 't', HTTP_HEADER_ACCEPT),
+    HEADER_SLOT("Accept-Encoding", 'A', 'g', HTTP_HEADER_ACCEPT_ENCODING),
+    HEADER_SLOT("Accept-Language", 'A', 'e', HTTP_HEADER_ACCEPT_LANGUAGE),
+    HEADER_SLOT("Authorization", 'A', 'n', HTTP_HEADER_AUTHORIZATION),
+    HEADER_SLOT("Cookie", 'C', 'e', HTTP_HEADER_COOKIE),
+    HEADER_SLOT("Cache-Control", 'C', 'l', HTTP_HEADER_CACHE_CONTROL),
+    HEADER_SLOT("Pragma", 'P', 'a', HTTP_HEADER_PRAGMA),
+    HEADER_SLOT("Date", 'D', 'e', HTTP_HEADER_DATE),
+    HEADER_SLOT("If-Modified-Since", 'I', 'e', HTTP_HEADER_IF_MODIFIED_SINCE),
+    HEADER_SLOT("If-None-Match", 'I', 'h', HTTP_HEADER_IF_NONE_MATCH),
+    HEADER_SLOT("If-Range", 'I', 'e', HTTP_HEADER_IF_RANGE),
+    HEADER_SLOT("Range", 'R', 'e', HTTP_HEADER_RANGE),
+    HEADER_SLOT("Origin", 'O', 'n', HTTP_HEADER_ORIGIN),
+    HEADER_SLOT("Referer", 'R', 'r', HTTP_HEADER_REFERER),
+    HEADER_SLOT("X-Forwarded-For", 'X', 'r', HTTP_HEADER_X_FORWARDED_FOR),
+    HEADER_SLOT("X-Request-Id", 'X', 'd', HTTP_HEADER_X_REQUEST_ID),
+};
 
 void init_http_request(http_request *request)
 {
     if (request)
     {
         request->request_line.method = HTTP_METHOD_UNKNOWN;
-        request->request_line.uri = NULL;
-        request->request_line.version = NULL;
+        request->request_line.uri = (http_slice){NULL, 0};
+        request->request_line.version = (http_slice){NULL, 0};
 
-        // initialize headers
+        // headers past header_count are never read, so only the count is reset
         request->header_count = 0;
-        for (int i = 0; i < HTTP_MAX_HEADERS; i++)
-        {
-            request->headers[i].name = NULL;
-            request->headers[i].value = NULL;
-        }
+        memset(request->header_index, 0, sizeof(request->header_index));
 
         // initialize body
         request->body = NULL;
         request->body_length = 0;
+        request->body_fd = -1;
+        request->body_offset = 0;
+        request->body_partial = 0;
     }
 }
 
@@ -48,38 +113,14 @@ void cleanup_http_request(http_request *request)
 {
     if (request)
     {
-        if (request->request_line.uri)
-        {
-            free(request->request_line.uri);
-            request->request_line.uri = NULL;
-        }
-        if (request->request_line.version)
-        {
-            free(request->request_line.version);
-            request->request_line.version = NULL;
-        }
-
-        // free headers
-        for (int i = 0; i < request->header_count; i++)
-        {
-            if (request->headers[i].name)
-            {
-                free((void *)request->headers[i].name);
-                request->headers[i].name = NULL;
-            }
-            if (request->headers[i].value)
-            {
-                free((void *)request->headers[i].value);
-                request->headers[i].value = NULL;
-            }
-        }
+        // every field is borrowed, the body from whoever collected it; just forget them
         request->header_count = 0;
-        if (request->body)
-        {
-            free(request->body);
-            request->body = NULL;
-            request->body_length = 0;
-        }
+        memset(request->header_index, 0, sizeof(request->header_index));
+        request->body = NULL;
+        request->body_length = 0;
+        request->body_fd = -1;
+        request->body_offset = 0;
+        request->body_partial = 0;
     }
 }
 
@@ -95,179 +136,607 @@ http_method find_http_method(const char *method_str)
     return HTTP_METHOD_UNKNOWN;
 }
 
-int store_http_header(http_request *request, const char *name, const char *value)
+http_header_id http_header_lookup(const char *name, size_t length)
 {
-    if (request && name && value && request->header_count < HTTP_MAX_HEADERS)
-    {
-        request->headers[request->header_count].name = duplicate_string_or_exit(name);
-        request->headers[request->header_count].value = duplicate_string_or_exit(value);
-        request->header_count++;
-        return 0;
-    }
-    fprintf(stderr, "Failed to store header exceeded maximum headers or invalid parameters : %s: %s\n", name, value);
-    return -1; //
+    if (length == 0)
+        return HTTP_HEADER_UNKNOWN;
+
+    http_header_id id = header_hash[HEADER_HASH(length, (unsigned char)name[0], (unsigned char)name[length - 1])];
+    if (id != HTTP_HEADER_UNKNOWN && header_names[id].length == length &&
+        strncasecmp(name, header_names[id].name, length) == 0)
+        return id;
+
+    return HTTP_HEADER_UNKNOWN;
 }
 
-void store_http_body(http_request *request, const char *body, size_t length)
+const char *http_header_name(http_header_id id)
 {
-    if (request)
+    return id > HTTP_HEADER_UNKNOWN && id < HTTP_HEADER_COUNT ? header_names[id].name : NULL;
+}
+
+const http_slice *http_request_find_header(const http_request *request, http_header_id id)
+{
+    if (id <= HTTP_HEADER_UNKNOWN || id >= HTTP_HEADER_COUNT || request->header_index[id] == 0)
+        return NULL;
+    return &request->headers[request->header_index[id] - 1].value;
+}
+
+int store_http_header(http_request *request, http_slice name, http_slice value)
+{
+    if (request && name.data && value.data && request->header_count < HTTP_MAX_HEADERS)
     {
-        // Free existing body if present
-        if (request->body)
-        {
-            free(request->body);
-        }
-        // Duplicate the body content
-        request->body = body ? strndup(body, length) : NULL;
-        if (body)
+        http_header_id id = http_header_lookup(name.data, name.length);
+        if (id != HTTP_HEADER_UNKNOWN)
         {
-            request->body_length = length;
-        }
-        else
-        {
-            request->body_length = 0;
-        }
-        // Automatically set Content-Length header if body is present
-        if (body)
-        {
-            char content_length[20];
-            snprintf(content_length, sizeof(content_length), "%zu", length);
-            // Check if Content-Length header already exists
-            int found = -1;
-            for (int i = 0; i < request->header_count; i++)
-            {
-                if (strcasecmp(request->headers[i].name, "Content-Length") == 0)
-                {
-                    found = i;
-                    break;
-                }
-            }
-            if (found != -1)
+            const http_slice *first = http_request_find_header(request, id);
+            if (!first)
             {
-                // Update existing Content-Length header
-                free(request->headers[found].value);
-                request->headers[found].value = duplicate_string_or_exit(content_length);
+                request->header_index[id] = request->header_count + 1;
             }
-            else
+            else if (id == HTTP_HEADER_CONTENT_LENGTH &&
+                     (first->length != value.length || memcmp(first->data, value.data, value.length) != 0))
             {
-                // Add new Content-Length header
-                if (store_http_header(request, "Content-Length", content_length) != 0)
-                {
-                    fprintf(stderr, "Error: Unable to add Content-Length header.\n");
-                }
+                // RFC 9112 6.3: differing lengths make the body boundary ambiguous
+                fprintf(stderr, "Error: Conflicting Content-Length headers.\n");
+                return -1;
             }
         }
+
+        request->headers[request->header_count].name = name;
+        request->headers[request->header_count].value = value;
+        request->headers[request->header_count].id = id;
+        request->header_count++;
+        return 0;
     }
+    fprintf(stderr, "Failed to store header exceeded maximum headers or invalid parameters : %.*s: %.*s\n",
+            (int)name.length, name.data ? name.data : "", (int)value.length, value.data ? value.data : "");
+    return -1;
 }
 
-int parse_http_request(const char *raw_request, size_t request_length, http_request *request)
+void store_http_body(http_request *request, const char *body, size_t length)
 {
-    if (!raw_request || !request)
-        return -1;
+    if (request)
+    {
+        request->body = body;
+        request->body_length = body ? length : 0;
+    }
+}
 
-    // Initialize the request structure
-    init_http_request(request);
+static void rebase_slice(http_slice *slice, uintptr_t old_base, uintptr_t new_base)
+{
+    if (slice->data)
+        slice->data = (const char *)(new_base + ((uintptr_t)slice->data - old_base));
+}
+
+void http_request_rebase(http_request *request, const char *old_base, const char *new_base)
+{
+    uintptr_t from = (uintptr_t)old_base;
+    uintptr_t to = (uintptr_t)new_base;
 
-    // Make a copy of the raw request to tokenize
-    char *request_copy = strndup(raw_request, request_length);
-    if (!request_copy)
+    rebase_slice(&request->request_line.uri, from, to);
+    rebase_slice(&request->request_line.version, from, to);
+    for (int i = 0; i < request->header_count; i++)
     {
-        fprintf(stderr, "Error: Memory allocation failed while copying raw request.\n");
-        cleanup_http_request(request);
+        rebase_slice(&request->headers[i].name, from, to);
+        rebase_slice(&request->headers[i].value, from, to);
+    }
+}
+
+int http_slice_equals(http_slice slice, const char *str)
+{
+    size_t length = strlen(str);
+    return slice.length == length && memcmp(slice.data, str, length) == 0;
+}
+
+int http_slice_equals_ignore_case(http_slice slice, const char *str)
+{
+    size_t length = strlen(str);
+    return slice.length == length && strncasecmp(slice.data, str, length) == 0;
+}
+
+static int is_ows(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+int http_slice_has_token(http_slice list, const char *token)
+{
+    const char *p = list.data;
+    const char *end = list.data + list.length;
+
+    while (p < end)
+    {
+        const char *comma = memchr(p, ',', end - p);
+        const char *item_end = comma ? comma : end;
+
+        while (p < item_end && is_ows(*p))
+            p++;
+        const char *last = item_end;
+        while (last > p && is_ows(last[-1]))
+            last--;
+
+        http_slice item = {p, (size_t)(last - p)};
+        if (http_slice_equals_ignore_case(item, token))
+            return 1;
+
+        p = item_end + 1;
+    }
+
+    return 0;
+}
+
+int http_request_keep_alive(const http_request *request)
+{
+    int keep_alive = http_slice_equals(request->request_line.version, "HTTP/1.1");
+    if (request->header_index[HTTP_HEADER_CONNECTION] == 0)
+        return keep_alive;
+
+    // the option list may be split over several Connection lines
+    for (int i = request->header_index[HTTP_HEADER_CONNECTION] - 1; i < request->header_count; i++)
+    {
+        if (request->headers[i].id != HTTP_HEADER_CONNECTION)
+            continue;
+        if (http_slice_has_token(request->headers[i].value, "close"))
+            return 0;
+        if (http_slice_has_token(request->headers[i].value, "keep-alive"))
+            keep_alive = 1;
+    }
+
+    return keep_alive;
+}
+
+/*
+ * The scanner has already located the two spaces of the request line, so
+ * the tokens are sliced without looking at their bytes again.
+ */
+static int parse_request_line(const char *line, const char *end, const char *method_end, const char *uri_end,
+                              http_request *request, http_parser *parser)
+{
+    // method SP request-target SP HTTP-version, and nothing else: a space in the target is not absorbed
+    const char *uri = method_end + 1;
+    const char *version = uri_end + 1;
+    if (method_end == line || method_end - line >= HTTP_METHOD_MAX_LEN || uri_end == uri || version >= end ||
+        memchr(version, ' ', end - version))
+    {
+        fprintf(stderr, "Error: Malformed request line.\n");
         return -1;
     }
 
-    char *saveptr;
+    // RFC 9112 2.3: HTTP/1.0 and HTTP/1.1 are served; another well-formed version gets 505
+    size_t version_length = end - version;
+    if (version_length != 8 || memcmp(version, "HTTP/1.", 7) != 0 || (version[7] != '0' && version[7] != '1'))
+    {
+        if (version_length == 8 && memcmp(version, "HTTP/", 5) == 0 && isdigit((unsigned char)version[5]) &&
+            version[6] == '.' && isdigit((unsigned char)version[7]))
+            parser->error_status = 505;
+        fprintf(stderr, "Error: Unsupported HTTP version: %.*s\n", (int)version_length, version);
+        return -1;
+    }
+
+    char method[HTTP_METHOD_MAX_LEN];
+    memcpy(method, line, method_end - line);
+    method[method_end - line] = '\0';
+
+    request->request_line.method = find_http_method(method);
+    request->request_line.uri = (http_slice){uri, uri_end - uri};
+    request->request_line.version = (http_slice){version, version_length};
+
+    return 0;
+}
+
+static int parse_header_line(const char *line, const char *end, const char *colon, http_request *request)
+{
+    const char *name = line;
+    const char *name_end = colon;
 
-    // Parse the request line
-    char *line = strtok_r(request_copy, "\r\n", &saveptr);
-    if (!line)
+    /*
+     * RFC 9112 5.2: a line starting with whitespace is an obsolete folded
+     * continuation of the previous field's value, or garbage before the
+     * first field. Taken as a field of its own, " Transfer-Encoding: chunked"
+     * would frame a body here that another hop reads as part of a value.
+     */
+    if (is_ows(*name))
     {
-        fprintf(stderr, "Error: Invalid HTTP request. Missing request line.\n");
-        free(request_copy);
-        cleanup_http_request(request);
+        fprintf(stderr, "Error: Header line starts with whitespace.\n");
+        return -1;
+    }
+
+    /*
+     * RFC 9112 5.1: no whitespace is allowed between the name and the colon.
+     * Trimming it would let "Transfer-Encoding : chunked" frame a body here
+     * while an upstream that ignores the field frames it differently.
+     */
+    if (name_end > name && is_ows(name_end[-1]))
+    {
+        fprintf(stderr, "Error: Whitespace before header colon.\n");
         return -1;
     }
 
-    // Tokenize the request line into method, URI, and version
-    char *method_str = strtok(line, " ");
-    char *uri = strtok(NULL, " ");
-    char *version = strtok(NULL, " ");
+    // surrounding whitespace is not part of the value
+    const char *value = colon + 1;
+    const char *value_end = end;
+    while (value < value_end && is_ows(*value))
+        value++;
+    while (value_end > value && is_ows(value_end[-1]))
+        value_end--;
 
-    if (!method_str || !uri || !version)
+    if (name == name_end)
     {
-        fprintf(stderr, "Error: Malformed request line.\n");
-        free(request_copy);
-        cleanup_http_request(request);
+        fprintf(stderr, "Error: Empty header name.\n");
+        return -1;
+    }
+
+    return store_http_header(request, (http_slice){name, name_end - name}, (http_slice){value, value_end - value});
+}
+
+static int parse_content_length(const http_slice *digits, size_t *content_length)
+{
+    size_t value = 0;
+    if (digits->length == 0)
         return -1;
+
+    for (size_t j = 0; j < digits->length; j++)
+    {
+        if (!isdigit((unsigned char)digits->data[j]) || value > HTTP_MAX_BODY_SIZE)
+            return -1;
+        value = value * 10 + (digits->data[j] - '0');
     }
+    if (value > HTTP_MAX_BODY_SIZE)
+        return -1;
+    *content_length = value;
 
-    // Set the method
-    request->request_line.method = find_http_method(method_str);
+    return 0;
+}
 
-    // Duplicate and set the URI
-    request->request_line.uri = duplicate_string_or_exit(uri);
+/*
+ * RFC 9112 6.3: chunked framing wins over Content-Length, but a request
+ * carrying both is how smuggling attacks split one request into two, so
+ * such requests are refused rather than guessed at.
+ */
+static int parse_body_framing(http_request *request, http_parser *parser)
+{
+    parser->framing = HTTP_BODY_NONE;
+    parser->body_remaining = 0;
 
-    // Duplicate and set the HTTP version
-    request->request_line.version = duplicate_string_or_exit(version);
+    const http_slice *transfer_encoding = http_request_find_header(request, HTTP_HEADER_TRANSFER_ENCODING);
+    const http_slice *content_length = http_request_find_header(request, HTTP_HEADER_CONTENT_LENGTH);
 
-    // Parse headers
-    while ((line = strtok_r(NULL, "\r\n", &saveptr)) != NULL && strlen(line) > 0)
+    if (transfer_encoding)
     {
-        char *colon = strchr(line, ':');
-        if (!colon)
+        // only chunked is understood, and only HTTP/1.1 may use it
+        int count = 0;
+        for (int i = request->header_index[HTTP_HEADER_TRANSFER_ENCODING] - 1; i < request->header_count; i++)
+            count += request->headers[i].id == HTTP_HEADER_TRANSFER_ENCODING;
+
+        if (content_length || count != 1 || !http_slice_equals_ignore_case(*transfer_encoding, "chunked") ||
+            !http_slice_equals(request->request_line.version, "HTTP/1.1"))
         {
-            fprintf(stderr, "Error: Malformed header line (missing colon).\n");
-            free(request_copy);
-            cleanup_http_request(request);
+            fprintf(stderr, "Error: Unsupported Transfer-Encoding: %.*s\n", (int)transfer_encoding->length,
+                    transfer_encoding->data);
             return -1;
         }
-        *colon = '\0'; // Split the line into name and value
-        char *name = line;
-        char *value = colon + 1;
-
-        // Trim leading and trailing whitespace from name
-        while (isspace((unsigned char)*name))
-            name++;
-        char *end = name + strlen(name) - 1;
-        while (end > name && isspace((unsigned char)*end))
+
+        parser->framing = HTTP_BODY_CHUNKED;
+        parser->chunk_state = HTTP_CHUNK_SIZE;
+        return 0;
+    }
+
+    // duplicates were checked against the first as they were stored
+    if (!content_length)
+        return 0;
+    if (parse_content_length(content_length, &parser->body_remaining) == -1)
+    {
+        fprintf(stderr, "Error: Invalid or oversized Content-Length.\n");
+        return -1;
+    }
+    if (parser->body_remaining > 0)
+        parser->framing = HTTP_BODY_LENGTH;
+
+    return 0;
+}
+
+void http_parser_init(http_parser *parser, http_request *request)
+{
+    parser->state = HTTP_PARSER_REQUEST_LINE;
+    parser->line_start = 0;
+    parser->scan = 0;
+    parser->mark_count = 0;
+    parser->body_start = 0;
+    parser->consumed = 0;
+    parser->framing = HTTP_BODY_NONE;
+    parser->chunk_state = HTTP_CHUNK_SIZE;
+    parser->body_remaining = 0;
+    parser->body_received = 0;
+    parser->line_length = 0;
+    parser->trailer_size = 0;
+    parser->error_status = 400;
+
+    init_http_request(request);
+}
+
+void http_parser_init_body(http_parser *parser, http_body_framing framing, size_t length)
+{
+    http_parser_init(parser, NULL);
+    parser->state = HTTP_PARSER_BODY;
+    parser->framing = framing;
+    parser->body_remaining = framing == HTTP_BODY_LENGTH ? length : 0;
+}
+
+http_parse_status http_parser_execute(http_parser *parser, const char *data, size_t length, http_request *request)
+{
+    if (parser->state == HTTP_PARSER_BODY)
+        return HTTP_PARSE_BODY;
+
+    while (parser->state == HTTP_PARSER_REQUEST_LINE || parser->state == HTTP_PARSER_HEADERS)
+    {
+        // one pass over each byte: stop at the next token boundary or line end
+        http_scan_set set = HTTP_SCAN_LF;
+        if (parser->state == HTTP_PARSER_REQUEST_LINE && parser->mark_count < 2)
+            set = HTTP_SCAN_SPACE_LF;
+        else if (parser->state == HTTP_PARSER_HEADERS && parser->mark_count < 1)
+            set = HTTP_SCAN_COLON_LF;
+
+        size_t found = parser->scan + http_scan(data + parser->scan, length - parser->scan, set);
+        if (found == length)
         {
-            *end = '\0';
-            end--;
+            parser->scan = length;
+            if (length >= HTTP_MAX_HEADER_SIZE)
+            {
+                fprintf(stderr, "Error: Request header section too large.\n");
+                return HTTP_PARSE_ERROR;
+            }
+            return HTTP_PARSE_NEED_MORE;
         }
 
-        // Trim leading and trailing whitespace from value
-        while (isspace((unsigned char)*value))
-            value++;
-        end = value + strlen(value) - 1;
-        while (end > value && isspace((unsigned char)*end))
+        parser->scan = found + 1;
+        if (parser->scan > HTTP_MAX_HEADER_SIZE)
         {
-            *end = '\0';
-            end--;
+            fprintf(stderr, "Error: Request header section too large.\n");
+            return HTTP_PARSE_ERROR;
         }
 
-        // Store the header
-        if (store_http_header(request, name, value) != 0)
+        if (data[found] != '\n')
         {
-            fprintf(stderr, "Error: Failed to store header: %s: %s\n", name, value);
-            free(request_copy);
-            cleanup_http_request(request);
-            return -1;
+            parser->marks[parser->mark_count++] = found;
+            continue;
+        }
+
+        const char *line = data + parser->line_start;
+        const char *end = data + found;
+        if (end > line && end[-1] == '\r')
+            end--;
+
+        int mark_count = parser->mark_count;
+        parser->line_start = parser->scan;
+        parser->mark_count = 0;
+
+        if (parser->state == HTTP_PARSER_REQUEST_LINE)
+        {
+            // RFC 9112 2.2: ignore empty lines before the request line
+            if (end == line && mark_count == 0)
+                continue;
+            if (mark_count < 2)
+            {
+                fprintf(stderr, "Error: Malformed request line.\n");
+                return HTTP_PARSE_ERROR;
+            }
+            const char *method_end = data + parser->marks[0];
+            if (parse_request_line(line, end, method_end, data + parser->marks[1], request, parser) == -1)
+                return HTTP_PARSE_ERROR;
+            parser->state = HTTP_PARSER_HEADERS;
+        }
+        else if (mark_count == 1)
+        {
+            if (parse_header_line(line, end, data + parser->marks[0], request) == -1)
+                return HTTP_PARSE_ERROR;
+        }
+        else if (end == line)
+        {
+            if (parse_body_framing(request, parser) == -1)
+                return HTTP_PARSE_ERROR;
+            parser->body_start = parser->scan;
+            parser->consumed = parser->scan;
+            if (parser->framing == HTTP_BODY_NONE)
+            {
+                parser->state = HTTP_PARSER_DONE;
+                return HTTP_PARSE_COMPLETE;
+            }
+            parser->state = HTTP_PARSER_BODY;
+            return HTTP_PARSE_BODY;
         }
+        else
+        {
+            fprintf(stderr, "Error: Malformed header line (missing colon).\n");
+            return HTTP_PARSE_ERROR;
+        }
+    }
+
+    return HTTP_PARSE_COMPLETE;
+}
+
+static int hex_value(unsigned char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c |= 0x20;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+static http_parse_status chunk_error(void)
+{
+    fprintf(stderr, "Error: Malformed or oversized chunked body.\n");
+    return HTTP_PARSE_ERROR;
+}
+
+// a chunk-size line ended: start its data, or the trailer after the last chunk
+static int end_chunk_size(http_parser *parser)
+{
+    if (parser->body_remaining == 0)
+    {
+        parser->chunk_state = HTTP_CHUNK_TRAILER;
     }
+    else
+    {
+        if (parser->body_remaining > HTTP_MAX_BODY_SIZE - parser->body_received)
+            return -1;
+        parser->chunk_state = HTTP_CHUNK_DATA;
+    }
+    parser->line_length = 0;
+    return 0;
+}
+
+http_parse_status http_parser_body(http_parser *parser, const char *data, size_t length, size_t *used,
+                                   http_slice *chunk)
+{
+    *used = 0;
+    *chunk = (http_slice){NULL, 0};
+
+    if (parser->state == HTTP_PARSER_DONE)
+        return HTTP_PARSE_COMPLETE;
+    if (parser->state != HTTP_PARSER_BODY)
+        return HTTP_PARSE_ERROR;
 
-    // If there's a body, parse it based on Content-Length
-    const char *body_start = strstr(raw_request, "\r\n\r\n");
-    if (body_start)
+    if (parser->framing == HTTP_BODY_LENGTH)
     {
-        body_start += 4; // Move past "\r\n\r\n"
-        size_t body_len = request_length - (body_start - raw_request);
-        if (body_len > 0)
+        size_t n = length < parser->body_remaining ? length : parser->body_remaining;
+        *chunk = (http_slice){data, n};
+        *used = n;
+        parser->body_remaining -= n;
+        parser->body_received += n;
+        if (parser->body_remaining > 0)
+            return HTTP_PARSE_NEED_MORE;
+        parser->state = HTTP_PARSER_DONE;
+        return HTTP_PARSE_COMPLETE;
+    }
+
+    // framing bytes are few, so they are walked one at a time; data is handed out whole
+    size_t i = 0;
+    while (i < length)
+    {
+        unsigned char c = data[i];
+        switch (parser->chunk_state)
+        {
+        case HTTP_CHUNK_DATA:
         {
-            store_http_body(request, body_start, body_len);
+            size_t n = length - i < parser->body_remaining ? length - i : parser->body_remaining;
+            *chunk = (http_slice){data + i, n};
+            *used = i + n;
+            parser->body_remaining -= n;
+            parser->body_received += n;
+            if (parser->body_remaining == 0)
+                parser->chunk_state = HTTP_CHUNK_DATA_CR;
+            return HTTP_PARSE_NEED_MORE;
         }
+        case HTTP_CHUNK_SIZE:
+        {
+            int digit = hex_value(c);
+            if (digit >= 0)
+            {
+                if (parser->body_remaining > HTTP_MAX_BODY_SIZE / 16)
+                    return chunk_error();
+                parser->body_remaining = parser->body_remaining * 16 + digit;
+                parser->line_length++;
+            }
+            else if (parser->line_length == 0)
+            {
+                return chunk_error();
+            }
+            else if (c == ';' || c == ' ' || c == '\t')
+            {
+                parser->chunk_state = HTTP_CHUNK_EXTENSION;
+            }
+            else if (c == '\r')
+            {
+                parser->chunk_state = HTTP_CHUNK_SIZE_LF;
+            }
+            else if (c != '\n' || end_chunk_size(parser) == -1)
+            {
+                return chunk_error();
+            }
+            break;
+        }
+        case HTTP_CHUNK_EXTENSION:
+            if (c == '\n')
+            {
+                if (end_chunk_size(parser) == -1)
+                    return chunk_error();
+            }
+            else if (++parser->line_length > HTTP_MAX_HEADER_SIZE)
+            {
+                return chunk_error();
+            }
+            break;
+        case HTTP_CHUNK_SIZE_LF:
+            if (c != '\n' || end_chunk_size(parser) == -1)
+                return chunk_error();
+            break;
+        case HTTP_CHUNK_DATA_CR:
+            if (c == '\r')
+            {
+                parser->chunk_state = HTTP_CHUNK_DATA_LF;
+                break;
+            }
+            // a bare LF ends the data as well
+            // fall through
+        case HTTP_CHUNK_DATA_LF:
+            if (c != '\n')
+                return chunk_error();
+            parser->chunk_state = HTTP_CHUNK_SIZE;
+            parser->body_remaining = 0;
+            parser->line_length = 0;
+            break;
+        case HTTP_CHUNK_TRAILER:
+            if (++parser->trailer_size > HTTP_MAX_HEADER_SIZE)
+                return chunk_error();
+            if (c == '\n')
+            {
+                if (parser->line_length == 0)
+                {
+                    *used = i + 1;
+                    parser->state = HTTP_PARSER_DONE;
+                    return HTTP_PARSE_COMPLETE;
+                }
+                parser->line_length = 0;
+            }
+            else if (c != '\r')
+            {
+                parser->line_length++;
+            }
+            break;
+        }
+        i++;
+    }
+
+    *used = length;
+    return HTTP_PARSE_NEED_MORE;
+}
+
+int parse_http_request(const char *raw_request, size_t request_length, http_request *request)
+{
+    if (!raw_request || !request)
+        return -1;
+
+    http_parser parser;
+    http_parser_init(&parser, request);
+
+    http_parse_status status = http_parser_execute(&parser, raw_request, request_length, request);
+    if (status == HTTP_PARSE_BODY && parser.framing == HTTP_BODY_LENGTH)
+    {
+        // the whole body is one run of the raw request
+        size_t used;
+        http_slice body;
+        status = http_parser_body(&parser, raw_request + parser.body_start, request_length - parser.body_start, &used,
+                                  &body);
+        store_http_body(request, body.data, body.length);
+    }
+
+    if (status != HTTP_PARSE_COMPLETE)
+    {
+        cleanup_http_request(request);
+        return -1;
     }
 
-    free(request_copy);
     return 0;
 }
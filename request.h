@@ -27,17 +27,66 @@ typedef struct
 
 extern const http_method_entry http_methods[HTTP_METHOD_COUNT];
 
+/*
+ * Borrowed view into the connection's receive buffer. Not NUL-terminated;
+ * valid until the request is cleaned up.
+ */
+typedef struct
+{
+    const char *data;
+    size_t length;
+} http_slice;
+
 typedef struct
 {
     http_method method;
-    char *uri;     // Mutable string for URI
-    char *version; // Mutable string for HTTP version
+    http_slice uri;
+    http_slice version;
 } http_request_line;
 
+/*
+ * Header names the parser recognizes. Each request records where the first
+ * of each one is, so handlers find them without scanning the header list.
+ */
+typedef enum
+{
+    HTTP_HEADER_UNKNOWN,
+    HTTP_HEADER_HOST,
+    HTTP_HEADER_CONNECTION,
+    HTTP_HEADER_CONTENT_LENGTH,
+    HTTP_HEADER_CONTENT_TYPE,
+    HTTP_HEADER_CONTENT_ENCODING,
+    HTTP_HEADER_TRANSFER_ENCODING,
+    HTTP_HEADER_TE,
+    HTTP_HEADER_TRAILER,
+    HTTP_HEADER_EXPECT,
+    HTTP_HEADER_UPGRADE,
+    HTTP_HEADER_KEEP_ALIVE,
+    HTTP_HEADER_USER_AGENT,
+    HTTP_HEADER_ACCEPT,
+    HTTP_HEADER_ACCEPT_ENCODING,
+    HTTP_HEADER_ACCEPT_LANGUAGE,
+    HTTP_HEADER_AUTHORIZATION,
+    HTTP_HEADER_COOKIE,
+    HTTP_HEADER_CACHE_CONTROL,
+    HTTP_HEADER_PRAGMA,
+    HTTP_HEADER_DATE,
+    HTTP_HEADER_IF_MODIFIED_SINCE,
+    HTTP_HEADER_IF_NONE_MATCH,
+    HTTP_HEADER_IF_RANGE,
+    HTTP_HEADER_RANGE,
+    HTTP_HEADER_ORIGIN,
+    HTTP_HEADER_REFERER,
+    HTTP_HEADER_X_FORWARDED_FOR,
+    HTTP_HEADER_X_REQUEST_ID,
+    HTTP_HEADER_COUNT
+} http_header_id;
+
 typedef struct
 {
-    char *name;  // (e.g., "Content-Type")
-    char *value; // (e.g., "application/json")
+    http_slice name;  // (e.g., "Content-Type")
+    http_slice value; // (e.g., "application/json")
+    http_header_id id;
 } http_request_header;
 
 typedef struct
@@ -45,10 +94,75 @@ typedef struct
     http_request_line request_line;
     http_request_header headers[HTTP_MAX_HEADERS];
     int header_count;
-    char *body; // Mutable string for body
+    unsigned char header_index[HTTP_HEADER_COUNT]; // 1 + position of the first of each known header, 0 if absent
+    // the body, or while a body streams the chunk just received; never in the receive buffer
+    const char *body;
     size_t body_length;
+    int body_fd;        // spooled body to read from offset 0, -1 if the body is in memory
+    size_t body_offset; // streaming: body bytes delivered before this chunk
+    int body_partial;   // streaming: more chunks follow this one
 } http_request;
 
+typedef enum
+{
+    HTTP_PARSE_ERROR = -1,
+    HTTP_PARSE_NEED_MORE,
+    HTTP_PARSE_COMPLETE,
+    HTTP_PARSE_BODY // header section complete, a body follows; read it with http_parser_body
+} http_parse_status;
+
+typedef enum
+{
+    HTTP_PARSER_REQUEST_LINE,
+    HTTP_PARSER_HEADERS,
+    HTTP_PARSER_BODY,
+    HTTP_PARSER_DONE
+} http_parser_state;
+
+typedef enum
+{
+    HTTP_BODY_NONE,
+    HTTP_BODY_LENGTH, // Content-Length bytes
+    HTTP_BODY_CHUNKED // Transfer-Encoding: chunked
+} http_body_framing;
+
+typedef enum
+{
+    HTTP_CHUNK_SIZE,      // hex digits of a chunk-size line
+    HTTP_CHUNK_EXTENSION, // rest of the size line, ignored
+    HTTP_CHUNK_SIZE_LF,
+    HTTP_CHUNK_DATA,
+    HTTP_CHUNK_DATA_CR, // line break after the chunk data
+    HTTP_CHUNK_DATA_LF,
+    HTTP_CHUNK_TRAILER // trailer lines, ignored, up to an empty one
+} http_chunk_state;
+
+/*
+ * Resumable request parser. Offsets are relative to the first byte of the
+ * request, so the caller may move its buffer between calls as long as the
+ * request's bytes stay in order.
+ */
+typedef struct
+{
+    http_parser_state state;
+    size_t line_start;     // start of the line being parsed
+    size_t scan;           // bytes already examined; never scanned again
+    size_t marks[2];       // delimiters found so far in the current line
+    int mark_count;
+    size_t body_start;     // first body byte, once headers are complete
+    size_t consumed;       // total request length once complete
+
+    // body framing, decoded by http_parser_body as the body arrives
+    http_body_framing framing;
+    http_chunk_state chunk_state;
+    size_t body_remaining; // left in the body, or in the current chunk
+    size_t body_received;  // decoded body bytes so far
+    size_t line_length;    // bytes of the chunk-size or trailer line so far
+    size_t trailer_size;
+
+    int error_status; // what a request rejected with HTTP_PARSE_ERROR is answered with: 400, or 505
+} http_parser;
+
 /**
  * Initializes an http_request structure.
  *
@@ -57,19 +171,76 @@ typedef struct
 void init_http_request(http_request *request);
 
 /**
- * Cleans up an http_request structure, freeing any allocated memory.
+ * Cleans up an http_request structure. Parsed requests only borrow from
+ * the receive buffer, so this allocates and frees nothing.
  *
  * @param request Pointer to the http_request structure to clean up.
  */
 void cleanup_http_request(http_request *request);
 
 /**
- * Parses a raw HTTP request string into an http_request structure.
+ * Prepares a parser and its request for a new request.
+ *
+ * @param parser Pointer to the http_parser structure to initialize.
+ * @param request Pointer to the http_request structure the parser fills in.
+ */
+void http_parser_init(http_parser *parser, http_request *request);
+
+/**
+ * Prepares a parser to decode a body that did not follow a request it
+ * parsed, such as an upstream's response, with http_parser_body.
+ *
+ * @param parser Pointer to the http_parser structure to initialize.
+ * @param framing HTTP_BODY_LENGTH or HTTP_BODY_CHUNKED.
+ * @param length Body length for HTTP_BODY_LENGTH, ignored otherwise.
+ */
+void http_parser_init_body(http_parser *parser, http_body_framing framing, size_t length);
+
+/**
+ * Feeds the bytes received so far for the current request to the parser.
+ * Only bytes past those seen by earlier calls are examined; complete lines
+ * are parsed into the request as soon as their terminator arrives.
+ *
+ * @param parser Pointer to the parser state.
+ * @param data Pointer to the first byte of the request.
+ * @param length Number of request bytes available, including those already seen.
+ * @param request Pointer to the http_request structure being filled in.
+ * @return HTTP_PARSE_COMPLETE when a request without a body is complete and
+ *         parser->consumed holds its length, HTTP_PARSE_BODY when the header
+ *         section (parser->body_start bytes) is complete and a body follows,
+ *         HTTP_PARSE_NEED_MORE when more bytes are needed, HTTP_PARSE_ERROR if
+ *         the request is malformed or too large (parser->error_status holds
+ *         the status to answer it with).
+ */
+http_parse_status http_parser_execute(http_parser *parser, const char *data, size_t length, http_request *request);
+
+/**
+ * Decodes body bytes received after the header section, following
+ * Content-Length or chunked framing. Each call returns at most one run of
+ * body data, which points into the input, so a caller loops until the input
+ * is used up or the body is complete. Input bytes reported as used are never
+ * needed again, so the caller may discard them between calls.
+ *
+ * @param parser Pointer to a parser that returned HTTP_PARSE_BODY.
+ * @param data Body bytes not yet passed to this function.
+ * @param length Number of bytes available.
+ * @param used Set to the number of input bytes consumed.
+ * @param chunk Set to the body data found, empty if the input held only framing.
+ * @return HTTP_PARSE_COMPLETE once the body (and any trailer) has ended,
+ *         HTTP_PARSE_NEED_MORE if more of it is to come, HTTP_PARSE_ERROR if
+ *         the framing is malformed or the body exceeds HTTP_MAX_BODY_SIZE.
+ */
+http_parse_status http_parser_body(http_parser *parser, const char *data, size_t length, size_t *used,
+                                   http_slice *chunk);
+
+/**
+ * Parses a raw HTTP request string into an http_request structure. A body
+ * must be framed by Content-Length; it is borrowed from the raw request.
  *
  * @param raw_request Pointer to the raw HTTP request string.
  * @param request_length Length of the raw HTTP request string.
  * @param request Pointer to the http_request structure to populate.
- * @return 0 on success, non-zero on failure.
+ * @return 0 on success, non-zero on failure or if the request is incomplete.
  */
 int parse_http_request(const char *raw_request, size_t request_length, http_request *request);
 
@@ -82,17 +253,46 @@ int parse_http_request(const char *raw_request, size_t request_length, http_requ
 http_method find_http_method(const char *method_str);
 
 /**
- * Stores a header in the HTTP request.
+ * Maps a header name to its well-known id with a perfect hash over its
+ * length and first and last bytes, then one comparison.
+ *
+ * @param name Header name, not NUL-terminated.
+ * @param length Length of the name.
+ * @return The id, or HTTP_HEADER_UNKNOWN if the name is not a known header.
+ */
+http_header_id http_header_lookup(const char *name, size_t length);
+
+/**
+ * Returns the canonical spelling of a known header name.
+ *
+ * @param id Header id.
+ * @return Static name string (e.g., "Content-Length"), or NULL for HTTP_HEADER_UNKNOWN.
+ */
+const char *http_header_name(http_header_id id);
+
+/**
+ * Finds a well-known header of a parsed request in constant time.
+ *
+ * @param request Pointer to the http_request structure.
+ * @param id Header to find.
+ * @return The value of its first occurrence, or NULL if the request has none.
+ */
+const http_slice *http_request_find_header(const http_request *request, http_header_id id);
+
+/**
+ * Stores a header in the HTTP request. The name and value are borrowed, not copied.
  *
  * @param request Pointer to the http_request structure.
  * @param name Name of the header.
  * @param value Value of the header.
- * @return 0 on success, non-zero on failure (e.g., if maximum headers exceeded).
+ * @return 0 on success, non-zero on failure (e.g., if maximum headers exceeded,
+ *         or a second Content-Length disagrees with the first).
  */
-int store_http_header(http_request *request, const char *name, const char *value);
+int store_http_header(http_request *request, http_slice name, http_slice value);
 
 /**
- * Stores the body of the HTTP request.
+ * Stores the body of the HTTP request. The body is borrowed, not copied, and
+ * is not moved by http_request_rebase.
  *
  * @param request Pointer to the http_request structure.
  * @param body Pointer to the body data.
@@ -100,4 +300,51 @@ int store_http_header(http_request *request, const char *name, const char *value
  */
 void store_http_body(http_request *request, const char *body, size_t length);
 
+/**
+ * Moves every slice of a request to a new buffer after the bytes they point
+ * into were relocated (e.g., the receive buffer was compacted or grown).
+ *
+ * @param request Pointer to the http_request structure.
+ * @param old_base Former address of the request's first byte.
+ * @param new_base New address of the request's first byte.
+ */
+void http_request_rebase(http_request *request, const char *old_base, const char *new_base);
+
+/**
+ * Compares a slice with a NUL-terminated string.
+ *
+ * @param slice Slice to compare.
+ * @param str String to compare with.
+ * @return Non-zero if they are equal.
+ */
+int http_slice_equals(http_slice slice, const char *str);
+
+/**
+ * Compares a slice with a NUL-terminated string, ignoring ASCII case.
+ *
+ * @param slice Slice to compare.
+ * @param str String to compare with.
+ * @return Non-zero if they are equal ignoring case.
+ */
+int http_slice_equals_ignore_case(http_slice slice, const char *str);
+
+/**
+ * Checks a comma-separated header value (e.g., "keep-alive, Upgrade") for a
+ * token, ignoring ASCII case and optional whitespace.
+ *
+ * @param list Header value to search.
+ * @param token Token to look for.
+ * @return Non-zero if the token is present.
+ */
+int http_slice_has_token(http_slice list, const char *token);
+
+/**
+ * Decides whether the connection stays open after this request: HTTP/1.1
+ * unless "Connection: close", HTTP/1.0 only with "Connection: keep-alive".
+ *
+ * @param request Pointer to a parsed request.
+ * @return Non-zero if the client asked for a persistent connection.
+ */
+int http_request_keep_alive(const http_request *request);
+
 #endif // REQUEST_H
@@ -0,0 +1,135 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "io_stats.h"
+#include "request_body.h"
+
+static int open_spool_file(void);
+static int write_all(int fd, const char *data, size_t length);
+
+void request_body_init(request_body *body)
+{
+    body->data = NULL;
+    body->length = 0;
+    body->capacity = 0;
+    body->fd = -1;
+}
+
+int request_body_append(request_body *body, const char *data, size_t length)
+{
+    if (length == 0)
+        return 0;
+
+    if (body->fd == -1 && body->length + length > REQUEST_BODY_MEMORY_MAX)
+    {
+        // move what is buffered so far to the file and stop buffering
+        int fd = open_spool_file();
+        if (fd == -1)
+            return -1;
+        if (write_all(fd, body->data, body->length) == -1)
+        {
+            close(fd);
+            return -1;
+        }
+        free(body->data);
+        body->data = NULL;
+        body->capacity = 0;
+        body->fd = fd;
+    }
+
+    if (body->fd != -1)
+    {
+        if (write_all(body->fd, data, length) == -1)
+            return -1;
+        body->length += length;
+        return 0;
+    }
+
+    if (body->length + length > body->capacity)
+    {
+        size_t capacity = body->capacity ? body->capacity : REQUEST_BODY_INITIAL;
+        while (capacity < body->length + length)
+            capacity *= 2;
+        if (capacity > REQUEST_BODY_MEMORY_MAX)
+            capacity = REQUEST_BODY_MEMORY_MAX;
+
+        char *data_buf = realloc(body->data, capacity);
+        if (!data_buf)
+        {
+            fprintf(stderr, "Error: Unable to allocate memory for request body\n");
+            return -1;
+        }
+        body->data = data_buf;
+        body->capacity = capacity;
+    }
+
+    memcpy(body->data + body->length, data, length);
+    body->length += length;
+    return 0;
+}
+
+int request_body_take_fd(request_body *body)
+{
+    int fd = body->fd;
+    body->fd = -1;
+    return fd;
+}
+
+void request_body_reset(request_body *body)
+{
+    free(body->data);
+    if (body->fd != -1)
+        close(body->fd);
+    request_body_init(body);
+}
+
+static int open_spool_file(void)
+{
+    const char *dir = getenv("TMPDIR");
+    if (!dir || dir[0] == '\0')
+        dir = "/tmp";
+
+    // O_TMPFILE never gets a name, so nothing is left behind on a crash
+    int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd != -1 || (errno != EOPNOTSUPP && errno != EISDIR))
+    {
+        if (fd == -1)
+            perror("Failed to open request body spool file");
+        return fd;
+    }
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/http-body-XXXXXX", dir);
+    fd = mkostemp(path, O_CLOEXEC);
+    if (fd == -1)
+    {
+        perror("Failed to create request body spool file");
+        return -1;
+    }
+    unlink(path);
+    return fd;
+}
+
+static int write_all(int fd, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        io_stats_syscall();
+        ssize_t n = write(fd, data, length);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("Failed to spool request body");
+            return -1;
+        }
+        data += n;
+        length -= n;
+    }
+    return 0;
+}
@@ -0,0 +1,58 @@
+#ifndef REQUEST_BODY_H
+#define REQUEST_BODY_H
+
+#include <stddef.h> // size_t
+
+#define REQUEST_BODY_MEMORY_MAX (64 * 1024) // bytes kept in memory before the body is spooled to a file
+#define REQUEST_BODY_INITIAL 4096
+
+/*
+ * A request body collected for a handler that wants it whole. Small bodies
+ * stay in a heap buffer; once one outgrows REQUEST_BODY_MEMORY_MAX it moves
+ * to an unlinked temporary file, so a connection never holds more than that
+ * much of an upload in memory.
+ */
+typedef struct
+{
+    char *data; // in-memory body, NULL once spooled
+    size_t length;
+    size_t capacity;
+    int fd; // spool file, -1 while the body is in memory
+} request_body;
+
+/**
+ * Initializes an empty body. Nothing is allocated until data is appended.
+ *
+ * @param body Pointer to the request_body structure to initialize.
+ */
+void request_body_init(request_body *body);
+
+/**
+ * Appends received body bytes, spooling the body to a temporary file in
+ * $TMPDIR (default /tmp) once it outgrows REQUEST_BODY_MEMORY_MAX.
+ *
+ * @param body Pointer to the request body.
+ * @param data Bytes to append.
+ * @param length Number of bytes.
+ * @return 0 on success, -1 if memory or the spool file could not take them.
+ */
+int request_body_append(request_body *body, const char *data, size_t length);
+
+/**
+ * Takes over the spool file of a spooled body, e.g. to send it with
+ * sendfile after the body has been reset.
+ *
+ * @param body Pointer to the request body.
+ * @return The file descriptor, which the caller must close, or -1 if the
+ *         body is in memory.
+ */
+int request_body_take_fd(request_body *body);
+
+/**
+ * Frees the buffer and closes the spool file, leaving an empty body.
+ *
+ * @param body Pointer to the request body.
+ */
+void request_body_reset(request_body *body);
+
+#endif // REQUEST_BODY_H
@@ -2,16 +2,36 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "my_http.h"
+#include "request.h"
 #include "response.h"
 
 char *status_line_error = "HTTP/1.1 500 Internal Server Error\r\n\r\n";
 
+// codes the list leaves out stay zeroed: no reason, no line
 const http_status_entry http_statuses[HTTP_STATUS_COUNT] = {
-    {HTTP_OK, "OK"}, {HTTP_NOT_FOUND, "Not Found"}, {HTTP_INTERNAL_SERVER_ERROR, "Internal Server Error"}};
+#define HTTP_STATUS_ENTRY(code, name, reason)                                                                         \
+    [code - HTTP_STATUS_MIN] = {HTTP_##name, reason, HTTP_VERSION " " #code " " reason "\r\n",                          \
+                                sizeof(HTTP_VERSION " " #code " " reason "\r\n") - 1},
+    HTTP_STATUS_LIST(HTTP_STATUS_ENTRY)
+#undef HTTP_STATUS_ENTRY
+};
+
+// "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n", rewritten when the second changes
+typedef struct
+{
+    time_t second;
+    char field[48];
+    size_t length;
+} date_cache;
+
+static __thread date_cache date;
 
-static void set_http_headers(http_response *response, const char *headers);
+static int build_response(arena *a, const char *version, http_status_code code, const char *body, size_t length,
+                          const char *headers, int send_date, struct iovec iov[HTTP_RESPONSE_IOV_COUNT]);
+static char *append(char *out, const char *str, size_t length);
 
 void print_hex(const char *str, size_t len)
 {
@@ -34,53 +54,98 @@ void debug_response(http_response *response)
         printf("%s: %s\t", response->headers[i].name, response->headers[i].value);
         print_hex(response->headers[i].name, strlen(response->headers[i].name));
     }
-    printf("Body: %s\t", response->body);
+    printf("Body: %.*s\t", (int)response->body_length, response->body ? response->body : "");
     print_hex(response->body, response->body_length);
 }
 
-char *build_http_response(const char *version, http_status_code code, const char *body, size_t length,
-                          const char *headers)
+int build_http_response(arena *a, const char *version, http_status_code code, const char *body, size_t length,
+                        const char *headers, struct iovec iov[HTTP_RESPONSE_IOV_COUNT])
 {
-    http_response *response = malloc(sizeof(http_response));
-    if (!response)
-    {
-        fprintf(stderr, "Error: Unable to allocate memory for response\n");
-        return NULL;
-    }
+    return build_response(a, version, code, body, length, headers, 1, iov);
+}
 
-    init_http_response(response, version);
-    set_http_status(response, code);
+int prebuild_http_response(http_prebuilt_response *response, const char *version, http_status_code code,
+                           const char *body, size_t length, const char *headers)
+{
+    arena scratch;
+    arena_init(&scratch, ARENA_INITIAL_SIZE);
 
-    if (headers)
+    struct iovec iov[HTTP_RESPONSE_IOV_COUNT];
+    // the Date field is spliced in at send time like the other per-request fields
+    int count = build_response(&scratch, version, code, body, length, headers, 0, iov);
+    if (count == -1)
     {
-        set_http_headers(response, headers);
+        arena_destroy(&scratch);
+        return -1;
     }
 
-    if (body)
+    size_t size = 0;
+    for (int i = 0; i < count; i++)
+        size += iov[i].iov_len;
+
+    response->data = malloc(size);
+    if (!response->data)
     {
-        set_http_body(response, body, length);
+        fprintf(stderr, "Error: Unable to allocate memory for response\n");
+        arena_destroy(&scratch);
+        return -1;
     }
 
-    char *response_str = format_http_response(response);
+    char *out = response->data;
+    for (int i = 0; i < count; i++)
+        out = append(out, iov[i].iov_base, iov[i].iov_len);
+    response->length = size;
+    response->head_length = iov[0].iov_len - 2; // fields go before the blank line
+    response->status = code;
 
-#ifdef DEBUG
-    printf("=== Response ===\n");
-    debug_response(response);
-    printf("=== Response ===\n");
-#endif
+    arena_destroy(&scratch);
+    return 0;
+}
 
-    cleanup_http_response(response);
+int prebuilt_http_response_iov(const http_prebuilt_response *response, const struct iovec *fields, int field_count,
+                               int head_only, struct iovec iov[HTTP_PREBUILT_IOV_COUNT])
+{
+    if (field_count < 0 || field_count > HTTP_PREBUILT_MAX_FIELDS)
+        return -1;
 
-    return response_str;
+    // the blank line, and the body unless the head is all that is sent
+    size_t rest = head_only ? 2 : response->length - response->head_length;
+
+    if (field_count == 0)
+    {
+        iov[0].iov_base = response->data;
+        iov[0].iov_len = response->head_length + rest;
+        return 1;
+    }
+
+    iov[0].iov_base = response->data;
+    iov[0].iov_len = response->head_length;
+    memcpy(iov + 1, fields, field_count * sizeof(struct iovec));
+    iov[field_count + 1].iov_base = response->data + response->head_length;
+    iov[field_count + 1].iov_len = rest;
+    return field_count + 2;
 }
 
-void init_http_response(http_response *response, const char *version)
+void free_prebuilt_http_response(http_prebuilt_response *response)
+{
+    free(response->data);
+    response->data = NULL;
+    response->length = 0;
+    response->head_length = 0;
+}
+
+void init_http_response(http_response *response, arena *a, const char *version)
 {
     if (response)
     {
-        response->version = version ? strdup(version) : strdup("HTTP/1.1");
-        response->status = http_statuses[0]; // Default to HTTP_OK
+        response->arena = a;
+        response->version = version ? version : "HTTP/1.1";
+        response->status = http_statuses[HTTP_OK - HTTP_STATUS_MIN];
         response->header_count = 0;
+        response->fields = NULL;
+        response->fields_length = 0;
+        response->send_date = 1;
+        response->content_length_header = -1;
         response->body = NULL;
         response->body_length = 0;
     }
@@ -90,57 +155,113 @@ void cleanup_http_response(http_response *response)
 {
     if (response)
     {
-        if (response->version)
-        {
-            free((void *)response->version);
-            response->version = NULL;
-        }
-        for (int i = 0; i < response->header_count; i++)
-        {
-            if (response->headers[i].name)
-            {
-                free((void *)response->headers[i].name);
-                response->headers[i].name = NULL;
-            }
-            if (response->headers[i].value)
-            {
-                free((void *)response->headers[i].value);
-                response->headers[i].value = NULL;
-            }
-        }
+        response->version = NULL;
         response->header_count = 0;
-        if (response->body)
-        {
-            free(response->body);
-            response->body = NULL;
-            response->body_length = 0;
-        }
+        response->fields = NULL;
+        response->fields_length = 0;
+        response->content_length_header = -1;
+        response->body = NULL;
+        response->body_length = 0;
     }
 }
 
 void set_http_status(http_response *response, http_status_code code)
 {
     assert(response);
+    const http_status_entry *entry = find_http_status(code);
+    if (entry)
+    {
+        response->status = *entry;
+        return;
+    }
+
+    // RFC 9110 15: an unregistered code is sent with an empty reason phrase
+    if (code < HTTP_STATUS_MIN || code >= HTTP_STATUS_MIN + HTTP_STATUS_COUNT)
+    {
+        fprintf(stderr, "Error: Status code %d is out of range\n", (int)code);
+        response->status = http_statuses[HTTP_INTERNAL_SERVER_ERROR - HTTP_STATUS_MIN];
+        return;
+    }
     response->status.code = code;
-    response->status.reason = find_http_status(code)->reason;
+    response->status.reason = "";
+    response->status.line = NULL;
+    response->status.line_length = 0;
 }
 
 const http_status_entry *find_http_status(http_status_code code)
 {
-    for (size_t i = 0; i < HTTP_STATUS_COUNT; i++)
-        if (http_statuses[i].code == code)
-            return &http_statuses[i];
-    return NULL;
+    if (code < HTTP_STATUS_MIN || code >= HTTP_STATUS_MIN + HTTP_STATUS_COUNT)
+        return NULL;
+    const http_status_entry *entry = &http_statuses[code - HTTP_STATUS_MIN];
+    return entry->reason ? entry : NULL;
+}
+
+const char *http_date_field(size_t *length)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+    if (now.tv_sec != date.second || date.length == 0)
+    {
+        struct tm tm;
+        gmtime_r(&now.tv_sec, &tm);
+        date.length = strftime(date.field, sizeof(date.field), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+        date.second = now.tv_sec;
+    }
+    *length = date.length;
+    return date.field;
+}
+
+size_t http_format_decimal(char *out, unsigned long long value)
+{
+    static const char digit_pairs[201] = "00010203040506070809"
+                                         "10111213141516171819"
+                                         "20212223242526272829"
+                                         "30313233343536373839"
+                                         "40414243444546474849"
+                                         "50515253545556575859"
+                                         "60616263646566676869"
+                                         "70717273747576777879"
+                                         "80818283848586878889"
+                                         "90919293949596979899";
+
+    // written backwards from the end of a scratch buffer, two digits a step
+    char buffer[HTTP_DECIMAL_MAX_LEN];
+    char *p = buffer + sizeof(buffer);
+    while (value >= 100)
+    {
+        const char *pair = digit_pairs + (value % 100) * 2;
+        value /= 100;
+        *--p = pair[1];
+        *--p = pair[0];
+    }
+    if (value >= 10)
+    {
+        *--p = digit_pairs[value * 2 + 1];
+        *--p = digit_pairs[value * 2];
+    }
+    else
+        *--p = '0' + value;
+
+    size_t length = buffer + sizeof(buffer) - p;
+    memcpy(out, p, length);
+    out[length] = '\0';
+    return length;
 }
 
 int add_http_header(http_response *response, const char *name, const char *value)
 {
     if (response && response->header_count < HTTP_MAX_HEADERS)
     {
-        response->headers[response->header_count].name = strdup(name);
-        response->headers[response->header_count].value = strdup(value);
-        if (response->headers[response->header_count].name && response->headers[response->header_count].value)
+        http_header *header = &response->headers[response->header_count];
+        header->name_length = strlen(name);
+        header->value_length = strlen(value);
+        header->name = arena_strndup(response->arena, name, header->name_length);
+        header->value = arena_strndup(response->arena, value, header->value_length);
+        if (header->name && header->value)
         {
+            if (response->content_length_header == -1 &&
+                http_header_lookup(name, header->name_length) == HTTP_HEADER_CONTENT_LENGTH)
+                response->content_length_header = response->header_count;
             response->header_count++;
             return 0;
         }
@@ -158,13 +279,7 @@ void set_http_body(http_response *response, const char *body, size_t length)
 {
     if (response)
     {
-        if (response->body)
-        {
-            free(response->body);
-            response->body = NULL;
-            response->body_length = 0;
-        }
-        response->body = body ? strndup(body, length) : NULL;
+        response->body = body;
         if (body)
         {
             response->body_length = length;
@@ -175,24 +290,15 @@ void set_http_body(http_response *response, const char *body, size_t length)
         }
 
         // Automatically set Content-Length header
-        char content_length[20];
+        char content_length[HTTP_DECIMAL_MAX_LEN];
+        size_t content_length_length = http_format_decimal(content_length, length);
 
-        snprintf(content_length, sizeof(content_length), "%zu", length);
-        // Remove the old Content-Length header if it exists
-        // assumes that the Content-Length header is unique and only appears once
-        int found = -1;
-        for (int i = 0; i < response->header_count; i++)
-        {
-            if (strcasecmp(response->headers[i].name, "Content-Length") == 0)
-            {
-                found = i;
-                break;
-            }
-        }
+        // Replace the old Content-Length header if it exists
+        int found = response->content_length_header;
         if (found != -1)
         {
-            free((void *)response->headers[found].value);
-            response->headers[found].value = strdup(content_length);
+            response->headers[found].value = arena_strndup(response->arena, content_length, content_length_length);
+            response->headers[found].value_length = content_length_length;
             if (!response->headers[found].value)
                 fprintf(stderr, "Error: Unable to allocate memory for header value\n");
         }
@@ -203,80 +309,145 @@ void set_http_body(http_response *response, const char *body, size_t length)
     }
 }
 
-char *format_http_response(const http_response *response)
+static int build_response(arena *a, const char *version, http_status_code code, const char *body, size_t length,
+                          const char *headers, int send_date, struct iovec iov[HTTP_RESPONSE_IOV_COUNT])
 {
+    http_response *response = arena_alloc(a, sizeof(http_response));
     if (!response)
-        return NULL;
-
-    // estimate the size needed
-    size_t size = 0;
-    size += strlen(response->version) + 1; // version + space + null terminator
-    size += MAX_STATUS_LEN;                // status code and reason
-    size += 2;                             // CRLF
-
-    for (int i = 0; i < response->header_count; i++)
     {
-        size += strlen(response->headers[i].name) + 2;  // header name + colon + space
-        size += strlen(response->headers[i].value) + 2; // header value + CRLF
+        fprintf(stderr, "Error: Unable to allocate memory for response\n");
+        return -1;
     }
 
-    size += 2; // CRLF after headers
+    init_http_response(response, a, version);
+    set_http_status(response, code);
 
-    size += response->body_length;
+    response->send_date = send_date;
 
-    if (size > HTTP_MAX_RESPONSE_SIZE)
+    if (headers)
     {
-        fprintf(stderr, "Error: Response size exceeds maximum size\n");
-        return NULL;
+        response->fields = headers;
+        response->fields_length = strlen(headers);
     }
 
-    char *response_str = malloc(size + 1); // +1 for null terminator
-    if (!response_str)
+    if (body)
     {
-        fprintf(stderr, "Error: Unable to allocate memory for response\n");
-        return NULL;
+        set_http_body(response, body, length);
     }
 
-    // initialize the response string
-    response_str[0] = '\0';
+    int count = serialize_http_response(response, iov);
 
-    // start formatting
-    char status_line[MAX_STATUS_LEN];
-    snprintf(status_line, sizeof(status_line), "%s %d %s\r\n", response->version, response->status.code,
-             response->status.reason);
-    strncat(response_str, status_line, size + 1 - strlen(response_str)); // +1 for null terminator
+#ifdef DEBUG
+    printf("=== Response ===\n");
+    debug_response(response);
+    printf("=== Response ===\n");
+#endif
+
+    cleanup_http_response(response);
+
+    return count;
+}
+
+static char *append(char *out, const char *str, size_t length)
+{
+    memcpy(out, str, length);
+    return out + length;
+}
 
+int serialize_http_response(const http_response *response, struct iovec iov[HTTP_RESPONSE_IOV_COUNT])
+{
+    if (!response)
+        return -1;
+
+    // the table's line is only right for the version it was formatted with
+    const char *line = response->status.line;
+    size_t line_length = response->status.line_length;
+    if (!line || strcmp(response->version, HTTP_VERSION) != 0)
+        line = NULL;
+
+    size_t version_length = 0;
+    size_t reason_length = 0;
+    if (!line)
+    {
+        // "<version> <code> <reason>\r\n"
+        version_length = strlen(response->version);
+        reason_length = strlen(response->status.reason);
+        line_length = version_length + 5 + reason_length + 2;
+    }
+
+    size_t date_length = 0;
+    const char *date_field = response->send_date ? http_date_field(&date_length) : NULL;
+
+    // status line, Date, preformatted fields, headers, blank line
+    size_t size = line_length + date_length + response->fields_length;
     for (int i = 0; i < response->header_count; i++)
+        size += response->headers[i].name_length + 2 + response->headers[i].value_length + 2;
+    size += 2;
+
+    char *head = arena_alloc(response->arena, size);
+    if (!head)
     {
-        char header_line[HTTP_HEADER_NAME_MAX_LEN + HTTP_HEADER_VALUE_MAX_LEN + 4]; // 2 for colon and space, 2 for CRLF
-        snprintf(header_line, sizeof(header_line), "%s: %s\r\n", response->headers[i].name, response->headers[i].value);
-        strncat(response_str, header_line, size + 1 - strlen(response_str));
+        fprintf(stderr, "Error: Unable to allocate memory for response\n");
+        return -1;
     }
 
-    strncat(response_str, "\r\n", size + 1 - strlen(response_str)); // end of headers
+    char *out = head;
+    if (line)
+        out = append(out, line, line_length);
+    else
+    {
+        unsigned int code = response->status.code;
+        char status_code[5] = {' ', '0' + code / 100 % 10, '0' + code / 10 % 10, '0' + code % 10, ' '};
+        out = append(out, response->version, version_length);
+        out = append(out, status_code, sizeof(status_code));
+        out = append(out, response->status.reason, reason_length);
+        out = append(out, "\r\n", 2);
+    }
+    if (date_field)
+        out = append(out, date_field, date_length);
+    if (response->fields)
+        out = append(out, response->fields, response->fields_length);
+    for (int i = 0; i < response->header_count; i++)
+    {
+        out = append(out, response->headers[i].name, response->headers[i].name_length);
+        out = append(out, ": ", 2);
+        out = append(out, response->headers[i].value, response->headers[i].value_length);
+        out = append(out, "\r\n", 2);
+    }
+    out = append(out, "\r\n", 2);
 
-    if (response->body && response->body_length > 0)
-        strncat(response_str, response->body, size + 1 - strlen(response_str));
+    iov[0].iov_base = head;
+    iov[0].iov_len = size;
+    if (!response->body || response->body_length == 0)
+        return 1;
 
-    return response_str;
+    iov[1].iov_base = (void *)response->body;
+    iov[1].iov_len = response->body_length;
+    return 2;
 }
 
-static void set_http_headers(http_response *response, const char *headers)
+char *format_http_response(const http_response *response)
 {
-    if (response && headers)
+    struct iovec iov[HTTP_RESPONSE_IOV_COUNT];
+    int count = serialize_http_response(response, iov);
+    if (count == -1)
+        return NULL;
+
+    size_t size = 0;
+    for (int i = 0; i < count; i++)
+        size += iov[i].iov_len;
+
+    char *response_str = arena_alloc(response->arena, size + 1); // +1 for null terminator
+    if (!response_str)
     {
-        char *header = strdup(headers);
-        char *header_line = strtok(header, "\r\n");
-        while (header_line)
-        {
-            char *name = strtok(header_line, ":");
-            char *value = strtok(NULL, ":");
-            if (name && value)
-            {
-                add_http_header(response, name, value);
-            }
-            header_line = strtok(NULL, "\r\n");
-        }
-        free(header);
+        fprintf(stderr, "Error: Unable to allocate memory for response\n");
+        return NULL;
     }
-}
\ No newline at end of file
+
+    char *out = response_str;
+    for (int i = 0; i < count; i++)
+        out = append(out, iov[i].iov_base, iov[i].iov_len);
+    *out = '\0';
+
+    return response_str;
+}
@@ -1,69 +1,195 @@
 #ifndef RESPONSE_H
 #define RESPONSE_H
 
+#include "arena.h"
 #include "my_http.h"
-#include <stddef.h> // size_t
+#include <stddef.h>  // size_t
+#include <sys/uio.h> // struct iovec
+
+#define HTTP_RESPONSE_IOV_COUNT 2 // status line and headers, body
+#define HTTP_PREBUILT_MAX_FIELDS 4 // per-request header lines spliced into a prebuilt response
+#define HTTP_PREBUILT_IOV_COUNT (HTTP_PREBUILT_MAX_FIELDS + 2)
+#define HTTP_DECIMAL_MAX_LEN 21 // digits of the largest unsigned long long and a NUL
+
+/*
+ * The status codes of RFC 9110 section 15, plus 428, 429 and 431 from
+ * RFC 6585, as X(code, name, reason); expanded into the enum below and into
+ * the table of preformatted status lines.
+ */
+#define HTTP_STATUS_LIST(X)                                                                                           \
+    X(100, CONTINUE, "Continue")                                                                                      \
+    X(101, SWITCHING_PROTOCOLS, "Switching Protocols")                                                                \
+    X(200, OK, "OK")                                                                                                  \
+    X(201, CREATED, "Created")                                                                                        \
+    X(202, ACCEPTED, "Accepted")                                                                                      \
+    X(203, NON_AUTHORITATIVE_INFORMATION, "Non-Authoritative Information")                                            \
+    X(204, NO_CONTENT, "No Content")                                                                                  \
+    X(205, RESET_CONTENT, "Reset Content")                                                                            \
+    X(206, PARTIAL_CONTENT, "Partial Content")                                                                        \
+    X(300, MULTIPLE_CHOICES, "Multiple Choices")                                                                      \
+    X(301, MOVED_PERMANENTLY, "Moved Permanently")                                                                    \
+    X(302, FOUND, "Found")                                                                                            \
+    X(303, SEE_OTHER, "See Other")                                                                                    \
+    X(304, NOT_MODIFIED, "Not Modified")                                                                              \
+    X(305, USE_PROXY, "Use Proxy")                                                                                    \
+    X(307, TEMPORARY_REDIRECT, "Temporary Redirect")                                                                  \
+    X(308, PERMANENT_REDIRECT, "Permanent Redirect")                                                                  \
+    X(400, BAD_REQUEST, "Bad Request")                                                                                \
+    X(401, UNAUTHORIZED, "Unauthorized")                                                                              \
+    X(402, PAYMENT_REQUIRED, "Payment Required")                                                                      \
+    X(403, FORBIDDEN, "Forbidden")                                                                                    \
+    X(404, NOT_FOUND, "Not Found")                                                                                    \
+    X(405, METHOD_NOT_ALLOWED, "Method Not Allowed")                                                                  \
+    X(406, NOT_ACCEPTABLE, "Not Acceptable")                                                                          \
+    X(407, PROXY_AUTHENTICATION_REQUIRED, "Proxy Authentication Required")                                            \
+    X(408, REQUEST_TIMEOUT, "Request Timeout")                                                                        \
+    X(409, CONFLICT, "Conflict")                                                                                      \
+    X(410, GONE, "Gone")                                                                                              \
+    X(411, LENGTH_REQUIRED, "Length Required")                                                                        \
+    X(412, PRECONDITION_FAILED, "Precondition Failed")                                                                \
+    X(413, CONTENT_TOO_LARGE, "Content Too Large")                                                                    \
+    X(414, URI_TOO_LONG, "URI Too Long")                                                                              \
+    X(415, UNSUPPORTED_MEDIA_TYPE, "Unsupported Media Type")                                                          \
+    X(416, RANGE_NOT_SATISFIABLE, "Range Not Satisfiable")                                                            \
+    X(417, EXPECTATION_FAILED, "Expectation Failed")                                                                  \
+    X(421, MISDIRECTED_REQUEST, "Misdirected Request")                                                                \
+    X(422, UNPROCESSABLE_CONTENT, "Unprocessable Content")                                                            \
+    X(426, UPGRADE_REQUIRED, "Upgrade Required")                                                                      \
+    X(428, PRECONDITION_REQUIRED, "Precondition Required")                                                            \
+    X(429, TOO_MANY_REQUESTS, "Too Many Requests")                                                                    \
+    X(431, REQUEST_HEADER_FIELDS_TOO_LARGE, "Request Header Fields Too Large")                                        \
+    X(500, INTERNAL_SERVER_ERROR, "Internal Server Error")                                                            \
+    X(501, NOT_IMPLEMENTED, "Not Implemented")                                                                        \
+    X(502, BAD_GATEWAY, "Bad Gateway")                                                                                \
+    X(503, SERVICE_UNAVAILABLE, "Service Unavailable")                                                                \
+    X(504, GATEWAY_TIMEOUT, "Gateway Timeout")                                                                        \
+    X(505, HTTP_VERSION_NOT_SUPPORTED, "HTTP Version Not Supported")
 
 typedef enum
 {
-    HTTP_OK = 200,
-    HTTP_NOT_FOUND = 404,
-    HTTP_INTERNAL_SERVER_ERROR = 500
+#define HTTP_STATUS_ENUM(code, name, reason) HTTP_##name = code,
+    HTTP_STATUS_LIST(HTTP_STATUS_ENUM)
+#undef HTTP_STATUS_ENUM
 } http_status_code;
 
 typedef struct
 {
     http_status_code code;
-    const char *reason;
+    const char *reason; // NULL for codes the table does not define
+    const char *line;   // "HTTP/1.1 200 OK\r\n", NULL if the code has none
+    size_t line_length;
 } http_status_entry;
 
 typedef struct
 {
     const char *name;
     const char *value;
+    size_t name_length;
+    size_t value_length;
 } http_header;
 
 typedef struct
 {
+    arena *arena; // owns the header copies and the serialized head
     const char *version;
     http_status_entry status;
     http_header headers[HTTP_MAX_HEADERS];
     int header_count;
-    char *body;
+    const char *fields; // preformatted header lines ("Name: value\r\n..."), copied before headers
+    size_t fields_length;
+    int send_date; // emit the worker's Date field; off for responses serialized once and sent later
+    int content_length_header; // index of the Content-Length header, -1 if there is none
+    const char *body; // not copied; must outlive the send
     size_t body_length;
 } http_response;
 
+/*
+ * A response serialized once at startup and sent by reference on every
+ * request. Header lines that vary per request (Date, Connection) are spliced
+ * in before the blank line at send time, so the buffer is never written to
+ * again and all workers can share it.
+ */
+typedef struct
+{
+    char *data;         // status line, headers, blank line, body
+    size_t length;
+    size_t head_length; // status line and headers, up to the blank line
+    http_status_code status;
+} http_prebuilt_response;
+
+// indexed by code - HTTP_STATUS_MIN
 extern const http_status_entry http_statuses[HTTP_STATUS_COUNT];
 
 /** 
- * Builds an HTTP response string.
+ * Builds an HTTP response ready for a gathering write.
  * 
+ * @param a Arena the response and its head are allocated from.
  * @param version HTTP version string (e.g., "HTTP/1.1").
  * @param code HTTP status code.
- * @param body Pointer to the body data.
+ * @param body Pointer to the body data, referenced rather than copied.
  * @param length Length of the body data.
- * @return Pointer to a newly allocated string containing the raw HTTP response.
- * The caller is responsible for freeing this memory.
+ * @param headers Header lines ("Name: value\r\n..."), copied verbatim, or NULL. Content-Length is added.
+ * @param iov Set to the serialized head and the body.
+ * @return Number of iovec entries used, or -1 on failure.
+ */
+int build_http_response(arena *a, const char *version, http_status_code code, const char *body, size_t length,
+                        const char *headers, struct iovec iov[HTTP_RESPONSE_IOV_COUNT]);
+
+/**
+ * Serializes a response whose status, headers and body never change into
+ * one heap buffer.
+ *
+ * @param response Set to the serialized response.
+ * @param version HTTP version string (e.g., "HTTP/1.1").
+ * @param code HTTP status code.
+ * @param body Pointer to the body data, copied into the buffer.
+ * @param length Length of the body data.
+ * @param headers Header lines ("Name: value\r\n..."), copied verbatim, or NULL. Content-Length is added.
+ * @return 0 on success, -1 on failure.
+ */
+int prebuild_http_response(http_prebuilt_response *response, const char *version, http_status_code code,
+                           const char *body, size_t length, const char *headers);
+
+/**
+ * Points an iovec array at a prebuilt response with per-request header lines
+ * spliced in. With no fields the whole response is a single entry.
+ *
+ * @param response Response from prebuild_http_response.
+ * @param fields Complete header lines ("Name: value\r\n"), or NULL.
+ * @param field_count Number of fields, at most HTTP_PREBUILT_MAX_FIELDS.
+ * @param head_only Leave the body out, as for HEAD; Content-Length still gives its length.
+ * @param iov Set to the pieces of the response in order.
+ * @return Number of iovec entries used, or -1 if there are too many fields.
+ */
+int prebuilt_http_response_iov(const http_prebuilt_response *response, const struct iovec *fields, int field_count,
+                               int head_only, struct iovec iov[HTTP_PREBUILT_IOV_COUNT]);
+
+/**
+ * Frees the buffer of a prebuilt response.
+ *
+ * @param response Response from prebuild_http_response.
  */
-char *build_http_response(const char *version, http_status_code code, const char *body, size_t length, const char *headers);
+void free_prebuilt_http_response(http_prebuilt_response *response);
 
 /**
  * Initializes an http_response structure.
  *
  * @param response Pointer to the http_response structure to initialize.
+ * @param a Arena the response's strings are allocated from.
  * @param version HTTP version string (e.g., "HTTP/1.1").
  */
-void init_http_response(http_response *response, const char *version);
+void init_http_response(http_response *response, arena *a, const char *version);
 
 /**
- * Cleans up an http_response structure, freeing any allocated memory.
+ * Clears an http_response structure. Its memory is released with the arena.
  *
  * @param response Pointer to the http_response structure to clean up.
  */
 void cleanup_http_response(http_response *response);
 
 /**
- * Sets the HTTP status for the response.
+ * Sets the HTTP status for the response. A code missing from the table is
+ * sent with an empty reason phrase; one outside 100-599 becomes 500.
  *
  * @param response Pointer to the http_response structure.
  * @param code The HTTP status code to set.
@@ -71,7 +197,7 @@ void cleanup_http_response(http_response *response);
 void set_http_status (http_response *response, http_status_code code);
 
 /**
- * Finds an HTTP status entry based on the status code.
+ * Finds an HTTP status entry based on the status code, by indexing the table.
  *
  * @param code The HTTP status code to find.
  * @return Pointer to the corresponding http_status_entry, or NULL if not found.
@@ -89,29 +215,50 @@ const http_status_entry *find_http_status(http_status_code code);
 int add_http_header (http_response *response, const char *name, const char *value);
 
 /**
- * Sets the body of the HTTP response.
+ * Sets the body of the HTTP response and its Content-Length header.
  *
  * @param response Pointer to the http_response structure.
- * @param body Pointer to the body data.
+ * @param body Pointer to the body data. Not copied, so it must stay valid
+ *             until the response is sent.
  * @param length Length of the body data.
  */
 void set_http_body(http_response *response, const char *body, size_t length);
 
 /**
- * Formats the http_response structure into a raw HTTP response string.
+ * Serializes the status line and headers into the response's arena in one
+ * pass. The body is referenced, not copied, and may contain NUL bytes.
  *
  * @param response Pointer to the http_response structure.
- * @return Pointer to a newly allocated string containing the raw HTTP response.
- *         The caller is responsible for freeing this memory.
+ * @param iov Set to the serialized head and, if there is one, the body.
+ * @return Number of iovec entries used, or -1 on failure.
+ */
+int serialize_http_response(const http_response *response, struct iovec iov[HTTP_RESPONSE_IOV_COUNT]);
+
+/**
+ * Formats the http_response structure into one contiguous raw HTTP response
+ * string. Copies the body; the server sends serialize_http_response output.
+ *
+ * @param response Pointer to the http_response structure.
+ * @return Pointer to the raw HTTP response in the response's arena.
  */
 char *format_http_response(const http_response *response);
 
 /**
- * Finds an HTTP status code in the http_statuses array.
+ * Returns the worker's "Date: ...\r\n" field in the IMF-fixdate format of
+ * RFC 9110 5.6.7, formatted again only when the second has changed.
  *
- * @param code The HTTP status code to find.
- * @return Pointer to the corresponding http_status_entry, or NULL if not found.
+ * @param length Set to the length of the field.
+ * @return The field, valid until the thread's next call.
  */
-const http_status_entry *find_http_status(http_status_code code);
+const char *http_date_field(size_t *length);
+
+/**
+ * Writes a number in decimal, without snprintf.
+ *
+ * @param out Buffer of at least HTTP_DECIMAL_MAX_LEN bytes.
+ * @param value Number to format.
+ * @return Number of digits written; out is NUL-terminated after them.
+ */
+size_t http_format_decimal(char *out, unsigned long long value);
 
 #endif // RESPONSE_H
\ No newline at end of file
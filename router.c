@@ -0,0 +1,378 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "router.h"
+
+static router_node *new_node(const char *label, size_t length);
+static void free_node(router_node *node);
+static router_node *static_child(router_node *node, const char *text, size_t length);
+static router_node *param_child(router_node *node, const char *name, size_t length);
+static int add_child(router_node *node, router_node *child);
+static int split_node(router_node *node, size_t length);
+static int set_handlers(route_handler *slots, unsigned int *mask, int method, route_handler handler);
+static int number_route(router *r, int *route, const char *pattern);
+static route_handler match_node(const router_node *node, http_method method, const char *path, size_t length,
+                                route_match *match);
+
+int router_init(router *r)
+{
+    r->patterns = NULL;
+    r->route_count = 0;
+    r->root = new_node("", 0);
+    return r->root ? 0 : -1;
+}
+
+void router_destroy(router *r)
+{
+    if (r->root)
+        free_node(r->root);
+    r->root = NULL;
+    for (int i = 0; i < r->route_count; i++)
+        free(r->patterns[i]);
+    free(r->patterns);
+    r->patterns = NULL;
+    r->route_count = 0;
+}
+
+int router_add(router *r, int method, const char *pattern, route_handler handler)
+{
+    if (!pattern || pattern[0] != '/' || !handler || method < ROUTER_ANY_METHOD || method >= ROUTER_METHOD_SLOTS)
+    {
+        fprintf(stderr, "Error: Invalid route %s\n", pattern ? pattern : "(null)");
+        return -1;
+    }
+
+    router_node *node = r->root;
+    const char *p = pattern;
+    while (*p)
+    {
+        if (*p == '*')
+        {
+            if (p[1] != '\0')
+            {
+                fprintf(stderr, "Error: '*' must end route %s\n", pattern);
+                return -1;
+            }
+            if (set_handlers(node->prefix, &node->prefix_mask, method, handler) == -1)
+            {
+                fprintf(stderr, "Error: Route %s is already registered\n", pattern);
+                return -1;
+            }
+            return number_route(r, &node->prefix_route, pattern);
+        }
+
+        if (*p == ':')
+        {
+            size_t length = strcspn(p + 1, "/:*");
+            if (p[-1] != '/' || length == 0 || (p[1 + length] != '/' && p[1 + length] != '\0'))
+            {
+                fprintf(stderr, "Error: Parameter must be a whole segment in route %s\n", pattern);
+                return -1;
+            }
+            node = param_child(node, p + 1, length);
+            if (!node)
+            {
+                fprintf(stderr, "Error: Conflicting parameter in route %s\n", pattern);
+                return -1;
+            }
+            p += 1 + length;
+            continue;
+        }
+
+        size_t length = strcspn(p, ":*");
+        node = static_child(node, p, length);
+        if (!node)
+        {
+            fprintf(stderr, "Error: Unable to allocate memory for route %s\n", pattern);
+            return -1;
+        }
+        p += length;
+    }
+
+    if (set_handlers(node->exact, &node->exact_mask, method, handler) == -1)
+    {
+        fprintf(stderr, "Error: Route %s is already registered\n", pattern);
+        return -1;
+    }
+    return number_route(r, &node->exact_route, pattern);
+}
+
+const char *router_route_pattern(const router *r, int route)
+{
+    if (route < 0 || route >= r->route_count)
+        return NULL;
+    return r->patterns[route];
+}
+
+route_handler router_lookup(const router *r, http_method method, const char *path, size_t length,
+                            route_match *match)
+{
+    match->param_count = 0;
+    match->rest.data = NULL;
+    match->rest.length = 0;
+    match->allowed = 0;
+    match->route = -1;
+
+    if ((unsigned int)method >= ROUTER_METHOD_SLOTS)
+        method = HTTP_METHOD_UNKNOWN;
+
+    return match_node(r->root, method, path, length, match);
+}
+
+/*
+ * Literal bytes are tried first, then a parameter, then a trailing '*', so a
+ * more specific route wins wherever two of them overlap.
+ */
+static route_handler match_node(const router_node *node, http_method method, const char *path, size_t length,
+                                route_match *match)
+{
+    route_handler handler;
+
+    if (length == 0 && node->exact_mask)
+    {
+        if (node->exact[method])
+        {
+            match->route = node->exact_route;
+            return node->exact[method];
+        }
+        match->allowed |= node->exact_mask;
+    }
+    else if (length > 0)
+    {
+        const unsigned char *first =
+            node->child_count ? memchr(node->first, (unsigned char)path[0], node->child_count) : NULL;
+        if (first)
+        {
+            const router_node *child = node->children[first - node->first];
+            if (child->label_length <= length && memcmp(child->label, path, child->label_length) == 0)
+            {
+                handler = match_node(child, method, path + child->label_length, length - child->label_length, match);
+                if (handler)
+                    return handler;
+            }
+        }
+
+        if (node->param && path[0] != '/' && match->param_count < ROUTER_MAX_PARAMS)
+        {
+            const char *slash = memchr(path, '/', length);
+            size_t segment = slash ? (size_t)(slash - path) : length;
+
+            route_param *param = &match->params[match->param_count++];
+            param->name.data = node->param->label;
+            param->name.length = node->param->label_length;
+            param->value.data = path;
+            param->value.length = segment;
+
+            handler = match_node(node->param, method, path + segment, length - segment, match);
+            if (handler)
+                return handler;
+            match->param_count--;
+        }
+    }
+
+    if (node->prefix_mask)
+    {
+        if (node->prefix[method])
+        {
+            match->rest.data = path;
+            match->rest.length = length;
+            match->route = node->prefix_route;
+            return node->prefix[method];
+        }
+        match->allowed |= node->prefix_mask;
+    }
+
+    return NULL;
+}
+
+static router_node *new_node(const char *label, size_t length)
+{
+    router_node *node = calloc(1, sizeof(router_node));
+    if (!node)
+        return NULL;
+
+    node->label = strndup(label, length);
+    if (!node->label)
+    {
+        free(node);
+        return NULL;
+    }
+    node->label_length = length;
+    node->exact_route = -1;
+    node->prefix_route = -1;
+
+    return node;
+}
+
+static void free_node(router_node *node)
+{
+    for (int i = 0; i < node->child_count; i++)
+        free_node(node->children[i]);
+    if (node->param)
+        free_node(node->param);
+    free(node->children);
+    free(node->first);
+    free(node->label);
+    free(node);
+}
+
+/*
+ * Walks literal text down from a node, splitting an edge where the text
+ * leaves it, and returns the node the text ends at.
+ */
+static router_node *static_child(router_node *node, const char *text, size_t length)
+{
+    while (length > 0)
+    {
+        const unsigned char *first =
+            node->child_count ? memchr(node->first, (unsigned char)text[0], node->child_count) : NULL;
+        if (!first)
+        {
+            router_node *child = new_node(text, length);
+            if (!child)
+                return NULL;
+            if (add_child(node, child) == -1)
+            {
+                free_node(child);
+                return NULL;
+            }
+            return child;
+        }
+
+        router_node *child = node->children[first - node->first];
+        size_t common = 0;
+        while (common < child->label_length && common < length && child->label[common] == text[common])
+            common++;
+
+        if (common < child->label_length && split_node(child, common) == -1)
+            return NULL;
+
+        node = child;
+        text += common;
+        length -= common;
+    }
+
+    return node;
+}
+
+static router_node *param_child(router_node *node, const char *name, size_t length)
+{
+    if (node->param)
+    {
+        // one name per position, or a lookup could not tell which to report
+        if (node->param->label_length != length || memcmp(node->param->label, name, length) != 0)
+            return NULL;
+        return node->param;
+    }
+
+    node->param = new_node(name, length);
+    return node->param;
+}
+
+static int add_child(router_node *node, router_node *child)
+{
+    router_node **children = realloc(node->children, (node->child_count + 1) * sizeof(router_node *));
+    if (!children)
+        return -1;
+    node->children = children;
+
+    unsigned char *first = realloc(node->first, node->child_count + 1);
+    if (!first)
+        return -1;
+    node->first = first;
+
+    node->children[node->child_count] = child;
+    node->first[node->child_count] = (unsigned char)child->label[0];
+    node->child_count++;
+    return 0;
+}
+
+/*
+ * Cuts a node's label after length bytes. The node keeps the head of the
+ * label; everything it held moves to a new child carrying the tail.
+ */
+static int split_node(router_node *node, size_t length)
+{
+    router_node *tail = new_node(node->label + length, node->label_length - length);
+    router_node **children = malloc(sizeof(router_node *));
+    unsigned char *first = malloc(1);
+    if (!tail || !children || !first)
+    {
+        if (tail)
+            free_node(tail);
+        free(children);
+        free(first);
+        return -1;
+    }
+
+    tail->children = node->children;
+    tail->first = node->first;
+    tail->child_count = node->child_count;
+    tail->param = node->param;
+    memcpy(tail->exact, node->exact, sizeof(node->exact));
+    memcpy(tail->prefix, node->prefix, sizeof(node->prefix));
+    tail->exact_mask = node->exact_mask;
+    tail->prefix_mask = node->prefix_mask;
+    tail->exact_route = node->exact_route;
+    tail->prefix_route = node->prefix_route;
+
+    children[0] = tail;
+    first[0] = (unsigned char)tail->label[0];
+    node->children = children;
+    node->first = first;
+    node->child_count = 1;
+    node->param = NULL;
+    memset(node->exact, 0, sizeof(node->exact));
+    memset(node->prefix, 0, sizeof(node->prefix));
+    node->exact_mask = 0;
+    node->prefix_mask = 0;
+    node->exact_route = -1;
+    node->prefix_route = -1;
+    node->label_length = length;
+
+    return 0;
+}
+
+static int set_handlers(route_handler *slots, unsigned int *mask, int method, route_handler handler)
+{
+    if (method != ROUTER_ANY_METHOD)
+    {
+        if (slots[method])
+            return -1;
+        slots[method] = handler;
+        *mask |= 1u << method;
+        return 0;
+    }
+
+    if (*mask)
+        return -1;
+    for (int i = 0; i < ROUTER_METHOD_SLOTS; i++)
+        slots[i] = handler;
+    *mask = (1u << ROUTER_METHOD_SLOTS) - 1;
+    return 0;
+}
+
+// numbers a pattern the first time a handler is registered for it
+static int number_route(router *r, int *route, const char *pattern)
+{
+    if (*route != -1)
+        return 0;
+
+    char **patterns = realloc(r->patterns, (r->route_count + 1) * sizeof(char *));
+    if (!patterns)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for route %s\n", pattern);
+        return -1;
+    }
+    r->patterns = patterns;
+
+    r->patterns[r->route_count] = strdup(pattern);
+    if (!r->patterns[r->route_count])
+    {
+        fprintf(stderr, "Error: Unable to allocate memory for route %s\n", pattern);
+        return -1;
+    }
+    *route = r->route_count++;
+    return 0;
+}
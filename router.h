@@ -0,0 +1,120 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <stddef.h> // size_t
+
+#include "request.h"
+
+#define ROUTER_MAX_PARAMS 8
+#define ROUTER_METHOD_SLOTS (HTTP_METHOD_UNKNOWN + 1)
+#define ROUTER_ANY_METHOD -1 // registers a handler for every method
+
+struct connection;
+
+typedef struct
+{
+    http_slice name;  // (e.g., "id" for "/users/:id")
+    http_slice value; // borrowed from the request path
+} route_param;
+
+/*
+ * What a successful lookup captured from the path. Slices point into the
+ * path that was looked up.
+ */
+typedef struct
+{
+    route_param params[ROUTER_MAX_PARAMS];
+    int param_count;
+    http_slice rest;      // the part a trailing '*' matched, empty otherwise
+    unsigned int allowed; // on a method mismatch, bit n set if method n has a handler
+    int route;            // number of the matched pattern, -1 if none matched
+} route_match;
+
+typedef int (*route_handler)(http_request *request, struct connection *conn, const route_match *match);
+
+/*
+ * Node of a compressed radix trie. Static children are keyed by the first
+ * byte of their label, which no two siblings share, so a lookup walks at
+ * most one static edge per path byte. A parameter child and the handlers of
+ * a trailing '*' hang off the node they follow.
+ */
+typedef struct router_node
+{
+    char *label; // static bytes leading to this node; the name for a parameter node
+    size_t label_length;
+    struct router_node **children; // static children
+    unsigned char *first;          // first label byte of each static child
+    int child_count;
+    struct router_node *param; // ":name" child, matches one non-empty segment
+    route_handler exact[ROUTER_METHOD_SLOTS];
+    route_handler prefix[ROUTER_METHOD_SLOTS]; // "...*": matches anything after this node
+    unsigned int exact_mask;  // bit n set if exact[n] is
+    unsigned int prefix_mask; // bit n set if prefix[n] is
+    int exact_route;          // number of the pattern ending here, -1 if none
+    int prefix_route;         // number of the pattern ending here in '*', -1 if none
+} router_node;
+
+typedef struct
+{
+    router_node *root;
+    char **patterns; // registered patterns, numbered in order of registration
+    int route_count;
+} router;
+
+/**
+ * Initializes an empty router.
+ *
+ * @param r Pointer to the router to initialize.
+ * @return 0 on success, -1 on allocation failure.
+ */
+int router_init(router *r);
+
+/**
+ * Frees every node of a router.
+ *
+ * @param r Pointer to the router.
+ */
+void router_destroy(router *r);
+
+/**
+ * Registers a route. A pattern is a path of literal bytes in which a segment
+ * may be a parameter (":name", one non-empty segment) and which may end in
+ * '*' to match any remainder, including none. Literal bytes win over a
+ * parameter, and a parameter wins over '*'. Not thread-safe: register every
+ * route before lookups start. A pattern registered for several methods is
+ * numbered once.
+ *
+ * @param r Pointer to the router.
+ * @param method Method the handler serves, or ROUTER_ANY_METHOD.
+ * @param pattern Route pattern (e.g., "/users/:id").
+ * @param handler Handler to call for matching requests.
+ * @return 0 on success, -1 if the pattern is invalid or already registered.
+ */
+int router_add(router *r, int method, const char *pattern, route_handler handler);
+
+/**
+ * Returns the text of a registered pattern, for labelling a route_match.
+ *
+ * @param r Pointer to the router.
+ * @param route Pattern number from route_match.route.
+ * @return The pattern, or NULL if no pattern has that number.
+ */
+const char *router_route_pattern(const router *r, int route);
+
+/**
+ * Finds the handler for a method and path. Walks the trie along the path,
+ * so the cost does not grow with the number of routes.
+ *
+ * @param r Pointer to the router.
+ * @param method Request method.
+ * @param path Request path without the query string, not NUL-terminated.
+ * @param length Length of the path.
+ * @param match Set to the captured parameters, the remainder and the
+ *              number of the matched pattern.
+ * @return The handler, or NULL if no route matches. match->allowed is then
+ *         non-zero if the path matched for other methods.
+ */
+route_handler router_lookup(const router *r, http_method method, const char *path, size_t length,
+                            route_match *match);
+
+#endif // ROUTER_H
@@ -1,195 +1,810 @@
 #include <assert.h>
 #include <errno.h>
+#include <getopt.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
 #include <sys/socket.h>
 #include <unistd.h>
-#include <poll.h>
 
+#include "compression.h"
+#include "connection.h"
+#include "event_loop.h"
 #include "http_handler.h"
+#include "io_stats.h"
+#include "io_uring_loop.h"
+#include "metrics.h"
 #include "my_socket.h"
+#include "offload.h"
+#include "proxy.h"
 #include "request.h"
 #include "response.h"
+#include "static_file.h"
+#include "worker.h"
 
-#define MAX_REQUEST_SIZE 2048
-#define MAX_CLIENTS 10
-#define POLL_TIMEOUT 5000 // 5 seconds
+#define LOOP_TIMEOUT 1000 // 1 second, the granularity of connection deadlines
 
-char *wait_for_client_request(int client_fd, size_t *nrecv);
-int handle_new_connection(int server_fd, struct pollfd *fds, int *nfds);
-void handle_client_request(struct pollfd *pfd);
+int wait_for_client_request(connection *conn, int *peer_closed);
+void handle_new_connection(event_loop *loop, event_handler *handler, unsigned int events);
+void handle_client_request(event_loop *loop, event_handler *handler, unsigned int events);
+static void handle_offload_done(event_loop *loop, event_handler *handler, unsigned int events);
+static void handle_wakeup(event_loop *loop, event_handler *handler, unsigned int events);
+static void resume_connection(connection *conn);
+static void close_if_done(connection *conn, int peer_closed);
+static void tick_connections(event_loop *loop, void *data);
+int process_client_data(connection *conn, char *data, size_t length);
+static int process_connection_input(connection *conn);
+static int reject_request(connection *conn);
+static int begin_request_body(connection *conn);
+static int process_request_body(connection *conn, int *complete);
+static void finish_request(connection *conn, size_t consumed);
 
 static void print_http_request(http_request *request)
 {
     printf("Method: %s\n", http_methods[request->request_line.method].name);
-    printf("URI: %s\n", request->request_line.uri);
-    printf("Version: %s\n", request->request_line.version);
+    printf("URI: %.*s\n", (int)request->request_line.uri.length, request->request_line.uri.data);
+    printf("Version: %.*s\n", (int)request->request_line.version.length, request->request_line.version.data);
     printf("Header count: %d\n", request->header_count);
     for (int i = 0; i < request->header_count; i++)
     {
-        printf("Header %d: %s: %s\n", i, request->headers[i].name, request->headers[i].value);
+        printf("Header %d: %.*s: %.*s\n", i, (int)request->headers[i].name.length, request->headers[i].name.data,
+               (int)request->headers[i].value.length, request->headers[i].value.data);
     }
-    printf("Body: %s\n", request->body);
+    printf("Body: %.*s\n", (int)request->body_length, request->body ? request->body : "");
 }
 
+typedef struct
+{
+    int workers;
+    int pin_cpus;
+    int io_uring;
+    connection_timeouts timeouts;
+    int max_requests;
+    const char *static_dir;    // NULL to serve no files
+    const char *static_prefix;
+    int compression_level;
+    long compression_min_size;
+    int offload_threads;
+    int offload_queue;
+    const char *proxies[PROXY_MAX_ROUTES]; // PREFIX=ADDRESS[,ADDRESS...]
+    int proxy_count;
+} server_options;
+
+static worker workers[MAX_WORKERS];
+
+static int parse_arguments(int argc, char *argv[], server_options *options);
+static void print_usage(const char *program);
 static void initialize_server(void);
-static int setup_server(void);
-static void run_server_loop(int server_fd, struct pollfd *fds, int *nfds);
-static void cleanup_server(int server_fd);
+static int setup_server(const server_options *options);
+static void run_server_loop(worker *w);
+static void run_uring_server_loop(worker *w);
+static void wait_for_signals(int worker_count);
+static void cleanup_server(int worker_count);
 
 int main(int argc, char *argv[])
 {
+    server_options options;
+    if (parse_arguments(argc, argv, &options) == -1)
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+
     initialize_server();
 
-    int server_fd = setup_server();
-    if (server_fd == -1)
+    if (setup_server(&options) == -1)
+    {
+        cleanup_server(options.workers);
         return 1;
+    }
 
-    struct pollfd fds[MAX_CLIENTS + 1];
-    int nfds = 1;
+    if (workers_start(workers, options.workers) == -1)
+    {
+        cleanup_server(options.workers);
+        return 1;
+    }
 
-    fds[0].fd = server_fd;
-    fds[0].events = POLLIN;
+    wait_for_signals(options.workers);
 
-    run_server_loop(server_fd, fds, &nfds);
+    cleanup_server(options.workers);
+    return 0;
+}
+
+static int parse_arguments(int argc, char *argv[], server_options *options)
+{
+    static const struct option long_options[] = {
+        {"workers", required_argument, NULL, 'w'},
+        {"pin-cpus", no_argument, NULL, 'p'},
+        {"io-uring", no_argument, NULL, 'u'},
+        {"keepalive-timeout", required_argument, NULL, 'k'},
+        {"header-timeout", required_argument, NULL, 'H'},
+        {"body-timeout", required_argument, NULL, 'B'},
+        {"write-timeout", required_argument, NULL, 'W'},
+        {"upstream-timeout", required_argument, NULL, 't'},
+        {"max-requests", required_argument, NULL, 'm'},
+        {"static-dir", required_argument, NULL, 'd'},
+        {"static-prefix", required_argument, NULL, 's'},
+        {"compression-level", required_argument, NULL, 'z'},
+        {"compression-min-size", required_argument, NULL, 'Z'},
+        {"offload-threads", required_argument, NULL, 'o'},
+        {"offload-queue", required_argument, NULL, 'O'},
+        {"proxy", required_argument, NULL, 'P'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0},
+    };
+
+    options->workers = 1;
+    options->pin_cpus = 0;
+    options->io_uring = 0;
+    options->timeouts.idle = CONNECTION_IDLE_TIMEOUT;
+    options->timeouts.header = CONNECTION_HEADER_TIMEOUT;
+    options->timeouts.body = CONNECTION_BODY_TIMEOUT;
+    options->timeouts.write = CONNECTION_WRITE_TIMEOUT;
+    options->timeouts.upstream = CONNECTION_UPSTREAM_TIMEOUT;
+    options->max_requests = CONNECTION_MAX_REQUESTS;
+    options->static_dir = NULL;
+    options->static_prefix = STATIC_FILE_DEFAULT_PREFIX;
+    options->compression_level = COMPRESSION_DEFAULT_LEVEL;
+    options->compression_min_size = COMPRESSION_DEFAULT_MIN_SIZE;
+    options->offload_threads = OFFLOAD_DEFAULT_THREADS;
+    options->offload_queue = OFFLOAD_DEFAULT_QUEUE;
+    options->proxy_count = 0;
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "w:puk:H:B:W:t:m:d:s:z:Z:o:O:P:h", long_options, NULL)) != -1)
+    {
+        switch (opt)
+        {
+        case 'w':
+            options->workers = atoi(optarg);
+            if (options->workers < 1 || options->workers > MAX_WORKERS)
+            {
+                fprintf(stderr, "Worker count must be between 1 and %d.\n", MAX_WORKERS);
+                return -1;
+            }
+            break;
+        case 'p':
+            options->pin_cpus = 1;
+            break;
+        case 'u':
+            options->io_uring = 1;
+            break;
+        case 'k':
+        case 'H':
+        case 'B':
+        case 'W':
+        case 't':
+        {
+            int *timeout = opt == 'k'   ? &options->timeouts.idle
+                           : opt == 'H' ? &options->timeouts.header
+                           : opt == 'B' ? &options->timeouts.body
+                           : opt == 'W' ? &options->timeouts.write
+                                        : &options->timeouts.upstream;
+            *timeout = atoi(optarg);
+            if (*timeout < 0)
+            {
+                fprintf(stderr, "Timeouts must not be negative.\n");
+                return -1;
+            }
+            break;
+        }
+        case 'm':
+            options->max_requests = atoi(optarg);
+            if (options->max_requests < 0)
+            {
+                fprintf(stderr, "Max requests must not be negative.\n");
+                return -1;
+            }
+            break;
+        case 'd':
+            options->static_dir = optarg;
+            break;
+        case 's':
+            options->static_prefix = optarg;
+            break;
+        case 'z':
+            options->compression_level = atoi(optarg);
+            if (options->compression_level < 0 || options->compression_level > 9)
+            {
+                fprintf(stderr, "Compression level must be between 0 and 9.\n");
+                return -1;
+            }
+            break;
+        case 'Z':
+            options->compression_min_size = atol(optarg);
+            if (options->compression_min_size < 0)
+            {
+                fprintf(stderr, "Compression min size must not be negative.\n");
+                return -1;
+            }
+            break;
+        case 'o':
+            options->offload_threads = atoi(optarg);
+            if (options->offload_threads < 0 || options->offload_threads > MAX_WORKERS)
+            {
+                fprintf(stderr, "Offload threads must be between 0 and %d.\n", MAX_WORKERS);
+                return -1;
+            }
+            break;
+        case 'O':
+            options->offload_queue = atoi(optarg);
+            if (options->offload_queue < 1)
+            {
+                fprintf(stderr, "Offload queue must hold at least one job.\n");
+                return -1;
+            }
+            break;
+        case 'P':
+            if (options->proxy_count == PROXY_MAX_ROUTES)
+            {
+                fprintf(stderr, "At most %d prefixes can be proxied.\n", PROXY_MAX_ROUTES);
+                return -1;
+            }
+            options->proxies[options->proxy_count++] = optarg;
+            break;
+        default:
+            return -1;
+        }
+    }
 
-    cleanup_server(server_fd);
     return 0;
 }
 
+static void print_usage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s [--workers N] [--pin-cpus] [--io-uring] [--keepalive-timeout S] [--header-timeout S]\n"
+            "          [--body-timeout S] [--write-timeout S] [--upstream-timeout S] [--max-requests N] [--static-dir DIR]\n"
+            "          [--static-prefix P] [--compression-level L] [--compression-min-size N] [--offload-threads N]\n"
+            "          [--offload-queue N] [--proxy PREFIX=ADDRESS[,ADDRESS...]]...\n",
+            program);
+    fprintf(stderr, "  --workers N   run N event loop threads, each with its own SO_REUSEPORT listener\n");
+    fprintf(stderr, "  --pin-cpus    pin worker i to CPU i (modulo the online CPU count)\n");
+    fprintf(stderr, "  --io-uring    use the io_uring backend, falling back to epoll if unavailable\n");
+    fprintf(stderr, "  --keepalive-timeout S  close connections idle for S seconds (default %d, 0 = never)\n",
+            CONNECTION_IDLE_TIMEOUT);
+    fprintf(stderr, "  --header-timeout S     close connections whose request headers take S seconds (default %d)\n",
+            CONNECTION_HEADER_TIMEOUT);
+    fprintf(stderr, "  --body-timeout S       close connections whose request body stalls for S seconds (default %d)\n",
+            CONNECTION_BODY_TIMEOUT);
+    fprintf(stderr, "  --write-timeout S      close connections that read no output for S seconds (default %d)\n",
+            CONNECTION_WRITE_TIMEOUT);
+    fprintf(stderr, "  --upstream-timeout S   close connections whose proxied request gets no response head for S seconds\n"
+                    "                         (default %d, 0 = never)\n",
+            CONNECTION_UPSTREAM_TIMEOUT);
+    fprintf(stderr, "  --max-requests N       close a connection after N requests (default %d, 0 = no limit)\n",
+            CONNECTION_MAX_REQUESTS);
+    fprintf(stderr, "  --static-dir DIR       serve files below DIR with sendfile\n");
+    fprintf(stderr, "  --static-prefix P      URI prefix the files are served under (default %s)\n",
+            STATIC_FILE_DEFAULT_PREFIX);
+    fprintf(stderr, "  --compression-level L  gzip/deflate level for textual bodies (default %d, 0 = off)\n",
+            COMPRESSION_DEFAULT_LEVEL);
+    fprintf(stderr, "  --compression-min-size N  send bodies under N bytes uncompressed (default %d)\n",
+            COMPRESSION_DEFAULT_MIN_SIZE);
+    fprintf(stderr, "  --offload-threads N    threads for blocking handler work (default %d, 0 = on the event loop)\n",
+            OFFLOAD_DEFAULT_THREADS);
+    fprintf(stderr, "  --offload-queue N      offloaded jobs that may wait for a thread (default %d)\n",
+            OFFLOAD_DEFAULT_QUEUE);
+    fprintf(stderr, "  --proxy PREFIX=ADDRESS[,ADDRESS...]  forward requests under PREFIX to upstreams at host:port,\n"
+                    "                         [v6-address]:port or unix:/path; repeat for more prefixes\n");
+    fprintf(stderr, "Send SIGUSR1 to print per-worker connection counts.\n");
+}
+
 static void initialize_server(void)
 {
     setbuf(stdout, NULL);
     setbuf(stderr, NULL);
+
+    // sendfile has no MSG_NOSIGNAL; a client gone mid-response must not take the server down
+    signal(SIGPIPE, SIG_IGN);
+
+    // workers inherit this mask; only the main thread takes these signals
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
 }
 
-static int setup_server(void)
+static int setup_server(const server_options *options)
 {
-    return init_server();
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int reuse_port = options->workers > 1;
+
+    for (int i = 0; i < options->workers; i++)
+    {
+        workers[i].listen_fd = -1;
+        workers[i].wake_fd = -1;
+    }
+
+    if (options->static_dir && static_files_configure(options->static_prefix, options->static_dir) == -1)
+        return -1;
+
+    if (compression_configure(options->compression_level, options->compression_min_size) == -1)
+        return -1;
+
+    for (int i = 0; i < options->proxy_count; i++)
+        if (proxy_configure(options->proxies[i]) == -1)
+            return -1;
+
+    if (http_handler_init() == -1 || proxy_routes_init() == -1)
+        return -1;
+
+    if (offload_start(options->offload_threads, options->offload_queue) == -1)
+        return -1;
+
+    for (int i = 0; i < options->workers; i++)
+    {
+        workers[i].id = i;
+        workers[i].cpu = options->pin_cpus && cpus > 0 ? (int)(i % cpus) : -1;
+        workers[i].timeouts = options->timeouts;
+        workers[i].max_requests = options->max_requests;
+        workers[i].run = options->io_uring ? run_uring_server_loop : run_server_loop;
+        workers[i].listen_fd = init_server(reuse_port);
+        if (workers[i].listen_fd == -1)
+            return -1;
+    }
+
+    return 0;
 }
 
-static void run_server_loop(int server_fd, struct pollfd *fds, int *nfds)
+static void wait_for_signals(int worker_count)
 {
-    while (1)
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    sigaddset(&set, SIGUSR1);
+
+    for (;;)
     {
-        int poll_count = poll(fds, *nfds, POLL_TIMEOUT);
+        int sig;
+        if (sigwait(&set, &sig) != 0)
+            return;
 
-        if (poll_count == -1)
-        {
-            perror("poll");
-            break;
-        }
+        if (sig != SIGUSR1)
+            return;
+
+        workers_report(workers, worker_count, stdout);
+    }
+}
+
+static void run_server_loop(worker *w)
+{
+    event_loop *loop = event_loop_create(EVENT_LOOP_MAX_EVENTS);
+    if (!loop)
+        return;
+
+    if (connection_table_init(&w->connections, loop, MAX_CONNECTIONS) == -1)
+    {
+        event_loop_destroy(loop);
+        return;
+    }
+    w->connections.timeouts = w->timeouts;
+    w->connections.max_requests = w->max_requests;
+    event_loop_set_tick(loop, tick_connections, &w->connections);
+
+    offload_queue offload;
+    if (offload_queue_init(&offload, resume_connection) == -1)
+    {
+        connection_table_cleanup(&w->connections);
+        event_loop_destroy(loop);
+        return;
+    }
+
+    event_handler listener = {
+        .fd = w->listen_fd,
+        .events = EVENT_READ,
+        .callback = handle_new_connection,
+        .data = &w->connections,
+    };
+    event_handler offload_done = {
+        .fd = offload.event_fd,
+        .events = EVENT_READ,
+        .callback = handle_offload_done,
+        .data = &offload,
+    };
+    event_handler wakeup = {
+        .fd = w->wake_fd,
+        .events = EVENT_READ,
+        .callback = handle_wakeup,
+    };
+
+    accept_reserve_init();
+    if (proxy_worker_init(loop, resume_connection) == 0 && event_loop_add(loop, &listener) == 0 &&
+        event_loop_add(loop, &offload_done) == 0 && event_loop_add(loop, &wakeup) == 0)
+        event_loop_run(loop, LOOP_TIMEOUT);
+
+    accept_reserve_cleanup();
+    connection_table_cleanup(&w->connections);
+    proxy_worker_cleanup();
+    offload_queue_cleanup(&offload);
+    static_files_thread_cleanup();
+    compression_thread_cleanup();
+    event_loop_destroy(loop);
+}
+
+static void run_uring_server_loop(worker *w)
+{
+    if (run_io_uring_loop(w, process_client_data) == -1)
+    {
+        fprintf(stderr, "Worker %d: io_uring unavailable, falling back to epoll.\n", w->id);
+        run_server_loop(w);
+    }
+}
+
+static void cleanup_server(int worker_count)
+{
+    // the workers use everything freed below
+    workers_stop(workers, worker_count);
+
+    for (int i = 0; i < worker_count; i++)
+        if (workers[i].listen_fd != -1)
+            close(workers[i].listen_fd);
+
+    offload_stop();
+    http_handler_cleanup();
+    proxy_cleanup();
+}
+
+void handle_new_connection(event_loop *loop, event_handler *handler, unsigned int events)
+{
+    connection_table *connections = handler->data;
 
-        if (poll_count == 0)
+    if (events & EVENT_ERROR)
+    {
+        fprintf(stderr, "Listening socket failed.\n");
+        event_loop_stop(loop);
+        return;
+    }
+
+    // edge-triggered: drain the accept queue, or connections behind a failure wait for the next edge
+    for (;;)
+    {
+        int client_fd = accept_client(handler->fd);
+        if (client_fd == ACCEPT_SHED)
             continue;
+        if (client_fd < 0)
+            return;
 
-        for (int i = 0; i < *nfds; i++)
+        if (!connection_open(connections, client_fd, EVENT_READ, handle_client_request))
         {
-            if (fds[i].revents & POLLIN)
-            {
-                if (fds[i].fd == server_fd)
-                {
-                    if (handle_new_connection(server_fd, fds, nfds) == -1)
-                        return;
-                }
-                else
-                {
-                    handle_client_request(&fds[i]);
-                }
-            }
+            fprintf(stderr, "Too many clients. Connection rejected.\n");
+            close(client_fd);
         }
     }
 }
 
-static void cleanup_server(int server_fd)
+void handle_client_request(event_loop *loop, event_handler *handler, unsigned int events)
 {
-    close(server_fd);
-}
+    connection *conn = handler->data;
+    int peer_closed = 0;
 
-int handle_new_connection(int server_fd, struct pollfd *fds, int *nfds)
-{
-    int client_fd = accept_client(server_fd);
-    if (client_fd == -1)
-        return -1;
+    if (events & EVENT_ERROR)
+    {
+        connection_close(conn);
+        return;
+    }
 
-    if (*nfds < MAX_CLIENTS + 1)
+    int was_blocked = connection_input_paused(conn);
+    if ((events & EVENT_WRITE) && connection_write_queued(conn) == -1)
     {
-        fds[*nfds].fd = client_fd;
-        fds[*nfds].events = POLLIN;
-        (*nfds)++;
+        connection_close(conn);
+        return;
     }
-    else
+
+    // once a slow reader catches up, answer what it already sent before reading more
+    int resumed = was_blocked && !connection_input_paused(conn);
+    if ((resumed && process_connection_input(conn) == -1) ||
+        ((events & EVENT_READ || resumed) && wait_for_client_request(conn, &peer_closed) == -1))
     {
-        fprintf(stderr, "Too many clients. Connection rejected.\n");
-        close(client_fd);
+        connection_close(conn);
+        return;
     }
 
-    return 0;
+    close_if_done(conn, peer_closed);
 }
 
-void handle_client_request(struct pollfd *pfd)
+static void handle_offload_done(event_loop *loop, event_handler *handler, unsigned int events)
 {
-    http_request request;
-    size_t nrecv = 0;
-    char *client_request = wait_for_client_request(pfd->fd, &nrecv);
+    offload_queue_drain(handler->data);
+}
+
+// the main thread is shutting down; the worker's loop ends and its teardown runs
+static void handle_wakeup(event_loop *loop, event_handler *handler, unsigned int events)
+{
+    event_loop_stop(loop);
+}
 
-    if (client_request == NULL)
+// back from the offload pool or an upstream: send the response, answer what queued up behind it and read again
+static void resume_connection(connection *conn)
+{
+    int peer_closed = 0;
+    if (process_connection_input(conn) == -1 || wait_for_client_request(conn, &peer_closed) == -1)
     {
-        close(pfd->fd);
-        pfd->fd = -1;
+        connection_close(conn);
         return;
     }
 
-    if (parse_http_request(client_request, nrecv, &request) == -1)
+    close_if_done(conn, peer_closed);
+}
+
+static void close_if_done(connection *conn, int peer_closed)
+{
+    if (peer_closed)
+        conn->closing = 1;
+    if (conn->closing && conn->out_queued == 0 && !conn->producer.produce && !conn->parked)
+        connection_close(conn);
+}
+
+static void tick_connections(event_loop *loop, void *data)
+{
+    connection_table_tick(data);
+}
+
+int process_client_data(connection *conn, char *data, size_t length)
+{
+    // no data: output drained, so answer requests that were held back
+    if (length == 0)
+        return process_connection_input(conn);
+
+    // the data lives in a backend buffer, so keep it with the connection
+    while (length > 0 && !conn->closing)
     {
-        free(client_request);
-        close(pfd->fd);
-        pfd->fd = -1;
-        return;
+        size_t space;
+        char *buffer = connection_recv_space(conn, &space);
+        if (!buffer)
+        {
+            fprintf(stderr, "Request exceeds the receive buffer limit.\n");
+            return -1;
+        }
+
+        size_t n = length < space ? length : space;
+        memcpy(buffer, data, n);
+        conn->recv_len += n;
+        data += n;
+        length -= n;
+
+        if (process_connection_input(conn) == -1)
+            return -1;
     }
 
+    return 0;
+}
+
+/*
+ * Answers every complete request in the buffer, in order, then writes all
+ * of their responses at once. Responses may point into the receive buffer,
+ * so the flush must happen before the buffer is compacted by the next read.
+ * A request with a body is answered as its body arrives, and a streamed
+ * response is produced as output drains, in as many calls as that takes.
+ */
+static int process_connection_input(connection *conn)
+{
+    connection_table *table = conn->table;
+    unsigned long heap_allocs = conn->arena.heap_allocs;
+    int retval = 0;
+
+    for (;;)
+    {
+        // a streamed response is finished before the next request is answered
+        if (connection_run_producer(conn) == -1)
+        {
+            retval = -1;
+            break;
+        }
+        if (conn->producer.produce || conn->closing || connection_input_paused(conn) ||
+            conn->recv_start == conn->recv_len)
+            break;
+
+        unsigned long start = metrics_now();
+        if (conn->parser.state != HTTP_PARSER_BODY)
+        {
+            http_parse_status status = http_parser_execute(&conn->parser, conn->recv_buf + conn->recv_start,
+                                                           conn->recv_len - conn->recv_start, &conn->request);
+            if (status == HTTP_PARSE_NEED_MORE)
+                break;
+            unsigned long parsed = metrics_now();
+            metrics_observe(METRICS_PARSE, parsed - start);
+            start = parsed;
+
+            if (status == HTTP_PARSE_ERROR)
+            {
+                retval = reject_request(conn);
+                break;
+            }
+
 #ifdef DEBUG
-    print_http_request(&request);
+            print_http_request(&conn->request);
 #endif // DEBUG
 
-    handle_request(&request, pfd->fd);
-    free(client_request);
+            io_stats_request();
+            conn->requests++;
+            conn->keep_alive = http_request_keep_alive(&conn->request) &&
+                               (table->max_requests == 0 || conn->requests < (unsigned int)table->max_requests);
+
+            if (status == HTTP_PARSE_COMPLETE)
+            {
+                handle_request(&conn->request, conn);
+                metrics_observe(METRICS_HANDLE, metrics_now() - start);
+                finish_request(conn, conn->parser.consumed);
+                continue;
+            }
+
+            if (begin_request_body(conn) == -1)
+            {
+                retval = -1;
+                break;
+            }
+        }
+
+        int complete;
+        if (process_request_body(conn, &complete) == -1)
+        {
+            retval = -1;
+            break;
+        }
+        if (!complete)
+            break;
+        // from the last piece of the body, when the handler has it all
+        metrics_observe(METRICS_HANDLE, metrics_now() - start);
+        finish_request(conn, conn->parser.body_start);
+    }
+
+    if (conn->out_count > 0)
+    {
+        unsigned long start = metrics_now();
+        if (connection_flush(conn) == -1)
+            retval = -1;
+        metrics_observe(METRICS_FLUSH, metrics_now() - start);
+    }
+    io_stats_allocations(conn->arena.heap_allocs - heap_allocs);
+    arena_reset(&conn->arena);
+    // flushed, so nothing points into the receive buffer any more
+    connection_recv_release(conn);
+    connection_update_deadline(conn);
+
+    return retval;
+}
+
+/*
+ * Answers a request the parser refused and closes the connection after
+ * the response, since where the next request would start is unknown.
+ */
+static int reject_request(connection *conn)
+{
+    http_status_code status = conn->parser.error_status;
+    const http_status_entry *entry = find_http_status(status);
+
+    struct iovec iov[HTTP_RESPONSE_IOV_COUNT];
+    int count = build_http_response(&conn->arena, HTTP_VERSION, status, entry->reason, strlen(entry->reason),
+                                    "Content-Type: text/plain\r\nConnection: close\r\n", iov);
+    if (count == -1)
+        return -1;
+
+    metrics_status(status);
+    conn->keep_alive = 0;
+    conn->closing = 1;
+    return connection_sendv(conn, iov, count);
+}
+
+static int begin_request_body(connection *conn)
+{
+    // read a large body in large pieces; its bytes are dropped as they are handled
+    size_t wanted = CONNECTION_RECV_BODY;
+    if (conn->parser.framing == HTTP_BODY_LENGTH && conn->parser.body_remaining < wanted)
+        wanted = conn->parser.body_remaining;
+    if (connection_recv_reserve(conn, wanted) == -1)
+        return -1;
+
+    return handle_request_head(&conn->request, conn);
 }
 
-char *wait_for_client_request(int client_fd, size_t *nrecv)
+/*
+ * Hands the body bytes received so far to the handler, then cuts them out
+ * of the receive buffer. The header section stays in place for the handler,
+ * so however large the body, the buffer holds only what one read brought.
+ */
+static int process_request_body(connection *conn, int *complete)
 {
-    char *buffer = (char *)malloc(MAX_REQUEST_SIZE);
-    if (!buffer)
+    http_parser *parser = &conn->parser;
+    const char *input = conn->recv_buf + conn->recv_start + parser->body_start;
+    size_t available = conn->recv_len - conn->recv_start - parser->body_start;
+    size_t offset = 0;
+    http_parse_status status = HTTP_PARSE_NEED_MORE;
+
+    while (status == HTTP_PARSE_NEED_MORE && offset < available)
     {
-        fprintf(stderr, "Failed to allocate memory for client request buffer.\n");
-        return NULL;
+        size_t used;
+        http_slice chunk;
+        status = http_parser_body(parser, input + offset, available - offset, &used, &chunk);
+        if (status == HTTP_PARSE_ERROR)
+            return -1;
+        offset += used;
+
+        int last = status == HTTP_PARSE_COMPLETE;
+        if ((chunk.length > 0 || last) &&
+            handle_request_body(&conn->request, conn, chunk.data, chunk.length, last) == -1)
+            return -1;
     }
 
-    ssize_t n = recv(client_fd, buffer, MAX_REQUEST_SIZE, 0);
-    if (n == -1)
+    // responses may still point at the bytes about to be dropped
+    if (connection_flush(conn) == -1)
+        return -1;
+    connection_drop(conn, parser->body_start, offset);
+
+    *complete = status == HTTP_PARSE_COMPLETE;
+    return 0;
+}
+
+static void finish_request(connection *conn, size_t consumed)
+{
+    // a producer or offloaded job closes the connection itself once the response is complete
+    if (!conn->keep_alive && !conn->producer.produce && !conn->parked)
+        conn->closing = 1;
+
+    cleanup_http_request(&conn->request);
+    request_body_reset(&conn->body);
+    http_parser_init(&conn->parser, &conn->request);
+    connection_consume(conn, consumed);
+}
+
+int wait_for_client_request(connection *conn, int *peer_closed)
+{
+    // edge-triggered: read until the socket is drained, parsing as bytes arrive.
+    // Blocked on output or parked, leave the rest in the socket so TCP pushes back.
+    while (!conn->closing && !connection_input_paused(conn))
     {
-        if (errno == ECONNRESET)
+        size_t space;
+        char *buffer = connection_recv_space(conn, &space);
+        if (!buffer)
+        {
+            fprintf(stderr, "Request exceeds the receive buffer limit.\n");
+            return -1;
+        }
+
+        io_stats_syscall();
+        ssize_t n = recv(conn->handler.fd, buffer, space, 0);
+        if (n == -1)
         {
-            fprintf(stderr, "Connection reset by peer.\n");
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                connection_recv_release(conn);
+                return 0;
+            }
+            if (errno == ECONNRESET)
+            {
+                fprintf(stderr, "Connection reset by peer.\n");
+            }
+            else
+            {
+                perror("Failed to receive data from client");
+            }
+            return -1;
         }
-        else
+
+        if (n == 0)
         {
-            perror("Failed to receive data from client");
+            fprintf(stderr, "Client closed the connection.\n");
+            *peer_closed = 1;
+            return 0;
         }
-        free(buffer);
-        return NULL;
-    }
 
-    if (n == 0)
-    {
-        fprintf(stderr, "Client closed the connection.\n");
-        free(buffer);
-        return NULL;
+        conn->recv_len += n;
+        metrics_bytes_in(n);
+        if (process_connection_input(conn) == -1)
+            return -1;
+
+        // a short read drained the socket; new data raises a fresh edge
+        if ((size_t)n < space)
+            return 0;
     }
 
-    *nrecv = n;
-    return buffer;
+    return 0;
 }
@@ -0,0 +1,418 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/openat2.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "io_stats.h"
+#include "static_file.h"
+
+typedef struct
+{
+    static_file *buckets[STATIC_FILE_CACHE_BUCKETS];
+    int count;
+    unsigned long clock;
+} static_file_cache;
+
+static const struct
+{
+    const char *extension;
+    const char *content_type;
+} content_types[] = {
+    {"html", "text/html"},
+    {"htm", "text/html"},
+    {"css", "text/css"},
+    {"js", "text/javascript"},
+    {"json", "application/json"},
+    {"txt", "text/plain"},
+    {"xml", "application/xml"},
+    {"svg", "image/svg+xml"},
+    {"png", "image/png"},
+    {"jpg", "image/jpeg"},
+    {"jpeg", "image/jpeg"},
+    {"gif", "image/gif"},
+    {"webp", "image/webp"},
+    {"ico", "image/x-icon"},
+    {"wasm", "application/wasm"},
+    {"pdf", "application/pdf"},
+    {"woff2", "font/woff2"},
+    {NULL, NULL},
+};
+
+// written once before workers start, read-only afterwards
+static int root_fd = -1;
+static char mount_prefix[HTTP_PATH_MAX_LEN];
+
+// each worker thread owns its cache outright
+static __thread static_file_cache *cache;
+
+static int valid_path(const char *path, size_t length);
+static unsigned int hash_path(const char *path, size_t length);
+static const char *find_content_type(const char *path, size_t length);
+static static_file *open_file(const char *path, size_t length);
+static int unchanged(const static_file *file);
+static int read_file(const static_file *file, char *data);
+static int write_encoded(int fd, const char *data, size_t length);
+static void uncache(static_file *file);
+static void evict_one(void);
+
+int static_files_configure(const char *prefix, const char *root)
+{
+    size_t prefix_length = strlen(prefix);
+    if (prefix_length == 0 || prefix_length >= sizeof(mount_prefix) || prefix[0] != '/' ||
+        prefix[prefix_length - 1] != '/')
+    {
+        fprintf(stderr, "Static prefix must start and end with '/'.\n");
+        return -1;
+    }
+
+    root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd == -1)
+    {
+        perror("Failed to open static directory");
+        return -1;
+    }
+
+    memcpy(mount_prefix, prefix, prefix_length + 1);
+    return 0;
+}
+
+const char *static_files_prefix(void)
+{
+    return root_fd == -1 ? NULL : mount_prefix;
+}
+
+static_file *static_file_acquire(const char *path, size_t length)
+{
+    if (root_fd == -1 || !valid_path(path, length))
+        return NULL;
+
+    if (!cache)
+    {
+        cache = calloc(1, sizeof(static_file_cache));
+        if (!cache)
+        {
+            fprintf(stderr, "Error: Unable to allocate static file cache\n");
+            return NULL;
+        }
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    cache->clock++;
+
+    unsigned int bucket = hash_path(path, length) % STATIC_FILE_CACHE_BUCKETS;
+    for (static_file *file = cache->buckets[bucket]; file; file = file->next)
+    {
+        if (file->path_length != length || memcmp(file->path, path, length) != 0)
+            continue;
+
+        // a replaced or deleted file must not be served from the old descriptor forever
+        if (now.tv_sec - file->checked >= STATIC_FILE_REVALIDATE)
+        {
+            if (!unchanged(file))
+            {
+                uncache(file);
+                break;
+            }
+            file->checked = now.tv_sec;
+        }
+
+        file->used = cache->clock;
+        file->refs++;
+        return file;
+    }
+
+    if (cache->count >= STATIC_FILE_CACHE_SIZE)
+        evict_one();
+
+    static_file *file = open_file(path, length);
+    if (!file)
+        return NULL;
+
+    file->checked = now.tv_sec;
+    file->used = cache->clock;
+    file->refs = 2; // the cache's and the caller's
+    file->next = cache->buckets[bucket];
+    cache->buckets[bucket] = file;
+    cache->count++;
+
+    return file;
+}
+
+int static_file_encode_begin(static_file *file, http_coding coding)
+{
+    if (file->encoded_fd[coding] != -1)
+        return 0;
+    if (file->encoded_size[coding] == -1 || file->size == 0 || file->size > STATIC_FILE_COMPRESS_MAX)
+        return -1;
+
+    // one attempt per entry, whatever comes of it; requests meanwhile get the file as it is
+    file->encoded_size[coding] = -1;
+    return 1;
+}
+
+int static_file_encode_make(const static_file *file, http_coding coding, off_t *size)
+{
+    // the file, then room for an encoding no larger than it
+    char *data = malloc(2 * (size_t)file->size);
+    if (!data)
+    {
+        fprintf(stderr, "Error: Unable to allocate memory to compress %s\n", file->path);
+        return -1;
+    }
+    io_stats_allocations(1);
+
+    size_t encoded_length;
+    char *encoded = data + file->size;
+    if (read_file(file, data) == -1 || http_compress(coding, data, file->size, encoded, &encoded_length) != 1)
+    {
+        free(data);
+        return -1;
+    }
+
+    io_stats_syscall();
+    int fd = memfd_create("static-encoded", MFD_CLOEXEC);
+    if (fd == -1)
+    {
+        perror("Failed to create memfd for compressed file");
+        free(data);
+        return -1;
+    }
+    if (write_encoded(fd, encoded, encoded_length) == -1)
+    {
+        close(fd);
+        free(data);
+        return -1;
+    }
+    free(data);
+
+    *size = encoded_length;
+    return fd;
+}
+
+void static_file_encode_finish(static_file *file, http_coding coding, int fd, off_t size)
+{
+    file->encoded_fd[coding] = fd;
+    file->encoded_size[coding] = fd == -1 && size != -1 ? 0 : size;
+}
+
+void static_file_release(void *arg)
+{
+    static_file *file = arg;
+
+    if (--file->refs > 0)
+        return;
+
+    for (int coding = 0; coding < HTTP_CODING_COUNT; coding++)
+        if (file->encoded_fd[coding] != -1)
+            close(file->encoded_fd[coding]);
+    close(file->fd);
+    free(file);
+}
+
+void static_files_thread_cleanup(void)
+{
+    if (!cache)
+        return;
+
+    for (int i = 0; i < STATIC_FILE_CACHE_BUCKETS; i++)
+        while (cache->buckets[i])
+            uncache(cache->buckets[i]);
+    free(cache);
+    cache = NULL;
+}
+
+/*
+ * Rejects empty paths, NUL bytes and ".." segments up front; openat2 with
+ * RESOLVE_BENEATH then refuses symlinks that escape the root.
+ */
+static int valid_path(const char *path, size_t length)
+{
+    if (length == 0 || length >= HTTP_PATH_MAX_LEN || path[0] == '/' || memchr(path, '\0', length))
+        return 0;
+
+    const char *segment = path;
+    const char *end = path + length;
+    while (segment < end)
+    {
+        const char *slash = memchr(segment, '/', end - segment);
+        const char *segment_end = slash ? slash : end;
+        if (segment_end - segment == 2 && segment[0] == '.' && segment[1] == '.')
+            return 0;
+        segment = segment_end + 1;
+    }
+
+    return 1;
+}
+
+static unsigned int hash_path(const char *path, size_t length)
+{
+    // FNV-1a
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= (unsigned char)path[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static const char *find_content_type(const char *path, size_t length)
+{
+    const char *dot = NULL;
+    for (size_t i = length; i > 0 && path[i - 1] != '/'; i--)
+    {
+        if (path[i - 1] == '.')
+        {
+            dot = path + i;
+            break;
+        }
+    }
+
+    if (dot)
+    {
+        size_t extension_length = path + length - dot;
+        for (int i = 0; content_types[i].extension; i++)
+            if (strlen(content_types[i].extension) == extension_length &&
+                strncasecmp(dot, content_types[i].extension, extension_length) == 0)
+                return content_types[i].content_type;
+    }
+
+    return "application/octet-stream";
+}
+
+static static_file *open_file(const char *path, size_t length)
+{
+    static_file *file = malloc(sizeof(static_file));
+    if (!file)
+    {
+        fprintf(stderr, "Error: Unable to allocate static file entry\n");
+        return NULL;
+    }
+    io_stats_allocations(1);
+
+    memcpy(file->path, path, length);
+    file->path[length] = '\0';
+    file->path_length = length;
+
+    struct open_how how;
+    memset(&how, 0, sizeof(how));
+    how.flags = O_RDONLY | O_CLOEXEC;
+    how.resolve = RESOLVE_BENEATH;
+
+    io_stats_syscall();
+    file->fd = syscall(SYS_openat2, root_fd, file->path, &how, sizeof(how));
+    if (file->fd == -1)
+    {
+        if (errno != ENOENT && errno != ENOTDIR)
+            fprintf(stderr, "Failed to open static file %s: %s\n", file->path, strerror(errno));
+        free(file);
+        return NULL;
+    }
+
+    struct stat st;
+    io_stats_syscall();
+    if (fstat(file->fd, &st) == -1 || !S_ISREG(st.st_mode))
+    {
+        close(file->fd);
+        free(file);
+        return NULL;
+    }
+
+    file->size = st.st_size;
+    file->dev = st.st_dev;
+    file->ino = st.st_ino;
+    file->mtime = st.st_mtim;
+    file->content_type = find_content_type(path, length);
+    for (int coding = 0; coding < HTTP_CODING_COUNT; coding++)
+    {
+        file->encoded_fd[coding] = -1;
+        file->encoded_size[coding] = 0;
+    }
+
+    return file;
+}
+
+static int unchanged(const static_file *file)
+{
+    struct stat st;
+    io_stats_syscall();
+    if (fstatat(root_fd, file->path, &st, 0) == -1)
+        return 0;
+
+    return st.st_dev == file->dev && st.st_ino == file->ino && st.st_size == file->size &&
+           st.st_mtim.tv_sec == file->mtime.tv_sec && st.st_mtim.tv_nsec == file->mtime.tv_nsec;
+}
+
+static int read_file(const static_file *file, char *data)
+{
+    size_t done = 0;
+    while (done < (size_t)file->size)
+    {
+        io_stats_syscall();
+        ssize_t n = pread(file->fd, data + done, file->size - done, done);
+        if (n <= 0)
+        {
+            // a file that shrank since it was opened is revalidated soon; send it as it is until then
+            if (n == -1)
+                fprintf(stderr, "Failed to read static file %s: %s\n", file->path, strerror(errno));
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+static int write_encoded(int fd, const char *data, size_t length)
+{
+    size_t done = 0;
+    while (done < length)
+    {
+        io_stats_syscall();
+        ssize_t n = write(fd, data + done, length - done);
+        if (n == -1)
+        {
+            perror("Failed to write compressed file");
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+static void uncache(static_file *file)
+{
+    unsigned int bucket = hash_path(file->path, file->path_length) % STATIC_FILE_CACHE_BUCKETS;
+    for (static_file **link = &cache->buckets[bucket]; *link; link = &(*link)->next)
+    {
+        if (*link == file)
+        {
+            *link = file->next;
+            break;
+        }
+    }
+
+    cache->count--;
+    static_file_release(file);
+}
+
+static void evict_one(void)
+{
+    static_file *oldest = NULL;
+
+    for (int i = 0; i < STATIC_FILE_CACHE_BUCKETS; i++)
+        for (static_file *file = cache->buckets[i]; file; file = file->next)
+            if (!oldest || file->used < oldest->used)
+                oldest = file;
+
+    if (oldest)
+        uncache(oldest);
+}
@@ -0,0 +1,119 @@
+#ifndef STATIC_FILE_H
+#define STATIC_FILE_H
+
+#include <stddef.h>    // size_t
+#include <sys/types.h> // off_t, dev_t, ino_t
+#include <time.h>      // time_t
+
+#include "compression.h"
+#include "my_http.h"
+
+#define STATIC_FILE_DEFAULT_PREFIX "/static/"
+#define STATIC_FILE_CACHE_SIZE 256 // open files kept per worker
+#define STATIC_FILE_CACHE_BUCKETS 512
+#define STATIC_FILE_REVALIDATE 1 // seconds between checks that a cached path is unchanged
+#define STATIC_FILE_COMPRESS_MAX (4 << 20) // larger files are always sent as they are
+
+/*
+ * An open file in a worker's cache. Responses hold a reference while the
+ * file is being sent, so eviction only closes the descriptor once the last
+ * of them is done.
+ */
+typedef struct static_file
+{
+    char path[HTTP_PATH_MAX_LEN]; // relative to the static root
+    size_t path_length;
+    int fd;
+    off_t size;
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    const char *content_type;
+    // compressed copies, made on first request and kept in memfds so they go out with sendfile too
+    int encoded_fd[HTTP_CODING_COUNT];     // -1 until made
+    off_t encoded_size[HTTP_CODING_COUNT]; // -1 once making it failed or gained nothing
+    time_t checked;        // when the path was last compared with the open file
+    unsigned long used;    // cache clock at the last lookup, for LRU eviction
+    int refs;              // the cache's own reference plus one per response
+    struct static_file *next; // hash chain
+} static_file;
+
+/**
+ * Mounts a directory under a URI prefix. Call once before workers start.
+ *
+ * @param prefix URI prefix (e.g., "/static/"); must start and end with '/'.
+ * @param root Directory to serve files from.
+ * @return 0 on success, -1 if the directory cannot be opened.
+ */
+int static_files_configure(const char *prefix, const char *root);
+
+/**
+ * Returns the mounted URI prefix.
+ *
+ * @return The prefix, or NULL if no directory is mounted.
+ */
+const char *static_files_prefix(void);
+
+/**
+ * Looks up a file below the static root in the calling worker's cache,
+ * opening it on a miss. Paths that would leave the root are refused.
+ *
+ * @param path Path relative to the root, not NUL-terminated.
+ * @param length Length of the path.
+ * @return A referenced entry to pass to static_file_release, or NULL if the
+ *         path is invalid, missing or not a regular file.
+ */
+static_file *static_file_acquire(const char *path, size_t length);
+
+/**
+ * Checks for the compressed copy of a file in a coding, which is made once
+ * per cache entry, so the file is compressed again only after it changes
+ * or is evicted. The copy is file->encoded_fd[coding],
+ * file->encoded_size[coding] bytes long, and is closed with the entry.
+ *
+ * @param file Entry returned by static_file_acquire.
+ * @param coding Coding other than identity.
+ * @return 0 if the copy exists, 1 if the caller is to make it with
+ *         static_file_encode_make and static_file_encode_finish, -1 if the
+ *         file must be sent as it is (including while the copy is being made).
+ */
+int static_file_encode_begin(static_file *file, http_coding coding);
+
+/**
+ * Compresses a file into a new memfd. Touches nothing the worker's cache
+ * changes, so it may run on any thread while the caller holds a reference.
+ *
+ * @param file Entry static_file_encode_begin returned 1 for.
+ * @param coding Coding other than identity.
+ * @param size Set to the length of the copy.
+ * @return The memfd, or -1 if the file must be sent as it is.
+ */
+int static_file_encode_make(const static_file *file, http_coding coding, off_t *size);
+
+/**
+ * Stores a copy made by static_file_encode_make in its entry. Call on the
+ * worker that owns the entry.
+ *
+ * @param file Entry the copy was made from.
+ * @param coding Coding of the copy.
+ * @param fd Result of static_file_encode_make, or -1 if there is no copy.
+ * @param size Length of the copy; with no copy, -1 to send the file as it is
+ *             from now on, anything else to try again on a later request.
+ */
+void static_file_encode_finish(static_file *file, http_coding coding, int fd, off_t size);
+
+/**
+ * Drops a reference taken by static_file_acquire. Takes a void pointer so it
+ * can serve as a connection_file release callback.
+ *
+ * @param file Entry returned by static_file_acquire.
+ */
+void static_file_release(void *file);
+
+/**
+ * Drops the calling worker's cache. Entries still referenced by a response
+ * stay open until it releases them.
+ */
+void static_files_thread_cleanup(void);
+
+#endif // STATIC_FILE_H
@@ -0,0 +1,110 @@
+#include <stddef.h>
+#include <string.h>
+
+#include "timer_wheel.h"
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_SPAN(level) (1UL << (TIMER_WHEEL_BITS * (level)))
+
+static void link_timer(timer_wheel *wheel, timer *t);
+static void cascade(timer_wheel *wheel, int level);
+
+void timer_wheel_init(timer_wheel *wheel, unsigned long now)
+{
+    memset(wheel->slots, 0, sizeof(wheel->slots));
+    wheel->now = now;
+}
+
+void timer_init(timer *t, timer_callback callback, void *data)
+{
+    t->next = NULL;
+    t->pprev = NULL;
+    t->expires = 0;
+    t->callback = callback;
+    t->data = data;
+}
+
+void timer_wheel_arm(timer_wheel *wheel, timer *t, unsigned long expires)
+{
+    if (expires <= wheel->now)
+        expires = wheel->now + 1;
+    if (t->pprev && t->expires == expires)
+        return;
+
+    timer_cancel(t);
+    t->expires = expires;
+    link_timer(wheel, t);
+}
+
+void timer_cancel(timer *t)
+{
+    if (!t->pprev)
+        return;
+
+    *t->pprev = t->next;
+    if (t->next)
+        t->next->pprev = t->pprev;
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+void timer_wheel_advance(timer_wheel *wheel, unsigned long now)
+{
+    while (wheel->now < now)
+    {
+        wheel->now++;
+
+        // at each wrap of a level, the next slot up is spread over the levels below
+        for (int level = 1; level < TIMER_WHEEL_LEVELS; level++)
+        {
+            if (wheel->now & (TIMER_WHEEL_SPAN(level) - 1))
+                break;
+            cascade(wheel, level);
+        }
+
+        timer **slot = &wheel->slots[0][wheel->now & TIMER_WHEEL_MASK];
+        while (*slot)
+        {
+            timer *t = *slot;
+            timer_cancel(t);
+            t->callback(t);
+        }
+    }
+}
+
+/*
+ * Files a timer by how far off it is: in level L, a timer occupies the slot
+ * given by bits 6L..6L+5 of its expiry tick, which no other pending tick in
+ * that level's span shares.
+ */
+static void link_timer(timer_wheel *wheel, timer *t)
+{
+    unsigned long delta = t->expires - wheel->now;
+    int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= TIMER_WHEEL_SPAN(level + 1))
+        level++;
+
+    if (delta >= TIMER_WHEEL_SPAN(TIMER_WHEEL_LEVELS))
+        t->expires = wheel->now + TIMER_WHEEL_SPAN(TIMER_WHEEL_LEVELS) - 1;
+
+    timer **slot = &wheel->slots[level][(t->expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK];
+    t->next = *slot;
+    if (t->next)
+        t->next->pprev = &t->next;
+    t->pprev = slot;
+    *slot = t;
+}
+
+static void cascade(timer_wheel *wheel, int level)
+{
+    timer **slot = &wheel->slots[level][(wheel->now >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK];
+    timer *t = *slot;
+    *slot = NULL;
+
+    while (t)
+    {
+        timer *next = t->next;
+        link_timer(wheel, t);
+        t = next;
+    }
+}
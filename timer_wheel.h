@@ -0,0 +1,80 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_LEVELS 4 // deadlines up to 64^4 ticks ahead; later ones are clamped
+
+typedef struct timer timer;
+typedef void (*timer_callback)(timer *t);
+
+/*
+ * A deadline. The owner embeds it in its own state, so arming and
+ * cancelling only relink list pointers and never allocate.
+ */
+struct timer
+{
+    timer *next;
+    timer **pprev; // link that points at this timer, NULL when not armed
+    unsigned long expires;
+    timer_callback callback;
+    void *data;
+};
+
+/*
+ * Hierarchical timing wheel. Level 0 has a slot for each of the next 64
+ * ticks; each level above covers 64 times the span of the one below, and
+ * its slots are redistributed downward as the clock reaches them. Arming
+ * and cancelling are O(1), and advancing costs one slot per tick plus the
+ * timers that expire or move down a level.
+ */
+typedef struct
+{
+    timer *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    unsigned long now; // last tick processed
+} timer_wheel;
+
+/**
+ * Initializes an empty wheel.
+ *
+ * @param wheel Pointer to the wheel.
+ * @param now Current tick.
+ */
+void timer_wheel_init(timer_wheel *wheel, unsigned long now);
+
+/**
+ * Initializes a timer that is not armed.
+ *
+ * @param t Pointer to the timer.
+ * @param callback Called when the timer expires, after it has been disarmed.
+ * @param data Owner of the timer, for the callback.
+ */
+void timer_init(timer *t, timer_callback callback, void *data);
+
+/**
+ * Arms a timer, moving it if it is already armed. Re-arming for the same
+ * tick does nothing.
+ *
+ * @param wheel Pointer to the wheel.
+ * @param t Pointer to the timer.
+ * @param expires Tick at which the timer fires; past ticks fire on the next advance.
+ */
+void timer_wheel_arm(timer_wheel *wheel, timer *t, unsigned long expires);
+
+/**
+ * Disarms a timer. Does nothing if it is not armed.
+ *
+ * @param t Pointer to the timer.
+ */
+void timer_cancel(timer *t);
+
+/**
+ * Advances the clock, firing every timer that expires up to and including
+ * the given tick. Callbacks may arm and cancel timers, including their own.
+ *
+ * @param wheel Pointer to the wheel.
+ * @param now Current tick.
+ */
+void timer_wheel_advance(timer_wheel *wheel, unsigned long now);
+
+#endif // TIMER_WHEEL_H
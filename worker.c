@@ -0,0 +1,153 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "worker.h"
+
+static io_stats scratch_io_stats;
+__thread io_stats *io_stats_current = &scratch_io_stats;
+
+static atomic_int workers_running;
+
+static void *worker_thread(void *arg);
+static void pin_to_cpu(worker *w);
+
+int workers_start(worker *workers, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        workers[i].wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (workers[i].wake_fd == -1)
+        {
+            perror("Failed to create worker wakeup eventfd");
+            return -1;
+        }
+        atomic_init(&workers[i].stop, 0);
+
+        atomic_fetch_add(&workers_running, 1);
+        int err = pthread_create(&workers[i].thread, NULL, worker_thread, &workers[i]);
+        if (err != 0)
+        {
+            atomic_fetch_sub(&workers_running, 1);
+            fprintf(stderr, "Failed to start worker %d: %s\n", i, strerror(err));
+            return -1;
+        }
+        workers[i].started = 1;
+    }
+
+    return 0;
+}
+
+void workers_stop(worker *workers, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (!workers[i].started)
+            continue;
+        uint64_t one = 1;
+        atomic_store(&workers[i].stop, 1);
+        while (write(workers[i].wake_fd, &one, sizeof(one)) == -1 && errno == EINTR)
+            ;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        if (workers[i].started)
+            pthread_join(workers[i].thread, NULL);
+        workers[i].started = 0;
+        if (workers[i].wake_fd != -1)
+            close(workers[i].wake_fd);
+        workers[i].wake_fd = -1;
+    }
+}
+
+void workers_report(worker *workers, int count, FILE *out)
+{
+    int total_active = 0;
+    unsigned long total_accepted = 0;
+    unsigned long total_requests = 0;
+    unsigned long total_syscalls = 0;
+    unsigned long total_allocations = 0;
+    long total_queued = 0;
+    unsigned long total_recv_bytes = 0;
+
+    for (int i = 0; i < count; i++)
+    {
+        int active = atomic_load_explicit(&workers[i].connections.active, memory_order_relaxed);
+        unsigned long accepted = atomic_load_explicit(&workers[i].connections.accepted, memory_order_relaxed);
+        unsigned long requests = atomic_load_explicit(&workers[i].stats.requests, memory_order_relaxed);
+        unsigned long syscalls = atomic_load_explicit(&workers[i].stats.syscalls, memory_order_relaxed);
+        unsigned long allocations = atomic_load_explicit(&workers[i].stats.allocations, memory_order_relaxed);
+        long queued = atomic_load_explicit(&workers[i].stats.output_queued, memory_order_relaxed);
+        unsigned long recv_buffers = atomic_load_explicit(&workers[i].metrics.recv_buffers, memory_order_relaxed);
+        unsigned long recv_bytes = atomic_load_explicit(&workers[i].metrics.recv_buffer_bytes, memory_order_relaxed);
+        unsigned long recv_peak =
+            atomic_load_explicit(&workers[i].metrics.recv_buffer_peak_bytes, memory_order_relaxed);
+        unsigned long recv_free = atomic_load_explicit(&workers[i].metrics.recv_pool_free_bytes, memory_order_relaxed);
+        fprintf(out,
+                "worker %d (cpu %d): %d open, %lu accepted, %lu requests, %lu syscalls, %lu allocations, "
+                "%ld bytes queued, %lu receive buffers (%lu bytes, peak %lu, %lu pooled)\n",
+                workers[i].id, workers[i].cpu, active, accepted, requests, syscalls, allocations, queued,
+                recv_buffers, recv_bytes, recv_peak, recv_free);
+        total_active += active;
+        total_accepted += accepted;
+        total_requests += requests;
+        total_syscalls += syscalls;
+        total_allocations += allocations;
+        total_queued += queued;
+        total_recv_bytes += recv_bytes;
+    }
+
+    fprintf(out, "total: %d open, %lu accepted, %lu requests, %lu syscalls, %.2f syscalls/request\n", total_active,
+            total_accepted, total_requests, total_syscalls,
+            total_requests ? (double)total_syscalls / total_requests : 0.0);
+    fprintf(out, "allocations: %lu, %.3f per request\n", total_allocations,
+            total_requests ? (double)total_allocations / total_requests : 0.0);
+    fprintf(out, "output queued: %ld bytes\n", total_queued);
+    fprintf(out, "receive buffers: %lu bytes lent\n", total_recv_bytes);
+}
+
+static void *worker_thread(void *arg)
+{
+    worker *w = arg;
+
+    io_stats_current = &w->stats;
+    metrics_current = &w->metrics;
+    metrics_register(&w->metrics);
+    if (w->cpu >= 0)
+        pin_to_cpu(w);
+
+    w->run(w);
+
+    if (!atomic_load(&w->stop))
+    {
+        // left open, the listener would keep taking its share of connections with no one to accept them
+        fprintf(stderr, "Worker %d: event loop failed; closing its listener.\n", w->id);
+        close(w->listen_fd);
+        w->listen_fd = -1;
+    }
+    if (atomic_fetch_sub(&workers_running, 1) == 1 && !atomic_load(&w->stop))
+        kill(getpid(), SIGTERM);
+    return NULL;
+}
+
+static void pin_to_cpu(worker *w)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(w->cpu, &set);
+
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0)
+    {
+        fprintf(stderr, "Failed to pin worker %d to CPU %d: %s\n", w->id, w->cpu, strerror(err));
+        w->cpu = -1;
+    }
+}
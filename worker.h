@@ -0,0 +1,70 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <pthread.h>
+#include <stdio.h>
+
+#include "connection.h"
+#include "io_stats.h"
+#include "metrics.h"
+
+#define MAX_WORKERS 256
+
+typedef struct worker worker;
+
+typedef void (*worker_main)(worker *w);
+
+/*
+ * One event loop thread. Each worker owns its listener, loop and connection
+ * table outright; nothing on the request path is shared between workers.
+ */
+struct worker
+{
+    int id;
+    int listen_fd;
+    int cpu; // CPU the thread is pinned to, -1 when unpinned
+    connection_timeouts timeouts;
+    int max_requests; // requests per connection, 0 for no limit
+    pthread_t thread;
+    int started;     // the thread is running, or has exited and waits to be joined
+    int wake_fd;     // eventfd the loop watches; workers_stop writes it
+    atomic_int stop; // set before the wakeup, so a loop ending without it has failed
+    worker_main run;
+    connection_table connections;
+    io_stats stats;
+    metrics metrics; // served on /metrics
+};
+
+/**
+ * Starts one thread per worker, each calling its run function. The run
+ * function must watch the worker's wake_fd and return once it is readable.
+ * A worker whose run function returns unasked closes its listener, so the
+ * kernel stops queueing connections for it, and stops the server if it was
+ * the last one running.
+ *
+ * @param workers Array of workers with id, listen_fd, cpu and run filled in.
+ * @param count Number of workers.
+ * @return 0 on success, -1 if a thread could not be started.
+ */
+int workers_start(worker *workers, int count);
+
+/**
+ * Wakes every started worker, waits for its thread to exit and closes its
+ * wakeup. State the workers share may be freed once this returns.
+ *
+ * @param workers Array of workers passed to workers_start.
+ * @param count Number of workers.
+ */
+void workers_stop(worker *workers, int count);
+
+/**
+ * Prints the connection counts and I/O counters of every worker.
+ * Safe to call from any thread while workers are running.
+ *
+ * @param workers Array of running workers.
+ * @param count Number of workers.
+ * @param out Stream to print to.
+ */
+void workers_report(worker *workers, int count, FILE *out);
+
+#endif // WORKER_H